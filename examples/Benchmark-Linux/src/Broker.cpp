@@ -0,0 +1,253 @@
+#include "Broker.hpp"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <AsyncMqttClient/Helpers.hpp>
+
+namespace {
+size_t encodeRemainingLength(size_t length, uint8_t* destination) {
+  size_t bytes = 0;
+  do {
+    uint8_t digit = length % 128;
+    length /= 128;
+    if (length > 0) digit |= 0x80;
+    destination[bytes++] = digit;
+  } while (length > 0);
+  return bytes;
+}
+}  // namespace
+
+Broker::Broker()
+: _listenFd(-1)
+, _acceptThread()
+, _mutex()
+, _connections()
+, _subscriptions() {
+}
+
+Broker::~Broker() {
+  stop();
+}
+
+uint16_t Broker::start() {
+  _listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (_listenFd == -1) return 0;
+
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;  // any free port
+  socklen_t addressLength = sizeof(address);
+  if (bind(_listenFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1 ||
+      listen(_listenFd, 64) == -1 ||
+      getsockname(_listenFd, reinterpret_cast<struct sockaddr*>(&address), &addressLength) == -1) {
+    ::close(_listenFd);
+    _listenFd = -1;
+    return 0;
+  }
+
+  _acceptThread = std::thread(&Broker::_accept, this);
+  return ntohs(address.sin_port);
+}
+
+void Broker::stop() {
+  if (_listenFd == -1) return;
+
+  shutdown(_listenFd, SHUT_RDWR);
+  _acceptThread.join();
+  ::close(_listenFd);
+  _listenFd = -1;
+
+  std::vector<Connection*> connections;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    connections.swap(_connections);
+    _subscriptions.clear();
+  }
+  for (Connection* connection : connections) {
+    shutdown(connection->fd, SHUT_RDWR);
+    connection->thread.join();
+    ::close(connection->fd);
+    delete connection;
+  }
+}
+
+void Broker::_accept() {
+  while (true) {
+    int fd = accept4(_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    Connection* connection = new Connection();
+    connection->fd = fd;
+    connection->nextPacketId = 0;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _connections.push_back(connection);
+    connection->thread = std::thread(&Broker::_serve, this, connection);
+  }
+}
+
+void Broker::_serve(Connection* connection) {
+  std::vector<uint8_t> buffer;
+  uint8_t chunk[16384];
+  bool open = true;
+  while (open) {
+    ssize_t received = recv(connection->fd, chunk, sizeof(chunk), 0);
+    if (received <= 0) {
+      if (received == -1 && errno == EINTR) continue;
+      break;
+    }
+    buffer.insert(buffer.end(), chunk, chunk + received);
+
+    // handle every complete packet of the buffer
+    size_t position = 0;
+    while (open && buffer.size() - position >= 2) {
+      size_t length = 0;
+      size_t multiplier = 1;
+      size_t headerLength = 1;
+      bool complete = false;
+      while (position + headerLength < buffer.size() && headerLength <= 4) {
+        uint8_t digit = buffer[position + headerLength++];
+        length += (digit & 127) * multiplier;
+        multiplier *= 128;
+        if ((digit & 128) == 0) {
+          complete = true;
+          break;
+        }
+      }
+      if (!complete || buffer.size() - position - headerLength < length) break;
+
+      open = _handle(connection, buffer[position], buffer.data() + position + headerLength, length);
+      position += headerLength + length;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + position);
+  }
+
+  _unsubscribe(connection);
+  shutdown(connection->fd, SHUT_RDWR);
+}
+
+bool Broker::_handle(Connection* connection, uint8_t header, const uint8_t* packet, size_t length) {
+  switch (header >> 4) {
+    case 1: {  // CONNECT
+      const uint8_t connAck[] = { 0x20, 2, 0, 0 };
+      return _write(connection, connAck, sizeof(connAck));
+    }
+    case 3: {  // PUBLISH
+      uint8_t qos = (header >> 1) & 0x03;
+      size_t topicLength = (packet[0] << 8) | packet[1];
+      std::string topic(reinterpret_cast<const char*>(packet) + 2, topicLength);
+      size_t position = 2 + topicLength;
+      uint16_t packetId = 0;
+      if (qos != 0) {
+        packetId = (packet[position] << 8) | packet[position + 1];
+        position += 2;
+      }
+
+      _forward(topic, qos, packet + position, length - position);
+
+      if (qos == 0) return true;
+      const uint8_t ack[] = { static_cast<uint8_t>(qos == 1 ? 0x40 : 0x50), 2, static_cast<uint8_t>(packetId >> 8), static_cast<uint8_t>(packetId & 0xFF) };
+      return _write(connection, ack, sizeof(ack));
+    }
+    case 4:  // PUBACK
+    case 7:  // PUBCOMP
+      return true;
+    case 5: {  // PUBREC
+      const uint8_t pubRel[] = { 0x62, 2, packet[0], packet[1] };
+      return _write(connection, pubRel, sizeof(pubRel));
+    }
+    case 6: {  // PUBREL
+      const uint8_t pubComp[] = { 0x70, 2, packet[0], packet[1] };
+      return _write(connection, pubComp, sizeof(pubComp));
+    }
+    case 8: {  // SUBSCRIBE
+      std::vector<uint8_t> subAck = { 0x90, 0, packet[0], packet[1] };
+      size_t position = 2;
+      std::lock_guard<std::mutex> lock(_mutex);
+      while (position + 3 <= length) {
+        size_t topicLength = (packet[position] << 8) | packet[position + 1];
+        std::string topic(reinterpret_cast<const char*>(packet) + position + 2, topicLength);
+        uint8_t qos = packet[position + 2 + topicLength] & 0x03;
+        position += 3 + topicLength;
+        _subscriptions.insert(std::make_pair(topic, std::make_pair(connection, qos)));
+        subAck.push_back(qos);
+      }
+      subAck[1] = subAck.size() - 2;
+      return _write(connection, subAck.data(), subAck.size());
+    }
+    case 10: {  // UNSUBSCRIBE
+      const uint8_t unsubAck[] = { 0xB0, 2, packet[0], packet[1] };
+      return _write(connection, unsubAck, sizeof(unsubAck));
+    }
+    case 12: {  // PINGREQ
+      const uint8_t pingResp[] = { 0xD0, 0 };
+      return _write(connection, pingResp, sizeof(pingResp));
+    }
+    default:  // DISCONNECT, or anything this stand-in does not know
+      return false;
+  }
+}
+
+void Broker::_forward(const std::string& topic, uint8_t qos, const uint8_t* payload, size_t length) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto it = _subscriptions.begin(); it != _subscriptions.end(); ++it) {
+    if (!AsyncMqttClientInternals::Helpers::topicMatches(it->first.c_str(), topic.c_str())) continue;
+    Connection* subscriber = it->second.first;
+    uint8_t grantedQos = qos < it->second.second ? qos : it->second.second;
+
+    uint8_t header[5 + 2 + 2];
+    size_t remainingLength = 2 + topic.size() + (grantedQos != 0 ? 2 : 0) + length;
+    header[0] = 0x30 | (grantedQos << 1);
+    size_t headerLength = 1 + encodeRemainingLength(remainingLength, header + 1);
+    header[headerLength++] = topic.size() >> 8;
+    header[headerLength++] = topic.size() & 0xFF;
+
+    std::lock_guard<std::mutex> writeLock(subscriber->writeMutex);
+    bool written = send(subscriber->fd, header, headerLength, MSG_NOSIGNAL | MSG_MORE) == static_cast<ssize_t>(headerLength);
+    written = written && send(subscriber->fd, topic.data(), topic.size(), MSG_NOSIGNAL | MSG_MORE) == static_cast<ssize_t>(topic.size());
+    if (written && grantedQos != 0) {
+      if (++subscriber->nextPacketId == 0) subscriber->nextPacketId = 1;
+      const uint8_t packetId[] = { static_cast<uint8_t>(subscriber->nextPacketId >> 8), static_cast<uint8_t>(subscriber->nextPacketId & 0xFF) };
+      written = send(subscriber->fd, packetId, sizeof(packetId), MSG_NOSIGNAL | MSG_MORE) == sizeof(packetId);
+    }
+    size_t sent = 0;
+    while (written && sent < length) {
+      ssize_t result = send(subscriber->fd, payload + sent, length - sent, MSG_NOSIGNAL);
+      if (result <= 0) break;
+      sent += result;
+    }
+    if (!written || sent < length) shutdown(subscriber->fd, SHUT_RDWR);
+  }
+}
+
+void Broker::_unsubscribe(Connection* connection) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto it = _subscriptions.begin(); it != _subscriptions.end();) {
+    if (it->second.first == connection) {
+      it = _subscriptions.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+bool Broker::_write(Connection* connection, const uint8_t* data, size_t length) {
+  std::lock_guard<std::mutex> lock(connection->writeMutex);
+  size_t sent = 0;
+  while (sent < length) {
+    ssize_t result = send(connection->fd, data + sent, length - sent, MSG_NOSIGNAL);
+    if (result <= 0) return false;
+    sent += result;
+  }
+  return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Minimal MQTT 3.1.1 broker on the loopback interface, enough to benchmark the client:
+// subscriptions with + and # wildcards, QoS 0, 1 and 2 both ways, no retained messages nor sessions.
+// Each connection is served by its own thread with blocking sockets.
+class Broker {
+ public:
+  Broker();
+  ~Broker();
+
+  // Returns the port listened to, 0 on failure
+  uint16_t start();
+  void stop();
+
+ private:
+  struct Connection {
+    int fd;
+    std::mutex writeMutex;
+    uint16_t nextPacketId;
+    std::thread thread;
+  };
+
+  void _accept();
+  void _serve(Connection* connection);
+  bool _handle(Connection* connection, uint8_t header, const uint8_t* packet, size_t length);
+  void _forward(const std::string& topic, uint8_t qos, const uint8_t* payload, size_t length);
+  void _unsubscribe(Connection* connection);
+  static bool _write(Connection* connection, const uint8_t* data, size_t length);
+
+  int _listenFd;
+  std::thread _acceptThread;
+  std::mutex _mutex;
+  std::vector<Connection*> _connections;
+  std::multimap<std::string, std::pair<Connection*, uint8_t>> _subscriptions;
+};
@@ -0,0 +1,468 @@
+/*
+Throughput and latency benchmark of the client on Linux, against the loopback broker of Broker.cpp.
+
+Every run connects one subscriber and one or more publishers, each publisher keeping at most
+WINDOW messages in flight. The payload carries its publication time, so the latency measured
+is the one of the whole path: publish, broker, _onData and the message callback.
+The codec is measured alone first, as the time to encode a packet without any connection.
+The bytes a PUBLISH takes on the wire with MQTT 5 are then counted with topic aliases off and on, on a simulated
+connection to a broker allowing them.
+The request/response runs time request() until its response callback, one request at a time.
+The shared runs have 1, 2, 4 then 8 threads publish through a single client, with the client lock, then through the
+lock-free publish queue of setPublishQueueSize(). Each of them is run SHARED_REPEATS times, the locked and queued runs
+taking turns, and the run of median throughput is reported.
+
+Build and run with `make benchmark`, the results are printed on stdout as JSON.
+Usage: benchmark [maximum messages per run]
+*/
+#include <AsyncMqttClient.h>
+#include <AsyncMqttClient/Transports/SimulatedTransport.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Broker.hpp"
+
+using AsyncMqttClientInternals::Codec;
+using AsyncMqttClientInternals::ConnectFields;
+using AsyncMqttClientInternals::EventLoop;
+using AsyncMqttClientInternals::PosixTransport;
+using AsyncMqttClientInternals::SimulatedTransport;
+
+namespace {
+const uint32_t WINDOW = 32;                   // messages published and not received yet, per publisher
+const size_t BYTES_PER_RUN = 32 * 1024 * 1024;
+const size_t MIN_MESSAGES = 100;
+const uint32_t TIMEOUT = 60;                  // seconds, a run not done by then is reported incomplete
+const size_t LARGE_SEND_BUFFER = 512 * 1024;  // lets a single publish() hold the largest payload
+
+const size_t PAYLOAD_SIZES[] = { 8, 64, 512, 4096, 32768, 262144 };
+const size_t STREAMED_PAYLOAD_SIZES[] = { 4096, 65536, 262144 };
+const uint8_t FAN_IN_PUBLISHERS = 8;
+const uint8_t SHARED_PRODUCERS[] = { 1, 2, 4, 8 };
+const uint8_t SHARED_REPEATS = 5;
+const uint16_t SHARED_PUBLISH_QUEUE_SIZE = 256;
+const size_t RPC_REQUESTS = 5000;
+
+const uint32_t CODEC_ITERATIONS = 10000000;
+constexpr char CODEC_TOPIC[] = "benchmark/codec";
+// the size of a publish to a fixed topic is known at compile time
+static_assert(Codec::packetSize(Codec::publishRemainingLength(Codec::stringLength(CODEC_TOPIC), 1, 0, 8)) == 1 + 1 + 2 + 15 + 2 + 8, "codec sizes are constexpr");
+volatile uint32_t codecChecksum = 0;  // keeps the encoding from being optimised away
+
+const uint16_t ALIAS_TOPICS = 8;
+const uint32_t ALIAS_PUBLISHES = 1000;
+const uint16_t ALIAS_MAXIMUM = 16;
+const size_t ALIAS_PAYLOAD_SIZE = 8;
+
+uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void sleepShortly() {
+  std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+template <typename Condition>
+bool waitFor(Condition condition, uint64_t deadline) {
+  while (!condition()) {
+    if (now() > deadline) return false;
+    sleepShortly();
+  }
+  return true;
+}
+
+struct Result {
+  const char* name;
+  uint8_t qos;
+  size_t payloadSize;
+  uint8_t publishers;
+  uint8_t producers;
+  size_t messages;
+  bool complete;
+  double seconds;
+  double messagesPerSecond;
+  double latencyP50;
+  double latencyP99;
+};
+
+class BenchmarkClient {
+ public:
+  BenchmarkClient(EventLoop* eventLoop, uint16_t port, size_t sendBufferSize, const std::string& clientId)
+  : _transport(eventLoop, sendBufferSize)
+  , _clientId(clientId)
+  , mqtt(&_transport)
+  , connected(false)
+  , subscriptions(0)
+  , received(0)
+  , latencies() {
+    mqtt.setServer(IPAddress(127, 0, 0, 1), port).setClientId(_clientId.c_str()).setKeepAlive(60);
+    mqtt.onConnect([this](bool sessionPresent) {
+      (void)sessionPresent;
+      connected = true;
+    });
+    mqtt.onDisconnect([this](AsyncMqttClientDisconnectReason reason) {
+      (void)reason;
+      connected = false;
+    });
+    mqtt.onSubscribe([this](uint16_t packetId, uint8_t qos) {
+      (void)packetId;
+      (void)qos;
+      subscriptions++;
+    });
+    mqtt.onMessage([this](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+      (void)topic;
+      (void)properties;
+      // the publication time is in the first bytes, which may come in more than one chunk
+      for (size_t i = index; i < sizeof(_sentAt) && i < index + len; i++) {
+        reinterpret_cast<char*>(&_sentAt)[i] = payload[i - index];
+      }
+      if (index + len < total) return;
+      latencies.push_back((now() - _sentAt) / 1000);
+      received.fetch_add(1, std::memory_order_release);
+    });
+  }
+
+ private:
+  PosixTransport _transport;
+  std::string _clientId;
+  uint64_t _sentAt;
+
+ public:
+  AsyncMqttClient mqtt;
+  std::atomic<bool> connected;
+  std::atomic<uint16_t> subscriptions;
+  std::atomic<size_t> received;
+  std::vector<uint32_t> latencies;  // us, written by the event loop thread only
+};
+
+// ns per packet, encode(destination, i) returns the size of the i-th packet
+template <typename Encode>
+double measureCodec(Encode encode) {
+  char buffer[Codec::MAX_CONNECT_HEAD_SIZE];
+  uint32_t checksum = 0;
+  uint64_t start = now();
+  for (uint32_t i = 0; i < CODEC_ITERATIONS; i++) {
+    uint8_t size = encode(buffer, i);
+    checksum += static_cast<uint8_t>(buffer[i % size]);
+  }
+  double nsPerPacket = static_cast<double>(now() - start) / CODEC_ITERATIONS;
+  codecChecksum += checksum;
+  return nsPerPacket;
+}
+
+void printCodec(const char* name, double nsPerPacket, bool first) {
+  printf("%s    {\"name\": \"%s\", \"nsPerPacket\": %.2f}", first ? "" : ",\n", name, nsPerPacket);
+}
+
+void benchmarkCodec() {
+  printCodec("connectHead", measureCodec([](char* destination, uint32_t i) {
+    ConnectFields fields = { AsyncMqttClientInternals::ProtocolVersion.V5, Codec::connectFlags(false, true, true, false, 0, false),
+                             static_cast<uint16_t>(i), 8, 16, 65536, 12, 0, 0, 8, 16 };
+    return Codec::encodeConnectHead(destination, fields);
+  }), true);
+  printCodec("publishHead", measureCodec([](char* destination, uint32_t i) {
+    const uint16_t topicLength = Codec::stringLength(CODEC_TOPIC);
+    const uint8_t qos = 1;
+    uint8_t size = Codec::encodePublishHead(destination, Codec::publishFixedHeader(qos, false, false), Codec::publishRemainingLength(topicLength, qos, 0, i % 1024), topicLength);
+    return size + Codec::encodePublishTail(destination + size, qos, i, AsyncMqttClientInternals::ProtocolVersion.V3_1_1, 0);
+  }), false);
+  printCodec("publishHeadV5", measureCodec([](char* destination, uint32_t i) {
+    const uint8_t qos = 1;
+    const uint16_t topicAlias = 1 + i % 8;
+    uint8_t propertiesLength = Codec::publishPropertiesLength(AsyncMqttClientInternals::ProtocolVersion.V5, topicAlias);
+    uint8_t size = Codec::encodePublishHead(destination, Codec::publishFixedHeader(qos, false, false), Codec::publishRemainingLength(0, qos, propertiesLength, i % 1024), 0);
+    return size + Codec::encodePublishTail(destination + size, qos, i, AsyncMqttClientInternals::ProtocolVersion.V5, topicAlias);
+  }), false);
+  printCodec("subscribeHead", measureCodec([](char* destination, uint32_t i) {
+    return Codec::encodeSubscribeHead(destination, AsyncMqttClientInternals::PacketType.SUBSCRIBE, AsyncMqttClientInternals::ProtocolVersion.V3_1_1, i, 1 + i % 64);
+  }), false);
+  printCodec("ack", measureCodec([](char* destination, uint32_t i) {
+    return Codec::encodeAck(destination, AsyncMqttClientInternals::PacketType.PUBACK, AsyncMqttClientInternals::HeaderFlag.PUBACK_RESERVED, i);
+  }), false);
+}
+
+// Bytes per PUBLISH of 8 bytes, to ALIAS_TOPICS topics in turn, with the client allowing `topicAliasMaximum` aliases
+double measureTopicAliases(uint16_t topicAliasMaximum) {
+  SimulatedTransport transport;
+  AsyncMqttClient mqtt(&transport);
+  mqtt.setClock([&transport]() { return transport.now(); });
+  mqtt.setServer(IPAddress(127, 0, 0, 1), 1883).setProtocolVersion(AsyncMqttClientInternals::ProtocolVersion.V5).setTopicAliasMaximum(topicAliasMaximum);
+  bool connected = false;
+  mqtt.onConnect([&connected](bool sessionPresent) {
+    (void)sessionPresent;
+    connected = true;
+  });
+  size_t bytes = 0;
+  transport.onServerData([&transport, &bytes, &connected](const char* data, size_t len) {
+    (void)data;
+    // CONNECT comes first, the broker allows ALIAS_MAXIMUM aliases
+    if (!connected && bytes == 0) {
+      const char connAck[] = { 0x20, 6, 0, 0, 3, 0x22, ALIAS_MAXIMUM >> 8, ALIAS_MAXIMUM & 0xFF };
+      transport.serverSend(connAck, sizeof(connAck));
+    }
+    bytes += len;
+  });
+  mqtt.connect();
+  transport.advance(10);
+  if (!connected) return 0;
+
+  bytes = 0;
+  char payload[ALIAS_PAYLOAD_SIZE] = {};
+  for (uint32_t i = 0; i < ALIAS_PUBLISHES; i++) {
+    std::string topic = "benchmark/aliases/sensor-" + std::to_string(i % ALIAS_TOPICS) + "/temperature";
+    mqtt.publish(topic.c_str(), 0, false, payload, sizeof(payload));
+    transport.advance(1);
+  }
+  mqtt.disconnect(true);
+  return static_cast<double>(bytes) / ALIAS_PUBLISHES;
+}
+
+void benchmarkTopicAliases() {
+  double without = measureTopicAliases(0);
+  double with = measureTopicAliases(ALIAS_MAXIMUM);
+  printf("    {\"topicAliases\": false, \"topics\": %u, \"payloadSize\": %zu, \"bytesPerPublish\": %.2f},\n", ALIAS_TOPICS, ALIAS_PAYLOAD_SIZE, without);
+  printf("    {\"topicAliases\": true, \"topics\": %u, \"payloadSize\": %zu, \"bytesPerPublish\": %.2f}", ALIAS_TOPICS, ALIAS_PAYLOAD_SIZE, with);
+}
+
+double percentile(const std::vector<uint32_t>& sorted, uint8_t percent) {
+  if (sorted.empty()) return 0;
+  size_t index = sorted.size() * percent / 100;
+  if (index >= sorted.size()) index = sorted.size() - 1;
+  return sorted[index];
+}
+
+// `producersPerPublisher` threads publish through each publisher, to its topic
+Result run(const char* name, uint16_t port, uint8_t qos, size_t payloadSize, uint8_t publisherCount, bool streamed, size_t messages,
+           uint8_t producersPerPublisher = 1, uint16_t publishQueueSize = 0) {
+  uint8_t producerCount = publisherCount * producersPerPublisher;
+  Result result = { name, qos, payloadSize, publisherCount, producerCount, messages, false, 0, 0, 0, 0 };
+  // an event loop per run, the clients cannot be destroyed while theirs runs
+  EventLoop eventLoop;
+  std::thread network([&eventLoop]() { eventLoop.run(); });
+
+  {
+    std::vector<std::unique_ptr<BenchmarkClient>> publishers;
+    for (uint8_t i = 0; i < publisherCount; i++) {
+      // streamed payloads go through the default send buffer, so that they are actually sent in chunks
+      size_t sendBufferSize = streamed ? PosixTransport::SEND_BUFFER_SIZE : LARGE_SEND_BUFFER;
+      publishers.emplace_back(new BenchmarkClient(&eventLoop, port, sendBufferSize, "publisher-" + std::to_string(i)));
+      publishers.back()->mqtt.setPublishQueueSize(publishQueueSize);
+    }
+    BenchmarkClient subscriber(&eventLoop, port, PosixTransport::SEND_BUFFER_SIZE, "subscriber");
+    subscriber.latencies.reserve(messages);
+
+    uint64_t deadline = now() + TIMEOUT * 1000000000ULL;
+    std::vector<std::string> topics;
+    bool ready = true;
+    subscriber.mqtt.connect();
+    ready = ready && waitFor([&subscriber]() { return subscriber.connected.load(); }, deadline);
+    for (uint8_t i = 0; ready && i < publisherCount; i++) {
+      topics.push_back(std::string("benchmark/") + name + "/" + std::to_string(i));
+      subscriber.mqtt.subscribe(topics.back().c_str(), qos);
+      BenchmarkClient* publisher = publishers[i].get();
+      publisher->mqtt.connect();
+      ready = waitFor([publisher]() { return publisher->connected.load(); }, deadline);
+    }
+    ready = ready && waitFor([&subscriber, publisherCount]() { return subscriber.subscriptions == publisherCount; }, deadline);
+
+    if (ready) {
+      std::atomic<size_t> sent(0);
+      uint32_t window = streamed ? 1 : WINDOW * producerCount;
+      uint64_t start = now();
+      // outlive the producers, the end of a streamed payload is read after its publish() returned
+      std::vector<std::vector<char>> payloads(producerCount, std::vector<char>(payloadSize, 'x'));
+      std::vector<std::thread> producers;
+      for (uint8_t i = 0; i < producerCount; i++) {
+        size_t count = messages / producerCount + (i < messages % producerCount ? 1 : 0);
+        producers.emplace_back([&, i, count]() {
+          AsyncMqttClient& mqtt = publishers[i / producersPerPublisher]->mqtt;
+          const char* topic = topics[i / producersPerPublisher].c_str();
+          std::vector<char>& payload = payloads[i];
+          for (size_t j = 0; j < count; j++) {
+            while (sent - subscriber.received.load(std::memory_order_acquire) >= window) {
+              if (now() > deadline) return;
+              sleepShortly();
+            }
+            uint64_t sentAt = now();
+            memcpy(payload.data(), &sentAt, sizeof(sentAt));
+            sent++;
+            while ((streamed ? mqtt.publish(topic, qos, false, [&payload](size_t index) { return payload.data() + index; }, payloadSize)
+                             : mqtt.publish(topic, qos, false, payload.data(), payloadSize)) == 0) {
+              if (now() > deadline || !mqtt.connected()) return;
+              sleepShortly();
+            }
+          }
+        });
+      }
+      for (std::thread& producer : producers) producer.join();
+
+      result.complete = waitFor([&subscriber, messages]() { return subscriber.received.load(std::memory_order_acquire) == messages; }, deadline);
+      result.seconds = (now() - start) / 1e9;
+
+      for (std::unique_ptr<BenchmarkClient>& publisher : publishers) publisher->mqtt.disconnect(true);
+      subscriber.mqtt.disconnect(true);
+      eventLoop.stop();
+      network.join();
+    } else {
+      eventLoop.stop();
+      network.join();
+    }
+
+    std::vector<uint32_t>& latencies = subscriber.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    result.messages = latencies.size();
+    if (result.seconds > 0) result.messagesPerSecond = latencies.size() / result.seconds;
+    result.latencyP50 = percentile(latencies, 50);
+    result.latencyP99 = percentile(latencies, 99);
+  }
+
+  return result;
+}
+
+// A responder client answers every request from its message callback, on the response topic of the requester
+Result rpc(uint16_t port, uint8_t qos, size_t requests) {
+  Result result = { "rpc", qos, sizeof(uint64_t), 1, 1, requests, false, 0, 0, 0, 0 };
+  EventLoop eventLoop;
+  std::thread network([&eventLoop]() { eventLoop.run(); });
+
+  {
+    BenchmarkClient requester(&eventLoop, port, PosixTransport::SEND_BUFFER_SIZE, "requester");
+    BenchmarkClient responder(&eventLoop, port, PosixTransport::SEND_BUFFER_SIZE, "responder");
+    requester.mqtt.setRpc("benchmark/rpc/response", 1);
+    responder.mqtt.onMessage([&responder, qos](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+      (void)properties;
+      (void)index;
+      (void)total;
+      std::string responseTopic = std::string("benchmark/rpc/response/") + (strrchr(topic, '/') + 1);
+      responder.mqtt.publish(responseTopic.c_str(), qos, false, payload, len);
+    });
+
+    uint64_t deadline = now() + TIMEOUT * 1000000000ULL;
+    requester.mqtt.connect();
+    responder.mqtt.connect();
+    bool ready = waitFor([&requester, &responder]() { return requester.connected && responder.connected; }, deadline);
+    if (ready) responder.mqtt.subscribe("benchmark/rpc/request/+", qos);
+    ready = ready && waitFor([&responder]() { return responder.subscriptions == 1; }, deadline);
+
+    std::vector<uint32_t> latencies;
+    latencies.reserve(requests);
+    if (ready) {
+      std::atomic<uint8_t> status(0);  // 1 answered, 2 failed
+      uint64_t answeredAt = 0;
+      uint64_t start = now();
+      for (size_t i = 0; i < requests; i++) {
+        status = 0;
+        uint64_t sentAt = now();
+        char payload[sizeof(uint64_t)];
+        memcpy(payload, &sentAt, sizeof(sentAt));
+        while (requester.mqtt.request("benchmark/rpc/request", payload, sizeof(payload), 1000, [&status, &answeredAt](uint16_t requestId, AsyncMqttClientRpcStatus rpcStatus, const char* response, size_t len, size_t index, size_t total) {
+          (void)requestId;
+          (void)response;
+          if (rpcStatus != AsyncMqttClientRpcStatus::RESPONSE) {
+            status = 2;
+          } else if (index + len == total) {
+            answeredAt = now();
+            status = 1;
+          }
+        }, qos) == 0) {
+          if (now() > deadline) break;
+          sleepShortly();
+        }
+        if (!waitFor([&status]() { return status != 0; }, deadline) || status != 1) break;
+        latencies.push_back((answeredAt - sentAt) / 1000);
+      }
+      result.complete = latencies.size() == requests;
+      result.seconds = (now() - start) / 1e9;
+    }
+    requester.mqtt.disconnect(true);
+    responder.mqtt.disconnect(true);
+    eventLoop.stop();
+    network.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    result.messages = latencies.size();
+    if (result.seconds > 0) result.messagesPerSecond = latencies.size() / result.seconds;
+    result.latencyP50 = percentile(latencies, 50);
+    result.latencyP99 = percentile(latencies, 99);
+  }
+
+  return result;
+}
+
+// The run of median throughput, complete if all of them were
+Result median(std::vector<Result>& results) {
+  std::sort(results.begin(), results.end(), [](const Result& a, const Result& b) { return a.messagesPerSecond < b.messagesPerSecond; });
+  Result result = results[results.size() / 2];
+  for (const Result& run : results) result.complete = result.complete && run.complete;
+  return result;
+}
+
+// Printed as soon as done, so that a run that hangs does not hide the previous ones
+bool print(const Result& result, bool first) {
+  printf("%s    {\"name\": \"%s\", \"qos\": %u, \"payloadSize\": %zu, \"publishers\": %u, \"producers\": %u, \"messages\": %zu, \"complete\": %s, "
+         "\"seconds\": %.3f, \"messagesPerSecond\": %.1f, \"latencyP50Us\": %.0f, \"latencyP99Us\": %.0f}",
+         first ? "" : ",\n", result.name, result.qos, result.payloadSize, result.publishers, result.producers, result.messages, result.complete ? "true" : "false",
+         result.seconds, result.messagesPerSecond, result.latencyP50, result.latencyP99);
+  fflush(stdout);
+  return result.complete;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t maxMessages = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+  if (maxMessages == 0) {
+    fprintf(stderr, "usage: %s [maximum messages per run]\n", argv[0]);
+    return 1;
+  }
+
+  Broker broker;
+  uint16_t port = broker.start();
+  if (port == 0) {
+    fprintf(stderr, "cannot start the broker\n");
+    return 1;
+  }
+
+  bool complete = true;
+  bool first = true;
+  printf("{\n  \"codec\": [\n");
+  benchmarkCodec();
+  printf("\n  ],\n  \"topicAliases\": [\n");
+  benchmarkTopicAliases();
+  printf("\n  ],\n  \"benchmarks\": [\n");
+  for (uint8_t qos = 0; qos <= 2; qos++) {
+    for (size_t payloadSize : PAYLOAD_SIZES) {
+      size_t messages = std::min(maxMessages, std::max(MIN_MESSAGES, BYTES_PER_RUN / payloadSize));
+      complete &= print(run("publish", port, qos, payloadSize, 1, false, messages), first);
+      first = false;
+    }
+    for (size_t payloadSize : STREAMED_PAYLOAD_SIZES) {
+      complete &= print(run("streamed", port, qos, payloadSize, 1, true, std::min(maxMessages, MIN_MESSAGES)), first);
+    }
+    complete &= print(run("fanIn", port, qos, 64, FAN_IN_PUBLISHERS, false, maxMessages), first);
+    for (uint8_t producers : SHARED_PRODUCERS) {
+      // taking turns, so that a slower moment of the machine does not fall on one of them only
+      std::vector<Result> locked;
+      std::vector<Result> queued;
+      for (uint8_t i = 0; i < SHARED_REPEATS; i++) {
+        locked.push_back(run("shared", port, qos, 64, 1, false, maxMessages, producers));
+        queued.push_back(run("sharedQueue", port, qos, 64, 1, false, maxMessages, producers, SHARED_PUBLISH_QUEUE_SIZE));
+      }
+      complete &= print(median(locked), first);
+      complete &= print(median(queued), first);
+    }
+    complete &= print(rpc(port, qos, std::min(maxMessages, RPC_REQUESTS)), first);
+  }
+  printf("\n  ]\n}\n");
+
+  broker.stop();
+  return complete ? 0 : 2;
+}
@@ -0,0 +1,416 @@
+/*
+Bytes copied and heap allocations per telemetry message, from its values to the TCP send buffer, on Linux.
+
+The same message is published three ways: as JSON appended to an Arduino style String, which is then passed to
+publish(); as JSON serialised by AsyncMqttClientJsonWriter with publish() with a writer; and as CBOR with
+AsyncMqttClientCborWriter. The transport counts the bytes the client adds and the packets it hands over, and the global
+operator new the allocations. The String reallocates to the exact length on every concatenation, as Arduino's does,
+and the bytes it moves when its buffer changes address are counted.
+
+The transport reserves room in its send buffer, as the Linux one does: the writers serialise the payload there and
+the packet is handed over without being copied again. The String path copies the payload into the String, then the
+packet into the send buffer, with separate add() calls for the head, topic and payload, a tcp_write() each with lwIP.
+Where the transport cannot reserve room, on ESP, the writers build the packet in the writer buffer and copy it once.
+
+The packets of the String and the JSON writer are compared byte for byte, with payloads whose remaining length takes
+1, 2 and 3 bytes: the fixed header the writer writes last, in the room left for it, must be the one publish() writes.
+
+Build and run with `make payload-writer`, the results are printed on stdout as JSON and the exit code is 2 on failure.
+Usage: payload-writer [messages]
+*/
+#include <AsyncMqttClient.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+const size_t DEFAULT_MESSAGES = 200000;
+const size_t WRITER_BUFFER = 32 * 1024;
+const size_t SEND_BUFFER = 64 * 1024;
+const char TOPIC[] = "sensors/esp32-a1b2c3/telemetry";
+
+size_t allocations = 0;
+
+uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Always connected with room to spare, keeps the last packet written
+class CountingTransport : public AsyncMqttClientInternals::Transport {
+ public:
+  CountingTransport()
+  : bytes(0)
+  , calls(0)
+  , packet()
+  , _sent(true)
+  , _sendBuffer(SEND_BUFFER) {
+  }
+
+  bool connect(IPAddress ip, uint16_t port, bool secure) override {
+    (void)ip;
+    (void)port;
+    (void)secure;
+    return true;
+  }
+
+  bool connect(const char* host, uint16_t port, bool secure) override {
+    (void)host;
+    (void)port;
+    (void)secure;
+    return true;
+  }
+
+  // The TCP connection is up and the server accepts the CONNECT
+  void accept() {
+    _onConnect();
+    char connAck[] = { 0x20, 0x02, 0x00, 0x00 };
+    _onData(connAck, sizeof(connAck));
+  }
+
+  // With MQTT 5, allowing 8 topic aliases
+  void acceptV5() {
+    _onConnect();
+    char connAck[] = { 0x20, 0x06, 0x00, 0x00, 0x03, 0x22, 0x00, 0x08 };
+    _onData(connAck, sizeof(connAck));
+  }
+
+  void close(bool now) override {
+    (void)now;
+  }
+
+  bool canSend() override {
+    return true;
+  }
+
+  size_t space() override {
+    return 1024 * 1024;
+  }
+
+  size_t add(const char* data, size_t size) override {
+    if (_sent) packet.clear();
+    _sent = false;
+    packet.append(data, size);
+    bytes += size;
+    calls++;
+    return size;
+  }
+
+  bool send() override {
+    _sent = true;
+    return true;
+  }
+
+  // Written in place, not counted as copied. The packet is kept for the comparisons
+  char* reserve(size_t size) override {
+    return size <= _sendBuffer.size() ? _sendBuffer.data() : nullptr;
+  }
+
+  void commit(size_t offset, size_t length) override {
+    if (length == 0) return;
+    if (_sent) packet.clear();
+    _sent = false;
+    packet.append(_sendBuffer.data() + offset, length);
+    calls++;
+  }
+
+  void ackLater() override {}
+
+  size_t ack(size_t len) override {
+    return len;
+  }
+
+#if ASYNC_MQTT_TLS
+  bool matchFingerprint(const uint8_t* fingerprint) override {
+    (void)fingerprint;
+    return false;
+  }
+#endif
+
+  size_t bytes;        // added by the client
+  size_t calls;        // to add() and commit()
+  std::string packet;  // the last one sent
+
+ private:
+  bool _sent;
+  std::vector<char> _sendBuffer;
+};
+
+// Arduino's String: concat() reallocates to the exact length
+class ArduinoString {
+ public:
+  ArduinoString()
+  : moved(0)
+  , written(0)
+  , _buffer(nullptr)
+  , _length(0) {
+  }
+
+  ~ArduinoString() {
+    free(_buffer);
+  }
+
+  void concat(const char* data) {
+    concat(data, strlen(data));
+  }
+
+  void concat(const char* data, size_t len) {
+    char* buffer = static_cast<char*>(realloc(_buffer, _length + len + 1));
+    allocations++;
+    if (buffer != _buffer) moved += _length;
+    _buffer = buffer;
+    memcpy(_buffer + _length, data, len);
+    _length += len;
+    _buffer[_length] = '\0';
+    written += len;
+  }
+
+  // As String(value) would, through a buffer on the stack
+  void concat(double value) {
+    char number[32];
+    concat(number, snprintf(number, sizeof(number), "%.6g", value));
+  }
+
+  void concat(long value) {
+    char number[24];
+    concat(number, snprintf(number, sizeof(number), "%ld", value));
+  }
+
+  const char* c_str() const {
+    return _buffer;
+  }
+
+  size_t length() const {
+    return _length;
+  }
+
+  size_t moved;
+  size_t written;
+
+ private:
+  char* _buffer;
+  size_t _length;
+};
+
+struct Telemetry {
+  const char* device;
+  long uptime;
+  long rssi;
+  double battery;
+  bool charging;
+  double temperatures[8];
+  const char* status;  // longer for the packets whose remaining length takes 2 and 3 bytes
+};
+
+Telemetry reading(uint32_t i) {
+  Telemetry telemetry = { "esp32-a1b2c3", static_cast<long>(i), -40 - static_cast<long>(i % 50), 3.3 + (i % 90) / 100.0, i % 7 == 0,
+                          { 0 }, "ok" };
+  for (uint8_t t = 0; t < 8; t++) telemetry.temperatures[t] = 18.0 + ((i + t * 13) % 200) / 16.0;
+  return telemetry;
+}
+
+void json(ArduinoString& string, const Telemetry& telemetry) {
+  string.concat("{\"device\":\"");
+  string.concat(telemetry.device);
+  string.concat("\",\"uptime\":");
+  string.concat(telemetry.uptime);
+  string.concat(",\"rssi\":");
+  string.concat(telemetry.rssi);
+  string.concat(",\"battery\":");
+  string.concat(telemetry.battery);
+  string.concat(",\"charging\":");
+  string.concat(telemetry.charging ? "true" : "false");
+  string.concat(",\"temperatures\":[");
+  for (uint8_t t = 0; t < 8; t++) {
+    if (t > 0) string.concat(",");
+    string.concat(telemetry.temperatures[t]);
+  }
+  string.concat("],\"status\":\"");
+  string.concat(telemetry.status);
+  string.concat("\"}");
+}
+
+void json(AsyncMqttClientWriter& writer, const Telemetry& telemetry) {
+  AsyncMqttClientJsonWriter json(writer);
+  json.beginObject();
+  json.key("device").value(telemetry.device);
+  json.key("uptime").value(telemetry.uptime);
+  json.key("rssi").value(telemetry.rssi);
+  json.key("battery").value(telemetry.battery);
+  json.key("charging").value(telemetry.charging);
+  json.key("temperatures").beginArray();
+  for (double temperature : telemetry.temperatures) json.value(temperature);
+  json.endArray();
+  json.key("status").value(telemetry.status);
+  json.endObject();
+}
+
+void cbor(AsyncMqttClientWriter& writer, const Telemetry& telemetry) {
+  AsyncMqttClientCborWriter cbor(writer);
+  cbor.map(7);
+  cbor.key("device").value(telemetry.device);
+  cbor.key("uptime").value(telemetry.uptime);
+  cbor.key("rssi").value(telemetry.rssi);
+  cbor.key("battery").value(static_cast<float>(telemetry.battery));
+  cbor.key("charging").value(telemetry.charging);
+  cbor.key("temperatures").array(8);
+  for (double temperature : telemetry.temperatures) cbor.value(static_cast<float>(temperature));
+  cbor.key("status").value(telemetry.status);
+}
+
+struct Run {
+  const char* name;
+  size_t payloadBytes;     // of the last message
+  double bytesCopied;      // per message: into intermediate buffers, moved by reallocations, added to the transport
+  double allocations;      // per message
+  double adds;             // add() and commit() calls to the transport per message
+  double nsPerMessage;
+};
+
+void print(const Run& run, bool last) {
+  printf("    {\"name\": \"%s\", \"payloadBytes\": %zu, \"bytesCopiedPerMessage\": %.1f, \"allocationsPerMessage\": %.2f, \"addsPerMessage\": %.1f, \"nsPerMessage\": %.0f}%s\n",
+         run.name, run.payloadBytes, run.bytesCopied, run.allocations, run.adds, run.nsPerMessage, last ? "" : ",");
+}
+}  // namespace
+
+void* operator new(size_t size) {
+  allocations++;
+  void* pointer = malloc(size == 0 ? 1 : size);
+  if (pointer == nullptr) throw std::bad_alloc();
+  return pointer;
+}
+
+void* operator new[](size_t size) {
+  allocations++;
+  void* pointer = malloc(size == 0 ? 1 : size);
+  if (pointer == nullptr) throw std::bad_alloc();
+  return pointer;
+}
+
+void operator delete(void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete(void* pointer, size_t size) noexcept {
+  (void)size;
+  free(pointer);
+}
+
+void operator delete[](void* pointer, size_t size) noexcept {
+  (void)size;
+  free(pointer);
+}
+
+int main(int argc, char** argv) {
+  size_t messages = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_MESSAGES;
+  if (messages == 0) messages = 1;
+
+  CountingTransport transport;
+  AsyncMqttClient client(&transport);
+  client.setServer(IPAddress(127, 0, 0, 1), 1883).setWriterBuffer(WRITER_BUFFER);
+  client.connect();
+  transport.accept();
+  bool ok = client.connected();
+
+  // the same packets, with remaining lengths of 1, 2 and 3 bytes
+  bool identical = true;
+  std::string statuses[] = { "", std::string(200, 's'), std::string(20000, 's') };
+  for (const std::string& status : statuses) {
+    Telemetry telemetry = reading(1);
+    telemetry.status = status.c_str();
+    ArduinoString string;
+    json(string, telemetry);
+    ok = ok && client.publish(TOPIC, 0, false, string.c_str(), string.length()) == 1;
+    std::string fromString = transport.packet;
+    ok = ok && client.publish(TOPIC, 0, false, [&telemetry](AsyncMqttClientWriter& writer) { json(writer, telemetry); }) == 1;
+    identical = identical && transport.packet == fromString && fromString.size() > string.length();
+  }
+  // with MQTT 5, a topic gets its alias as with publish(), then is replaced by it
+  CountingTransport stringTransport;
+  CountingTransport writerTransport;
+  AsyncMqttClient stringClient(&stringTransport);
+  AsyncMqttClient writerClient(&writerTransport);
+  stringClient.setServer(IPAddress(127, 0, 0, 1), 1883).setProtocolVersion(5).setTopicAliasMaximum(8);
+  writerClient.setServer(IPAddress(127, 0, 0, 1), 1883).setProtocolVersion(5).setTopicAliasMaximum(8).setWriterBuffer(WRITER_BUFFER);
+  stringClient.connect();
+  stringTransport.acceptV5();
+  writerClient.connect();
+  writerTransport.acceptV5();
+  bool aliased = stringClient.connected() && writerClient.connected();
+  size_t packetSizes[2];
+  for (uint8_t i = 0; i < 2; i++) {
+    Telemetry telemetry = reading(1);
+    ArduinoString string;
+    json(string, telemetry);
+    aliased = aliased && stringClient.publish(TOPIC, 1, false, string.c_str(), string.length()) != 0;
+    aliased = aliased && writerClient.publish(TOPIC, 1, false, [&telemetry](AsyncMqttClientWriter& writer) { json(writer, telemetry); }) != 0;
+    aliased = aliased && writerTransport.packet == stringTransport.packet;
+    packetSizes[i] = writerTransport.packet.size();
+  }
+  aliased = aliased && packetSizes[1] + strlen(TOPIC) == packetSizes[0];
+  identical = identical && aliased;
+
+  // nothing is sent for a payload cancelled or past the buffer
+  size_t bytes = transport.bytes;
+  ok = ok && client.publish(TOPIC, 0, false, [](AsyncMqttClientWriter& writer) { writer.cancel(); }) == 0;
+  ok = ok && client.publish(TOPIC, 0, false, [](AsyncMqttClientWriter& writer) { writer.write(std::string(WRITER_BUFFER, 'x').data(), WRITER_BUFFER); }) == 0;
+  ok = ok && transport.bytes == bytes;
+
+  Run runs[3] = { { "string", 0, 0, 0, 0, 0 }, { "jsonWriter", 0, 0, 0, 0, 0 }, { "cborWriter", 0, 0, 0, 0, 0 } };
+  for (uint8_t r = 0; r < 3; r++) {
+    size_t copied = 0;
+    size_t bytesBefore = transport.bytes;
+    size_t callsBefore = transport.calls;
+    size_t allocationsBefore = allocations;
+    uint64_t start = now();
+    for (uint32_t i = 0; i < messages; i++) {
+      Telemetry telemetry = reading(i);
+      uint16_t sent;
+      if (r == 0) {
+        ArduinoString string;
+        json(string, telemetry);
+        sent = client.publish(TOPIC, 0, false, string.c_str(), string.length());
+        copied += string.written + string.moved;
+        runs[r].payloadBytes = string.length();
+      } else {
+        // a single reference, held by std::function without allocating
+        struct {
+          const Telemetry* telemetry;
+          bool cbor;
+          size_t* payloadBytes;
+        } message = { &telemetry, r == 2, &runs[r].payloadBytes };
+        sent = client.publish(TOPIC, 0, false, [&message](AsyncMqttClientWriter& writer) {
+          if (message.cbor) {
+            cbor(writer, *message.telemetry);
+          } else {
+            json(writer, *message.telemetry);
+          }
+          *message.payloadBytes = writer.length();
+        });
+        // serialised once, into the send buffer. The topic is copied into it too
+        copied += runs[r].payloadBytes + strlen(TOPIC);
+      }
+      ok = ok && sent == 1;
+    }
+    uint64_t elapsed = now() - start;
+    copied += transport.bytes - bytesBefore;
+    runs[r].bytesCopied = static_cast<double>(copied) / messages;
+    runs[r].allocations = static_cast<double>(allocations - allocationsBefore) / messages;
+    runs[r].adds = static_cast<double>(transport.calls - callsBefore) / messages;
+    runs[r].nsPerMessage = static_cast<double>(elapsed) / messages;
+  }
+  ok = ok && identical && runs[1].allocations == 0 && runs[2].allocations == 0 && runs[1].adds == 1 && runs[2].adds == 1;
+
+  printf("{\n  \"messages\": %zu,\n  \"runs\": [\n", messages);
+  for (uint8_t r = 0; r < 3; r++) print(runs[r], r == 2);
+  printf("  ],\n  \"identicalPackets\": %s,\n  \"ok\": %s\n}\n", identical ? "true" : "false", ok ? "true" : "false");
+  return ok ? 0 : 2;
+}
@@ -0,0 +1,1272 @@
+/*
+Deterministic network simulation of the client, on SimulatedTransport and its clock.
+
+Scenarios:
+- segmentation: packets of every kind split at random boundaries, with latency and jitter, MQTT 3.1.1 and 5
+- keepAlive: time to detect a broker that stopped answering, and no false detection on a slow link
+- drop: connection lost at every byte of a packet, time to reconnect, parser state after it
+- space: publishes with a send buffer shrunk below the packet size
+- priority: acks, ping and urgent publishes waiting for a long streamed payload go out first once it ends
+- rateLimit: publishes over the rate limits rejected, queued until tokens are back, or dropping the oldest held one,
+  and through a publish queue, limited as it drains
+- coalescing: telemetry published faster than a tight link sends it, only the latest value of each topic goes out
+- cache: last payload of the cached topics, split in segments, evicted least recently used first within the budget
+- rpc: responses matched to their requests, late ones ignored, timeouts at the deadline, requests ended by a disconnection
+- sink: a payload split in segments written in blocks and hashed on the way, another one cut by a disconnection
+- dns: reconnections to the cached address of the server, with DNS slow or down, and to the next one when unreachable
+  or when the connection cannot be started
+- pipelining: subscriptions and publishes sent right behind CONNECT, time until the subscriptions are acknowledged
+- packetIds: publishes the broker never acknowledges until no id is left, ids reused once their acknowledgement came
+- ackTimeout: publishes the broker does not acknowledge reported once past their deadline, the acknowledged ones never
+- deadlines: a host loop calling tick() when nextDeadlineMs() is over, the timed work done on time rather than at a poll
+- offline: publishes buffered while disconnected, evicted by priority, expired, and sent at the flush rate once connected
+- inboundBudget: reads stopped once the application holds more payload than its budget, resumed as it releases it
+- dispatch: messages delivered by worker threads, in order per topic, the network task held back by a full queue, and
+  what is queued delivered when the client is destroyed
+
+Every run is reproducible from its seed. Build and run with `make simulation`, the results are
+printed on stdout as JSON and the exit code is not 0 if a scenario failed.
+*/
+#include <AsyncMqttClient.h>
+#include <AsyncMqttClient/Transports/SimulatedTransport.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using AsyncMqttClientInternals::SimulatedTransport;
+
+namespace {
+const uint32_t SEGMENTATION_SEEDS = 500;
+const uint32_t RECONNECT_DELAY = 1000;  // ms, what the application waits before reconnecting
+
+// Broker played on the server side of the transport, MQTT 3.1.1 or 5.
+// With MQTT 5 its publishes carry properties and use the topic aliases the client allows.
+class Broker {
+ public:
+  explicit Broker(SimulatedTransport* transport)
+  : answerPings(true)
+  , received()
+  , sequence()
+  , published()
+  , segments(0)
+  , keepAlive(0)
+  , disconnectReason(-1)
+  , _transport(transport)
+  , _buffer()
+  , _nextPacketId(0)
+  , _v5(false)
+  , _topicAliasMaximum(0)
+  , _aliases() {
+    _transport->onServerConnect([this]() {
+      _buffer.clear();
+      _aliases.clear();
+    });
+    _transport->onServerData([this](const char* data, size_t len) {
+      segments++;
+      _buffer.insert(_buffer.end(), data, data + len);
+      _parse();
+    });
+  }
+
+  static std::vector<char> packet(uint8_t header, const std::string& variable) {
+    std::vector<char> packet(1, static_cast<char>(header));
+    size_t length = variable.size();
+    do {
+      uint8_t digit = length % 128;
+      length /= 128;
+      if (length > 0) digit |= 0x80;
+      packet.push_back(static_cast<char>(digit));
+    } while (length > 0);
+    packet.insert(packet.end(), variable.begin(), variable.end());
+    return packet;
+  }
+
+  std::vector<char> publishPacket(const std::string& topic, const std::string& payload, uint8_t qos) {
+    std::string properties;
+    std::string sentTopic = topic;
+    if (_v5) {
+      properties += std::string("\x01\x01", 2);  // payload format indicator
+      properties += std::string("\x26\0\x03key\0\x05value", 13);  // user property
+      uint16_t alias = 0;
+      for (size_t i = 0; i < _aliases.size() && alias == 0; i++) {
+        if (_aliases[i] == topic) {
+          alias = i + 1;
+          sentTopic.clear();
+        }
+      }
+      if (alias == 0 && _aliases.size() < _topicAliasMaximum) {
+        _aliases.push_back(topic);
+        alias = _aliases.size();
+      }
+      if (alias != 0) properties += std::string("\x23\0", 2) + static_cast<char>(alias);
+    }
+
+    std::string variable;
+    variable += static_cast<char>(sentTopic.size() >> 8);
+    variable += static_cast<char>(sentTopic.size() & 0xFF);
+    variable += sentTopic;
+    if (qos != 0) {
+      if (++_nextPacketId == 0) _nextPacketId = 1;
+      variable += static_cast<char>(_nextPacketId >> 8);
+      variable += static_cast<char>(_nextPacketId & 0xFF);
+    }
+    if (_v5) {
+      variable += static_cast<char>(properties.size());
+      variable += properties;
+    }
+    variable += payload;
+    return packet(0x30 | (qos << 1), variable);
+  }
+
+  void send(const std::vector<char>& packet) {
+    _transport->serverSend(packet.data(), packet.size());
+  }
+
+  bool answerPings;
+  uint32_t received[16];  // packets received from the client, by type
+  std::vector<uint8_t> sequence;  // their types, in order
+  std::vector<std::string> published;  // "topic|payload" of the PUBLISH packets, without topic alias
+  uint32_t segments;   // data received from the client, in TCP segments
+  uint16_t keepAlive;  // of the last CONNECT
+  int16_t disconnectReason;  // of the last DISCONNECT, 0 without reason code
+
+ private:
+  void _parse() {
+    while (_buffer.size() >= 2) {
+      size_t length = 0;
+      size_t multiplier = 1;
+      size_t headerLength = 1;
+      bool complete = false;
+      while (headerLength < _buffer.size() && headerLength <= 4) {
+        uint8_t digit = _buffer[headerLength++];
+        length += (digit & 127) * multiplier;
+        multiplier *= 128;
+        if ((digit & 128) == 0) {
+          complete = true;
+          break;
+        }
+      }
+      if (!complete || _buffer.size() < headerLength + length) return;
+
+      std::string variable(_buffer.begin() + headerLength, _buffer.begin() + headerLength + length);
+      _handle(static_cast<uint8_t>(_buffer[0]), variable);
+      _buffer.erase(_buffer.begin(), _buffer.begin() + headerLength + length);
+    }
+  }
+
+  void _handle(uint8_t header, const std::string& variable) {
+    uint8_t type = header >> 4;
+    received[type]++;
+    sequence.push_back(type);
+    switch (type) {
+      case 1:  // CONNECT
+        _v5 = variable[6] == 5;
+        keepAlive = (static_cast<uint8_t>(variable[8]) << 8) | static_cast<uint8_t>(variable[9]);
+        _topicAliasMaximum = 0;
+        if (_v5) {
+          // the properties follow the protocol name, version, flags and keep alive
+          for (size_t i = 11; i < 11 + static_cast<size_t>(static_cast<uint8_t>(variable[10])); i += 3) {
+            if (variable[i] == 0x22) _topicAliasMaximum = (static_cast<uint8_t>(variable[i + 1]) << 8) | static_cast<uint8_t>(variable[i + 2]);
+          }
+          send(packet(0x20, std::string("\0\0\x03\x21\0\x05", 6)));  // receive maximum 5
+        } else {
+          send(packet(0x20, std::string("\0\0", 2)));
+        }
+        break;
+      case 3: {  // PUBLISH
+        size_t topicLength = (static_cast<uint8_t>(variable[0]) << 8) | static_cast<uint8_t>(variable[1]);
+        size_t payloadStart = 2 + topicLength + (((header >> 1) & 0x03) != 0 ? 2 : 0);
+        if (_v5) payloadStart += 1 + static_cast<uint8_t>(variable[payloadStart]);  // properties shorter than 128 bytes
+        published.push_back(variable.substr(2, topicLength) + "|" + variable.substr(payloadStart));
+        break;
+      }
+      case 5:  // PUBREC
+        send(packet(0x62, variable.substr(0, 2)));
+        break;
+      case 8:  // SUBSCRIBE, every QoS is granted
+        send(packet(0x90, variable.substr(0, 2) + (_v5 ? std::string(1, '\0') : std::string()) + variable.substr(variable.size() - 1)));
+        break;
+      case 10:  // UNSUBSCRIBE, of one topic
+        send(packet(0xB0, variable.substr(0, 2) + (_v5 ? std::string("\0\0", 2) : std::string())));
+        break;
+      case 12:  // PINGREQ
+        if (answerPings) send(packet(0xD0, std::string()));
+        break;
+      case 14:  // DISCONNECT
+        disconnectReason = variable.empty() ? 0 : static_cast<uint8_t>(variable[0]);
+        break;
+      default:
+        break;
+    }
+  }
+
+  SimulatedTransport* _transport;
+  std::vector<char> _buffer;
+  uint16_t _nextPacketId;
+  bool _v5;
+  uint16_t _topicAliasMaximum;
+  std::vector<std::string> _aliases;
+};
+
+// A client on its own simulated link, recording the complete messages it receives
+struct Simulation {
+  explicit Simulation(uint32_t seed)
+  : transport(seed)
+  , broker(&transport)
+  , client(&transport)
+  , messages()
+  , connections(0)
+  , disconnections(0)
+  , reason(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED)
+  , _message() {
+    for (uint32_t& count : broker.received) count = 0;
+    client.setClock([this]() { return transport.now(); });
+    client.setServer(IPAddress(127, 0, 0, 1), 1883);
+    client.onConnect([this](bool sessionPresent) {
+      (void)sessionPresent;
+      connections++;
+    });
+    client.onDisconnect([this](AsyncMqttClientDisconnectReason disconnectReason) {
+      reason = disconnectReason;
+      disconnections++;
+    });
+    client.onMessage([this](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+      (void)properties;
+      // a message cut by a disconnection is never completed, the next one starts over
+      if (index == 0) _message = std::string(topic) + "|";
+      _message.append(payload, len);
+      if (index + len == total) messages.push_back(_message);
+    });
+  }
+
+  // Advances the clock ms by ms until the condition holds, returns false if it does not within timeout ms
+  template <typename Condition>
+  bool advanceUntil(Condition condition, uint32_t timeout) {
+    for (uint32_t i = 0; i < timeout; i++) {
+      if (condition()) return true;
+      transport.advance(1);
+    }
+    return condition();
+  }
+
+  bool connect() {
+    uint32_t before = connections;
+    client.connect();
+    return advanceUntil([this, before]() { return connections > before; }, 60000);
+  }
+
+  SimulatedTransport transport;
+  Broker broker;
+  AsyncMqttClient client;
+  std::vector<std::string> messages;
+  uint32_t connections;
+  uint32_t disconnections;
+  AsyncMqttClientDisconnectReason reason;  // of the last disconnection
+
+ private:
+  std::string _message;
+};
+
+bool first = true;
+
+void print(const std::string& result) {
+  printf("%s    %s", first ? "" : ",\n", result.c_str());
+  fflush(stdout);
+  first = false;
+}
+
+// Every packet the client parses, split at random boundaries, odd seeds with MQTT 5
+bool segmentation() {
+  uint32_t failures = 0;
+  uint32_t firstFailure = 0;
+  for (uint32_t seed = 0; seed < SEGMENTATION_SEEDS; seed++) {
+    Simulation simulation(seed);
+    simulation.transport.setLatency(seed % 20, seed % 7);
+    simulation.transport.setMaxSegmentSize(1 + seed % 16);
+    simulation.client.setKeepAlive(5);
+    if (seed % 2 == 1) simulation.client.setProtocolVersion(5).setTopicAliasMaximum(8);
+
+    bool ok = simulation.connect();
+    simulation.client.subscribe("segmentation/#", 2);
+
+    std::vector<std::string> expected;
+    uint32_t expectedAcks[3] = { 0, 0, 0 };
+    for (uint32_t i = 0; i < 60; i++) {
+      std::string topic = "segmentation/" + std::string(i % 40, 't');
+      std::string payload;
+      for (uint32_t j = 0; j < (i * 37 + seed) % 700; j++) payload += static_cast<char>('a' + (i + j) % 26);
+      uint8_t qos = i % 3;
+      simulation.broker.send(simulation.broker.publishPacket(topic, payload, qos));
+      expected.push_back(topic + "|" + payload);
+      expectedAcks[qos]++;
+      if (i % 10 == 0) simulation.broker.send(Broker::packet(0xD0, std::string()));  // unsolicited PINGRESP
+    }
+    simulation.transport.advance(10000);  // pings included
+
+    ok = ok && simulation.client.connected() && simulation.disconnections == 0;
+    ok = ok && simulation.messages == expected;
+    ok = ok && simulation.broker.received[4] == expectedAcks[1] && simulation.broker.received[7] == expectedAcks[2];  // PUBACK, PUBCOMP
+    if (!ok && failures++ == 0) firstFailure = seed;
+  }
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"segmentation\", \"runs\": %u, \"failures\": %u, \"firstFailedSeed\": %d}",
+           SEGMENTATION_SEEDS, failures, failures > 0 ? static_cast<int>(firstFailure) : -1);
+  print(result);
+  return failures == 0;
+}
+
+// A broker that stops answering is detected within 2.7 keep alive periods, a slow one is not taken for dead
+bool keepAlive() {
+  const uint16_t keepAlive = 10;
+
+  Simulation silent(1);
+  silent.client.setKeepAlive(keepAlive);
+  bool ok = silent.connect();
+  silent.broker.answerPings = false;
+  uint32_t start = silent.transport.now();
+  ok = ok && silent.advanceUntil([&silent]() { return silent.disconnections > 0; }, 120000);
+  uint32_t detection = silent.transport.now() - start;
+  ok = ok && detection <= keepAlive * 1000 * 27 / 10 + SimulatedTransport::POLL_INTERVAL;
+
+  Simulation slow(2);
+  slow.client.setKeepAlive(keepAlive);
+  slow.transport.setLatency(2000, 1000);  // round trips of up to 6 s
+  bool stable = slow.connect();
+  slow.transport.advance(keepAlive * 1000 * 12);
+  stable = stable && slow.client.connected() && slow.disconnections == 0 && slow.broker.received[12] >= 10;  // PINGREQ
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"keepAlive\", \"keepAliveMs\": %u, \"detectionMs\": %u, \"slowLinkStable\": %s}",
+           keepAlive * 1000, detection, stable ? "true" : "false");
+  print(result);
+  return ok && stable;
+}
+
+// The connection is lost at every byte of a publish, the application reconnects after RECONNECT_DELAY
+bool drop() {
+  std::vector<char> packet;
+  {
+    Simulation simulation(0);
+    packet = simulation.broker.publishPacket("drop/topic", std::string(200, 'd'), 1);
+  }
+
+  uint32_t failures = 0;
+  uint32_t maxRecovery = 0;
+  uint64_t totalRecovery = 0;
+  for (size_t cut = 1; cut < packet.size(); cut++) {
+    Simulation simulation(cut);
+    simulation.transport.setLatency(10, 5);
+    simulation.transport.setMaxSegmentSize(64);
+    bool ok = simulation.connect();
+
+    simulation.transport.dropAfter(cut);
+    simulation.broker.send(packet);
+    ok = ok && simulation.advanceUntil([&simulation]() { return simulation.disconnections > 0; }, 10000);
+    uint32_t droppedAt = simulation.transport.now();
+
+    simulation.transport.advance(RECONNECT_DELAY);
+    ok = ok && simulation.connect();
+    uint32_t recovery = simulation.transport.now() - droppedAt;
+    maxRecovery = recovery > maxRecovery ? recovery : maxRecovery;
+    totalRecovery += recovery;
+
+    // nothing of the cut message, and the next one parsed from a clean state
+    simulation.broker.send(simulation.broker.publishPacket("after/drop", "intact", 1));
+    simulation.transport.advance(1000);
+    ok = ok && simulation.messages == std::vector<std::string> { "after/drop|intact" };
+    ok = ok && simulation.broker.received[4] == 1;
+    if (!ok) failures++;
+  }
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"drop\", \"runs\": %zu, \"failures\": %u, \"reconnectDelayMs\": %u, \"averageRecoveryMs\": %.1f, \"maxRecoveryMs\": %u}",
+           packet.size() - 1, failures, RECONNECT_DELAY, static_cast<double>(totalRecovery) / (packet.size() - 1), maxRecovery);
+  print(result);
+  return failures == 0;
+}
+
+// publish() refuses what does not fit, and succeeds again once TCP acks freed the space
+bool space() {
+  Simulation simulation(3);
+  simulation.transport.setLatency(50);
+  bool ok = simulation.connect();
+  std::string payload(100, 's');
+
+  simulation.transport.setSendBufferSize(64);
+  bool refused = simulation.client.publish("space", 0, false, payload.c_str()) == 0;
+  // a streamed payload needs room for everything before it, nothing of the packet is sent otherwise
+  std::string longTopic(80, 't');
+  refused = refused && simulation.client.publish(longTopic.c_str(), 1, false, [&payload](size_t index) { return payload.data() + index; }, payload.size()) == 0;
+  simulation.transport.advance(200);
+  refused = refused && simulation.broker.received[3] == 0 && simulation.disconnections == 0;
+
+  simulation.transport.setSendBufferSize(1000);
+  uint32_t accepted = 0;
+  while (simulation.client.publish("space", 1, false, payload.c_str()) != 0) accepted++;
+  simulation.transport.advance(200);  // round trip
+  bool resumed = simulation.client.publish("space", 1, false, payload.c_str()) != 0;
+  simulation.transport.advance(200);
+
+  size_t packetSize = 1 + 1 + 2 + 5 + 2 + payload.size();  // header, remaining length, topic, packet id, payload
+  ok = ok && refused && accepted == 1000 / packetSize && resumed;
+  ok = ok && simulation.broker.received[3] == accepted + 1;  // PUBLISH
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"space\", \"refusedWhenTooSmall\": %s, \"acceptedBeforeFull\": %u, \"resumedAfterAck\": %s, \"ok\": %s}",
+           refused ? "true" : "false", accepted, resumed ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+// A payload streamed for longer than the keep alive, while the broker sends QoS 1 messages then goes quiet:
+// their PUBACKs, the PINGREQ and an urgent publish come right after the payload, ahead of a publish queued before
+bool priority() {
+  Simulation simulation(5);
+  simulation.transport.setLatency(50);
+  simulation.client.setKeepAlive(5).setPublishQueueSize(8);
+  bool ok = simulation.connect();
+  simulation.transport.setSendBufferSize(512);
+
+  std::string bulk(64 * 1024, 'b');
+  uint32_t start = simulation.transport.now();
+  ok = ok && simulation.client.publish("bulk", 1, false, [&bulk](size_t index) { return bulk.data() + index; }, bulk.size()) != 0;
+  size_t boundary = simulation.broker.sequence.size();
+  for (uint8_t i = 0; i < 3; i++) {
+    simulation.broker.send(simulation.broker.publishPacket("in", "x", 1));
+    simulation.transport.advance(500);
+  }
+  ok = ok && simulation.client.publish("normal", 1, false, "n") != 0;
+  ok = ok && simulation.client.publishUrgent("urgent", 1, false, "u") != 0;
+  // the PUBACKs follow the end of the payload in the same write, not at the next poll
+  uint32_t payloadEndAt = 0;
+  uint32_t acksAt = 0;
+  ok = ok && simulation.advanceUntil([&]() {
+    size_t received = simulation.broker.sequence.size() - boundary;
+    if (payloadEndAt == 0 && received >= 1) payloadEndAt = simulation.transport.now();
+    if (acksAt == 0 && received >= 2) acksAt = simulation.transport.now();
+    return simulation.broker.received[3] == 3;
+  }, 60000);
+  uint32_t streamMs = simulation.transport.now() - start;
+  simulation.transport.advance(1000);
+
+  // PUBLISH (the payload), 3 PUBACK, PINGREQ, PUBLISH (urgent), PUBLISH (normal)
+  std::vector<uint8_t> expected = { 3, 4, 4, 4, 12, 3, 3 };
+  std::vector<uint8_t> sent(simulation.broker.sequence.begin() + boundary, simulation.broker.sequence.end());
+  bool ordered = sent.size() >= expected.size() && std::equal(expected.begin(), expected.end(), sent.begin());
+  uint32_t controlLagMs = acksAt - payloadEndAt;
+
+  // without publish queue, a PUBACK waiting for the poll goes out ahead of a publish written right away
+  Simulation direct(5);
+  ok = ok && direct.connect();
+  direct.broker.send(direct.broker.publishPacket("in", "x", 1));
+  direct.transport.advance(10);
+  boundary = direct.broker.sequence.size();
+  ok = ok && direct.client.publish("direct", 0, false, "d") != 0;
+  direct.transport.advance(10);
+  bool ackFirst = direct.broker.sequence.size() == boundary + 2 && direct.broker.sequence[boundary] == 4 && direct.broker.sequence[boundary + 1] == 3;
+  ordered = ordered && ackFirst;
+  ok = ok && ordered && streamMs > 5000 && acksAt != 0 && controlLagMs < SimulatedTransport::POLL_INTERVAL / 10 && simulation.disconnections == 0;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"priority\", \"streamMs\": %u, \"controlFirst\": %s, \"ackBeforeDirectPublish\": %s, \"controlLagMs\": %u, \"ok\": %s}",
+           streamMs, ordered ? "true" : "false", ackFirst ? "true" : "false", controlLagMs, ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// A burst of publishes against each policy: what is sent never exceeds the burst plus the refill,
+// and what is queued is all sent once the bucket refilled
+bool rateLimit() {
+  Simulation rejecting(6);
+  rejecting.client.addPublishRateLimit("noisy/#", 1, 1000, 1);
+  bool ok = rejecting.connect();
+  uint32_t accepted = 0;
+  for (uint8_t i = 0; i < 10; i++) accepted += rejecting.client.publish("noisy/a", 0, false, "r") != 0;
+  rejecting.transport.advance(1000);
+  bool refilled = rejecting.client.publish("noisy/a", 0, false, "r") != 0 && rejecting.client.publish("quiet", 0, false, "q") != 0;
+  rejecting.transport.advance(100);
+  ok = ok && accepted == 1 && refilled && rejecting.client.getRateStats().rejected == 9 && rejecting.broker.received[3] == 3;
+
+  Simulation queueing(7);
+  queueing.client.setPublishRateLimit(10, 1000, 5, AsyncMqttClientRatePolicy::QUEUE, 32);
+  ok = queueing.connect() && ok;
+  uint32_t start = queueing.transport.now();
+  accepted = 0;
+  for (uint8_t i = 0; i < 30; i++) accepted += queueing.client.publish("queued", 1, false, "q") != 0;
+  bool withinRate = true;
+  while (queueing.broker.received[3] < 30 && queueing.transport.now() - start < 10000) {
+    queueing.transport.advance(10);
+    withinRate = withinRate && queueing.broker.received[3] <= 5 + (queueing.transport.now() - start) * 10 / 1000;
+  }
+  uint32_t drainMs = queueing.transport.now() - start;
+  ok = ok && accepted == 30 && withinRate && queueing.broker.received[3] == 30 && queueing.client.getRateStats().queued == 25;
+  ok = ok && drainMs >= 2500 && drainMs <= 2500 + 2 * SimulatedTransport::POLL_INTERVAL;
+
+  Simulation dropping(8);
+  dropping.client.addPublishRateLimit("log/+", 1, 1000, 1, AsyncMqttClientRatePolicy::DROP_OLDEST, 2);
+  ok = dropping.connect() && ok;
+  accepted = 0;
+  for (uint8_t i = 0; i < 5; i++) accepted += dropping.client.publish("log/a", 0, false, "d") != 0;
+  dropping.transport.advance(3000);
+  AsyncMqttClientRateStats stats = dropping.client.getRateStats();
+  ok = ok && accepted == 5 && stats.queued == 4 && stats.dropped == 2 && dropping.broker.received[3] == 3;
+
+  // with a publish queue, the limits apply as it drains: the rejected packets are dropped there, with their ids
+  Simulation draining(21);
+  draining.client.setPublishQueueSize(4).setPublishRateLimit(1, 1000, 1);
+  ok = draining.connect() && ok;
+  accepted = 0;
+  for (uint8_t i = 0; i < 3; i++) accepted += draining.client.publish("drained", 1, false, "q") != 0;
+  accepted += draining.client.publish("drained", 1, false, "q", 1, true, 42) == 42;
+  draining.transport.advance(100);
+  bool drained = accepted == 4 && draining.client.getRateStats().rejected == 3 && draining.broker.received[3] == 1;
+  drained = drained && draining.client.getPacketIdStats().inUse == 1;  // the one sent, never acknowledged
+
+  // nor is a retransmission that does not fit in the queue left holding the id it took
+  draining.transport.setSendBufferSize(1);
+  for (uint8_t i = 0; i < 4; i++) draining.client.publish("drained", 1, false, "q");
+  drained = drained && draining.client.publish("drained", 1, false, "q", 1, true, 42) == 0 && draining.client.getPacketIdStats().inUse == 5;
+  ok = ok && drained;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"rateLimit\", \"queueDrainMs\": %u, \"withinRate\": %s, \"limitedWhileDraining\": %s, \"ok\": %s}",
+           drainMs, withinRate ? "true" : "false", drained ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// 4 topics published every ms through a 64 bytes send buffer, freed by acks 20 ms later: the stale values are
+// replaced before being sent, every topic ends on its latest value, and no topic goes backwards
+bool coalescing() {
+  Simulation simulation(9);
+  simulation.transport.setLatency(20);
+  simulation.client.addCoalescedTopic("telemetry/+");
+  bool ok = simulation.connect();
+  simulation.transport.setSendBufferSize(64);
+
+  const uint32_t values = 1000;
+  uint32_t accepted = 0;
+  for (uint32_t value = 0; value < values; value++) {
+    for (uint8_t topic = 0; topic < 4; topic++) {
+      accepted += simulation.client.publish(("telemetry/" + std::to_string(topic)).c_str(), 0, false, std::to_string(value).c_str()) != 0;
+    }
+    simulation.transport.advance(1);
+  }
+  simulation.transport.advance(1000);
+
+  int32_t last[4] = { -1, -1, -1, -1 };
+  bool monotonic = true;
+  for (const std::string& message : simulation.broker.published) {
+    size_t topic = message[10] - '0';
+    int32_t value = std::stoi(message.substr(12));
+    monotonic = monotonic && topic < 4 && value > last[topic];
+    if (topic < 4) last[topic] = value;
+  }
+  bool latest = std::all_of(last, last + 4, [values](int32_t value) { return value == static_cast<int32_t>(values) - 1; });
+  size_t sent = simulation.broker.published.size();
+  uint32_t replaced = simulation.client.getCoalescedCount();
+  ok = ok && accepted == 4 * values && monotonic && latest && sent + replaced == 4 * values && sent < 4 * values;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"coalescing\", \"published\": %u, \"sent\": %zu, \"replaced\": %u, \"latestDelivered\": %s, \"ok\": %s}",
+           4 * values, sent, replaced, latest ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// Messages split in small segments fill the cache, which keeps within its budget by evicting the least
+// recently read topics, and forgets a topic whose retained message is cleared
+bool cache() {
+  Simulation simulation(10);
+  simulation.transport.setMaxSegmentSize(7);
+  simulation.client.setMessageCache(2048).addCachedTopic("config/#").addCachedTopic("state/+");
+  bool ok = simulation.connect();
+
+  auto value = [&simulation](const char* topic) {
+    char payload[512];
+    size_t length = 0;
+    if (!simulation.client.getCachedMessage(topic, payload, sizeof(payload), &length)) return std::string("-");
+    return std::string(payload, length < sizeof(payload) ? length : sizeof(payload));
+  };
+  auto retained = [&simulation](const std::string& topic, const std::string& payload) {
+    std::vector<char> packet = simulation.broker.publishPacket(topic, payload, 1);
+    packet[0] |= 0x01;
+    simulation.broker.send(packet);
+  };
+
+  retained("config/a", "1");
+  simulation.broker.send(simulation.broker.publishPacket("state/b", std::string(300, 'b'), 0));
+  simulation.broker.send(simulation.broker.publishPacket("other", "o", 0));
+  simulation.transport.advance(100);
+  bool filled = value("config/a") == "1" && value("state/b") == std::string(300, 'b') && value("other") == "-";
+
+  simulation.broker.send(simulation.broker.publishPacket("config/a", "2", 2));
+  simulation.transport.advance(100);
+  bool replaced = value("config/a") == "2";
+
+  // 10 topics of 300 bytes do not fit: config/a, read last, stays, state/b and the first ones go
+  for (uint8_t i = 0; i < 10; i++) {
+    simulation.broker.send(simulation.broker.publishPacket("config/n" + std::to_string(i), std::string(300, '0' + i), 1));
+    simulation.transport.advance(10);
+    value("config/a");
+  }
+  simulation.transport.advance(100);
+  bool evicted = value("state/b") == "-" && value("config/n0") == "-" && value("config/a") == "2" && value("config/n9") == std::string(300, '9');
+
+  retained("config/a", "");
+  simulation.transport.advance(100);
+  bool cleared = value("config/a") == "-";
+  ok = ok && filled && replaced && evicted && cleared && simulation.messages.size() == 15;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"cache\", \"filled\": %s, \"replaced\": %s, \"evicted\": %s, \"cleared\": %s, \"ok\": %s}",
+           filled ? "true" : "false", replaced ? "true" : "false", evicted ? "true" : "false", cleared ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// Two requests, one answered and one timing out then answered too late, then a third one cut by a disconnection.
+// The response topic is subscribed without the application seeing it, and responses never reach onMessage
+bool rpc() {
+  Simulation simulation(11);
+  simulation.transport.setLatency(10);
+  simulation.client.setRpc("rpc/response", 4);
+  uint32_t userSubscriptions = 0;
+  simulation.client.onSubscribe([&userSubscriptions](uint16_t packetId, uint8_t qos) {
+    (void)packetId;
+    (void)qos;
+    userSubscriptions++;
+  });
+  std::vector<std::string> events;  // request id:status:payload
+  auto callback = [&events](uint16_t requestId, AsyncMqttClientRpcStatus status, const char* payload, size_t len, size_t index, size_t total) {
+    (void)index;
+    (void)total;
+    events.push_back(std::to_string(requestId) + ":" + std::to_string(static_cast<int>(status)) + ":" + std::string(payload != nullptr ? payload : "", len));
+  };
+  bool ok = simulation.connect();
+  simulation.transport.advance(100);
+  bool subscribed = simulation.broker.received[8] == 1 && userSubscriptions == 0;
+
+  uint32_t start = simulation.transport.now();
+  uint16_t answered = simulation.client.request("rpc/request", "a", 0, 1000, callback);
+  uint16_t late = simulation.client.request("rpc/request", "b", 0, 1000, callback);
+  simulation.transport.advance(100);
+  ok = ok && answered != 0 && late != 0 && answered != late;
+  ok = ok && simulation.broker.published == std::vector<std::string> { "rpc/request/" + std::to_string(answered) + "|a", "rpc/request/" + std::to_string(late) + "|b" };
+  simulation.broker.send(simulation.broker.publishPacket("rpc/response/" + std::to_string(answered), "A", 1));
+  ok = ok && simulation.advanceUntil([&events]() { return events.size() == 2; }, 5000);
+  uint32_t timeoutMs = simulation.transport.now() - start;
+  simulation.broker.send(simulation.broker.publishPacket("rpc/response/" + std::to_string(late), "B", 1));
+  simulation.transport.advance(100);
+
+  uint16_t cut = simulation.client.request("rpc/request", "c", 0, 10000, callback);
+  simulation.transport.advance(100);
+  simulation.transport.drop();
+  std::vector<std::string> expected = { std::to_string(answered) + ":0:A", std::to_string(late) + ":1:", std::to_string(cut) + ":2:" };
+  ok = ok && subscribed && events == expected && simulation.messages.empty();
+  ok = ok && timeoutMs >= 1000 && timeoutMs <= 1000 + SimulatedTransport::POLL_INTERVAL;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"rpc\", \"timeoutMs\": 1000, \"timedOutAfterMs\": %u, \"ok\": %s}", timeoutMs, ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// Keeps the blocks written, as a flash would, the digest of the payload and the threads that wrote them
+class RecordingSink : public AsyncMqttClientBlockSink {
+ public:
+  RecordingSink()
+  : AsyncMqttClientBlockSink(64)
+  , written()
+  , blocks(0)
+  , digest()
+  , cancelled(0)
+  , writers(0) {
+  }
+
+  std::string written;
+  uint32_t blocks;
+  std::string digest;
+  uint32_t cancelled;
+  uint32_t writers;
+
+ protected:
+  bool writeBlock(const uint8_t* block, size_t length, size_t offset) override {
+    if (offset != written.size()) return false;
+    written.append(reinterpret_cast<const char*>(block), length);
+    blocks++;
+    static thread_local bool counted = false;  // an id can be reused by the next thread, not this
+    if (!counted) writers++;
+    counted = true;
+    return true;
+  }
+
+  void close(const uint8_t* digest) override {
+    char hex[3];
+    this->digest.clear();
+    for (uint8_t i = 0; i < 32; i++) {
+      snprintf(hex, sizeof(hex), "%02x", digest[i]);
+      this->digest += hex;
+    }
+  }
+
+  void cancel() override {
+    cancelled++;
+  }
+};
+
+// A payload of 1000 bytes received in segments of 7 goes to its sink in 16 blocks, with its SHA-256 known at the end.
+// Other topics still reach onMessage, and a payload cut by a disconnection aborts its sink
+bool sink() {
+  Simulation simulation(12);
+  simulation.transport.setMaxSegmentSize(7);
+  RecordingSink firmware;
+  simulation.client.addPayloadSink("firmware/+", &firmware);
+  bool ok = simulation.connect();
+
+  std::string payload;
+  for (uint32_t i = 0; i < 1000; i++) payload += static_cast<char>((i * 7) % 251);
+  simulation.broker.send(simulation.broker.publishPacket("firmware/a", payload, 1));
+  simulation.broker.send(simulation.broker.publishPacket("other", "o", 0));
+  simulation.transport.advance(1000);
+  bool written = firmware.written == payload && firmware.blocks == 16 && firmware.cancelled == 0;
+  bool hashed = firmware.digest == "59425e4412e296fc74736673ce067027f384203f59c0d2c3e6be7b13347b3ffc";
+  ok = ok && simulation.messages == std::vector<std::string> { "other|o" } && simulation.broker.received[4] == 1;
+
+  firmware.written.clear();
+  std::vector<char> packet = simulation.broker.publishPacket("firmware/b", payload, 1);
+  simulation.transport.dropAfter(packet.size() / 2);
+  simulation.broker.send(packet);
+  ok = ok && simulation.advanceUntil([&simulation]() { return simulation.disconnections > 0; }, 10000);
+  bool aborted = firmware.cancelled == 1 && firmware.written.size() < payload.size();
+  // one worker for both payloads
+  bool oneWriter = firmware.writers == 1;
+  ok = ok && written && hashed && aborted && oneWriter;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"sink\", \"written\": %s, \"hashed\": %s, \"aborted\": %s, \"oneWriter\": %s, \"ok\": %s}",
+           written ? "true" : "false", hashed ? "true" : "false", aborted ? "true" : "false", oneWriter ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// With a DNS answering in 300 ms, a reconnection to the cached address saves the resolution. The cached address is
+// still used while DNS is down, and an unreachable address falls back to the next record of the name
+bool dns() {
+  const IPAddress first(10, 0, 0, 1);
+  const IPAddress second(10, 0, 0, 2);
+
+  Simulation uncached(13);
+  uncached.transport.setLatency(10);
+  uncached.transport.setHostAddresses({ first, second }, 300);
+  uncached.client.setServer("broker.local", 1883);
+  bool ok = uncached.connect();
+  uint32_t uncachedMs = uncached.client.getConnectStats().lastConnectMs;
+
+  Simulation simulation(13);
+  simulation.transport.setLatency(10);
+  simulation.transport.setHostAddresses({ first, second }, 300);
+  simulation.client.setServer("broker.local", 1883).setAddressCache(60000);
+  ok = ok && simulation.connect();
+  simulation.client.disconnect(true);
+  ok = ok && simulation.connect();
+  AsyncMqttClientConnectStats stats = simulation.client.getConnectStats();
+  uint32_t cachedMs = stats.lastConnectMs;
+  ok = ok && stats.connections == 2 && stats.cached == 1 && stats.resolutions == 1 && simulation.transport.resolutions() == 1;
+
+  // past the time to live, DNS down
+  simulation.transport.setHostAddresses({}, 300);
+  simulation.transport.advance(60000);
+  simulation.client.disconnect(true);
+  bool stale = simulation.connect() && simulation.transport.lastAddress() == first;
+  simulation.transport.advance(1000);
+  stats = simulation.client.getConnectStats();
+  stale = stale && stats.cached == 2 && stats.failedResolutions == 1;
+
+  // the server behind the first address is down
+  simulation.transport.setHostAddresses({ first, second }, 300);
+  simulation.transport.setUnreachable(first);
+  simulation.client.disconnect(true);
+  uint32_t disconnections = simulation.disconnections;
+  bool fallback = simulation.connect() && simulation.transport.lastAddress() == second;
+  stats = simulation.client.getConnectStats();
+  fallback = fallback && stats.fallbacks == 1 && stats.cached == 3 && simulation.disconnections == disconnections;
+
+  // connections the transport cannot even start: to a cached address, the next one is tried
+  Simulation failing(13);
+  failing.transport.setHostAddresses({ first, second }, 300);
+  failing.client.setServer("broker.local", 1883).setAddressCache(60000);
+  bool notStarted = failing.connect();
+  failing.client.disconnect(true);
+  failing.transport.failConnects(1);
+  notStarted = notStarted && failing.connect() && failing.transport.lastAddress() == second && failing.disconnections == 1;
+
+  // after a failed resolution, onDisconnect is called and the client can connect again
+  Simulation unresolved(13);
+  unresolved.transport.setHostAddresses({}, 300);
+  unresolved.transport.failConnects(1);
+  unresolved.client.setServer("broker.local", 1883).setAddressCache(60000);
+  unresolved.client.connect();
+  notStarted = notStarted && unresolved.advanceUntil([&unresolved]() { return unresolved.disconnections == 1; }, 1000);
+  unresolved.transport.setHostAddresses({ first, second }, 300);
+  notStarted = notStarted && unresolved.connect();
+  ok = ok && cachedMs < uncachedMs && stale && fallback && notStarted;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"dns\", \"uncachedConnectMs\": %u, \"cachedConnectMs\": %u, \"staleUsed\": %s, \"fallback\": %s, \"notStarted\": %s, \"ok\": %s}",
+           uncachedMs, cachedMs, stale ? "true" : "false", fallback ? "true" : "false", notStarted ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// With 50 ms of latency, subscribing in the onConnect callback is ready after three round trips: TCP, CONNECT and
+// SUBSCRIBE. Pipelined behind CONNECT, in the same segment, the subscription saves one of them
+bool pipelining() {
+  Simulation waiting(14);
+  waiting.transport.setLatency(50);
+  waiting.client.onConnect([&waiting](bool sessionPresent) {
+    (void)sessionPresent;
+    waiting.connections++;
+    waiting.client.subscribe("pipelining/#", 1);
+  });
+  bool ok = waiting.connect();
+  waiting.transport.advance(1000);
+  uint32_t waitingMs = waiting.client.getConnectStats().lastReadyMs;
+
+  Simulation simulation(14);
+  simulation.transport.setLatency(50);
+  simulation.client.setPipelinedConnect(256);
+  uint32_t before = simulation.connections;
+  simulation.client.connect();
+  ok = ok && simulation.client.subscribe("pipelining/#", 1) != 0 && simulation.client.publish("pipelining/hello", 1, false, "hi") != 0;
+  ok = ok && simulation.advanceUntil([&simulation, before]() { return simulation.connections > before; }, 1000);
+  simulation.transport.advance(1000);
+  uint32_t pipelinedMs = simulation.client.getConnectStats().lastReadyMs;
+  bool oneSegment = simulation.broker.segments == 1 && simulation.broker.sequence == std::vector<uint8_t> { 1, 8, 3 };
+  ok = ok && simulation.broker.published == std::vector<std::string> { "pipelining/hello|hi" };
+
+  // CONNECT is encoded again after a setter changed it
+  simulation.client.disconnect(true);
+  simulation.client.setKeepAlive(30);
+  ok = ok && simulation.connect() && simulation.broker.keepAlive == 30 && simulation.broker.received[1] == 2;
+  ok = ok && oneSegment && waitingMs == 300 && pipelinedMs == 200;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"pipelining\", \"readyMs\": %u, \"pipelinedReadyMs\": %u, \"oneSegment\": %s, \"ok\": %s}",
+           waitingMs, pipelinedMs, oneSegment ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// The broker withholds its PUBACKs: no id is handed out twice while it waits for them, publish() and subscribe()
+// return 0 once none is left, and an id acknowledged is the next one handed out from where the last one was
+bool packetIds() {
+  const uint16_t count = ASYNC_MQTT_PACKET_IDS;
+  Simulation simulation(15);
+  simulation.transport.setSendBufferSize(64 * count);
+  bool ok = simulation.connect();
+  auto acknowledge = [&simulation](uint8_t header, uint16_t packetId) {
+    simulation.broker.send(Broker::packet(header, std::string { static_cast<char>(packetId >> 8), static_cast<char>(packetId & 0xFF) }));
+    simulation.transport.advance(10);
+  };
+
+  std::vector<uint16_t> ids;
+  for (uint16_t packetId; (packetId = simulation.client.publish("ids", 1, false, "x")) != 0;) ids.push_back(packetId);
+  std::vector<uint16_t> sorted(ids);
+  std::sort(sorted.begin(), sorted.end());
+  bool unique = ids.size() == count && std::unique(sorted.begin(), sorted.end()) == sorted.end() && sorted.front() == 1;
+  ok = ok && simulation.client.subscribe("ids/#", 1) == 0;
+  AsyncMqttClientPacketIdStats stats = simulation.client.getPacketIdStats();
+  bool exhausted = stats.inUse == count && stats.exhausted == 2;
+
+  // PUBACK
+  acknowledge(0x40, count / 3);
+  bool reused = simulation.client.publish("ids", 1, false, "x") == count / 3;
+  acknowledge(0x40, 7);
+  acknowledge(0x40, count - 96);
+  reused = reused && simulation.client.publish("ids", 1, false, "x") == count - 96;
+  reused = reused && simulation.client.publish("ids", 1, false, "x") == 7;
+
+  // SUBACK and UNSUBACK, sent by the broker as soon as it gets the requests
+  acknowledge(0x40, 10);
+  acknowledge(0x40, 11);
+  reused = reused && simulation.client.subscribe("ids/#", 1) == 10 && simulation.client.unsubscribe("ids/#") == 11;
+  simulation.transport.advance(10);
+  reused = reused && simulation.client.getPacketIdStats().inUse == count - 2;
+
+  // no acknowledgement can come after a disconnection
+  simulation.client.disconnect(true);
+  ok = ok && simulation.connect() && simulation.client.getPacketIdStats().inUse == 0;
+  ok = ok && simulation.client.publish("ids", 1, false, "x") == 1;
+  ok = ok && unique && exhausted && reused && simulation.client.getPacketIdStats().maxInUse == count;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"packetIds\", \"ids\": %u, \"unique\": %s, \"exhaustionReported\": %s, \"reusedOnAck\": %s, \"ok\": %s}",
+           static_cast<unsigned>(ids.size()), unique ? "true" : "false", exhausted ? "true" : "false", reused ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// A publish every 97 ms for 20 s, the broker acknowledging one in three: each of the others is reported once, at the
+// first poll past its deadline, after waiting in the 4 s level of the wheel and moving down. The acknowledged ones,
+// the subscription and a publish cut by a disconnection are not
+bool ackTimeout() {
+  const uint32_t timeout = 5000;
+  Simulation simulation(16);
+  simulation.transport.setLatency(20);
+  simulation.client.setAckTimeout(timeout, 64);
+  struct Timeout {
+    uint16_t packetId;
+    AsyncMqttClientAckType type;
+    uint32_t at;
+  };
+  std::vector<Timeout> timeouts;
+  simulation.client.onTimeout([&simulation, &timeouts](uint16_t packetId, AsyncMqttClientAckType type) {
+    timeouts.push_back(Timeout { packetId, type, simulation.transport.now() });
+  });
+  bool ok = simulation.connect();
+  ok = ok && simulation.client.subscribe("timeout/#", 1) != 0;
+
+  std::vector<std::pair<uint16_t, uint32_t>> unacknowledged;  // packet id, sent at
+  for (uint32_t i = 0; i < 200; i++) {
+    uint16_t packetId = simulation.client.publish("timeout", 1, false, "x");
+    ok = ok && packetId != 0;
+    if (i % 3 == 0) {
+      simulation.broker.send(Broker::packet(0x40, std::string { static_cast<char>(packetId >> 8), static_cast<char>(packetId & 0xFF) }));
+    } else {
+      unacknowledged.push_back(std::make_pair(packetId, simulation.transport.now()));
+    }
+    simulation.transport.advance(97);
+  }
+  simulation.transport.advance(2 * timeout);
+
+  bool reported = timeouts.size() == unacknowledged.size();
+  uint32_t maxLateMs = 0;
+  for (size_t i = 0; reported && i < timeouts.size(); i++) {
+    uint32_t waited = timeouts[i].at - unacknowledged[i].second;
+    reported = timeouts[i].packetId == unacknowledged[i].first && timeouts[i].type == AsyncMqttClientAckType::PUBLISH && waited >= timeout;
+    maxLateMs = std::max(maxLateMs, waited - timeout);
+  }
+  ok = ok && reported && maxLateMs < 500;  // the poll interval
+
+  // no acknowledgement is waited for once the connection is lost
+  size_t before = timeouts.size();
+  ok = ok && simulation.client.publish("timeout", 1, false, "x") != 0;
+  simulation.client.disconnect(true);
+  ok = ok && simulation.connect();
+  simulation.transport.advance(2 * timeout);
+  ok = ok && timeouts.size() == before;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"ackTimeout\", \"timeoutMs\": %u, \"reported\": %u, \"maxLateMs\": %u, \"ok\": %s}",
+           timeout, static_cast<unsigned>(timeouts.size()), maxLateMs, ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// A host loop calling tick() when nextDeadlineMs() is over: publishes held back by the rate limit go out as soon as
+// their token is back, the acknowledgement timeouts are reported on their deadline and the ping goes out at 70 % of
+// the keep alive after the CONNACK, the last packet received, rather than at the next poll of the transport
+bool deadlines() {
+  const uint32_t latency = 10;
+  Simulation simulation(17);
+  simulation.transport.setLatency(latency);
+  simulation.client.setKeepAlive(10).setAckTimeout(1000, 8).setPublishRateLimit(1, 300, 1, AsyncMqttClientRatePolicy::QUEUE, 8);
+  std::vector<uint32_t> timeouts;
+  simulation.client.onTimeout([&simulation, &timeouts](uint16_t packetId, AsyncMqttClientAckType type) {
+    (void)packetId;
+    (void)type;
+    timeouts.push_back(simulation.transport.now());
+  });
+  bool ok = simulation.connect();
+  uint32_t connAckAt = simulation.transport.now();
+  uint32_t start = connAckAt + 100;
+  simulation.transport.advance(100);
+  for (uint8_t i = 0; i < 3; i++) ok = ok && simulation.client.publish("deadlines", 1, false, "x") != 0;
+
+  std::vector<uint32_t> arrivals;
+  uint32_t pingAt = 0;
+  while (simulation.transport.now() - start < 8000) {
+    if (simulation.client.nextDeadlineMs() == 0) simulation.client.tick();
+    simulation.transport.advance(1);
+    if (simulation.broker.received[3] > arrivals.size()) arrivals.push_back(simulation.transport.now() - latency);
+    if (pingAt == 0 && simulation.broker.received[12] > 0) pingAt = simulation.transport.now() - latency;
+  }
+  bool released = arrivals == std::vector<uint32_t> { start, start + 300, start + 600 };
+  bool reported = timeouts == std::vector<uint32_t> { start + 1000, start + 1300, start + 1600 };
+  bool pinged = pingAt == connAckAt + 7000;
+  ok = ok && released && reported && pinged && simulation.client.nextDeadlineMs() > 0;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"deadlines\", \"releasedOnToken\": %s, \"timeoutsOnDeadline\": %s, \"pingOnTime\": %s, \"ok\": %s}",
+           released ? "true" : "false", reported ? "true" : "false", pinged ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+// Publishes made before connecting, in a 64 bytes buffer of 8 messages: the oldest of the lowest priority are evicted
+// for the new ones, the room they leave in the middle of the ring closed up, a message larger than the buffer refused
+// and one past its time to live dropped. Once connected, the rest goes out by priority then age, 2 per second
+bool offline() {
+  const uint32_t latency = 10;
+  Simulation simulation(18);
+  simulation.transport.setLatency(latency);
+  simulation.client.setOfflineBuffer(64, 8, 2);
+  AsyncMqttClient& client = simulation.client;
+  bool ok = client.publish("o/a", 1, false, "first") == 1;
+  ok = ok && client.publishBuffered("o/t", 0, false, "ttl1", 0, 1000) == 1 && client.publishBuffered("o/t", 0, false, "ttl2", 0, 1000) == 1;
+  ok = ok && client.publishBuffered("o/h", 1, false, "high1", 0, 0, 2) == 1;
+  for (const char* payload : { "low1", "low2", "low3" }) ok = ok && client.publish("o/l", 0, false, payload) == 1;
+  ok = ok && client.publishBuffered("o/m", 0, false, "mid", 0, 0, 1) == 1;
+  ok = ok && client.publishBuffered("o/h", 0, false, "high2", 0, 0, 2) == 1;  // evicts o/a
+  ok = ok && client.publish("o/l", 0, false, "low4") == 1;                     // o/t ttl1
+  ok = ok && client.publishBuffered("o/x", 0, false, "extra", 0, 0, 1) == 1;  // o/t ttl2
+  ok = ok && client.publishBuffered("o/h", 2, false, "high3", 0, 0, 2) == 1;  // low1, between high1 and low2
+  ok = ok && client.publishBuffered("o/t", 0, false, "ttl3", 0, 500, 3) == 1;  // low2
+  ok = ok && client.publishBuffered("o/n", 0, false, std::string(70, 'n').c_str(), 0, 0, 3) == 0;
+  simulation.transport.advance(1000);
+
+  ok = ok && simulation.connect();
+  uint32_t connAckAt = simulation.transport.now();
+  std::vector<uint32_t> arrivals;
+  while (simulation.transport.now() - connAckAt < 4000) {
+    if (client.nextDeadlineMs() == 0) client.tick();
+    simulation.transport.advance(1);
+    while (simulation.broker.received[3] > arrivals.size()) arrivals.push_back(simulation.transport.now() - latency - connAckAt);
+  }
+  bool ordered = simulation.broker.published == std::vector<std::string> { "o/h|high1", "o/h|high2", "o/h|high3", "o/m|mid", "o/x|extra", "o/l|low3", "o/l|low4" };
+  bool paced = arrivals == std::vector<uint32_t> { 0, 0, 500, 1000, 1500, 2000, 2500 };
+  AsyncMqttClientOfflineStats stats = client.getOfflineStats();
+  bool counted = stats.buffered == 13 && stats.sent == 7 && stats.expired == 1 && stats.dropped == 6 && stats.pending == 0 && stats.bytes == 0;
+  ok = ok && ordered && paced && counted && client.nextDeadlineMs() > 0;
+
+  // once connected, published right away
+  ok = ok && client.publishBuffered("o/c", 1, false, "online", 0, 1000) > 1;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"offline\", \"sent\": %u, \"expired\": %u, \"dropped\": %u, \"ordered\": %s, \"paced\": %s, \"ok\": %s}",
+           stats.sent, stats.expired, stats.dropped, ordered ? "true" : "false", paced ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// 10 messages of 40 bytes, each in a segment of its own, against a budget of 100 bytes: the segment that crosses the
+// budget is delivered whole and left unacknowledged, so the application holds 120 bytes and nothing more comes until
+// it releases some. Each release that brings it back within the budget lets one more segment in
+bool inboundBudget() {
+  const size_t budget = 100;
+  const size_t payloadSize = 40;
+  Simulation simulation(23);
+  simulation.client.setInboundBudget(budget);
+  size_t held = 0;
+  simulation.client.onMessage([&held](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+    (void)topic;
+    (void)payload;
+    (void)properties;
+    (void)index;
+    (void)total;
+    held += len;
+  });
+  bool ok = simulation.connect();
+  for (uint8_t i = 0; i < 10; i++) simulation.broker.send(simulation.broker.publishPacket("budget", std::string(payloadSize, 'b'), 0));
+  simulation.transport.advance(10);
+  size_t heldAtStop = held;
+  // past the budget by the segment that crossed it, no more
+  bool stopped = heldAtStop == 3 * payloadSize && heldAtStop <= budget + payloadSize;
+  simulation.transport.advance(1000);
+  stopped = stopped && held == heldAtStop && simulation.messages.size() == 3;
+
+  // still over the budget once released, then within it
+  simulation.client.releaseInbound(10);
+  simulation.transport.advance(10);
+  bool resumed = held == heldAtStop;
+  simulation.client.releaseInbound(payloadSize - 10);
+  simulation.transport.advance(10);
+  resumed = resumed && held == heldAtStop + payloadSize;
+
+  // released as it comes, the rest flows
+  simulation.client.releaseInbound(held);
+  simulation.transport.advance(10);
+  for (uint8_t i = 0; i < 10 && simulation.messages.size() < 10; i++) {
+    simulation.client.releaseInbound(budget);
+    simulation.transport.advance(10);
+  }
+  ok = ok && stopped && resumed && simulation.messages.size() == 10 && simulation.disconnections == 0;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"inboundBudget\", \"budget\": %zu, \"heldAtStop\": %zu, \"stopped\": %s, \"resumedOnRelease\": %s, \"ok\": %s}",
+           budget, heldAtStop, stopped ? "true" : "false", resumed ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// A QoS 1 publish over setMaximumPacketSize(). MQTT 5 advertised the size: the client disconnects with reason code
+// 0x95. MQTT 3.1.1 did not: the publish is dropped but acknowledged, not to hold a slot of the broker's quota
+bool packetTooLarge() {
+  const uint32_t maximumPacketSize = 64;
+  bool ok = true;
+  bool disconnected = false;
+  bool acknowledged = false;
+  for (uint8_t version : { 5, 4 }) {
+    Simulation simulation(24);
+    simulation.client.setProtocolVersion(version).setMaximumPacketSize(maximumPacketSize);
+    ok = simulation.connect() && ok;
+    simulation.broker.send(simulation.broker.publishPacket("size", std::string(8, 's'), 1));
+    simulation.broker.send(simulation.broker.publishPacket("size", std::string(2 * maximumPacketSize, 'l'), 1));
+    simulation.broker.send(simulation.broker.publishPacket("size", std::string(8, 'a'), 1));
+    simulation.transport.advance(2 * SimulatedTransport::POLL_INTERVAL);  // the acks go out on poll
+    if (version == 5) {
+      disconnected = simulation.disconnections == 1 && simulation.reason == AsyncMqttClientDisconnectReason::MQTT_PACKET_TOO_LARGE &&
+                     simulation.broker.disconnectReason == 0x95 && simulation.messages.size() == 1;
+    } else {
+      acknowledged = simulation.disconnections == 0 && simulation.broker.received[4] == 3 && simulation.messages.size() == 2 &&
+                     simulation.messages[1] == "size|aaaaaaaa";
+    }
+  }
+  ok = ok && disconnected && acknowledged;
+
+  char result[192];
+  snprintf(result, sizeof(result), "{\"name\": \"packetTooLarge\", \"maximumPacketSize\": %u, \"disconnectedV5\": %s, \"acknowledgedV3\": %s, \"ok\": %s}",
+           maximumPacketSize, disconnected ? "true" : "false", acknowledged ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+
+// 8 topics delivered by 3 workers: the messages of a topic in order, by a single worker. With the workers stalled,
+// a full queue stops the network task until they resume, and destroying the client delivers what was queued.
+// The workers run on real threads, so the network task is the thread advancing the clock
+bool dispatch() {
+  const uint8_t workers = 3;
+  const uint16_t queueSize = 4;
+  const uint8_t topics = 8;
+  const uint8_t perTopic = 25;
+
+  SimulatedTransport transport(22);
+  Broker broker(&transport);
+  std::unique_ptr<AsyncMqttClient> client(new AsyncMqttClient(&transport));
+  std::mutex mutex;
+  std::condition_variable resumed;
+  bool stalled = false;
+  uint8_t stalledWorkers = 0;
+  std::map<std::string, std::vector<std::string>> received;
+  std::map<std::string, std::set<std::thread::id>> deliveredBy;
+  size_t delivered = 0;
+  client->setClock([&transport]() { return transport.now(); });
+  client->setServer(IPAddress(127, 0, 0, 1), 1883);
+  client->onMessage([&](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+    (void)properties;
+    (void)index;
+    (void)total;
+    std::unique_lock<std::mutex> lock(mutex);
+    stalledWorkers++;
+    resumed.wait(lock, [&stalled]() { return !stalled; });
+    stalledWorkers--;
+    received[topic].push_back(std::string(payload, len));
+    deliveredBy[topic].insert(std::this_thread::get_id());
+    delivered++;
+  });
+  client->setMessageDispatch(workers, queueSize);
+  client->connect();
+  transport.advance(10);
+  bool ok = client->connected();
+  auto waitFor = [&mutex](std::function<bool()> condition) {
+    for (uint32_t i = 0; i < 5000; i++) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (condition()) return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  };
+  auto setStalled = [&](bool value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stalled = value;
+    resumed.notify_all();
+  };
+
+  // a full queue does not stop the delivery of the others, the network task waits for it
+  for (uint8_t i = 0; i < perTopic; i++) {
+    for (uint8_t topic = 0; topic < topics; topic++) broker.send(broker.publishPacket("d/" + std::to_string(topic), std::to_string(i), 0));
+    transport.advance(1);
+  }
+  size_t expected = topics * perTopic;
+  ok = ok && waitFor([&]() { return delivered == expected; });
+  bool ordered = received.size() == topics;
+  for (const auto& topic : received) {
+    for (uint8_t i = 0; ordered && i < perTopic; i++) ordered = topic.second.size() == perTopic && topic.second[i] == std::to_string(i);
+    ordered = ordered && deliveredBy[topic.first].size() == 1;
+  }
+
+  // one message stuck in the callback, a full queue behind it, and one more for the network task to wait with
+  setStalled(true);
+  std::atomic<bool> advanced(false);
+  for (uint16_t i = 0; i < queueSize + 2; i++) broker.send(broker.publishPacket("d/stalled", std::to_string(i), 0));
+  std::thread network([&transport, &advanced]() {
+    transport.advance(10);
+    advanced = true;
+  });
+  bool full = waitFor([&]() { return stalledWorkers == 1; }) && client->getDispatchStats().queueDepth == queueSize;
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  bool blocked = full && !advanced;
+  setStalled(false);
+  network.join();
+  expected += queueSize + 2;
+  ok = ok && waitFor([&]() { return delivered == expected; });
+
+  // destroyed with messages queued, which are delivered first
+  setStalled(true);
+  for (uint16_t i = 0; i < queueSize; i++) broker.send(broker.publishPacket("d/teardown", std::to_string(i), 0));
+  transport.advance(10);
+  client->disconnect(true);
+  transport.advance(10);
+  std::thread resume([&setStalled]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    setStalled(false);
+  });
+  client.reset();
+  bool tornDown = delivered == expected + queueSize && received["d/teardown"].size() == queueSize;
+  resume.join();
+  ok = ok && ordered && blocked && tornDown;
+
+  char result[256];
+  snprintf(result, sizeof(result), "{\"name\": \"dispatch\", \"ordered\": %s, \"networkBlockedWhenFull\": %s, \"deliveredOnTeardown\": %s, \"ok\": %s}",
+           ordered ? "true" : "false", blocked ? "true" : "false", tornDown ? "true" : "false", ok ? "true" : "false");
+  print(result);
+  return ok;
+}
+}  // namespace
+
+int main() {
+  printf("{\n  \"scenarios\": [\n");
+  bool ok = segmentation();
+  ok &= keepAlive();
+  ok &= drop();
+  ok &= space();
+  ok &= priority();
+  ok &= rateLimit();
+  ok &= coalescing();
+  ok &= cache();
+  ok &= rpc();
+  ok &= sink();
+  ok &= dns();
+  ok &= pipelining();
+  ok &= packetIds();
+  ok &= ackTimeout();
+  ok &= deadlines();
+  ok &= offline();
+  ok &= inboundBudget();
+  ok &= packetTooLarge();
+  ok &= dispatch();
+  printf("\n  ]\n}\n");
+  return ok ? 0 : 2;
+}
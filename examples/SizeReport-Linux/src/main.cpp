@@ -0,0 +1,49 @@
+/*
+Publish-only sensor, the program measured by scripts/size-report for every configuration of Config.hpp.
+
+Run without arguments, it prints the RAM taken by a client object and exits.
+Usage: size-report [broker port]
+*/
+#include <AsyncMqttClient.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+AsyncMqttClient* mqttClient;
+
+// plain functions, so that they fit every callback type
+void onMqttConnect(bool sessionPresent) {
+  (void)sessionPresent;
+  mqttClient->subscribe("sensor/command", 1);
+  mqttClient->publish("sensor/temperature", 0, false, "21.5");
+}
+
+void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
+  printf("disconnected: %u\n", static_cast<uint8_t>(reason));
+  exit(0);
+}
+
+void onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+  (void)payload;
+  (void)properties;
+  (void)index;
+  (void)total;
+  printf("%s: %zu bytes\n", topic, len);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  AsyncMqttClient client;
+  mqttClient = &client;
+  printf("{\"clientSize\": %zu}\n", sizeof(AsyncMqttClient));
+  if (argc < 2) return 0;
+
+  client.onConnect(onMqttConnect);
+  client.onDisconnect(onMqttDisconnect);
+  client.onMessage(onMqttMessage);
+  client.setServer(IPAddress(127, 0, 0, 1), atoi(argv[1]));
+  client.connect();
+  AsyncMqttClientInternals::EventLoop::getDefault()->run();
+  return 0;
+}
@@ -0,0 +1,349 @@
+/*
+TLS session resumption on Linux, with ASYNC_MQTT_OPENSSL, against the loopback broker of Benchmark-Linux
+behind a TLS front end using a self-signed certificate made at startup.
+
+For TLS 1.3 (session tickets) and TLS 1.2 (session tickets and ids), a client connects `reconnects` times,
+each time publishing a message larger than a TLS record to itself: the first handshake is a full one, the
+next ones resume its session. A new client, as after a reboot, then resumes the session saved by the first one
+with getTlsSession(). A client expecting another fingerprint is refused and does not keep the session, a client
+without fingerprint does not trust the certificate. Handshake times come from getTlsStats().
+
+Build and run with `make tls-resume`, the result is printed on stdout as JSON and the exit code is 2 on failure.
+Usage: tls-resume [reconnects]
+*/
+#include <AsyncMqttClient.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../Benchmark-Linux/src/Broker.hpp"
+
+#if !ASYNC_MQTT_OPENSSL
+#error "build with -DASYNC_MQTT_OPENSSL=1"
+#endif
+
+using AsyncMqttClientInternals::EventLoop;
+using AsyncMqttClientInternals::PosixTransport;
+
+namespace {
+const uint32_t DEFAULT_RECONNECTS = 20;
+const size_t PAYLOAD_SIZE = 12000;  // decrypted in several reads of the transport
+const uint32_t TIMEOUT = 10;        // seconds, for each step
+
+uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Condition>
+bool waitFor(Condition condition) {
+  uint64_t deadline = now() + TIMEOUT * 1000000000ULL;
+  while (!condition()) {
+    if (now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  return true;
+}
+
+// TLS in front of the plain broker, a thread and blocking sockets per connection
+class TlsFrontEnd {
+ public:
+  TlsFrontEnd(SSL_CTX* context, uint16_t brokerPort)
+  : _context(context)
+  , _brokerPort(brokerPort)
+  , _listenFd(-1)
+  , _acceptThread()
+  , _mutex()
+  , _connections() {
+  }
+
+  ~TlsFrontEnd() {
+    stop();
+  }
+
+  // Returns the port listened to, 0 on failure
+  uint16_t start() {
+    _listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    if (_listenFd == -1 || bind(_listenFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1 ||
+        listen(_listenFd, 16) == -1 || getsockname(_listenFd, reinterpret_cast<struct sockaddr*>(&address), &addressLength) == -1) {
+      return 0;
+    }
+    _acceptThread = std::thread(&TlsFrontEnd::_accept, this);
+    return ntohs(address.sin_port);
+  }
+
+  void stop() {
+    if (_listenFd == -1) return;
+    shutdown(_listenFd, SHUT_RDWR);
+    _acceptThread.join();
+    ::close(_listenFd);
+    _listenFd = -1;
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (Connection* connection : _connections) {
+      shutdown(connection->fd, SHUT_RDWR);
+      connection->thread.join();
+      ::close(connection->fd);
+      delete connection;
+    }
+    _connections.clear();
+  }
+
+ private:
+  struct Connection {
+    int fd;
+    std::thread thread;
+  };
+
+  void _accept() {
+    for (;;) {
+      int fd = accept4(_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd == -1) return;
+      int noDelay = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+      std::lock_guard<std::mutex> lock(_mutex);
+      Connection* connection = new Connection { fd, std::thread() };
+      _connections.push_back(connection);
+      connection->thread = std::thread(&TlsFrontEnd::_serve, this, fd);
+    }
+  }
+
+  void _serve(int fd) {
+    SSL* tls = SSL_new(_context);
+    SSL_set_fd(tls, fd);
+    int upstream = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in broker = {};
+    broker.sin_family = AF_INET;
+    broker.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    broker.sin_port = htons(_brokerPort);
+    if (SSL_accept(tls) == 1 && connect(upstream, reinterpret_cast<struct sockaddr*>(&broker), sizeof(broker)) == 0) {
+      int noDelay = 1;
+      setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+      char buffer[16384];
+      for (;;) {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { upstream, POLLIN, 0 } };
+        if (SSL_pending(tls) == 0 && poll(fds, 2, -1) <= 0) break;
+        if (SSL_pending(tls) > 0 || fds[0].revents != 0) {
+          int received = SSL_read(tls, buffer, sizeof(buffer));
+          if (received <= 0 || !_forward(upstream, buffer, received)) break;
+        }
+        if (fds[1].revents != 0) {
+          ssize_t received = recv(upstream, buffer, sizeof(buffer), 0);
+          if (received <= 0 || SSL_write(tls, buffer, received) != received) break;
+        }
+      }
+    }
+    ::close(upstream);
+    SSL_free(tls);
+    shutdown(fd, SHUT_RDWR);
+  }
+
+  static bool _forward(int fd, const char* data, size_t length) {
+    while (length > 0) {
+      ssize_t sent = ::send(fd, data, length, MSG_NOSIGNAL);
+      if (sent <= 0) return false;
+      data += sent;
+      length -= sent;
+    }
+    return true;
+  }
+
+  SSL_CTX* _context;
+  uint16_t _brokerPort;
+  int _listenFd;
+  std::thread _acceptThread;
+  std::mutex _mutex;
+  std::vector<Connection*> _connections;
+};
+
+// A client on its own transport, recording its state from the callbacks. Without fingerprint, the certificate is
+// verified against the certificate authorities of the system
+struct Client {
+  Client(EventLoop* eventLoop, uint16_t port, const uint8_t* fingerprint)
+  : transport(eventLoop)
+  , mqtt(&transport)
+  , connected(false)
+  , subscribed(false)
+  , received(0)
+  , reason(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED)
+  , disconnections(0) {
+    mqtt.setServer("localhost", port).setSecure(true).setClientId("tls-resume").setKeepAlive(60);
+    if (fingerprint != nullptr) mqtt.addServerFingerprint(fingerprint);
+    mqtt.onConnect([this](bool sessionPresent) {
+      (void)sessionPresent;
+      connected = true;
+    });
+    mqtt.onDisconnect([this](AsyncMqttClientDisconnectReason disconnectReason) {
+      reason = disconnectReason;
+      connected = false;
+      disconnections++;
+    });
+    mqtt.onSubscribe([this](uint16_t packetId, uint8_t qos) {
+      (void)packetId;
+      (void)qos;
+      subscribed = true;
+    });
+    mqtt.onMessage([this](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+      (void)topic;
+      (void)payload;
+      (void)properties;
+      if (index + len == total && total == PAYLOAD_SIZE) received++;
+    });
+  }
+
+  // Connects, publishes a message to itself and disconnects
+  bool roundTrip() {
+    uint32_t before = received;
+    mqtt.connect();
+    bool ok = waitFor([this]() { return connected.load(); });
+    subscribed = false;
+    ok = ok && mqtt.subscribe("tls/resume", 1) != 0 && waitFor([this]() { return subscribed.load(); });
+    std::string payload(PAYLOAD_SIZE, 'r');
+    ok = ok && mqtt.publish("tls/resume", 1, false, payload.data(), payload.size()) != 0;
+    ok = ok && waitFor([this, before]() { return received > before; });
+    mqtt.disconnect();
+    return waitFor([this]() { return !connected.load(); }) && ok;
+  }
+
+  PosixTransport transport;
+  AsyncMqttClient mqtt;
+  std::atomic<bool> connected;
+  std::atomic<bool> subscribed;
+  std::atomic<uint32_t> received;
+  AsyncMqttClientDisconnectReason reason;
+  std::atomic<uint32_t> disconnections;
+};
+
+// Ephemeral P-256 key and self-signed certificate for the front end
+bool makeCertificate(EVP_PKEY** key, X509** certificate) {
+  EVP_PKEY_CTX* keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  *key = nullptr;
+  bool ok = keyContext != nullptr && EVP_PKEY_keygen_init(keyContext) == 1 &&
+            EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) == 1 && EVP_PKEY_keygen(keyContext, key) == 1;
+  EVP_PKEY_CTX_free(keyContext);
+  if (!ok) return false;
+
+  *certificate = X509_new();
+  X509_set_version(*certificate, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(*certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(*certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(*certificate), 3600);
+  X509_set_pubkey(*certificate, *key);
+  X509_NAME* name = X509_get_subject_name(*certificate);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(*certificate, name);
+  return X509_sign(*certificate, *key, EVP_sha256()) > 0;
+}
+
+bool run(const char* name, int version, uint32_t reconnects, EVP_PKEY* key, X509* certificate, const uint8_t* fingerprint, uint16_t brokerPort) {
+  SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+  SSL_CTX_use_certificate(context, certificate);
+  SSL_CTX_use_PrivateKey(context, key);
+  SSL_CTX_set_min_proto_version(context, version);
+  SSL_CTX_set_max_proto_version(context, version);
+  TlsFrontEnd frontEnd(context, brokerPort);
+  uint16_t port = frontEnd.start();
+  bool ok = port != 0;
+
+  // stopped before the clients are destroyed
+  EventLoop eventLoop;
+  std::thread network([&eventLoop]() { eventLoop.run(); });
+
+  Client client(&eventLoop, port, fingerprint);
+  uint64_t fullUs = 0;
+  uint64_t resumedUs = 0;
+  for (uint32_t i = 0; ok && i < reconnects; i++) {
+    ok = client.roundTrip();
+    uint32_t handshakeUs = client.mqtt.getTlsStats().lastHandshakeUs;
+    if (i == 0) {
+      fullUs = handshakeUs;
+    } else {
+      resumedUs += handshakeUs;
+    }
+  }
+  AsyncMqttClientTlsStats stats = client.mqtt.getTlsStats();
+  ok = ok && stats.handshakes == reconnects && stats.resumed == reconnects - 1;
+
+  // as after a reboot: the saved session, on a new transport
+  std::vector<uint8_t> session(client.mqtt.getTlsSession(nullptr, 0));
+  ok = ok && !session.empty() && client.mqtt.getTlsSession(session.data(), session.size()) == session.size();
+  Client rebooted(&eventLoop, port, fingerprint);
+  rebooted.mqtt.setTlsSession(session.data(), session.size());
+  bool persisted = ok && rebooted.roundTrip() && rebooted.mqtt.getTlsStats().resumed == 1;
+
+  uint8_t otherFingerprint[SHA1_SIZE] = {};
+  Client impostor(&eventLoop, port, otherFingerprint);
+  impostor.mqtt.connect();
+  bool refused = waitFor([&impostor]() { return impostor.disconnections > 0; }) && impostor.reason == AsyncMqttClientDisconnectReason::TLS_BAD_FINGERPRINT;
+  refused = refused && impostor.mqtt.getTlsSession(nullptr, 0) == 0;
+
+  // self-signed, so not trusted
+  Client trusting(&eventLoop, port, nullptr);
+  trusting.mqtt.connect();
+  bool untrusted = waitFor([&trusting]() { return trusting.disconnections > 0; }) && trusting.mqtt.getTlsStats().handshakes == 0;
+  ok = ok && persisted && refused && untrusted;
+
+  eventLoop.stop();
+  network.join();
+  frontEnd.stop();
+  SSL_CTX_free(context);
+
+  printf("%s    {\"protocol\": \"%s\", \"handshakes\": %u, \"resumed\": %u, \"fullHandshakeUs\": %llu, \"averageResumedHandshakeUs\": %llu, "
+         "\"resumedAfterReboot\": %s, \"badFingerprintRefused\": %s, \"untrustedRefused\": %s, \"ok\": %s}",
+         version == TLS1_3_VERSION ? "" : ",\n", name, stats.handshakes, stats.resumed, static_cast<unsigned long long>(fullUs),  // NOLINT(runtime/int)
+         static_cast<unsigned long long>(reconnects > 1 ? resumedUs / (reconnects - 1) : 0), persisted ? "true" : "false",  // NOLINT(runtime/int)
+         refused ? "true" : "false", untrusted ? "true" : "false", ok ? "true" : "false");
+  fflush(stdout);
+  return ok;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  uint32_t reconnects = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_RECONNECTS;
+  if (reconnects < 2) reconnects = 2;
+  signal(SIGPIPE, SIG_IGN);  // the front end writes to connections the client closes
+
+  EVP_PKEY* key;
+  X509* certificate;
+  uint8_t fingerprint[SHA1_SIZE];
+  unsigned int fingerprintLength = 0;
+  if (!makeCertificate(&key, &certificate) || X509_digest(certificate, EVP_sha1(), fingerprint, &fingerprintLength) != 1) {
+    fprintf(stderr, "cannot make the certificate\n");
+    return 1;
+  }
+  Broker broker;
+  uint16_t brokerPort = broker.start();
+  if (brokerPort == 0) {
+    fprintf(stderr, "cannot start the broker\n");
+    return 1;
+  }
+
+  printf("{\n  \"reconnects\": %u,\n  \"runs\": [\n", reconnects);
+  bool ok = run("TLS 1.3", TLS1_3_VERSION, reconnects, key, certificate, fingerprint, brokerPort);
+  ok &= run("TLS 1.2", TLS1_2_VERSION, reconnects, key, certificate, fingerprint, brokerPort);
+  printf("\n  ],\n  \"ok\": %s\n}\n", ok ? "true" : "false");
+
+  broker.stop();
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+  return ok ? 0 : 2;
+}
@@ -0,0 +1,194 @@
+/*
+Allocation soak test of ASYNC_MQTT_FIXED_CAPACITY on Linux, against the loopback broker of Benchmark-Linux.
+
+The global operator new is replaced to count the allocations of the event loop thread and of the
+publishing thread once the client is connected and subscribed. The client then publishes to itself,
+cycling through QoS 0, 1 and 2, so that every packet and ack path runs in both directions.
+Any allocation, or a message not received, fails the run.
+
+Build and run with `make zero-heap`, the result is printed on stdout as JSON and the exit code is 2 on failure.
+Usage: zero-heap [messages]
+*/
+#include <AsyncMqttClient.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+#include "../../Benchmark-Linux/src/Broker.hpp"
+
+#if !ASYNC_MQTT_FIXED_CAPACITY
+#error "build with -DASYNC_MQTT_FIXED_CAPACITY=1"
+#endif
+
+using AsyncMqttClientInternals::EventLoop;
+using AsyncMqttClientInternals::PosixTransport;
+
+namespace {
+const size_t DEFAULT_MESSAGES = 1000000;
+const uint32_t WINDOW = 12;     // messages published and not received yet, fewer QoS 2 ones than ASYNC_MQTT_PENDING_PUBRELS
+const uint32_t TIMEOUT = 600;  // seconds
+const char* const TOPICS[] = { "soak/qos0", "soak/qos1", "soak/qos2" };
+
+std::atomic<bool> armed(false);
+std::atomic<size_t> allocations(0);
+thread_local bool tracked = false;  // the threads the client runs on
+
+void* allocate(size_t size) {
+  if (tracked && armed.load(std::memory_order_relaxed)) allocations.fetch_add(1, std::memory_order_relaxed);
+  return malloc(size == 0 ? 1 : size);
+}
+
+uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Condition>
+bool waitFor(Condition condition, uint64_t deadline) {
+  while (!condition()) {
+    if (now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  return true;
+}
+}  // namespace
+
+void* operator new(size_t size) {
+  void* pointer = allocate(size);
+  if (pointer == nullptr) throw std::bad_alloc();
+  return pointer;
+}
+
+void* operator new[](size_t size) {
+  void* pointer = allocate(size);
+  if (pointer == nullptr) throw std::bad_alloc();
+  return pointer;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+  free(pointer);
+}
+
+int main(int argc, char** argv) {
+  size_t messages = argc > 1 ? strtoull(argv[1], nullptr, 10) : DEFAULT_MESSAGES;
+
+  Broker broker;
+  uint16_t port = broker.start();
+  if (port == 0) {
+    fprintf(stderr, "cannot start the broker\n");
+    return 1;
+  }
+
+  EventLoop eventLoop;
+  PosixTransport transport(&eventLoop);
+  AsyncMqttClient mqtt(&transport);
+  std::atomic<bool> connected(false);
+  std::atomic<uint8_t> subscriptions(0);
+  std::atomic<size_t> received(0);
+  std::atomic<size_t> receivedByQos[3] = {};
+
+  // callbacks capturing a pointer or two, which std::function holds without allocating
+  mqtt.setServer(IPAddress(127, 0, 0, 1), port).setClientId("zero-heap").setKeepAlive(60);
+  mqtt.onConnect([&connected](bool sessionPresent) {
+    (void)sessionPresent;
+    connected = true;
+  });
+  mqtt.onDisconnect([&connected](AsyncMqttClientDisconnectReason reason) {
+    (void)reason;
+    connected = false;
+  });
+  mqtt.onSubscribe([&subscriptions](uint16_t packetId, uint8_t qos) {
+    (void)packetId;
+    (void)qos;
+    subscriptions++;
+  });
+  mqtt.onMessage([&received, &receivedByQos](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+    (void)topic;
+    (void)payload;
+    (void)len;
+    if (index + len < total) return;
+    receivedByQos[properties.qos].fetch_add(1, std::memory_order_relaxed);
+    received.fetch_add(1, std::memory_order_release);
+  });
+
+  std::thread network([&eventLoop]() {
+    tracked = true;
+    eventLoop.run();
+  });
+
+  uint64_t deadline = now() + TIMEOUT * 1000000000ULL;
+  mqtt.connect();
+  bool ready = waitFor([&connected]() { return connected.load(); }, deadline);
+  for (uint8_t qos = 0; ready && qos < 3; qos++) mqtt.subscribe(TOPICS[qos], qos);
+  ready = ready && waitFor([&subscriptions]() { return subscriptions == 3; }, deadline);
+
+  // from here on, nothing may be allocated
+  tracked = true;
+  armed = true;
+  uint64_t start = now();
+  size_t published = 0;
+  bool complete = ready;
+  while (complete && published < messages) {
+    if (!connected || now() > deadline) {
+      complete = false;
+      break;
+    }
+    if (published - received.load(std::memory_order_acquire) >= WINDOW) {
+      std::this_thread::yield();
+      continue;
+    }
+    uint8_t qos = published % 3;
+    char payload[sizeof(size_t)];
+    for (size_t i = 0; i < sizeof(payload); i++) payload[i] = static_cast<char>(published >> (i * 8));
+    if (mqtt.publish(TOPICS[qos], qos, false, payload, sizeof(payload)) == 0) {
+      std::this_thread::yield();  // no room in the TCP buffer yet
+      continue;
+    }
+    published++;
+  }
+  complete = complete && waitFor([&received, messages]() { return received == messages; }, deadline);
+  double seconds = static_cast<double>(now() - start) / 1e9;
+  armed = false;
+  tracked = false;
+
+  mqtt.disconnect();
+  waitFor([&connected]() { return !connected.load(); }, now() + 1000000000ULL);
+  eventLoop.stop();
+  network.join();
+  broker.stop();
+
+  size_t allocated = allocations.load();
+  bool ok = complete && allocated == 0;
+  printf("{\n");
+  printf("  \"messages\": %zu,\n", messages);
+  printf("  \"received\": [%zu, %zu, %zu],\n", receivedByQos[0].load(), receivedByQos[1].load(), receivedByQos[2].load());
+  printf("  \"complete\": %s,\n", complete ? "true" : "false");
+  printf("  \"seconds\": %.2f,\n", seconds);
+  printf("  \"allocations\": %zu,\n", allocated);
+  printf("  \"ok\": %s\n", ok ? "true" : "false");
+  printf("}\n");
+  return ok ? 0 : 2;
+}
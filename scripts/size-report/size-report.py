@@ -0,0 +1,52 @@
+#!/usr/bin/env python
+
+# Builds examples/SizeReport-Linux once per configuration of src/AsyncMqttClient/Config.hpp
+# and prints the flash (text + data), static RAM (data + bss) and client object sizes as JSON.
+# Unused sections are dropped at link time, like the Arduino cores do.
+# The sizes are the ones of the host compiler: they compare configurations, they are not the ones of an ESP.
+
+import argparse
+import json
+import os
+import subprocess
+import tempfile
+
+LATER_FEATURES = ['-DASYNC_MQTT_' + feature + '=0' for feature in [
+    'RATE_LIMITS', 'COALESCING', 'MESSAGE_CACHE', 'RPC', 'PAYLOAD_SINKS', 'ADDRESS_CACHE', 'PIPELINING',
+    'ACK_TIMEOUTS', 'DEADLINES', 'OFFLINE_BUFFER', 'PAYLOAD_WRITER', 'URGENT_PUBLISHES']]
+
+CONFIGURATIONS = [
+    ('default', []),
+    ('noQos2', ['-DASYNC_MQTT_QOS2=0']),
+    ('noStreamedPayloads', ['-DASYNC_MQTT_STREAMED_PAYLOADS=0']),
+    ('functionPointerCallbacks', ['-DASYNC_MQTT_FUNCTION_CALLBACKS=0']),
+    ('fixedCapacity', ['-DASYNC_MQTT_FIXED_CAPACITY=1']),
+    ('noLaterFeatures', LATER_FEATURES),
+    ('qos0Sensor', ['-DASYNC_MQTT_QOS2=0', '-DASYNC_MQTT_STREAMED_PAYLOADS=0', '-DASYNC_MQTT_FUNCTION_CALLBACKS=0',
+                    '-DASYNC_MQTT_MAX_TOPIC_LENGTH=64', '-DASYNC_MQTT_PACKET_IDS=0',
+                    '-DASYNC_MQTT_PACKET_STORAGE=0'] + LATER_FEATURES),
+]
+
+root = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..')
+
+parser = argparse.ArgumentParser(description='Report the size of the client for every configuration.')
+parser.add_argument('--cxx', default=os.environ.get('CXX', 'g++'))
+parser.add_argument('--size', default='size')
+args = parser.parse_args()
+
+sources = [os.path.join(root, 'examples', 'SizeReport-Linux', 'src', 'main.cpp')]
+for directory, _, files in os.walk(os.path.join(root, 'src')):
+    sources += [os.path.join(directory, name) for name in sorted(files) if name.endswith('.cpp')]
+
+results = []
+with tempfile.TemporaryDirectory() as build:
+    for name, flags in CONFIGURATIONS:
+        binary = os.path.join(build, name)
+        subprocess.check_call([args.cxx, '-std=gnu++11', '-Os', '-ffunction-sections', '-fdata-sections', '-Wl,--gc-sections',
+                               '-I' + os.path.join(root, 'src')] + flags + ['-o', binary] + sources + ['-lpthread'])
+        # text data bss dec hex filename
+        text, data, bss = [int(value) for value in subprocess.check_output([args.size, binary]).decode().splitlines()[1].split()[:3]]
+        clientSize = json.loads(subprocess.check_output([binary]).decode().splitlines()[0])['clientSize']
+        results.append({'name': name, 'flags': ' '.join(flags), 'flash': text + data, 'staticRam': data + bss, 'clientSize': clientSize})
+
+print(json.dumps({'configurations': results}, indent=2))
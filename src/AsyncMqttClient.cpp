@@ -1,17 +1,48 @@
 #include "AsyncMqttClient.hpp"
 
 AsyncMqttClient::AsyncMqttClient()
-: _connected(false)
+#if defined(ESP32) || defined(ESP8266)
+: AsyncMqttClient(new AsyncMqttClientInternals::AsyncTcpTransport()) {
+#elif defined(__linux__)
+: AsyncMqttClient(new AsyncMqttClientInternals::PosixTransport()) {
+#endif
+  _transportOwned = true;
+}
+
+AsyncMqttClient::AsyncMqttClient(AsyncMqttClientInternals::Transport* transport)
+: _transport(transport)
+, _transportOwned(false)
+, _connected(false)
 , _lockMutiConnections(false)
 , _connectPacketNotEnoughSpace(false)
 , _disconnectOnPoll(false)
+, _pingDue(false)
 , _tlsBadFingerprint(false)
+, _overflowed(false)
 , _lastClientActivity(0)
 , _lastServerActivity(0)
 , _lastPingRequestTime(0)
 , _host(nullptr)
 , _useIp(false)
-#if ASYNC_TCP_SSL_ENABLED
+#if ASYNC_MQTT_ADDRESS_CACHE
+, _addressCache()
+, _connectStats()
+, _connectStart(0)
+, _resolveStart(0)
+, _connectOnResolve(false)
+, _connectingCached(false)
+, _usedCache(false)
+, _readying(false)
+, _readyPending(0)
+#endif
+#if ASYNC_MQTT_PIPELINING
+, _connectPacket()
+, _connectPacketStale(true)
+, _connectSent(false)
+, _pipelineSize(0)
+, _pipeline()
+#endif
+#if ASYNC_MQTT_TLS
 , _secure(false)
 #endif
 , _port(0)
@@ -25,7 +56,24 @@ AsyncMqttClient::AsyncMqttClient()
 , _willPayloadLength(0)
 , _willQos(0)
 , _willRetain(false)
-#if ASYNC_TCP_SSL_ENABLED
+, _protocolVersion(AsyncMqttClientInternals::ProtocolVersion.V3_1_1)
+, _topicAliasMaximum(0)
+, _receiveMaximum(0)
+, _serverReceiveMaximum(0)
+, _serverMaximumPacketSize(0)
+, _inFlightPublishes(0)
+, _packetIds()
+, _inboundBudget(0)
+, _inboundHeld(0)
+, _inboundUnacked(0)
+, _clock(nullptr)
+#if ASYNC_MQTT_RPC
+, _rpcResponseTopic(nullptr)
+, _rpcResponseTopicLength(0)
+, _rpcSubscription(nullptr)
+, _rpcSubscribeId(0)
+#endif
+#if ASYNC_MQTT_TLS
 , _secureServerFingerprints()
 #endif
 , _onConnectUserCallback(nullptr)
@@ -35,52 +83,124 @@ AsyncMqttClient::AsyncMqttClient()
 , _onMessageUserCallbacks()
 , _onPublishUserCallback(nullptr)
 , _onPingUserCallback(nullptr)
+#if ASYNC_MQTT_ACK_TIMEOUTS
+, _onTimeoutUserCallback(nullptr)
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+, _messageDispatcher()
+#endif
 , _parsingInformation { .bufferState = AsyncMqttClientInternals::BufferState::NONE }
 , _currentParsedPacket(nullptr)
 , _remainingLengthBufferPosition(0)
-, _nextPacketId(0)
+, _inboundTopicAliases()
+, _outboundTopicAliases()
+#if ASYNC_MQTT_RATE_LIMITS
+, _rateLimiter()
+#endif
+#if ASYNC_MQTT_COALESCING
+, _coalescedPublishes()
+#endif
+#if ASYNC_MQTT_MESSAGE_CACHE
+, _messageCache()
+#endif
+#if ASYNC_MQTT_RPC
+, _pendingRequests()
+#endif
+#if ASYNC_MQTT_PAYLOAD_SINKS
+, _payloadSinks()
+#endif
+#if ASYNC_MQTT_ACK_TIMEOUTS
+, _ackTimers()
+, _ackTimeout(0)
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+, _offlineBuffer()
+, _offlineFlush(nullptr, 0, 1000, 0, AsyncMqttClientRatePolicy::REJECT, 0)
+, _offlineFlushRate(0)
+#endif
+#if ASYNC_MQTT_PAYLOAD_WRITER
+, _writerBuffer()
+#if ASYNC_MQTT_MULTITHREADED
+, _writerMutex()
+#endif
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+, _publishQueue()
+#if ASYNC_MQTT_URGENT_PUBLISHES
+, _urgentQueue()
+#endif
+#endif
+#if ASYNC_MQTT_STREAMED_PAYLOADS
 , _isSendingLargePayload(false)
 , _largePayloadLength(0)
 , _largePayloadIndex(0)
-, _largePayloadHandler(nullptr) {
-  _client.onConnect([](void* obj, AsyncClient* c) { (static_cast<AsyncMqttClient*>(obj))->_onConnect(c); }, this);
-  _client.onDisconnect([](void* obj, AsyncClient* c) { (static_cast<AsyncMqttClient*>(obj))->_onDisconnect(c); }, this);
-  _client.onError([](void* obj, AsyncClient* c, int8_t error) { (static_cast<AsyncMqttClient*>(obj))->_onError(c, error); }, this);
-  _client.onTimeout([](void* obj, AsyncClient* c, uint32_t time) { (static_cast<AsyncMqttClient*>(obj))->_onTimeout(c, time); }, this);
-  _client.onAck([](void* obj, AsyncClient* c, size_t len, uint32_t time) { (static_cast<AsyncMqttClient*>(obj))->_onAck(c, len, time); }, this);
-  _client.onData([](void* obj, AsyncClient* c, void* data, size_t len) { (static_cast<AsyncMqttClient*>(obj))->_onData(c, static_cast<char*>(data), len); }, this);
-  _client.onPoll([](void* obj, AsyncClient* c) { (static_cast<AsyncMqttClient*>(obj))->_onPoll(c); }, this);
+, _largePayloadHandler(nullptr)
+#endif
+{
+  _transport->onConnect([this]() { _onConnect(); });
+  _transport->onDisconnect([this]() { _onDisconnect(); });
+  _transport->onError([](int8_t error) { _onError(error); });
+  _transport->onTimeout([this](uint32_t time) { _onTimeout(time); });
+  _transport->onAck([this](size_t len, uint32_t time) { _onAck(len, time); });
+  _transport->onData([this](char* data, size_t len) { _onData(data, len); });
+  _transport->onPoll([this]() { _onPoll(); });
+#if ASYNC_MQTT_ADDRESS_CACHE
+  _transport->onResolve([this](const IPAddress* addresses, uint8_t count) { _onResolve(addresses, count); });
+#endif
 
 #ifdef ESP32
   sprintf(_generatedClientId, "esp32-%06llx", ESP.getEfuseMac());
   _xSemaphore = xSemaphoreCreateMutex();
 #elif defined(ESP8266)
   sprintf(_generatedClientId, "esp8266-%06x", ESP.getChipId());
+#elif defined(__linux__)
+  sprintf(_generatedClientId, "linux-%06lx%06x", gethostid() & 0xFFFFFF, getpid() & 0xFFFFFF);
 #endif
   _clientId = _generatedClientId;
-  setMaxTopicLength(128);
+  _parsingInformation.topicAliases = &_inboundTopicAliases;
+#if ASYNC_MQTT_RATE_LIMITS
+  _rateLimiter.setPacketIds(&_packetIds);
+#endif
+  setMaxTopicLength(ASYNC_MQTT_MAX_TOPIC_LENGTH);
+#if ASYNC_MQTT_MULTITHREADED
+  _publishQueue.resize(ASYNC_MQTT_PUBLISH_QUEUE_SIZE);
+#if ASYNC_MQTT_URGENT_PUBLISHES
+  _urgentQueue.resize(ASYNC_MQTT_URGENT_QUEUE_SIZE);
+#endif
+#endif
 }
 
 AsyncMqttClient::~AsyncMqttClient() {
-  delete _currentParsedPacket;
+#if ASYNC_MQTT_MULTITHREADED
+  // the queued messages are delivered while the client is still whole
+  _messageDispatcher.end();
+#endif
+  _freeCurrentParsedPacket();
   delete[] _parsingInformation.topicBuffer;
+#if ASYNC_MQTT_RPC
+  delete[] _rpcSubscription;
+#endif
 #ifdef ESP32
   vSemaphoreDelete(_xSemaphore);
 #endif
+  if (_transportOwned) delete _transport;
 }
 
 AsyncMqttClient& AsyncMqttClient::setKeepAlive(uint16_t keepAlive) {
   _keepAlive = keepAlive;
+  _connectChanged();
   return *this;
 }
 
 AsyncMqttClient& AsyncMqttClient::setClientId(const char* clientId) {
   _clientId = clientId;
+  _connectChanged();
   return *this;
 }
 
 AsyncMqttClient& AsyncMqttClient::setCleanSession(bool cleanSession) {
   _cleanSession = cleanSession;
+  _connectChanged();
   return *this;
 }
 
@@ -88,12 +208,15 @@ AsyncMqttClient& AsyncMqttClient::setMaxTopicLength(uint16_t maxTopicLength) {
   _parsingInformation.maxTopicLength = maxTopicLength;
   delete[] _parsingInformation.topicBuffer;
   _parsingInformation.topicBuffer = new char[maxTopicLength + 1];
+  _inboundTopicAliases.resize(_topicAliasMaximum, maxTopicLength);
+  _outboundTopicAliases.resize(_topicAliasMaximum, maxTopicLength);
   return *this;
 }
 
 AsyncMqttClient& AsyncMqttClient::setCredentials(const char* username, const char* password) {
   _username = username;
   _password = password;
+  _connectChanged();
   return *this;
 }
 
@@ -103,6 +226,7 @@ AsyncMqttClient& AsyncMqttClient::setWill(const char* topic, uint8_t qos, bool r
   _willRetain = retain;
   _willPayload = payload;
   _willPayloadLength = length;
+  _connectChanged();
   return *this;
 }
 
@@ -117,21 +241,219 @@ AsyncMqttClient& AsyncMqttClient::setServer(const char* host, uint16_t port) {
   _useIp = false;
   _host = host;
   _port = port;
+#if ASYNC_MQTT_ADDRESS_CACHE
+  SEMAPHORE_TAKE(*this);
+  _addressCache.clear();
+  SEMAPHORE_GIVE();
+#endif
+  return *this;
+}
+
+#if ASYNC_MQTT_ADDRESS_CACHE
+// Keeps the addresses the host name of setServer() resolves to for ttlMs: connect() goes straight to the one
+// that worked last and tries the next ones when it is unreachable, while the name is resolved again in the
+// background once ttlMs are over. 0, the default, resolves the name on every connect()
+AsyncMqttClient& AsyncMqttClient::setAddressCache(uint32_t ttlMs) {
+  SEMAPHORE_TAKE(*this);
+  _addressCache.setTtl(ttlMs);
+  SEMAPHORE_GIVE();
+  return *this;
+}
+#endif
+
+AsyncMqttClient& AsyncMqttClient::setProtocolVersion(uint8_t protocolVersion) {
+  _protocolVersion = protocolVersion;
+  _connectChanged();
+  return *this;
+}
+
+AsyncMqttClient& AsyncMqttClient::setTopicAliasMaximum(uint16_t topicAliasMaximum) {
+  _topicAliasMaximum = topicAliasMaximum;
+  _inboundTopicAliases.resize(topicAliasMaximum, _parsingInformation.maxTopicLength);
+  _outboundTopicAliases.resize(topicAliasMaximum, _parsingInformation.maxTopicLength);
+  _connectChanged();
+  return *this;
+}
+
+AsyncMqttClient& AsyncMqttClient::setReceiveMaximum(uint16_t receiveMaximum) {
+  _receiveMaximum = receiveMaximum;
+  _connectChanged();
+  return *this;
+}
+
+AsyncMqttClient& AsyncMqttClient::setMaximumPacketSize(uint32_t maximumPacketSize) {
+  _parsingInformation.maximumPacketSize = maximumPacketSize;
+  _connectChanged();
+  return *this;
+}
+
+#if ASYNC_MQTT_PIPELINING
+// publish() and subscribe() can be called from connect() on, what they write before the connection is up goes
+// right behind CONNECT, in the same segment, up to `size` bytes. Pipelined publishes are not coalesced, queued
+// or held by the rate limits. 0, the default, disables it. To be called before connecting
+AsyncMqttClient& AsyncMqttClient::setPipelinedConnect(size_t size) {
+  _pipelineSize = size;
+  _pipeline.clear();
+  _pipeline.shrink_to_fit();
+  _pipeline.reserve(size);
+  return *this;
+}
+#endif
+
+AsyncMqttClient& AsyncMqttClient::setInboundBudget(size_t inboundBudget) {
+  _inboundBudget = inboundBudget;
+  return *this;
+}
+
+AsyncMqttClient& AsyncMqttClient::setClock(AsyncMqttClientInternals::Clock clock) {
+  _clock = clock;
+  return *this;
+}
+
+#if ASYNC_MQTT_RPC
+// Responses to request() are received on `responseTopic`/<request id>, `slots` requests can wait for theirs at once.
+// `responseTopic` must stay valid. To be called before connecting
+AsyncMqttClient& AsyncMqttClient::setRpc(const char* responseTopic, uint8_t slots) {
+  _rpcResponseTopic = responseTopic;
+  _rpcResponseTopicLength = strlen(responseTopic);
+  delete[] _rpcSubscription;
+  _rpcSubscription = new char[_rpcResponseTopicLength + 3];
+  memcpy(_rpcSubscription, responseTopic, _rpcResponseTopicLength);
+  memcpy(_rpcSubscription + _rpcResponseTopicLength, "/+", 3);
+  _pendingRequests.resize(slots);
+  return *this;
+}
+#endif
+
+#if ASYNC_MQTT_ACK_TIMEOUTS
+// onTimeout is called for a publish at QoS 1 or 2, a subscription or an unsubscription not acknowledged within
+// `timeoutMs` of being sent, `timers` of them at most waiting at once. To be called before connecting
+AsyncMqttClient& AsyncMqttClient::setAckTimeout(uint32_t timeoutMs, uint16_t timers) {
+  _ackTimeout = timeoutMs;
+  _ackTimers.resize(timeoutMs > 0 ? timers : 0);
   return *this;
 }
+#endif
+
+#if ASYNC_MQTT_OFFLINE_BUFFER
+// publish() buffers the messages while offline, their topic and payload in `size` bytes of RAM, `messages` of them at
+// most, and sends them once connected, `flushRate` per second. To be called before connecting
+AsyncMqttClient& AsyncMqttClient::setOfflineBuffer(size_t size, uint16_t messages, uint16_t flushRate) {
+  _setOfflineStore(size > 0 ? new AsyncMqttClientRamStore(size) : nullptr, true, messages, flushRate);
+  return *this;
+}
+
+// As setOfflineBuffer(), in `store`, e.g. a flash partition. The pointer must stay valid
+AsyncMqttClient& AsyncMqttClient::setOfflineStore(AsyncMqttClientOfflineStore* store, uint16_t messages, uint16_t flushRate) {
+  _setOfflineStore(store, false, messages, flushRate);
+  return *this;
+}
+
+void AsyncMqttClient::_setOfflineStore(AsyncMqttClientOfflineStore* store, bool owned, uint16_t messages, uint16_t flushRate) {
+  _offlineBuffer.setStore(store, owned, messages);
+  _offlineFlush = AsyncMqttClientInternals::TokenBucket(nullptr, flushRate, 1000, flushRate, AsyncMqttClientRatePolicy::REJECT, 0);
+  _offlineFlushRate = flushRate;
+}
+#endif
+
+#if ASYNC_MQTT_PAYLOAD_WRITER
+// The packet publish() with a writer serialises its payload into: `size` bytes for the fixed header, the topic and the
+// payload. To be called before connecting
+AsyncMqttClient& AsyncMqttClient::setWriterBuffer(size_t size) {
+  _writerBuffer.assign(size, 0);
+  return *this;
+}
+#endif
+
+#if ASYNC_MQTT_MESSAGE_CACHE
+// Keeps the last payload of the received topics added with addCachedTopic(), within `budget` bytes
+AsyncMqttClient& AsyncMqttClient::setMessageCache(size_t budget) {
+  SEMAPHORE_TAKE(*this);
+  _messageCache.setBudget(budget);
+  SEMAPHORE_GIVE();
+  return *this;
+}
+
+// `topicFilter` must stay valid. To be called before connecting
+AsyncMqttClient& AsyncMqttClient::addCachedTopic(const char* topicFilter) {
+  _messageCache.add(topicFilter);
+  return *this;
+}
+#endif
+
+#if ASYNC_MQTT_PAYLOAD_SINKS
+// The payloads of the topics matching `topicFilter` go to `sink` as they arrive, instead of the onMessage handlers.
+// Both must stay valid. To be called before connecting
+AsyncMqttClient& AsyncMqttClient::addPayloadSink(const char* topicFilter, AsyncMqttClientPayloadSink* sink) {
+  _payloadSinks.add(topicFilter, sink);
+  return *this;
+}
+#endif
+
+#if ASYNC_MQTT_COALESCING
+// QoS 0 publishes to the topics matching `topicFilter`, which must stay valid, replace the unsent one of their topic
+AsyncMqttClient& AsyncMqttClient::addCoalescedTopic(const char* topicFilter, uint16_t slots) {
+  _coalescedPublishes.add(topicFilter, slots);
+  return *this;
+}
+#endif
+
+#if ASYNC_MQTT_RATE_LIMITS
+// At most `messages` publishes every `periodMs`, in bursts of up to `burst`. To be set before connecting
+AsyncMqttClient& AsyncMqttClient::setPublishRateLimit(uint32_t messages, uint32_t periodMs, uint16_t burst, AsyncMqttClientRatePolicy policy, uint16_t queueSize) {
+  _rateLimiter.setGlobal(messages, periodMs, burst, policy, queueSize);
+  return *this;
+}
+
+// The same for the topics matching `topicFilter`, which must stay valid. The first matching filter applies, then the global limit
+AsyncMqttClient& AsyncMqttClient::addPublishRateLimit(const char* topicFilter, uint32_t messages, uint32_t periodMs, uint16_t burst, AsyncMqttClientRatePolicy policy, uint16_t queueSize) {
+  _rateLimiter.add(topicFilter, messages, periodMs, burst, policy, queueSize);
+  return *this;
+}
+#endif
+
+#if ASYNC_MQTT_MULTITHREADED
+AsyncMqttClient& AsyncMqttClient::setPublishQueueSize(uint16_t publishQueueSize) {
+  _publishQueue.resize(publishQueueSize);
+  return *this;
+}
+
+#if ASYNC_MQTT_URGENT_PUBLISHES
+AsyncMqttClient& AsyncMqttClient::setUrgentQueueSize(uint16_t urgentQueueSize) {
+  _urgentQueue.resize(urgentQueueSize);
+  return *this;
+}
+#endif
+
+AsyncMqttClient& AsyncMqttClient::setMessageDispatch(uint8_t workers, uint16_t queueSize) {
+  _messageDispatcher.begin(workers, queueSize, [this](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+    for (const auto& callback : _onMessageUserCallbacks) callback(topic, payload, properties, len, index, total);
+  });
+  return *this;
+}
+#endif
 
-#if ASYNC_TCP_SSL_ENABLED
+#if ASYNC_MQTT_TLS
 AsyncMqttClient& AsyncMqttClient::setSecure(bool secure) {
   _secure = secure;
   return *this;
 }
 
 AsyncMqttClient& AsyncMqttClient::addServerFingerprint(const uint8_t* fingerprint) {
+#if ASYNC_MQTT_FIXED_CAPACITY
+  if (_secureServerFingerprints.full()) return *this;
+#endif
   std::array<uint8_t, SHA1_SIZE> newFingerprint;
   memcpy(newFingerprint.data(), fingerprint, SHA1_SIZE);
   _secureServerFingerprints.push_back(newFingerprint);
   return *this;
 }
+
+// A session saved with getTlsSession(), e.g. before a reboot, to resume on the next connection
+AsyncMqttClient& AsyncMqttClient::setTlsSession(const uint8_t* session, size_t length) {
+  _transport->setTlsSession(session, length);
+  return *this;
+}
 #endif
 
 AsyncMqttClient& AsyncMqttClient::onConnect(AsyncMqttClientInternals::OnConnectUserCallback callback) {
@@ -155,6 +477,9 @@ AsyncMqttClient& AsyncMqttClient::onUnsubscribe(AsyncMqttClientInternals::OnUnsu
 }
 
 AsyncMqttClient& AsyncMqttClient::onMessage(AsyncMqttClientInternals::OnMessageUserCallback callback) {
+#if ASYNC_MQTT_FIXED_CAPACITY
+  if (_onMessageUserCallbacks.full()) return *this;
+#endif
   _onMessageUserCallbacks.push_back(callback);
   return *this;
 }
@@ -169,42 +494,178 @@ AsyncMqttClient& AsyncMqttClient::onPing(AsyncMqttClientInternals::OnPingUserCal
   return *this;
 }
 
+#if ASYNC_MQTT_ACK_TIMEOUTS
+AsyncMqttClient& AsyncMqttClient::onTimeout(AsyncMqttClientInternals::OnTimeoutUserCallback callback) {
+  _onTimeoutUserCallback = callback;
+  return *this;
+}
+#endif
+
 void AsyncMqttClient::_freeCurrentParsedPacket() {
+#if ASYNC_MQTT_PACKET_STORAGE
+  if (_currentParsedPacket != nullptr) _currentParsedPacket->~Packet();
+#else
   delete _currentParsedPacket;
+#endif
   _currentParsedPacket = nullptr;
 }
 
 void AsyncMqttClient::_clear() {
   _lastPingRequestTime = 0;
+#if ASYNC_MQTT_STREAMED_PAYLOADS
   _isSendingLargePayload = false;
   _largePayloadIndex = 0;
+#endif
   _connected = false;
+#if ASYNC_MQTT_PIPELINING
+  _connectSent = false;
+#endif
+#if ASYNC_MQTT_ADDRESS_CACHE
+  _readying = false;
+#endif
   _disconnectOnPoll = false;
+  _pingDue = false;
   _connectPacketNotEnoughSpace = false;
   _tlsBadFingerprint = false;
+  _parsingInformation.packetTooLarge = false;
+  _overflowed = false;
   _freeCurrentParsedPacket();
 
+#if ASYNC_MQTT_QOS2
   _pendingPubRels.clear();
   _pendingPubRels.shrink_to_fit();
+#endif
 
   _toSendAcks.clear();
   _toSendAcks.shrink_to_fit();
 
-  _nextPacketId = 0;
+  _inboundTopicAliases.clear();
+  _outboundTopicAliases.clear();
+
+  _inFlightPublishes = 0;
+  _inboundHeld = 0;
+  _inboundUnacked = 0;
+  _packetIds.clear();
+#if ASYNC_MQTT_ACK_TIMEOUTS
+  _ackTimers.clear();
+#endif
   _parsingInformation.bufferState = AsyncMqttClientInternals::BufferState::NONE;
+  _remainingLengthBufferPosition = 0;
+}
+
+AsyncMqttClientInternals::ConnectFields AsyncMqttClient::_connectFields() const {
+  AsyncMqttClientInternals::ConnectFields fields;
+  fields.protocolVersion = _protocolVersion;
+  fields.flags = AsyncMqttClientInternals::Codec::connectFlags(_cleanSession, _username != nullptr, _password != nullptr, _willTopic != nullptr, _willQos, _willRetain);
+  fields.keepAlive = _keepAlive;
+  fields.topicAliasMaximum = _topicAliasMaximum;
+  fields.receiveMaximum = _receiveMaximum;
+  fields.maximumPacketSize = _parsingInformation.maximumPacketSize;
+  fields.clientIdLength = strlen(_clientId);
+  fields.willTopicLength = 0;
+  fields.willPayloadLength = 0;
+  if (_willTopic != nullptr) {
+    fields.willTopicLength = strlen(_willTopic);
+    if (_willPayload != nullptr) fields.willPayloadLength = _willPayloadLength > 0 ? _willPayloadLength : strlen(_willPayload);
+  }
+  fields.usernameLength = _username != nullptr ? strlen(_username) : 0;
+  fields.passwordLength = _password != nullptr ? strlen(_password) : 0;
+  return fields;
+}
+
+// CONNECT, piece by piece to `add(data, size)`
+template <typename Add>
+void AsyncMqttClient::_writeConnect(const AsyncMqttClientInternals::ConnectFields& fields, Add add) const {
+  char head[AsyncMqttClientInternals::Codec::MAX_CONNECT_HEAD_SIZE];
+  add(head, AsyncMqttClientInternals::Codec::encodeConnectHead(head, fields));
+  add(_clientId, fields.clientIdLength);
+  if (_willTopic != nullptr) {
+    add(head, AsyncMqttClientInternals::Codec::encodeConnectWillHead(head, _protocolVersion, fields.willTopicLength));
+    add(_willTopic, fields.willTopicLength);
+    add(head, AsyncMqttClientInternals::Codec::encodeUint16(head, fields.willPayloadLength));
+    if (_willPayload != nullptr) add(_willPayload, fields.willPayloadLength);
+  }
+  if (_username != nullptr) {
+    add(head, AsyncMqttClientInternals::Codec::encodeUint16(head, fields.usernameLength));
+    add(_username, fields.usernameLength);
+  }
+  if (_password != nullptr) {
+    add(head, AsyncMqttClientInternals::Codec::encodeUint16(head, fields.passwordLength));
+    add(_password, fields.passwordLength);
+  }
+}
+
+#if ASYNC_MQTT_PIPELINING
+// Serialised once for the connections to come, connect() calls it again after a setter changed what it carries
+void AsyncMqttClient::_encodeConnect() {
+  AsyncMqttClientInternals::ConnectFields fields = _connectFields();
+  _connectPacket.clear();
+  _connectPacket.reserve(AsyncMqttClientInternals::Codec::packetSize(AsyncMqttClientInternals::Codec::connectRemainingLength(fields)));
+  _writeConnect(fields, [this](const char* data, size_t size) { _connectPacket.insert(_connectPacket.end(), data, data + size); });
+  _connectPacketStale = false;
 }
+#endif
 
 /* TCP */
-void AsyncMqttClient::_onConnect(AsyncClient* client) {
-  (void)client;
+#if ASYNC_MQTT_ADDRESS_CACHE
+void AsyncMqttClient::_connectCached() {
+  uint32_t now = _millis();
+  IPAddress address;
+  SEMAPHORE_TAKE();
+  bool cached = _addressCache.get(&address);
+  bool refresh = _addressCache.stale(now);
+  _connectOnResolve = !cached;
+  SEMAPHORE_GIVE();
+  _usedCache = cached;
+
+  if (refresh) {
+    _resolveStart = now;
+    if (!_transport->resolve(_host) && !cached) {
+      // without background resolution, or with one in progress that is left alone
+      _connectOnResolve = false;
+      if (!_transport->connect(_host, _port, _secureFlag())) _onDisconnect();
+      return;
+    }
+  }
+  if (cached) _connectTo(address);
+}
+
+// Not started, the address is unreachable: the next one is tried
+void AsyncMqttClient::_connectTo(IPAddress address) {
+  _connectingCached = true;
+  if (!_transport->connectResolved(address, _host, _port, _secureFlag())) _onDisconnect();
+}
+
+void AsyncMqttClient::_onResolve(const IPAddress* addresses, uint8_t count) {
+  uint32_t now = _millis();
+  SEMAPHORE_TAKE();
+  _connectStats.resolutions++;
+  if (count == 0) _connectStats.failedResolutions++;
+  _connectStats.lastResolveMs = now - _resolveStart;
+  if (count > 0) _addressCache.store(addresses, count, now);  // a failed refresh keeps the addresses
+  bool connect = _connectOnResolve;
+  _connectOnResolve = false;
+  SEMAPHORE_GIVE();
+
+  if (!connect) return;
+  if (count > 0) {
+    _connectTo(addresses[0]);
+  } else if (!_transport->connect(_host, _port, _secureFlag())) {  // fails like without the cache
+    _onDisconnect();
+  }
+}
+#endif
+
+void AsyncMqttClient::_onConnect() {
   _lockMutiConnections = true;
-#if ASYNC_TCP_SSL_ENABLED
+#if ASYNC_MQTT_ADDRESS_CACHE
+  _connectingCached = false;
+#endif
+#if ASYNC_MQTT_TLS
   if (_secure && _secureServerFingerprints.size() > 0) {
-    SSL* clientSsl = _client.getSSL();
-
     bool sslFoundFingerprint = false;
-    for (std::array<uint8_t, SHA1_SIZE> fingerprint : _secureServerFingerprints) {
-      if (ssl_match_fingerprint(clientSsl, fingerprint.data()) == SSL_OK) {
+    for (const std::array<uint8_t, SHA1_SIZE>& fingerprint : _secureServerFingerprints) {
+      if (_transport->matchFingerprint(fingerprint.data())) {
         sslFoundFingerprint = true;
         break;
       }
@@ -212,169 +673,80 @@ void AsyncMqttClient::_onConnect(AsyncClient* client) {
 
     if (!sslFoundFingerprint) {
       _tlsBadFingerprint = true;
-      _client.close(true);
+      _transport->setTlsSession(nullptr, 0);  // not to be resumed with that server
+      _transport->close(true);
       return;
     }
   }
 #endif
 
-  char fixedHeader[5];
-  fixedHeader[0] = AsyncMqttClientInternals::PacketType.CONNECT;
-  fixedHeader[0] = fixedHeader[0] << 4;
-  fixedHeader[0] = fixedHeader[0] | AsyncMqttClientInternals::HeaderFlag.CONNECT_RESERVED;
-
-  uint16_t protocolNameLength = 4;
-  char protocolNameLengthBytes[2];
-  protocolNameLengthBytes[0] = protocolNameLength >> 8;
-  protocolNameLengthBytes[1] = protocolNameLength & 0xFF;
-
-  char protocolLevel[1];
-  protocolLevel[0] = 0x04;
-
-  char connectFlags[1];
-  connectFlags[0] = 0;
-  if (_cleanSession) connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.CLEAN_SESSION;
-  if (_username != nullptr) connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.USERNAME;
-  if (_password != nullptr) connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.PASSWORD;
-  if (_willTopic != nullptr) {
-    connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.WILL;
-    if (_willRetain) connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.WILL_RETAIN;
-    switch (_willQos) {
-      case 0:
-        connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.WILL_QOS0;
-        break;
-      case 1:
-        connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.WILL_QOS1;
-        break;
-      case 2:
-        connectFlags[0] |= AsyncMqttClientInternals::ConnectFlag.WILL_QOS2;
-        break;
-    }
-  }
-
-  char keepAliveBytes[2];
-  keepAliveBytes[0] = _keepAlive >> 8;
-  keepAliveBytes[1] = _keepAlive & 0xFF;
-
-  uint16_t clientIdLength = strlen(_clientId);
-  char clientIdLengthBytes[2];
-  clientIdLengthBytes[0] = clientIdLength >> 8;
-  clientIdLengthBytes[1] = clientIdLength & 0xFF;
-
-  // Optional fields
-  uint16_t willTopicLength = 0;
-  char willTopicLengthBytes[2];
-  uint16_t willPayloadLength = _willPayloadLength;
-  char willPayloadLengthBytes[2];
-  if (_willTopic != nullptr) {
-    willTopicLength = strlen(_willTopic);
-    willTopicLengthBytes[0] = willTopicLength >> 8;
-    willTopicLengthBytes[1] = willTopicLength & 0xFF;
-
-    if (_willPayload != nullptr && willPayloadLength == 0) willPayloadLength = strlen(_willPayload);
+  _parsingInformation.protocolVersion = _protocolVersion;
 
-    willPayloadLengthBytes[0] = willPayloadLength >> 8;
-    willPayloadLengthBytes[1] = willPayloadLength & 0xFF;
-  }
-
-  uint16_t usernameLength = 0;
-  char usernameLengthBytes[2];
-  if (_username != nullptr) {
-    usernameLength = strlen(_username);
-    usernameLengthBytes[0] = usernameLength >> 8;
-    usernameLengthBytes[1] = usernameLength & 0xFF;
-  }
-
-  uint16_t passwordLength = 0;
-  char passwordLengthBytes[2];
-  if (_password != nullptr) {
-    passwordLength = strlen(_password);
-    passwordLengthBytes[0] = passwordLength >> 8;
-    passwordLengthBytes[1] = passwordLength & 0xFF;
-  }
-
-  uint32_t remainingLength = 2 + protocolNameLength + 1 + 1 + 2 + 2 + clientIdLength;  // always present
-  if (_willTopic != nullptr) remainingLength += 2 + willTopicLength + 2 + willPayloadLength;
-  if (_username != nullptr) remainingLength += 2 + usernameLength;
-  if (_password != nullptr) remainingLength += 2 + passwordLength;
-  uint8_t remainingLengthLength = AsyncMqttClientInternals::Helpers::encodeRemainingLength(remainingLength, fixedHeader + 1);
-
-  uint32_t neededSpace = 1 + remainingLengthLength;
-  neededSpace += 2;
-  neededSpace += protocolNameLength;
-  neededSpace += 1;
-  neededSpace += 1;
-  neededSpace += 2;
-  neededSpace += 2;
-  neededSpace += clientIdLength;
-  if (_willTopic != nullptr) {
-    neededSpace += 2;
-    neededSpace += willTopicLength;
-
-    neededSpace += 2;
-    if (_willPayload != nullptr) neededSpace += willPayloadLength;
-  }
-  if (_username != nullptr) {
-    neededSpace += 2;
-    neededSpace += usernameLength;
-  }
-  if (_password != nullptr) {
-    neededSpace += 2;
-    neededSpace += passwordLength;
-  }
+#if ASYNC_MQTT_RPC && ASYNC_MQTT_PIPELINING
+  // the response topic of request(), right behind CONNECT with pipelining
+  if (_pipelineSize > 0 && _rpcSubscription != nullptr) _rpcSubscribeId = subscribe(_rpcSubscription, 1);
+#endif
 
   SEMAPHORE_TAKE();
-  if (_client.space() < neededSpace) {
+#if ASYNC_MQTT_MULTITHREADED
+  // dropped here rather than on disconnection, where the lock may already be held by this task
+  _publishQueue.clear();
+#if ASYNC_MQTT_URGENT_PUBLISHES
+  _urgentQueue.clear();
+#endif
+#endif
+#if ASYNC_MQTT_RATE_LIMITS
+  _rateLimiter.clear();
+#endif
+#if ASYNC_MQTT_COALESCING
+  _coalescedPublishes.clear();
+#endif
+#if ASYNC_MQTT_PIPELINING
+  size_t neededSpace = _connectPacket.size() + _pipeline.size();
+#else
+  // written on each connection, without a copy kept
+  AsyncMqttClientInternals::ConnectFields fields = _connectFields();
+  size_t neededSpace = AsyncMqttClientInternals::Codec::packetSize(AsyncMqttClientInternals::Codec::connectRemainingLength(fields));
+#endif
+  if (_transport->space() < neededSpace) {
     _connectPacketNotEnoughSpace = true;
-    _client.close(true);
+    _transport->close(true);
     SEMAPHORE_GIVE();
     return;
   }
 
-  _client.add(fixedHeader, 1 + remainingLengthLength);
-
-  // Using a sendbuffer to fix bug setwill on SSL not working
-  char sendbuffer[12];
-  sendbuffer[0] = protocolNameLengthBytes[0];
-  sendbuffer[1] = protocolNameLengthBytes[1];
-
-  sendbuffer[2] = 'M';
-  sendbuffer[3] = 'Q';
-  sendbuffer[4] = 'T';
-  sendbuffer[5] = 'T';
-  
-  sendbuffer[6] = protocolLevel[0];
-  sendbuffer[7] = connectFlags[0];
-  sendbuffer[8] = keepAliveBytes[0];
-  sendbuffer[9] = keepAliveBytes[1];
-  sendbuffer[10] = clientIdLengthBytes[0];
-  sendbuffer[11] = clientIdLengthBytes[1];
-
-  _client.add(sendbuffer, 12);
-
-  _client.add(_clientId, clientIdLength);
-  if (_willTopic != nullptr) {
-    _client.add(willTopicLengthBytes, 2);
-    _client.add(_willTopic, willTopicLength);
-
-    _client.add(willPayloadLengthBytes, 2);
-    if (_willPayload != nullptr) _client.add(_willPayload, willPayloadLength);
-  }
-  if (_username != nullptr) {
-    _client.add(usernameLengthBytes, 2);
-    _client.add(_username, usernameLength);
-  }
-  if (_password != nullptr) {
-    _client.add(passwordLengthBytes, 2);
-    _client.add(_password, passwordLength);
-  }
-  _client.send();
-  _lastClientActivity = millis();
+#if ASYNC_MQTT_PIPELINING
+  _transport->add(_connectPacket.data(), _connectPacket.size());
+  // in one buffer, the packets written while connecting in the same segment
+  if (!_pipeline.empty()) _transport->add(_pipeline.data(), _pipeline.size());
+  _pipeline.clear();
+  _connectSent = true;
+#else
+  _writeConnect(fields, [this](const char* data, size_t size) { _transport->add(data, size); });
+#endif
+  _transport->send();
+  _lastClientActivity = _millis();
   SEMAPHORE_GIVE();
 }
 
-void AsyncMqttClient::_onDisconnect(AsyncClient* client) {
-  (void)client;
+void AsyncMqttClient::_onDisconnect() {
+#if ASYNC_MQTT_ADDRESS_CACHE
+  if (_connectingCached) {
+    // unreachable, the next address of the cache is tried before giving up
+    _connectingCached = false;
+    IPAddress next;
+    SEMAPHORE_TAKE();
+    _addressCache.failed();
+    bool fallback = _addressCache.get(&next);
+    if (fallback) _connectStats.fallbacks++;
+    SEMAPHORE_GIVE();
+    if (fallback) {
+      _connectTo(next);
+      return;
+    }
+  }
+#endif
+
   _lockMutiConnections = false;
   AsyncMqttClientDisconnectReason reason;
 
@@ -382,73 +754,94 @@ void AsyncMqttClient::_onDisconnect(AsyncClient* client) {
     reason = AsyncMqttClientDisconnectReason::ESP8266_NOT_ENOUGH_SPACE;
   } else if (_tlsBadFingerprint) {
     reason = AsyncMqttClientDisconnectReason::TLS_BAD_FINGERPRINT;
+  } else if (_parsingInformation.packetTooLarge) {
+    reason = AsyncMqttClientDisconnectReason::MQTT_PACKET_TOO_LARGE;
   } else {
     reason = AsyncMqttClientDisconnectReason::TCP_DISCONNECTED;
   }
 
   _clear();
+#if ASYNC_MQTT_PAYLOAD_SINKS
+  _payloadSinks.abort();
+#endif
+#if ASYNC_MQTT_RPC
+  _expireRequests(true);
+#endif
 
   if (_onDisconnectUserCallback) _onDisconnectUserCallback(reason);
 }
 
-void AsyncMqttClient::_onError(AsyncClient* client, int8_t error) {
-  (void)client;
+void AsyncMqttClient::_onError(int8_t error) {
   (void)error;
   // _onDisconnect called anyway
 }
 
-void AsyncMqttClient::_onTimeout(AsyncClient* client, uint32_t time) {
-  (void)client;
+void AsyncMqttClient::_onTimeout(uint32_t time) {
   (void)time;
   // disconnection will be handled by ping/pong management
 }
 
-void AsyncMqttClient::_onAck(AsyncClient* client, size_t len, uint32_t time) {
-  (void)client;
+void AsyncMqttClient::_onAck(size_t len, uint32_t time) {
   (void)len;
   (void)time;
+#if ASYNC_MQTT_STREAMED_PAYLOADS
+  // the rest of a streamed payload goes first: its chunks are the bytes of a single PUBLISH, which no other packet
+  // may split. The control packets go out in this same call once its last chunk is written
+  if (_sendLargePayload()) return;
+#endif
+  _sendControlPackets();
+#if ASYNC_MQTT_MULTITHREADED
+  // TCP space was freed, send what producers queued meanwhile
+  _drainPublishQueue();
+#endif
+  _sendWaiting();
 }
 
-void AsyncMqttClient::_onData(AsyncClient* client, char* data, size_t len) {
-  (void)client;
+void AsyncMqttClient::_onData(char* data, size_t len) {
   size_t currentBytePosition = 0;
-  char currentByte;
-  _lastServerActivity = millis();
+  uint8_t currentByte;
+  _lastServerActivity = _millis();
   do {
     switch (_parsingInformation.bufferState) {
       case AsyncMqttClientInternals::BufferState::NONE:
         currentByte = data[currentBytePosition++];
         _parsingInformation.packetType = currentByte >> 4;
-        _parsingInformation.packetFlags = (currentByte << 4) >> 4;
+        _parsingInformation.packetFlags = currentByte & 0x0F;
         _parsingInformation.bufferState = AsyncMqttClientInternals::BufferState::REMAINING_LENGTH;
+        _freeCurrentParsedPacket();  // skipped packets never reach their callback
         switch (_parsingInformation.packetType) {
           case AsyncMqttClientInternals::PacketType.CONNACK:
-            _currentParsedPacket = new AsyncMqttClientInternals::ConnAckPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onConnAck, this, std::placeholders::_1, std::placeholders::_2));
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::ConnAckPacket>(&_parsingInformation, [this](bool sessionPresent, uint8_t connectReturnCode, const AsyncMqttClientInternals::Properties& properties) { _onConnAck(sessionPresent, connectReturnCode, properties); });
             break;
           case AsyncMqttClientInternals::PacketType.PINGRESP:
-            _currentParsedPacket = new AsyncMqttClientInternals::PingRespPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onPingResp, this));
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::PingRespPacket>(&_parsingInformation, [this]() { _onPingResp(); });
             break;
           case AsyncMqttClientInternals::PacketType.SUBACK:
-            _currentParsedPacket = new AsyncMqttClientInternals::SubAckPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onSubAck, this, std::placeholders::_1, std::placeholders::_2));
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::SubAckPacket>(&_parsingInformation, [this](uint16_t packetId, char status) { _onSubAck(packetId, status); });
             break;
           case AsyncMqttClientInternals::PacketType.UNSUBACK:
-            _currentParsedPacket = new AsyncMqttClientInternals::UnsubAckPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onUnsubAck, this, std::placeholders::_1));
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::UnsubAckPacket>(&_parsingInformation, [this](uint16_t packetId) { _onUnsubAck(packetId); });
             break;
           case AsyncMqttClientInternals::PacketType.PUBLISH:
-            _currentParsedPacket = new AsyncMqttClientInternals::PublishPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6, std::placeholders::_7, std::placeholders::_8, std::placeholders::_9), std::bind(&AsyncMqttClient::_onPublish, this, std::placeholders::_1, std::placeholders::_2));
-            break;
-          case AsyncMqttClientInternals::PacketType.PUBREL:
-            _currentParsedPacket = new AsyncMqttClientInternals::PubRelPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onPubRel, this, std::placeholders::_1));
+            // lambdas capturing this only, which std::function holds without allocating
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::PublishPacket>(&_parsingInformation,
+              [this](char* topic, char* payload, uint8_t qos, bool dup, bool retain, size_t len, size_t index, size_t total, uint16_t packetId) { _onMessage(topic, payload, qos, dup, retain, len, index, total, packetId); },
+              [this](uint16_t packetId, uint8_t qos) { _onPublish(packetId, qos); });
             break;
           case AsyncMqttClientInternals::PacketType.PUBACK:
-            _currentParsedPacket = new AsyncMqttClientInternals::PubAckPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onPubAck, this, std::placeholders::_1));
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::PubAckPacket>(&_parsingInformation, [this](uint16_t packetId) { _onPubAck(packetId); });
+            break;
+#if ASYNC_MQTT_QOS2
+          case AsyncMqttClientInternals::PacketType.PUBREL:
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::PubRelPacket>(&_parsingInformation, [this](uint16_t packetId) { _onPubRel(packetId); });
             break;
           case AsyncMqttClientInternals::PacketType.PUBREC:
-            _currentParsedPacket = new AsyncMqttClientInternals::PubRecPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onPubRec, this, std::placeholders::_1));
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::PubRecPacket>(&_parsingInformation, [this](uint16_t packetId) { _onPubRec(packetId); });
             break;
           case AsyncMqttClientInternals::PacketType.PUBCOMP:
-            _currentParsedPacket = new AsyncMqttClientInternals::PubCompPacket(&_parsingInformation, std::bind(&AsyncMqttClient::_onPubComp, this, std::placeholders::_1));
+            _currentParsedPacket = _newPacket<AsyncMqttClientInternals::PubCompPacket>(&_parsingInformation, [this](uint16_t packetId) { _onPubComp(packetId); });
             break;
+#endif
           default:
             break;
         }
@@ -461,15 +854,30 @@ void AsyncMqttClient::_onData(AsyncClient* client, char* data, size_t len) {
           _remainingLengthBufferPosition = 0;
           if (_parsingInformation.remainingLength > 0) {
             _parsingInformation.bufferState = AsyncMqttClientInternals::BufferState::VARIABLE_HEADER;
-          } else {
+          } else if (_parsingInformation.packetType == AsyncMqttClientInternals::PacketType.PINGRESP) {
             // PINGRESP is a special case where it has no variable header, so the packet ends right here
             _parsingInformation.bufferState = AsyncMqttClientInternals::BufferState::NONE;
             _onPingResp();
+          } else {
+            // an MQTT 5 DISCONNECT without a reason code, a normal disconnection, ends the connection as one with a
+            // reason code does. Any other packet needs a variable header
+            _transport->close(true);
+            return;
           }
         }
         break;
       case AsyncMqttClientInternals::BufferState::VARIABLE_HEADER:
+        if (_currentParsedPacket == nullptr) {
+          // a packet this build cannot parse, such as a QoS 2 ack without ASYNC_MQTT_QOS2 or an MQTT 5 DISCONNECT
+          _transport->close(true);
+          return;
+        }
         _currentParsedPacket->parseVariableHeader(data, len, &currentBytePosition);
+        if (_parsingInformation.packetTooLarge) {
+          // the broker is told why (MQTT 5, 3.1.2.11.4), or the connection is just closed
+          if (!_sendDisconnect(AsyncMqttClientInternals::ReasonCode.PACKET_TOO_LARGE)) _transport->close(true);
+          return;
+        }
         break;
       case AsyncMqttClientInternals::BufferState::PAYLOAD:
         _currentParsedPacket->parsePayload(data, len, &currentBytePosition);
@@ -477,47 +885,68 @@ void AsyncMqttClient::_onData(AsyncClient* client, char* data, size_t len) {
       default:
         currentBytePosition = len;
     }
-  } while (currentBytePosition != len);
-}
+  } while (currentBytePosition != len && !_overflowed);
 
-void AsyncMqttClient::_onPoll(AsyncClient* client) {
-  if (!_connected) return;
+  if (_overflowed) {
+    _transport->close(true);
+    return;
+  }
 
-  if (_isSendingLargePayload && _client.canSend()) {
-    // try to write as much as possible
-    size_t remainingPayloadLength = _largePayloadLength - _largePayloadIndex;
-    _largePayloadIndex += _client.write(_largePayloadHandler(_largePayloadIndex), remainingPayloadLength);
-    //_client.send();
-    if (_largePayloadIndex == _largePayloadLength) {
-      _isSendingLargePayload = false;
+  // the application holds too much, let the TCP window close until it releases some
+  if (_inboundBudget > 0) {
+    SEMAPHORE_TAKE();
+    if (_inboundHeld > _inboundBudget) {
+      _transport->ackLater();
+      _inboundUnacked += len;
     }
-    _lastClientActivity = millis();
-    return;
+    SEMAPHORE_GIVE();
   }
+}
+
+void AsyncMqttClient::_onPoll() {
+  if (!_connected) return;
+
+  // keep alive is checked while a payload is streamed too, its ping then goes out as soon as the payload ends
+
+  if (_keepAlive == 0) {
+    // a keep alive of 0 turns it off
 
   // if there is too much time the client has sent a ping request without a response, disconnect client to avoid half open connections
-  if (_lastPingRequestTime != 0 && (millis() - _lastPingRequestTime) >= (_keepAlive * 1000 * 2)) {
-    disconnect();
+  } else if (_lastPingRequestTime != 0 && (_millis() - _lastPingRequestTime) >= static_cast<uint32_t>(_keepAlive * 2000)) {
+    disconnect(_isSendingLargePayload);  // a DISCONNECT cannot be sent in the middle of a payload
     return;
   // send ping to ensure the server will receive at least one message inside keepalive window
-  } else if (_lastPingRequestTime == 0 && (millis() - _lastClientActivity) >= (_keepAlive * 1000 * 0.7)) {
-    _sendPing();
+  } else if (_lastPingRequestTime == 0 && (_millis() - _lastClientActivity) >= static_cast<uint32_t>(_keepAlive * 700)) {
+    _setPingDue();
 
   // send ping to verify if the server is still there (ensure this is not a half connection)
-  } else if (_connected && _lastPingRequestTime == 0 && (millis() - _lastServerActivity) >= (_keepAlive * 1000 * 0.7)) {
-    _sendPing();
+  } else if (_connected && _lastPingRequestTime == 0 && (_millis() - _lastServerActivity) >= static_cast<uint32_t>(_keepAlive * 700)) {
+    _setPingDue();
   }
 
+#if ASYNC_MQTT_RPC
+  _expireRequests(false);
+#endif
+  _expireAckTimers();
+
+#if ASYNC_MQTT_STREAMED_PAYLOADS
+  // as in _onAck(), the control packets wait for the end of the PUBLISH being streamed, not for the next poll
+  if (_sendLargePayload()) return;
+#endif
 
-  // handle to send ack packets
+  // handle acks, ping and disconnect
 
-  _sendAcks();
+  _sendControlPackets();
 
-  // handle disconnect
+#if ASYNC_MQTT_MULTITHREADED
+  // handle queued publishes
 
-  if (_disconnectOnPoll) {
-    _sendDisconnect();
-  }
+  _drainPublishQueue();
+#endif
+
+  // handle rate limited and coalesced publishes, then the ones buffered while offline
+
+  _sendWaiting();
 }
 
 /* MQTT */
@@ -527,13 +956,33 @@ void AsyncMqttClient::_onPingResp() {
   if (_onPingUserCallback) _onPingUserCallback(true);
 }
 
-void AsyncMqttClient::_onConnAck(bool sessionPresent, uint8_t connectReturnCode) {
+void AsyncMqttClient::_onConnAck(bool sessionPresent, uint8_t connectReturnCode, const AsyncMqttClientInternals::Properties& properties) {
   (void)sessionPresent;
+  _outboundTopicAliases.setLimit(properties.topicAliasMaximum);
+  _serverReceiveMaximum = properties.receiveMaximum != 0 ? properties.receiveMaximum : 65535;
+  _serverMaximumPacketSize = properties.maximumPacketSize;
   _freeCurrentParsedPacket();
 
   if (connectReturnCode == 0) {
     _connected = true;
+#if ASYNC_MQTT_ADDRESS_CACHE
+    _countConnection();
+#endif
+#if ASYNC_MQTT_RPC
+    // the response topic of request(), subscribed on every connection
+#if ASYNC_MQTT_PIPELINING
+    if (_rpcSubscription != nullptr && _pipelineSize == 0) _rpcSubscribeId = subscribe(_rpcSubscription, 1);
+#else
+    if (_rpcSubscription != nullptr) _rpcSubscribeId = subscribe(_rpcSubscription, 1);
+#endif
+#endif
     if (_onConnectUserCallback) _onConnectUserCallback(sessionPresent);
+#if ASYNC_MQTT_ADDRESS_CACHE
+    _trackReady(false);
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+    _flushOffline();
+#endif
   } else {
     // Callbacks are handled by the ondisconnect function which is called from the AsyncTcp lib
   }
@@ -541,12 +990,25 @@ void AsyncMqttClient::_onConnAck(bool sessionPresent, uint8_t connectReturnCode)
 
 void AsyncMqttClient::_onSubAck(uint16_t packetId, char status) {
   _freeCurrentParsedPacket();
+  _packetIds.release(packetId);
+  _disarmAckTimer(packetId);
+#if ASYNC_MQTT_ADDRESS_CACHE
+  _trackReady(true);
+#endif
 
+#if ASYNC_MQTT_RPC
+  if (_rpcSubscribeId != 0 && packetId == _rpcSubscribeId) {
+    _rpcSubscribeId = 0;
+    return;
+  }
+#endif
   if (_onSubscribeUserCallback) _onSubscribeUserCallback(packetId, status);
 }
 
 void AsyncMqttClient::_onUnsubAck(uint16_t packetId) {
   _freeCurrentParsedPacket();
+  _packetIds.release(packetId);
+  _disarmAckTimer(packetId);
 
   if (_onUnsubscribeUserCallback) _onUnsubscribeUserCallback(packetId);
 }
@@ -554,41 +1016,78 @@ void AsyncMqttClient::_onUnsubAck(uint16_t packetId) {
 void AsyncMqttClient::_onMessage(char* topic, char* payload, uint8_t qos, bool dup, bool retain, size_t len, size_t index, size_t total, uint16_t packetId) {
   bool notifyPublish = true;
 
+#if ASYNC_MQTT_QOS2
   if (qos == 2) {
-    for (AsyncMqttClientInternals::PendingPubRel pendingPubRel : _pendingPubRels) {
+    for (const AsyncMqttClientInternals::PendingPubRel& pendingPubRel : _pendingPubRels) {
       if (pendingPubRel.packetId == packetId) {
         notifyPublish = false;
         break;
       }
     }
+#if ASYNC_MQTT_FIXED_CAPACITY
+    // no room to remember it until its PUBREL: left undelivered, the broker sends it again on the next connection
+    if (notifyPublish && index == 0 && _pendingPubRels.full()) {
+      _overflowed = true;
+      return;
+    }
+#endif
   }
+#endif
 
   if (notifyPublish) {
+#if ASYNC_MQTT_RPC
+    if (_rpcResponseTopic != nullptr && _onResponse(topic, payload, len, index, total)) return;
+#endif
+#if ASYNC_MQTT_PAYLOAD_SINKS
+    if (_payloadSinks.enabled() && _payloadSinks.receive(topic, payload, len, index, total)) return;
+#endif
+
     AsyncMqttClientMessageProperties properties;
     properties.qos = qos;
     properties.dup = dup;
     properties.retain = retain;
 
-    for (auto callback : _onMessageUserCallbacks) callback(topic, payload, properties, len, index, total);
+    if (_inboundBudget > 0) {
+      SEMAPHORE_TAKE();
+      _inboundHeld += len;
+      SEMAPHORE_GIVE();
+    }
+
+#if ASYNC_MQTT_MESSAGE_CACHE
+    if (_messageCache.enabled()) {
+      SEMAPHORE_TAKE();
+      _messageCache.receive(topic, payload, retain, len, index, total);
+      SEMAPHORE_GIVE();
+    }
+#endif
+
+#if ASYNC_MQTT_MULTITHREADED
+    if (_messageDispatcher.enabled()) {
+      _messageDispatcher.dispatch(topic, payload, properties, len, index, total);
+      return;
+    }
+#endif
+    for (const auto& callback : _onMessageUserCallbacks) callback(topic, payload, properties, len, index, total);
   }
 }
 
 void AsyncMqttClient::_onPublish(uint16_t packetId, uint8_t qos) {
-  AsyncMqttClientInternals::PendingAck pendingAck;
+  if (_overflowed) {
+    _freeCurrentParsedPacket();
+    return;
+  }
 
   if (qos == 1) {
-    pendingAck.packetType = AsyncMqttClientInternals::PacketType.PUBACK;
-    pendingAck.headerFlag = AsyncMqttClientInternals::HeaderFlag.PUBACK_RESERVED;
-    pendingAck.packetId = packetId;
-    _toSendAcks.push_back(pendingAck);
+    _queueAck(AsyncMqttClientInternals::PacketType.PUBACK, AsyncMqttClientInternals::HeaderFlag.PUBACK_RESERVED, packetId);
+#if ASYNC_MQTT_QOS2
   } else if (qos == 2) {
-    pendingAck.packetType = AsyncMqttClientInternals::PacketType.PUBREC;
-    pendingAck.headerFlag = AsyncMqttClientInternals::HeaderFlag.PUBREC_RESERVED;
-    pendingAck.packetId = packetId;
-    _toSendAcks.push_back(pendingAck);
+    if (!_queueAck(AsyncMqttClientInternals::PacketType.PUBREC, AsyncMqttClientInternals::HeaderFlag.PUBREC_RESERVED, packetId)) {
+      _freeCurrentParsedPacket();
+      return;
+    }
 
     bool pubRelAwaiting = false;
-    for (AsyncMqttClientInternals::PendingPubRel pendingPubRel : _pendingPubRels) {
+    for (const AsyncMqttClientInternals::PendingPubRel& pendingPubRel : _pendingPubRels) {
       if (pendingPubRel.packetId == packetId) {
         pubRelAwaiting = true;
         break;
@@ -602,125 +1101,524 @@ void AsyncMqttClient::_onPublish(uint16_t packetId, uint8_t qos) {
     }
 
     _sendAcks();
+#endif
   }
 
   _freeCurrentParsedPacket();
 }
 
+#if ASYNC_MQTT_QOS2
 void AsyncMqttClient::_onPubRel(uint16_t packetId) {
   _freeCurrentParsedPacket();
 
-  AsyncMqttClientInternals::PendingAck pendingAck;
-  pendingAck.packetType = AsyncMqttClientInternals::PacketType.PUBCOMP;
-  pendingAck.headerFlag = AsyncMqttClientInternals::HeaderFlag.PUBCOMP_RESERVED;
-  pendingAck.packetId = packetId;
-  _toSendAcks.push_back(pendingAck);
+  if (!_queueAck(AsyncMqttClientInternals::PacketType.PUBCOMP, AsyncMqttClientInternals::HeaderFlag.PUBCOMP_RESERVED, packetId)) return;
 
   for (size_t i = 0; i < _pendingPubRels.size(); i++) {
     if (_pendingPubRels[i].packetId == packetId) {
       _pendingPubRels.erase(_pendingPubRels.begin() + i);
-      _pendingPubRels.shrink_to_fit();
+      break;
     }
   }
 
   _sendAcks();
 }
+#endif
 
 void AsyncMqttClient::_onPubAck(uint16_t packetId) {
   _freeCurrentParsedPacket();
+  _disarmAckTimer(packetId);
+  _releaseInFlightPublish();
+  _packetIds.release(packetId);
 
   if (_onPublishUserCallback) _onPublishUserCallback(packetId);
 }
 
+#if ASYNC_MQTT_QOS2
 void AsyncMqttClient::_onPubRec(uint16_t packetId) {
   _freeCurrentParsedPacket();
 
-  AsyncMqttClientInternals::PendingAck pendingAck;
-  pendingAck.packetType = AsyncMqttClientInternals::PacketType.PUBREL;
-  pendingAck.headerFlag = AsyncMqttClientInternals::HeaderFlag.PUBREL_RESERVED;
-  pendingAck.packetId = packetId;
-  _toSendAcks.push_back(pendingAck);
+  _queueAck(AsyncMqttClientInternals::PacketType.PUBREL, AsyncMqttClientInternals::HeaderFlag.PUBREL_RESERVED, packetId);
 
   _sendAcks();
 }
 
 void AsyncMqttClient::_onPubComp(uint16_t packetId) {
   _freeCurrentParsedPacket();
+  _disarmAckTimer(packetId);
+  _releaseInFlightPublish();
+  _packetIds.release(packetId);
 
   if (_onPublishUserCallback) _onPublishUserCallback(packetId);
 }
+#endif
 
-bool AsyncMqttClient::_sendPing() {
-  char fixedHeader[2];
-  fixedHeader[0] = AsyncMqttClientInternals::PacketType.PINGREQ;
-  fixedHeader[0] = fixedHeader[0] << 4;
-  fixedHeader[0] = fixedHeader[0] | AsyncMqttClientInternals::HeaderFlag.PINGREQ_RESERVED;
-  fixedHeader[1] = 0;
+#if ASYNC_MQTT_RPC
+// Delivers a response to its request, returns false if the topic is not one of a response
+bool AsyncMqttClient::_onResponse(const char* topic, const char* payload, size_t len, size_t index, size_t total) {
+  if (strncmp(topic, _rpcResponseTopic, _rpcResponseTopicLength) != 0 || topic[_rpcResponseTopicLength] != '/') return false;
+  const char* digits = topic + _rpcResponseTopicLength + 1;
+  uint32_t requestId = 0;
+  for (const char* digit = digits; *digit != '\0'; digit++) {
+    if (*digit < '0' || *digit > '9' || requestId > 0xFFFF) return false;
+    requestId = requestId * 10 + (*digit - '0');
+  }
+  if (*digits == '\0' || requestId > 0xFFFF) return false;
 
-  size_t neededSpace = 2;
+  SEMAPHORE_TAKE(true);
+  AsyncMqttClientInternals::PendingRequests::Request* request = _pendingRequests.find(requestId);
+  if (request != nullptr) request->delivering = true;
+  SEMAPHORE_GIVE();
+  if (request == nullptr) return true;  // timed out already
 
-  SEMAPHORE_TAKE(false);
-  if (_client.space() < neededSpace) { SEMAPHORE_GIVE(); return false; }
+  // the slot is not reused before the last fragment, nor can it time out meanwhile
+  if (request->callback) request->callback(requestId, AsyncMqttClientRpcStatus::RESPONSE, payload, len, index, total);
+  if (index + len == total) {
+    SEMAPHORE_TAKE(true);
+    _pendingRequests.remove(request);
+    SEMAPHORE_GIVE();
+  }
+  return true;
+}
+
+// Ends the requests past their deadline, or all of them on disconnection
+void AsyncMqttClient::_expireRequests(bool all) {
+  if (!_pendingRequests.enabled()) return;
+  AsyncMqttClientRpcStatus status = all ? AsyncMqttClientRpcStatus::DISCONNECTED : AsyncMqttClientRpcStatus::TIMEOUT;
+  for (;;) {
+    SEMAPHORE_TAKE();
+    AsyncMqttClientInternals::PendingRequests::Request* request = _pendingRequests.expired(_millis(), all);
+    if (request != nullptr) request->delivering = true;
+    SEMAPHORE_GIVE();
+    if (request == nullptr) return;
 
-  _client.add(fixedHeader, 2);
-  _client.send();
-  _lastClientActivity = millis();
-  _lastPingRequestTime = millis();
+    if (request->callback) request->callback(request->id, status, nullptr, 0, 0, 0);
+    SEMAPHORE_TAKE();
+    _pendingRequests.remove(request);
+    SEMAPHORE_GIVE();
+  }
+}
+#endif
 
+#if ASYNC_MQTT_ACK_TIMEOUTS
+// With the client lock held
+void AsyncMqttClient::_armAckTimer(uint16_t packetId, AsyncMqttClientAckType type) {
+  uint32_t now = _millis();
+  if (_ackTimers.enabled()) _ackTimers.add(packetId, static_cast<uint8_t>(type), now + _ackTimeout, now);
+}
+
+void AsyncMqttClient::_disarmAckTimer(uint16_t packetId) {
+  if (!_ackTimers.enabled()) return;
+  SEMAPHORE_TAKE();
+  _ackTimers.cancel(packetId);
   SEMAPHORE_GIVE();
-  if (_onPingUserCallback) _onPingUserCallback(false);
+}
+
+// The operations past their deadline, each one reported once. The packet id stays in use until the acknowledgement
+// comes or the connection is lost, so that a retransmission with the same id can still be acknowledged
+void AsyncMqttClient::_expireAckTimers() {
+  if (!_ackTimers.enabled()) return;
+  for (;;) {
+    uint16_t packetId;
+    uint8_t type;
+    SEMAPHORE_TAKE();
+    bool expired = _ackTimers.expired(_millis(), &packetId, &type);
+    SEMAPHORE_GIVE();
+    if (!expired) return;
+    if (_onTimeoutUserCallback) _onTimeoutUserCallback(packetId, static_cast<AsyncMqttClientAckType>(type));
+  }
+}
+#endif
+
+void AsyncMqttClient::_releaseInFlightPublish() {
+  SEMAPHORE_TAKE();
+  if (_inFlightPublishes > 0) _inFlightPublishes--;
+  SEMAPHORE_GIVE();
+#if ASYNC_MQTT_MULTITHREADED
+  _drainPublishQueue();
+#endif
+  _sendWaiting();
+}
+
+// The publishes waiting for TCP space or tokens: rate limited, coalesced, then buffered while offline
+void AsyncMqttClient::_sendWaiting() {
+#if ASYNC_MQTT_RATE_LIMITS
+  _releaseHeld();
+#endif
+#if ASYNC_MQTT_COALESCING
+  _sendCoalesced();
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  _flushOffline();
+#endif
+}
+
+#if ASYNC_MQTT_RATE_LIMITS
+// Sends the publishes the rate limits held back as their buckets refill
+void AsyncMqttClient::_releaseHeld() {
+  if (!_rateLimiter.enabled()) return;
+  SEMAPHORE_TAKE();
+
+  uint32_t now = _millis();
+  AsyncMqttClientInternals::TokenBucket* global = _rateLimiter.global();
+  bool sent = false;
+  // the topic buckets come first, what they release may have to wait in the global one
+  for (size_t i = 0; i < _rateLimiter.size(); i++) {
+    AsyncMqttClientInternals::TokenBucket* bucket = &_rateLimiter[i];
+    AsyncMqttClientInternals::TokenBucket* next = bucket != global ? global : nullptr;
+    AsyncMqttClientInternals::OutboundPacket* packet;
+    while ((packet = bucket->front()) != nullptr && bucket->hasToken(now)) {
+      if (next != nullptr && !next->admits(now)) {
+        AsyncMqttClientInternals::OutboundPacket released = *packet;
+        bucket->take();
+        bucket->pop();
+        if (!_rateLimiter.hold(next, released)) {
+          delete[] released.data;
+          if (released.ownsId) _packetIds.release(released.packetId);
+        }
+        continue;
+      }
+      if (_isSendingLargePayload || _transport->space() < packet->length || (packet->inFlight && _inFlightPublishes >= _serverReceiveMaximum)) break;
+      bucket->take();
+      if (next != nullptr) next->take();
+      if (packet->inFlight) _inFlightPublishes++;
+      if (packet->packetId != 0) _armAckTimer(packet->packetId, AsyncMqttClientAckType::PUBLISH);
+      _transport->add(packet->data, packet->length);
+      delete[] packet->data;
+      bucket->pop();
+      sent = true;
+    }
+  }
+  if (sent) {
+    _transport->send();
+    _lastClientActivity = _millis();
+  }
+
+  SEMAPHORE_GIVE();
+}
+#endif
+
+#if ASYNC_MQTT_COALESCING
+// Sends the coalesced publishes, oldest first, as TCP space and the rate limits allow
+void AsyncMqttClient::_sendCoalesced() {
+  if (!_coalescedPublishes.enabled()) return;
+  SEMAPHORE_TAKE();
+
+#if ASYNC_MQTT_RATE_LIMITS
+  uint32_t now = _millis();
+#endif
+  bool sent = false;
+  AsyncMqttClientInternals::CoalescedPublishes::Slot* slot = nullptr;
+  while ((slot = _coalescedPublishes.next(slot)) != nullptr) {
+    if (_isSendingLargePayload || _transport->space() < slot->packet.size()) break;
+#if ASYNC_MQTT_RATE_LIMITS
+    if (_rateLimiter.enabled() && !_rateLimiter.tryTake(slot->topic.c_str(), now)) continue;  // replaced meanwhile if need be
+#endif
+    _transport->add(slot->packet.data(), slot->packet.size());
+    slot->pending = false;
+    sent = true;
+  }
+  if (sent) {
+    _transport->send();
+    _lastClientActivity = _millis();
+  }
+
+  SEMAPHORE_GIVE();
+}
+#endif
+
+#if ASYNC_MQTT_OFFLINE_BUFFER
+// Sends the publishes buffered while offline, highest priority first, at the flush rate and as TCP space allows.
+// Their topic and payload are read from the store in chunks, straight into the TCP buffer
+void AsyncMqttClient::_flushOffline() {
+  if (!_offlineBuffer.enabled() || !_connected) return;
+  SEMAPHORE_TAKE();
+
+  uint32_t now = _millis();
+  bool sent = false;
+  bool cut = false;
+  const AsyncMqttClientInternals::OfflineBuffer::Entry* entry;
+  while ((entry = _offlineBuffer.next(now)) != nullptr && (_offlineFlushRate == 0 || _offlineFlush.hasToken(now))) {
+    size_t neededSpace = _offlinePacketSize(*entry);
+    if (_serverMaximumPacketSize != 0 && neededSpace > _serverMaximumPacketSize) {
+      _offlineBuffer.drop(entry);
+      continue;
+    }
+    if (_isSendingLargePayload || _transport->space() < neededSpace || (entry->qos != 0 && _inFlightPublishes >= _serverReceiveMaximum)) break;
+    uint16_t packetId = 0;
+    if (entry->qos != 0 && (packetId = _getNextPacketId()) == 0) break;
+    if (_offlineFlushRate != 0) _offlineFlush.take();
+    if (packetId != 0) {
+      _inFlightPublishes++;
+      _armAckTimer(packetId, AsyncMqttClientAckType::PUBLISH);
+    }
+
+    uint32_t payloadLength = entry->length - entry->topicLength;
+    uint32_t remainingLength = AsyncMqttClientInternals::Codec::publishRemainingLength(entry->topicLength, entry->qos, AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, 0), payloadLength);
+    char head[AsyncMqttClientInternals::Codec::MAX_PUBLISH_HEAD_SIZE];
+    char tail[AsyncMqttClientInternals::Codec::MAX_PUBLISH_TAIL_SIZE];
+    uint8_t tailLength = AsyncMqttClientInternals::Codec::encodePublishTail(tail, entry->qos, packetId, _protocolVersion, 0);
+    _transport->add(head, AsyncMqttClientInternals::Codec::encodePublishHead(head, AsyncMqttClientInternals::Codec::publishFixedHeader(entry->qos, entry->retain, false), remainingLength, entry->topicLength));
+    cut = !_addOffline(*entry, 0, entry->topicLength);
+    if (!cut && tailLength > 0) _transport->add(tail, tailLength);
+    cut = cut || !_addOffline(*entry, entry->topicLength, payloadLength);
+    sent = true;
+    if (cut) {
+      _offlineBuffer.drop(entry);
+      break;
+    }
+    _offlineBuffer.sent(entry);
+  }
+  if (sent) {
+    _transport->send();
+    _lastClientActivity = _millis();
+  }
+
+  SEMAPHORE_GIVE();
+  // a packet cut short by the store cannot be completed, the connection is lost with it
+  if (cut) _transport->close(true);
+}
+
+// `len` bytes of a buffered message from `index`, returns false if the store could not read them
+bool AsyncMqttClient::_addOffline(const AsyncMqttClientInternals::OfflineBuffer::Entry& entry, size_t index, size_t len) {
+  char chunk[64];
+  while (len > 0) {
+    size_t read = len < sizeof(chunk) ? len : sizeof(chunk);
+    if (!_offlineBuffer.read(entry, index, reinterpret_cast<uint8_t*>(chunk), read)) return false;
+    _transport->add(chunk, read);
+    index += read;
+    len -= read;
+  }
   return true;
 }
 
-void AsyncMqttClient::_sendAcks() {
-  uint8_t neededAckSpace = 2 + 2;
+// Of the PUBLISH of a buffered message, without topic alias
+size_t AsyncMqttClient::_offlinePacketSize(const AsyncMqttClientInternals::OfflineBuffer::Entry& entry) const {
+  uint8_t propertiesLength = AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, 0);
+  return AsyncMqttClientInternals::Codec::packetSize(AsyncMqttClientInternals::Codec::publishRemainingLength(entry.topicLength, entry.qos, propertiesLength, entry.length - entry.topicLength));
+}
+#endif
 
+#if ASYNC_MQTT_RATE_LIMITS
+bool AsyncMqttClient::_holdPublish(AsyncMqttClientInternals::TokenBucket* bucket, const AsyncMqttClientInternals::OutboundPacket& packet) {
+  SEMAPHORE_TAKE(false);
+  bool held = _rateLimiter.hold(bucket, packet);
+  SEMAPHORE_GIVE();
+  return held;
+}
+
+void AsyncMqttClient::_refundPublish(const char* topic) {
   SEMAPHORE_TAKE();
-  for (size_t i = 0; i < _toSendAcks.size(); i++) {
-    if (_client.space() < neededAckSpace) break;
+  _rateLimiter.giveBack(topic);
+  SEMAPHORE_GIVE();
+}
+#endif
 
-    AsyncMqttClientInternals::PendingAck pendingAck = _toSendAcks[i];
+#if ASYNC_MQTT_MULTITHREADED
+#if ASYNC_MQTT_RATE_LIMITS
+// The rate limits of a queued publish, with the lock held. Returns false if the packet was held back, its data then
+// belonging to the bucket, or rejected, its id released
+bool AsyncMqttClient::_admitQueued(AsyncMqttClientInternals::OutboundPacket* packet) {
+  // queued packets have their topic, never an alias, right after the remaining length
+  uint8_t offset = 1 + AsyncMqttClientInternals::Codec::remainingLengthSize(AsyncMqttClientInternals::Helpers::decodeRemainingLength(packet->data + 1));
+  uint16_t topicLength = static_cast<uint8_t>(packet->data[offset]) << 8 | static_cast<uint8_t>(packet->data[offset + 1]);
+  AsyncMqttClientInternals::TokenBucket* holder = nullptr;
+  AsyncMqttClientInternals::RateLimiter::Admission admission = _rateLimiter.admit(packet->data + offset + 2, topicLength, _millis(), true, &holder);
+  if (admission == AsyncMqttClientInternals::RateLimiter::Admission::ADMITTED) return true;
+  if (admission == AsyncMqttClientInternals::RateLimiter::Admission::HELD && _rateLimiter.hold(holder, *packet)) {
+    packet->data = nullptr;  // popped without being deleted
+  } else if (packet->ownsId) {
+    _packetIds.release(packet->packetId);
+  }
+  return false;
+}
+#endif
 
-    char fixedHeader[2];
-    fixedHeader[0] = pendingAck.packetType;
-    fixedHeader[0] = fixedHeader[0] << 4;
-    fixedHeader[0] = fixedHeader[0] | pendingAck.headerFlag;
-    fixedHeader[1] = 2;
+void AsyncMqttClient::_drainPublishQueue() {
+  // producers call this too, so the lock is never waited for: its holder drains the queue
+  while (_connected && (_urgentPending() || !_publishQueue.empty())) {
+    SEMAPHORE_TRY_TAKE();
+
+    bool blocked = false;
+    bool sent = false;
+    for (;;) {
+      // urgent publishes first, the order within each queue is kept
+#if ASYNC_MQTT_URGENT_PUBLISHES
+      AsyncMqttClientInternals::PublishQueue* queue = _urgentQueue.front() != nullptr ? &_urgentQueue : &_publishQueue;
+#else
+      AsyncMqttClientInternals::PublishQueue* queue = &_publishQueue;
+#endif
+      AsyncMqttClientInternals::OutboundPacket* packet = queue->front();
+      if (packet == nullptr) break;
+      if (_isSendingLargePayload || _transport->space() < packet->length || (packet->inFlight && _inFlightPublishes >= _serverReceiveMaximum)) {
+        blocked = true;  // resumed on the next TCP or MQTT ack
+        break;
+      }
+#if ASYNC_MQTT_RATE_LIMITS
+      if (queue == &_publishQueue && _rateLimiter.enabled() && !_admitQueued(packet)) {
+        queue->pop();
+        continue;
+      }
+#endif
+      if (packet->inFlight) _inFlightPublishes++;
+      if (packet->packetId != 0) _armAckTimer(packet->packetId, AsyncMqttClientAckType::PUBLISH);
+      _transport->add(packet->data, packet->length);
+      queue->pop();
+      sent = true;
+    }
+    if (sent) {
+      _transport->send();
+      _lastClientActivity = _millis();
+    }
 
-    char packetIdBytes[2];
-    packetIdBytes[0] = pendingAck.packetId >> 8;
-    packetIdBytes[1] = pendingAck.packetId & 0xFF;
+    SEMAPHORE_GIVE();
+    // a packet may have been pushed while we held the lock
+    if (blocked || !sent) return;
+  }
+}
+#endif
 
-    _client.add(fixedHeader, 2);
-    _client.add(packetIdBytes, 2);
-    _client.send();
+#if ASYNC_MQTT_STREAMED_PAYLOADS
+// Returns true while the payload is not fully sent
+bool AsyncMqttClient::_sendLargePayload() {
+  SEMAPHORE_TAKE(false);
+  if (_isSendingLargePayload && _transport->canSend()) {
+    // try to write as much as possible, but for the room the control packets waiting take, so that they go
+    // out as soon as the payload ends. Without more room than that, nothing is written until the next TCP ack or poll
+    size_t space = _transport->space();
+    size_t reserved = _controlSpace();
+    if (space <= reserved) {
+      SEMAPHORE_GIVE();
+      return true;
+    }
+    space -= reserved;
+    size_t remainingPayloadLength = _largePayloadLength - _largePayloadIndex;
+    if (remainingPayloadLength > space) remainingPayloadLength = space;
+    _largePayloadIndex += _transport->write(_largePayloadHandler(_largePayloadIndex), remainingPayloadLength);
+    if (_largePayloadIndex == _largePayloadLength) {
+      _isSendingLargePayload = false;
+    }
+    _lastClientActivity = _millis();
+  }
+  bool sending = _isSendingLargePayload;
+  SEMAPHORE_GIVE();
+  return sending;
+}
+#endif
+
+// Control packets: acks, PINGREQ and DISCONNECT. They are sent at every packet boundary, ahead of the
+// publishes, and a streamed payload does not start while they wait. Called with the lock held
+bool AsyncMqttClient::_controlPending() {
+  if (_urgentPending()) return true;
+  return !_toSendAcks.empty() || _pingDue || _disconnectOnPoll;
+}
+
+size_t AsyncMqttClient::_controlSpace() {
+  return _toSendAcks.size() * AsyncMqttClientInternals::Codec::ACK_SIZE +
+         (_pingDue ? AsyncMqttClientInternals::Codec::EMPTY_PACKET_SIZE : 0) +
+         (_disconnectOnPoll ? AsyncMqttClientInternals::Codec::EMPTY_PACKET_SIZE : 0);
+}
+
+void AsyncMqttClient::_setPingDue() {
+  SEMAPHORE_TAKE();
+  _pingDue = true;
+  SEMAPHORE_GIVE();
+}
+
+void AsyncMqttClient::_sendControlPackets() {
+  if (!_toSendAcks.empty()) _sendAcks();
+  if (_pingDue) _sendPing();
+  if (_disconnectOnPoll) _sendDisconnect();
+}
 
-    _toSendAcks.erase(_toSendAcks.begin() + i);
-    _toSendAcks.shrink_to_fit();
+bool AsyncMqttClient::_sendPing() {
+  char packet[AsyncMqttClientInternals::Codec::EMPTY_PACKET_SIZE];
+  AsyncMqttClientInternals::Codec::encodeEmptyPacket(packet, AsyncMqttClientInternals::PacketType.PINGREQ, AsyncMqttClientInternals::HeaderFlag.PINGREQ_RESERVED);
+
+  SEMAPHORE_TAKE(false);
+  if (_isSendingLargePayload || _transport->space() < sizeof(packet)) { SEMAPHORE_GIVE(); return false; }
+
+  _transport->add(packet, sizeof(packet));
+  _transport->send();
+  _lastClientActivity = _millis();
+  _lastPingRequestTime = _millis();
+  _pingDue = false;
+
+  SEMAPHORE_GIVE();
+  if (_onPingUserCallback) _onPingUserCallback(false);
+  return true;
+}
 
-    _lastClientActivity = millis();
+// Returns false when there is no room for it, the connection is then closed
+bool AsyncMqttClient::_queueAck(uint8_t packetType, uint8_t headerFlag, uint16_t packetId) {
+#if ASYNC_MQTT_FIXED_CAPACITY
+  if (_toSendAcks.full()) _sendAcks();
+  if (_toSendAcks.full()) {
+    _overflowed = true;
+    return false;
   }
+#endif
+  AsyncMqttClientInternals::PendingAck pendingAck;
+  pendingAck.packetType = packetType;
+  pendingAck.headerFlag = headerFlag;
+  pendingAck.packetId = packetId;
+  SEMAPHORE_TAKE(false);  // publish() checks it from other tasks
+  _toSendAcks.push_back(pendingAck);
+  SEMAPHORE_GIVE();
+  return true;
+}
+
+void AsyncMqttClient::_sendAcks() {
+  SEMAPHORE_TAKE();
+  // they cannot be interleaved with a streamed payload, they are sent once it is done
+  if (!_isSendingLargePayload) _addAcks();
   SEMAPHORE_GIVE();
 }
 
-bool AsyncMqttClient::_sendDisconnect() {
+// As many as fit, in as few writes as possible. Called with the lock held
+void AsyncMqttClient::_addAcks() {
+  size_t sent = 0;
+  while (sent < _toSendAcks.size()) {
+    char packets[16 * AsyncMqttClientInternals::Codec::ACK_SIZE];
+    size_t size = 0;
+    size_t space = _transport->space();
+    while (sent < _toSendAcks.size() && size + AsyncMqttClientInternals::Codec::ACK_SIZE <= sizeof(packets) && size + AsyncMqttClientInternals::Codec::ACK_SIZE <= space) {
+      const AsyncMqttClientInternals::PendingAck& pendingAck = _toSendAcks[sent++];
+      size += AsyncMqttClientInternals::Codec::encodeAck(packets + size, pendingAck.packetType, pendingAck.headerFlag, pendingAck.packetId);
+    }
+    if (size == 0) break;
+    _transport->add(packets, size);
+  }
+  if (sent > 0) {
+    _transport->send();
+    _toSendAcks.erase(_toSendAcks.begin(), _toSendAcks.begin() + sent);
+    _lastClientActivity = _millis();
+  }
+}
+
+// A publish written right away keeps the priority of the control packets: the acks waiting go first, if it fits
+// behind them, and urgent publishes still queued keep it waiting. A due PINGREQ goes out at the next poll, the
+// publish being activity enough. Called with the lock held
+bool AsyncMqttClient::_controlFirst(size_t neededSpace) {
+  if (_urgentPending()) return false;
+  if (_toSendAcks.empty()) return true;
+  if (_transport->space() < _toSendAcks.size() * AsyncMqttClientInternals::Codec::ACK_SIZE + neededSpace) return false;
+  _addAcks();
+  return true;
+}
+
+bool AsyncMqttClient::_sendDisconnect(uint8_t reasonCode) {
   if (!_connected) return true;
 
-  const uint8_t neededSpace = 2;
+  char packet[AsyncMqttClientInternals::Codec::MAX_DISCONNECT_SIZE];
+  uint8_t size = AsyncMqttClientInternals::Codec::encodeDisconnect(packet, _protocolVersion, reasonCode);
 
   SEMAPHORE_TAKE(false);
 
-  if (_client.space() < neededSpace) { SEMAPHORE_GIVE(); return false; }
+  if (_isSendingLargePayload || _transport->space() < size) { SEMAPHORE_GIVE(); return false; }
 
-  char fixedHeader[2];
-  fixedHeader[0] = AsyncMqttClientInternals::PacketType.DISCONNECT;
-  fixedHeader[0] = fixedHeader[0] << 4;
-  fixedHeader[0] = fixedHeader[0] | AsyncMqttClientInternals::HeaderFlag.DISCONNECT_RESERVED;
-  fixedHeader[1] = 0;
-
-  _client.add(fixedHeader, 2);
-  _client.send();
-  _client.close(true);
+  _transport->add(packet, size);
+  _transport->send();
+  _transport->close(true);
 
   _disconnectOnPoll = false;
 
@@ -728,33 +1626,189 @@ bool AsyncMqttClient::_sendDisconnect() {
   return true;
 }
 
+#if ASYNC_MQTT_ADDRESS_CACHE
+void AsyncMqttClient::_countConnection() {
+  SEMAPHORE_TAKE();
+  _connectStats.connections++;
+  if (_usedCache) _connectStats.cached++;
+  _connectStats.lastConnectMs = _millis() - _connectStart;
+  SEMAPHORE_GIVE();
+}
+
+// Ready once connected, with the subscriptions made while connecting and by the onConnect callback acknowledged
+void AsyncMqttClient::_trackReady(bool subAck) {
+  SEMAPHORE_TAKE();
+  bool ready;
+  if (subAck) {
+    ready = _readyPending > 0 && --_readyPending == 0 && !_readying;
+  } else {
+    _readying = false;
+    ready = _readyPending == 0;
+  }
+  if (ready) _connectStats.lastReadyMs = _millis() - _connectStart;
+  SEMAPHORE_GIVE();
+}
+#endif
+
+#if ASYNC_MQTT_PIPELINING
+// Writes between connect() and CONNECT go behind it, with setPipelinedConnect()
+bool AsyncMqttClient::_pipelineOpen() const {
+  return _pipelineSize > 0 && _lockMutiConnections;
+}
+#endif
+
+size_t AsyncMqttClient::_space() {
+#if ASYNC_MQTT_PIPELINING
+  return _connectSent ? _transport->space() : _pipelineSize - _pipeline.size();
+#else
+  return _transport->space();
+#endif
+}
+
+void AsyncMqttClient::_add(const char* data, size_t size) {
+#if ASYNC_MQTT_PIPELINING
+  if (!_connectSent) {
+    _pipeline.insert(_pipeline.end(), data, data + size);
+    return;
+  }
+#endif
+  _transport->add(data, size);
+}
+
+bool AsyncMqttClient::_secureFlag() const {
+#if ASYNC_MQTT_TLS
+  return _secure;
+#else
+  return false;
+#endif
+}
+
 uint16_t AsyncMqttClient::_getNextPacketId() {
-  ++_nextPacketId;
-  if (_nextPacketId == 0) ++_nextPacketId;  // 0 is forbidden
-  return _nextPacketId;
+  return _packetIds.allocate();  // 0 when every id waits for its acknowledgement
+}
+
+// A retransmission keeps the id of its original, still in use if the original was sent on this connection
+uint16_t AsyncMqttClient::_reservePacketId(uint16_t packetId) {
+  _packetIds.reserve(packetId);
+  return packetId;
+}
+
+uint32_t AsyncMqttClient::_millis() const {
+  return _clock ? _clock() : millis();
 }
 
 bool AsyncMqttClient::connected() const {
   return _connected;
 }
 
+#if ASYNC_MQTT_DEADLINES
+// Milliseconds until tick() has work to do, for a host loop or a light sleep scheduler to wake right then: 0 if it is
+// due, UINT32_MAX if nothing is scheduled. What waits for TCP space is not scheduled, it resumes on the TCP acks
+uint32_t AsyncMqttClient::nextDeadlineMs() {
+  if (!_connected) return UINT32_MAX;
+  uint32_t now = _millis();
+  uint32_t wait = UINT32_MAX;
+
+  // keep alive, from the last packet either way. A ping due already waits for TCP space
+  if (_keepAlive != 0 && _lastPingRequestTime != 0) {
+    wait = _until(now, _lastPingRequestTime + _keepAlive * 2000);
+  } else if (_keepAlive != 0 && !_pingDue) {
+    uint32_t lastActivity = static_cast<int32_t>(_lastClientActivity - _lastServerActivity) < 0 ? _lastClientActivity : _lastServerActivity;
+    wait = _until(now, lastActivity + _keepAlive * 700);
+  }
+
+  // held for a second by another task, which does the work meanwhile: the keep alive deadline rather than 0 and a
+  // busy loop, the polls of the transport still cover the rest
+  SEMAPHORE_TAKE(wait);
+  uint32_t deadline = 0;
+  (void)deadline;
+#if ASYNC_MQTT_RPC
+  if (_pendingRequests.nextDeadline(&deadline)) wait = std::min(wait, _until(now, deadline));
+#endif
+#if ASYNC_MQTT_ACK_TIMEOUTS
+  if (_ackTimers.nextDeadline(&deadline)) wait = std::min(wait, _until(now, deadline));
+#endif
+
+#if ASYNC_MQTT_RATE_LIMITS
+  // publishes held back by the rate limits, once their bucket has a token
+  for (size_t i = 0; i < _rateLimiter.size(); i++) {
+    AsyncMqttClientInternals::TokenBucket* bucket = &_rateLimiter[i];
+    AsyncMqttClientInternals::OutboundPacket* packet = bucket->front();
+    if (packet == nullptr) continue;
+    uint32_t tokenWait = bucket->wait(now);
+    if (tokenWait == 0 && (_isSendingLargePayload || _transport->space() < packet->length || (packet->inFlight && _inFlightPublishes >= _serverReceiveMaximum))) continue;
+    wait = std::min(wait, tokenWait);
+  }
+#if ASYNC_MQTT_COALESCING
+  // coalesced publishes waiting for the tokens of their topic
+  AsyncMqttClientInternals::CoalescedPublishes::Slot* slot = nullptr;
+  while (_rateLimiter.enabled() && (slot = _coalescedPublishes.next(slot)) != nullptr) {
+    uint32_t tokenWait = _rateLimiter.wait(slot->topic.c_str(), now);
+    if (tokenWait == 0 && (_isSendingLargePayload || _transport->space() < slot->packet.size())) continue;
+    wait = std::min(wait, tokenWait);
+  }
+#endif
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  // publishes buffered while offline, at the flush rate
+  const AsyncMqttClientInternals::OfflineBuffer::Entry* entry = _offlineBuffer.enabled() ? _offlineBuffer.next(now) : nullptr;
+  if (entry != nullptr) {
+    uint32_t tokenWait = _offlineFlushRate != 0 ? _offlineFlush.wait(now) : 0;
+    bool blocked = _isSendingLargePayload || _transport->space() < _offlinePacketSize(*entry) || (entry->qos != 0 && _inFlightPublishes >= _serverReceiveMaximum);
+    if (tokenWait != 0 || !blocked) wait = std::min(wait, tokenWait);
+  }
+#endif
+  SEMAPHORE_GIVE();
+  return wait;
+}
+
+// The time driven work the poll of the transport does, to be called when nextDeadlineMs() is over rather than
+// waiting for the next poll. It can be called from any task, on the clock of setClock()
+void AsyncMqttClient::tick() {
+  _onPoll();
+}
+
+uint32_t AsyncMqttClient::_until(uint32_t now, uint32_t deadline) const {
+  int32_t wait = static_cast<int32_t>(deadline - now);
+  return wait > 0 ? wait : 0;
+}
+#endif
+
 void AsyncMqttClient::connect() {
   if (_connected) return;
   if (_lockMutiConnections) return;
   _lockMutiConnections = true;
-#if ASYNC_TCP_SSL_ENABLED
-  if (_useIp) {
-    _client.connect(_ip, _port, _secure);
-  } else {
-    _client.connect(_host, _port, _secure);
-  }
-#else
+#if ASYNC_MQTT_ADDRESS_CACHE
+  _connectStart = _millis();
+  _usedCache = false;
+#endif
+#if ASYNC_MQTT_PIPELINING
+  if (_connectPacketStale) _encodeConnect();
+#endif
+#if ASYNC_MQTT_ADDRESS_CACHE || ASYNC_MQTT_PIPELINING
+  SEMAPHORE_TAKE();
+#if ASYNC_MQTT_PIPELINING
+  _pipeline.clear();  // left by a connection that failed
+#endif
+#if ASYNC_MQTT_ADDRESS_CACHE
+  _readying = true;
+  _readyPending = 0;
+#endif
+  SEMAPHORE_GIVE();
+#endif
+#if ASYNC_MQTT_TLS
+  _transport->setFingerprintVerification(_secureServerFingerprints.size() > 0);
+#endif
+  // a connection that could not be started is reported like one that failed
   if (_useIp) {
-    _client.connect(_ip, _port);
+    if (!_transport->connect(_ip, _port, _secureFlag())) _onDisconnect();
+#if ASYNC_MQTT_ADDRESS_CACHE
+  } else if (_addressCache.enabled()) {
+    _connectCached();
+#endif
   } else {
-    _client.connect(_host, _port);
+    if (!_transport->connect(_host, _port, _secureFlag())) _onDisconnect();
   }
-#endif
 }
 
 void AsyncMqttClient::disconnect(bool force) {
@@ -762,53 +1816,39 @@ void AsyncMqttClient::disconnect(bool force) {
   if (!_lockMutiConnections) return;
   _lockMutiConnections = false;
   if (force) {
-    _client.close(true);
+    _transport->close(true);
   } else {
-    _sendDisconnect();
-    _disconnectOnPoll = false;
+    // at the next packet boundary if it cannot be sent now
+    _disconnectOnPoll = !_sendDisconnect();
   }
 }
 
 uint16_t AsyncMqttClient::subscribe(const char* topic, uint8_t qos) {
-  if (!_connected) return 0;
-
-  char fixedHeader[5];
-  fixedHeader[0] = AsyncMqttClientInternals::PacketType.SUBSCRIBE;
-  fixedHeader[0] = fixedHeader[0] << 4;
-  fixedHeader[0] = fixedHeader[0] | AsyncMqttClientInternals::HeaderFlag.SUBSCRIBE_RESERVED;
+  if (!_connected && !_pipelineOpen()) return 0;
 
   uint16_t topicLength = strlen(topic);
-  char topicLengthBytes[2];
-  topicLengthBytes[0] = topicLength >> 8;
-  topicLengthBytes[1] = topicLength & 0xFF;
-
-  char qosByte[1];
-  qosByte[0] = qos;
-
-  uint8_t remainingLengthLength = AsyncMqttClientInternals::Helpers::encodeRemainingLength(2 + 2 + topicLength + 1, fixedHeader + 1);
+#if !ASYNC_MQTT_QOS2
+  if (qos > 1) qos = 1;
+#endif
+  const char qosByte[] = { static_cast<char>(qos) };
 
-  size_t neededSpace = 0;
-  neededSpace += 1 + remainingLengthLength;
-  neededSpace += 2;
-  neededSpace += 2;
-  neededSpace += topicLength;
-  neededSpace += 1;
+  size_t neededSpace = AsyncMqttClientInternals::Codec::packetSize(AsyncMqttClientInternals::Codec::subscribeRemainingLength(_protocolVersion, topicLength));
 
   SEMAPHORE_TAKE(0);
-  if (_client.space() < neededSpace) { SEMAPHORE_GIVE(); return 0; }
+  if (_isSendingLargePayload || _space() < neededSpace) { SEMAPHORE_GIVE(); return 0; }
 
   uint16_t packetId = _getNextPacketId();
-  char packetIdBytes[2];
-  packetIdBytes[0] = packetId >> 8;
-  packetIdBytes[1] = packetId & 0xFF;
-
-  _client.add(fixedHeader, 1 + remainingLengthLength);
-  _client.add(packetIdBytes, 2);
-  _client.add(topicLengthBytes, 2);
-  _client.add(topic, topicLength);
-  _client.add(qosByte, 1);
-  _client.send();
-  _lastClientActivity = millis();
+  if (packetId == 0) { SEMAPHORE_GIVE(); return 0; }
+  char head[AsyncMqttClientInternals::Codec::MAX_SUBSCRIBE_HEAD_SIZE];
+  _add(head, AsyncMqttClientInternals::Codec::encodeSubscribeHead(head, AsyncMqttClientInternals::PacketType.SUBSCRIBE, _protocolVersion, packetId, topicLength));
+  _add(topic, topicLength);
+  _add(qosByte, 1);
+  _armAckTimer(packetId, AsyncMqttClientAckType::SUBSCRIBE);
+  if (_connectSent) _transport->send();
+  _lastClientActivity = _millis();
+#if ASYNC_MQTT_ADDRESS_CACHE
+  if (_readying) _readyPending++;
+#endif
 
   SEMAPHORE_GIVE();
   return packetId;
@@ -817,105 +1857,234 @@ uint16_t AsyncMqttClient::subscribe(const char* topic, uint8_t qos) {
 uint16_t AsyncMqttClient::unsubscribe(const char* topic) {
   if (!_connected) return 0;
 
-  char fixedHeader[5];
-  fixedHeader[0] = AsyncMqttClientInternals::PacketType.UNSUBSCRIBE;
-  fixedHeader[0] = fixedHeader[0] << 4;
-  fixedHeader[0] = fixedHeader[0] | AsyncMqttClientInternals::HeaderFlag.UNSUBSCRIBE_RESERVED;
-
   uint16_t topicLength = strlen(topic);
-  char topicLengthBytes[2];
-  topicLengthBytes[0] = topicLength >> 8;
-  topicLengthBytes[1] = topicLength & 0xFF;
-
-  uint8_t remainingLengthLength = AsyncMqttClientInternals::Helpers::encodeRemainingLength(2 + 2 + topicLength, fixedHeader + 1);
 
-  size_t neededSpace = 0;
-  neededSpace += 1 + remainingLengthLength;
-  neededSpace += 2;
-  neededSpace += 2;
-  neededSpace += topicLength;
+  size_t neededSpace = AsyncMqttClientInternals::Codec::packetSize(AsyncMqttClientInternals::Codec::unsubscribeRemainingLength(_protocolVersion, topicLength));
 
   SEMAPHORE_TAKE(0);
-  if (_client.space() < neededSpace) { SEMAPHORE_GIVE(); return 0; }
+  if (_isSendingLargePayload || _transport->space() < neededSpace) { SEMAPHORE_GIVE(); return 0; }
 
   uint16_t packetId = _getNextPacketId();
-  char packetIdBytes[2];
-  packetIdBytes[0] = packetId >> 8;
-  packetIdBytes[1] = packetId & 0xFF;
-
-  _client.add(fixedHeader, 1 + remainingLengthLength);
-  _client.add(packetIdBytes, 2);
-  _client.add(topicLengthBytes, 2);
-  _client.add(topic, topicLength);
-  _client.send();
-  _lastClientActivity = millis();
+  if (packetId == 0) { SEMAPHORE_GIVE(); return 0; }
+  char head[AsyncMqttClientInternals::Codec::MAX_SUBSCRIBE_HEAD_SIZE];
+  _transport->add(head, AsyncMqttClientInternals::Codec::encodeSubscribeHead(head, AsyncMqttClientInternals::PacketType.UNSUBSCRIBE, _protocolVersion, packetId, topicLength));
+  _transport->add(topic, topicLength);
+  _armAckTimer(packetId, AsyncMqttClientAckType::UNSUBSCRIBE);
+  _transport->send();
+  _lastClientActivity = _millis();
 
   SEMAPHORE_GIVE();
   return packetId;
 }
 
 uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, bool dup, uint16_t message_id) {
-  if (!_connected) return 0;
+  return _publish(topic, qos, retain, payload, length, dup, message_id, false);
+}
 
-  char fixedHeader[5];
-  fixedHeader[0] = AsyncMqttClientInternals::PacketType.PUBLISH;
-  fixedHeader[0] = fixedHeader[0] << 4;
-  if (dup) fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_DUP;
-  if (retain) fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_RETAIN;
-  switch (qos) {
-    case 0:
-      fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_QOS0;
-      break;
-    case 1:
-      fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_QOS1;
-      break;
-    case 2:
-      fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_QOS2;
-      break;
-  }
+#if ASYNC_MQTT_MULTITHREADED && ASYNC_MQTT_URGENT_PUBLISHES
+// Queued in a lane of its own, sent ahead of the other publishes and of streamed payloads. Returns 0 if that queue is full
+uint16_t AsyncMqttClient::publishUrgent(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+  return _publish(topic, qos, retain, payload, length, false, 0, true);
+}
+#endif
+
+// With `packet`, the payload is in it with room before it for the header, as publish() with a writer leaves. Sent
+// right away, the packet is then written in one piece
+uint16_t AsyncMqttClient::_publish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, bool dup, uint16_t message_id, bool urgent, char* packet) {
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  if (!_connected && !_pipelineOpen()) return _offlineBuffer.enabled() && !dup ? _bufferOffline(topic, qos, retain, payload, length, 0, 0) : 0;
+#else
+  if (!_connected && !_pipelineOpen()) return 0;
+#endif
+#if !ASYNC_MQTT_QOS2
+  if (qos > 1) return 0;
+#endif
+  // while connecting, written behind CONNECT without being coalesced, queued or held
+  bool pipelined = !_connected;
+
+#if ASYNC_MQTT_COALESCING
+  // last value wins, the rate limits then apply when the slot is sent
+  if (qos == 0 && !urgent && !pipelined && _coalescedPublishes.enabled() && _coalescedPublishes.matches(topic)) return _publishCoalesced(topic, retain, payload, length);
+#endif
 
   uint16_t topicLength = strlen(topic);
-  char topicLengthBytes[2];
-  topicLengthBytes[0] = topicLength >> 8;
-  topicLengthBytes[1] = topicLength & 0xFF;
 
-  uint32_t payloadLength = length;
-  if (payload != nullptr && payloadLength == 0) payloadLength = strlen(payload);
+  bool queued = false;
+#if ASYNC_MQTT_RATE_LIMITS
+  // rate limits, which urgent publishes bypass. A publish held back is serialised like a queued one
+  bool rateLimited = _rateLimiter.enabled() && !urgent;
+#if ASYNC_MQTT_MULTITHREADED
+  // with a publish queue, they apply as it drains: the producer never waits for the lock
+  if (!pipelined && _publishQueue.capacity() > 0) rateLimited = false;
+#endif
+  AsyncMqttClientInternals::TokenBucket* holder = nullptr;
+  if (rateLimited) {
+    SEMAPHORE_TAKE(0);
+    AsyncMqttClientInternals::RateLimiter::Admission admission = _rateLimiter.admit(topic, _millis(), !pipelined, &holder);
+    SEMAPHORE_GIVE();
+    if (admission == AsyncMqttClientInternals::RateLimiter::Admission::REJECTED) return 0;
+  }
+  queued = holder != nullptr;
+#endif
+
+#if ASYNC_MQTT_MULTITHREADED
+#if ASYNC_MQTT_URGENT_PUBLISHES
+  AsyncMqttClientInternals::PublishQueue* queue = urgent ? &_urgentQueue : &_publishQueue;
+#else
+  AsyncMqttClientInternals::PublishQueue* queue = &_publishQueue;
+#endif
+  queued = !pipelined && (queued || urgent || _publishQueue.capacity() > 0);
+#endif
 
-  uint32_t remainingLength = 2 + topicLength + payloadLength;
-  if (qos != 0) remainingLength += 2;
-  uint8_t remainingLengthLength = AsyncMqttClientInternals::Helpers::encodeRemainingLength(remainingLength, fixedHeader + 1);
+  uint32_t payloadLength = 0;
+  if (payload != nullptr) payloadLength = length > 0 ? length : strlen(payload);
+
+  // the topic in full, as queued and held packets have it: the alias table belongs to the lock holder
+  uint16_t topicAlias = 0;
+  bool topicAliasKnown = false;
+  uint16_t sentTopicLength = topicLength;
+  uint8_t propertiesLength = AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, topicAlias);
+  uint32_t remainingLength = AsyncMqttClientInternals::Codec::publishRemainingLength(sentTopicLength, qos, propertiesLength, payloadLength);
+  size_t neededSpace = AsyncMqttClientInternals::Codec::packetSize(remainingLength);
+  uint8_t fixedHeader = AsyncMqttClientInternals::Codec::publishFixedHeader(qos, retain, dup);
+
+  // a retransmission reuses the in-flight slot of the original message
+  bool inFlight = qos != 0 && !(dup && message_id > 0);
+
+#if ASYNC_MQTT_MULTITHREADED || ASYNC_MQTT_RATE_LIMITS
+  // serialise the packet and leave the writing to whoever holds the lock, the producer never waits for it
+  if (queued) {
+    if (_serverMaximumPacketSize != 0 && neededSpace > _serverMaximumPacketSize) {
+#if ASYNC_MQTT_RATE_LIMITS
+      if (rateLimited && holder == nullptr) _refundPublish(topic);
+#endif
+      return 0;
+    }
 
-  size_t neededSpace = 0;
-  neededSpace += 1 + remainingLengthLength;
-  neededSpace += 2;
-  neededSpace += topicLength;
-  if (qos != 0) neededSpace += 2;
-  if (payload != nullptr) neededSpace += payloadLength;
+    uint16_t packetId = 0;
+    // a retransmission only gives back the id if it was not in use already
+    bool ownsId = false;
+    if (qos != 0 && dup && message_id > 0) {
+      packetId = message_id;
+      ownsId = _packetIds.reserve(message_id);
+    } else if (qos != 0) {
+      packetId = _getNextPacketId();
+      ownsId = true;
+    }
+    if (qos != 0 && packetId == 0) {
+#if ASYNC_MQTT_RATE_LIMITS
+      if (rateLimited && holder == nullptr) _refundPublish(topic);
+#endif
+      return 0;
+    }
+
+    AsyncMqttClientInternals::OutboundPacket packet;
+    packet.length = neededSpace;
+    packet.inFlight = inFlight;
+    packet.packetId = packetId;
+    packet.ownsId = ownsId;
+    packet.data = new char[packet.length];
+    char* position = packet.data;
+    position += AsyncMqttClientInternals::Codec::encodePublishHead(position, fixedHeader, remainingLength, sentTopicLength);
+    memcpy(position, topic, sentTopicLength);
+    position += sentTopicLength;
+    position += AsyncMqttClientInternals::Codec::encodePublishTail(position, qos, packetId, _protocolVersion, topicAlias);
+    if (payload != nullptr) memcpy(position, payload, payloadLength);
+
+#if ASYNC_MQTT_MULTITHREADED && ASYNC_MQTT_RATE_LIMITS
+    bool pushed = holder != nullptr ? _holdPublish(holder, packet) : queue->push(packet);
+#elif ASYNC_MQTT_MULTITHREADED
+    bool pushed = queue->push(packet);
+#else
+    bool pushed = _holdPublish(holder, packet);
+#endif
+    if (!pushed) {
+      delete[] packet.data;
+      if (ownsId) _packetIds.release(packetId);
+#if ASYNC_MQTT_RATE_LIMITS
+      if (rateLimited && holder == nullptr) _refundPublish(topic);
+#endif
+      return 0;
+    }
+#if ASYNC_MQTT_MULTITHREADED
+    _drainPublishQueue();
+#endif
+
+    if (qos != 0) {
+      return packetId;
+    } else {
+      return 1;
+    }
+  }
+#endif
+
+#if ASYNC_MQTT_MULTITHREADED
+  _drainPublishQueue();  // the urgent publishes first
+#endif
 
   SEMAPHORE_TAKE(0);
-  if (_client.space() < neededSpace) { SEMAPHORE_GIVE(); return 0; }
+  // MQTT 5 properties, the topic is replaced by its alias once the broker knows it. The topic alias maximum of the
+  // server is only known once connected
+  if (_protocolVersion == AsyncMqttClientInternals::ProtocolVersion.V5 && !pipelined) {
+    topicAlias = _outboundTopicAliases.lookup(topic, topicLength, &topicAliasKnown);
+    if (topicAliasKnown) sentTopicLength = 0;
+    propertiesLength = AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, topicAlias);
+    remainingLength = AsyncMqttClientInternals::Codec::publishRemainingLength(sentTopicLength, qos, propertiesLength, payloadLength);
+    neededSpace = AsyncMqttClientInternals::Codec::packetSize(remainingLength);
+  }
+  if (_serverMaximumPacketSize != 0 && neededSpace > _serverMaximumPacketSize) {
+#if ASYNC_MQTT_RATE_LIMITS
+    if (rateLimited) _rateLimiter.giveBack(topic);
+#endif
+    SEMAPHORE_GIVE();
+    return 0;
+  }
+  // the receive maximum of the server is only known once connected
+  if (_isSendingLargePayload || _space() < neededSpace || (inFlight && !pipelined && _inFlightPublishes >= _serverReceiveMaximum) || (!pipelined && !_controlFirst(neededSpace))) {
+#if ASYNC_MQTT_RATE_LIMITS
+    if (rateLimited) _rateLimiter.giveBack(topic);  // its tokens go to the retry
+#endif
+    SEMAPHORE_GIVE();
+    return 0;
+  }
 
   uint16_t packetId = 0;
-  char packetIdBytes[2];
   if (qos != 0) {
     if (dup && message_id > 0) {
-      packetId = message_id;
+      packetId = _reservePacketId(message_id);
     } else {
       packetId = _getNextPacketId();
     }
-
-    packetIdBytes[0] = packetId >> 8;
-    packetIdBytes[1] = packetId & 0xFF;
+    if (packetId == 0) {
+#if ASYNC_MQTT_RATE_LIMITS
+      if (rateLimited) _rateLimiter.giveBack(topic);
+#endif
+      SEMAPHORE_GIVE();
+      return 0;
+    }
   }
-
-  _client.add(fixedHeader, 1 + remainingLengthLength);
-  _client.add(topicLengthBytes, 2);
-  _client.add(topic, topicLength);
-  if (qos != 0) _client.add(packetIdBytes, 2);
-  if (payload != nullptr) _client.add(payload, payloadLength);
-  _client.send();
-  _lastClientActivity = millis();
+  if (inFlight) _inFlightPublishes++;
+  if (topicAlias != 0) _outboundTopicAliases.commit(topicAlias, topicAliasKnown, topic, topicLength);
+
+  size_t headerSize = neededSpace - payloadLength;
+  if (packet != nullptr && payload != nullptr && static_cast<size_t>(payload - packet) >= headerSize) {
+    char* start = packet + (payload - packet) - headerSize;
+    char* position = start + AsyncMqttClientInternals::Codec::encodePublishHead(start, fixedHeader, remainingLength, sentTopicLength);
+    memcpy(position, topic, sentTopicLength);
+    AsyncMqttClientInternals::Codec::encodePublishTail(position + sentTopicLength, qos, packetId, _protocolVersion, topicAlias);
+    _add(start, neededSpace);
+  } else {
+    char head[AsyncMqttClientInternals::Codec::MAX_PUBLISH_HEAD_SIZE];
+    char tail[AsyncMqttClientInternals::Codec::MAX_PUBLISH_TAIL_SIZE];
+    uint8_t tailLength = AsyncMqttClientInternals::Codec::encodePublishTail(tail, qos, packetId, _protocolVersion, topicAlias);
+    _add(head, AsyncMqttClientInternals::Codec::encodePublishHead(head, fixedHeader, remainingLength, sentTopicLength));
+    _add(topic, sentTopicLength);
+    if (tailLength > 0) _add(tail, tailLength);
+    if (payload != nullptr) _add(payload, payloadLength);
+  }
+  if (packetId != 0) _armAckTimer(packetId, AsyncMqttClientAckType::PUBLISH);
+  if (_connectSent) _transport->send();
+  _lastClientActivity = _millis();
 
   SEMAPHORE_GIVE();
   if (qos != 0) {
@@ -925,64 +2094,237 @@ uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, c
   }
 }
 
-uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, AsyncMqttClientInternals::PayloadHandler handler, size_t length, bool dup, uint16_t message_id) {
-  if (!_connected) return 0;
+#if ASYNC_MQTT_PAYLOAD_WRITER
+// The payload is serialised by `writer` into the packet, behind the room left for its header, the largest with a
+// topic alias. The remaining length is only known then: the header is written at the end of that room, in its shortest
+// form, and the packet sent from there in one piece. Written right away, the packet is built in the send buffer of the
+// transport if it can reserve it, otherwise in the writer buffer and added by the same path as publish(). A publish the
+// rate limits, the coalesced topics, the publish queue or the offline buffer take is handed to them as publish() would
+// be. Returns 0 if the payload did not fit
+uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, AsyncMqttClientInternals::PayloadWriter writer) {
+#if !ASYNC_MQTT_QOS2
+  if (qos > 1) return 0;
+#endif
+  uint16_t topicLength = strlen(topic);
+  uint8_t propertiesLength = AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, 1);
+  size_t payloadStart = AsyncMqttClientInternals::Codec::MAX_PUBLISH_HEAD_SIZE + topicLength + (qos != 0 ? 2 : 0) + propertiesLength;
+  if (_writerBuffer.size() < payloadStart) return 0;
 
-  char fixedHeader[5];
-  fixedHeader[0] = AsyncMqttClientInternals::PacketType.PUBLISH;
-  fixedHeader[0] = fixedHeader[0] << 4;
-  if (dup) fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_DUP;
-  if (retain) fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_RETAIN;
-  switch (qos) {
-    case 0:
-      fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_QOS0;
-      break;
-    case 1:
-      fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_QOS1;
-      break;
-    case 2:
-      fixedHeader[0] |= AsyncMqttClientInternals::HeaderFlag.PUBLISH_QOS2;
-      break;
+  uint16_t result = 0;
+  if (_publishInPlace(topic, topicLength, qos, retain, writer, _writerBuffer.size() - payloadStart, &result)) return result;
+
+#if ASYNC_MQTT_MULTITHREADED
+  std::lock_guard<std::mutex> lock(_writerMutex);
+#endif
+  char* packet = _writerBuffer.data();
+  AsyncMqttClientWriter payload(packet + payloadStart, _writerBuffer.size() - payloadStart);
+  writer(payload);
+  if (payload.failed()) return 0;
+  return _publish(topic, qos, retain, payload.length() > 0 ? payload.data() : nullptr, payload.length(), false, 0, false, packet);
+}
+
+// The packet written right away, with `writer` called under the lock into the send buffer the transport reserves, at
+// most `capacity` bytes of payload. Returns false, without calling it, if the publish takes another path
+bool AsyncMqttClient::_publishInPlace(const char* topic, uint16_t topicLength, uint8_t qos, bool retain, AsyncMqttClientInternals::PayloadWriter& writer, size_t capacity, uint16_t* result) {
+  if (!_connected) return false;
+#if ASYNC_MQTT_COALESCING
+  if (qos == 0 && _coalescedPublishes.enabled() && _coalescedPublishes.matches(topic)) return false;
+#endif
+#if ASYNC_MQTT_RATE_LIMITS
+  if (_rateLimiter.enabled()) return false;
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+  if (_publishQueue.capacity() > 0) return false;
+  _drainPublishQueue();  // the urgent publishes first
+#endif
+
+  SEMAPHORE_TAKE(false);
+  if (!_connected || _isSendingLargePayload || (qos != 0 && _inFlightPublishes >= _serverReceiveMaximum) || !_controlFirst(0)) {
+    SEMAPHORE_GIVE();
+    return false;
   }
 
+  uint16_t packetId = 0;
+  if (qos != 0) {
+    packetId = _getNextPacketId();
+    if (packetId == 0) {
+      SEMAPHORE_GIVE();
+      *result = 0;
+      return true;
+    }
+  }
+  uint16_t topicAlias = 0;
+  bool topicAliasKnown = false;
+  uint16_t sentTopicLength = topicLength;
+  if (_protocolVersion == AsyncMqttClientInternals::ProtocolVersion.V5) {
+    topicAlias = _outboundTopicAliases.lookup(topic, topicLength, &topicAliasKnown);
+    if (topicAliasKnown) sentTopicLength = 0;
+  }
+  char tail[AsyncMqttClientInternals::Codec::MAX_PUBLISH_TAIL_SIZE];
+  uint8_t tailLength = AsyncMqttClientInternals::Codec::encodePublishTail(tail, qos, packetId, _protocolVersion, topicAlias);
+  size_t room = AsyncMqttClientInternals::Codec::MAX_PUBLISH_HEAD_SIZE + sentTopicLength + tailLength;
+
+  size_t space = _transport->space();
+  char* region = space > room ? _transport->reserve(std::min(space, room + capacity)) : nullptr;
+  if (region == nullptr) {
+    if (packetId != 0) _packetIds.release(packetId);
+    SEMAPHORE_GIVE();
+    return false;
+  }
+
+  AsyncMqttClientWriter payload(region + room, std::min(space, room + capacity) - room);
+  writer(payload);
+  uint8_t propertiesLength = AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, topicAlias);
+  uint32_t remainingLength = AsyncMqttClientInternals::Codec::publishRemainingLength(sentTopicLength, qos, propertiesLength, payload.length());
+  size_t neededSpace = AsyncMqttClientInternals::Codec::packetSize(remainingLength);
+  if (payload.failed() || (_serverMaximumPacketSize != 0 && neededSpace > _serverMaximumPacketSize)) {
+    _transport->commit(0, 0);
+    if (packetId != 0) _packetIds.release(packetId);
+    SEMAPHORE_GIVE();
+    *result = 0;
+    return true;
+  }
+
+  size_t headerSize = neededSpace - payload.length();
+  char* position = region + room - headerSize;
+  position += AsyncMqttClientInternals::Codec::encodePublishHead(position, AsyncMqttClientInternals::Codec::publishFixedHeader(qos, retain, false), remainingLength, sentTopicLength);
+  memcpy(position, topic, sentTopicLength);
+  memcpy(position + sentTopicLength, tail, tailLength);
+  _transport->commit(room - headerSize, neededSpace);
+
+  if (qos != 0) _inFlightPublishes++;
+  if (topicAlias != 0) _outboundTopicAliases.commit(topicAlias, topicAliasKnown, topic, topicLength);
+  if (packetId != 0) _armAckTimer(packetId, AsyncMqttClientAckType::PUBLISH);
+  _transport->send();
+  _lastClientActivity = _millis();
+
+  SEMAPHORE_GIVE();
+  *result = qos != 0 ? packetId : 1;
+  return true;
+}
+#endif
+
+#if ASYNC_MQTT_OFFLINE_BUFFER
+// While offline, buffered with a time to live (0 for none) and a priority, the highest sent first and evicted last.
+// Published as publish() does once connected. Returns 1 once buffered
+uint16_t AsyncMqttClient::publishBuffered(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, uint32_t ttlMs, uint8_t priority) {
+  if (_connected || _pipelineOpen() || !_offlineBuffer.enabled()) return _publish(topic, qos, retain, payload, length, false, 0, false);
+  return _bufferOffline(topic, qos, retain, payload, length, ttlMs, priority);
+}
+
+uint16_t AsyncMqttClient::_bufferOffline(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, uint32_t ttlMs, uint8_t priority) {
+#if !ASYNC_MQTT_QOS2
+  if (qos > 1) return 0;
+#endif
+  size_t payloadLength = 0;
+  if (payload != nullptr) payloadLength = length > 0 ? length : strlen(payload);
+
+  SEMAPHORE_TAKE(0);
+  bool buffered = _offlineBuffer.push(topic, strlen(topic), payload, payloadLength, qos, retain, _millis(), ttlMs, priority);
+  SEMAPHORE_GIVE();
+  return buffered ? 1 : 0;
+}
+#endif
+
+#if ASYNC_MQTT_COALESCING
+// Serialised into the slot of its topic, without topic alias, then sent if nothing is in the way
+uint16_t AsyncMqttClient::_publishCoalesced(const char* topic, bool retain, const char* payload, size_t length) {
   uint16_t topicLength = strlen(topic);
-  char topicLengthBytes[2];
-  topicLengthBytes[0] = topicLength >> 8;
-  topicLengthBytes[1] = topicLength & 0xFF;
+  uint32_t payloadLength = 0;
+  if (payload != nullptr) payloadLength = length > 0 ? length : strlen(payload);
 
-  _largePayloadLength = length;
-  uint32_t remainingLength = 2 + topicLength + _largePayloadLength;
-  if (qos != 0) remainingLength += 2;
-  uint8_t remainingLengthLength = AsyncMqttClientInternals::Helpers::encodeRemainingLength(remainingLength, fixedHeader + 1);
+  uint8_t propertiesLength = AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, 0);
+  uint32_t remainingLength = AsyncMqttClientInternals::Codec::publishRemainingLength(topicLength, 0, propertiesLength, payloadLength);
+  size_t neededSpace = AsyncMqttClientInternals::Codec::packetSize(remainingLength);
+  if (_serverMaximumPacketSize != 0 && neededSpace > _serverMaximumPacketSize) return 0;
+
+  SEMAPHORE_TAKE(0);
+  char* position = _coalescedPublishes.store(topic, topicLength, neededSpace);
+  if (position == nullptr) { SEMAPHORE_GIVE(); return 0; }
+  position += AsyncMqttClientInternals::Codec::encodePublishHead(position, AsyncMqttClientInternals::Codec::publishFixedHeader(0, retain, false), remainingLength, topicLength);
+  memcpy(position, topic, topicLength);
+  position += topicLength;
+  position += AsyncMqttClientInternals::Codec::encodePublishTail(position, 0, 0, _protocolVersion, 0);
+  if (payload != nullptr) memcpy(position, payload, payloadLength);
+  SEMAPHORE_GIVE();
+
+  _sendCoalesced();
+  return 1;
+}
+#endif
+
+#if ASYNC_MQTT_STREAMED_PAYLOADS
+uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, AsyncMqttClientInternals::PayloadHandler handler, size_t length, bool dup, uint16_t message_id) {
+  if (!_connected) return 0;
+#if !ASYNC_MQTT_QOS2
+  if (qos > 1) return 0;
+#endif
+
+  uint16_t topicLength = strlen(topic);
+
+  // a retransmission reuses the in-flight slot of the original message
+  bool inFlight = qos != 0 && !(dup && message_id > 0);
+
+#if ASYNC_MQTT_MULTITHREADED
+  _drainPublishQueue();
+#endif
 
   SEMAPHORE_TAKE(0);
+  // MQTT 5 properties, the topic is replaced by its alias once the broker knows it. The alias table belongs to the
+  // lock holder
+  uint16_t topicAlias = 0;
+  bool topicAliasKnown = false;
+  if (_protocolVersion == AsyncMqttClientInternals::ProtocolVersion.V5) topicAlias = _outboundTopicAliases.lookup(topic, topicLength, &topicAliasKnown);
+  uint16_t sentTopicLength = topicAliasKnown ? 0 : topicLength;
+
+  uint8_t propertiesLength = AsyncMqttClientInternals::Codec::publishPropertiesLength(_protocolVersion, topicAlias);
+  uint32_t remainingLength = AsyncMqttClientInternals::Codec::publishRemainingLength(sentTopicLength, qos, propertiesLength, length);
+  if (_serverMaximumPacketSize != 0 && AsyncMqttClientInternals::Codec::packetSize(remainingLength) > _serverMaximumPacketSize) { SEMAPHORE_GIVE(); return 0; }
+  // all that comes before the payload, which is added at once
+  size_t headerSize = AsyncMqttClientInternals::Codec::packetSize(remainingLength) - length;
+
+  // only one payload can be streamed at a time, and not ahead of control packets
+  if (_isSendingLargePayload || _controlPending() || _transport->space() < headerSize) { SEMAPHORE_GIVE(); return 0; }
+  if (inFlight && _inFlightPublishes >= _serverReceiveMaximum) { SEMAPHORE_GIVE(); return 0; }
+#if ASYNC_MQTT_RATE_LIMITS
+  // a streamed payload cannot be held back by the rate limits
+  AsyncMqttClientInternals::TokenBucket* holder = nullptr;
+  if (_rateLimiter.enabled() && _rateLimiter.admit(topic, _millis(), false, &holder) == AsyncMqttClientInternals::RateLimiter::Admission::REJECTED) { SEMAPHORE_GIVE(); return 0; }
+#endif
 
   uint16_t packetId = 0;
-  char packetIdBytes[2];
   if (qos != 0) {
     if (dup && message_id > 0) {
-      packetId = message_id;
+      packetId = _reservePacketId(message_id);
     } else {
       packetId = _getNextPacketId();
     }
-
-    packetIdBytes[0] = packetId >> 8;
-    packetIdBytes[1] = packetId & 0xFF;
+    if (packetId == 0) {
+#if ASYNC_MQTT_RATE_LIMITS
+      if (_rateLimiter.enabled()) _rateLimiter.giveBack(topic);
+#endif
+      SEMAPHORE_GIVE();
+      return 0;
+    }
   }
+  if (inFlight) _inFlightPublishes++;
+  if (topicAlias != 0) _outboundTopicAliases.commit(topicAlias, topicAliasKnown, topic, topicLength);
 
-  size_t written = _client.add(fixedHeader, 1 + remainingLengthLength);
-  written += _client.add(topicLengthBytes, 2);
-  written += _client.add(topic, topicLength);
-  if (qos != 0) {
-    written += _client.add(packetIdBytes, 2);
-  }
+  char head[AsyncMqttClientInternals::Codec::MAX_PUBLISH_HEAD_SIZE];
+  char tail[AsyncMqttClientInternals::Codec::MAX_PUBLISH_TAIL_SIZE];
+  uint8_t tailLength = AsyncMqttClientInternals::Codec::encodePublishTail(tail, qos, packetId, _protocolVersion, topicAlias);
+  _transport->add(head, AsyncMqttClientInternals::Codec::encodePublishHead(head, AsyncMqttClientInternals::Codec::publishFixedHeader(qos, retain, dup), remainingLength, sentTopicLength));
+  _transport->add(topic, sentTopicLength);
+  if (tailLength > 0) _transport->add(tail, tailLength);
+  if (packetId != 0) _armAckTimer(packetId, AsyncMqttClientAckType::PUBLISH);
 
+  _largePayloadLength = length;
   _largePayloadHandler = handler;
-  // try to write as much as possible
-  _largePayloadIndex = _client.add(_largePayloadHandler(_largePayloadIndex), _largePayloadLength);
-  _client.send();
-  _isSendingLargePayload = true;
-  _lastClientActivity = millis();
+  // try to write as much as possible, the rest is sent as TCP space is freed
+  _largePayloadIndex = _transport->add(_largePayloadHandler(0), _largePayloadLength);
+  _isSendingLargePayload = _largePayloadIndex < _largePayloadLength;
+  _transport->send();
+  _lastClientActivity = _millis();
 
   SEMAPHORE_GIVE();
   if (qos != 0) {
@@ -991,7 +2333,115 @@ uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, A
     return 1;
   }
 }
+#endif
+
+#if ASYNC_MQTT_RPC
+// Publishes to `topic`/<request id>, the responder answers on the response topic of setRpc()/<request id>.
+// Returns the request id, or 0 if no slot is free or the request could not be published.
+// `callback` gets the fragments of the response, or the TIMEOUT or DISCONNECTED status, and is not called after that
+uint16_t AsyncMqttClient::request(const char* topic, const char* payload, size_t length, uint32_t timeoutMs, AsyncMqttClientInternals::OnResponseUserCallback callback, uint8_t qos) {
+  if (!_connected || !_pendingRequests.enabled()) return 0;
+  char requestTopic[ASYNC_MQTT_MAX_TOPIC_LENGTH + 1];
+  if (strlen(topic) + 1 + 5 >= sizeof(requestTopic)) return 0;
+
+  SEMAPHORE_TAKE(0);
+  uint16_t requestId = _pendingRequests.add(callback, _millis() + timeoutMs);
+  SEMAPHORE_GIVE();
+  if (requestId == 0) return 0;
+
+  snprintf(requestTopic, sizeof(requestTopic), "%s/%u", topic, static_cast<unsigned>(requestId));
+  if (publish(requestTopic, qos, false, payload, length) == 0) {
+    SEMAPHORE_TAKE(0);
+    _pendingRequests.remove(_pendingRequests.find(requestId));
+    SEMAPHORE_GIVE();
+    return 0;
+  }
+  return requestId;
+}
+#endif
+
+void AsyncMqttClient::releaseInbound(size_t length) {
+  SEMAPHORE_TAKE();
+  _inboundHeld = length < _inboundHeld ? _inboundHeld - length : 0;
+  if (_inboundHeld <= _inboundBudget && _inboundUnacked > 0) {
+    _transport->ack(_inboundUnacked);
+    _inboundUnacked = 0;
+  }
+  SEMAPHORE_GIVE();
+}
 
 const char* AsyncMqttClient::getClientId() {
   return _clientId;
 }
+
+#if ASYNC_MQTT_MESSAGE_CACHE
+// Copies up to `size` bytes of the last payload received on `topic` and sets its full length. Returns false if not cached
+bool AsyncMqttClient::getCachedMessage(const char* topic, char* payload, size_t size, size_t* length) {
+  SEMAPHORE_TAKE(false);
+  bool cached = _messageCache.get(topic, payload, size, length);
+  SEMAPHORE_GIVE();
+  return cached;
+}
+#endif
+
+#if ASYNC_MQTT_COALESCING
+uint32_t AsyncMqttClient::getCoalescedCount() {
+  SEMAPHORE_TAKE(0);
+  uint32_t replaced = _coalescedPublishes.replaced();
+  SEMAPHORE_GIVE();
+  return replaced;
+}
+#endif
+
+#if ASYNC_MQTT_RATE_LIMITS
+AsyncMqttClientRateStats AsyncMqttClient::getRateStats() {
+  AsyncMqttClientRateStats stats = {};
+  SEMAPHORE_TAKE(stats);
+  stats = _rateLimiter.stats();
+  SEMAPHORE_GIVE();
+  return stats;
+}
+#endif
+
+#if ASYNC_MQTT_ADDRESS_CACHE
+AsyncMqttClientConnectStats AsyncMqttClient::getConnectStats() {
+  AsyncMqttClientConnectStats stats = {};
+  SEMAPHORE_TAKE(stats);
+  stats = _connectStats;
+  SEMAPHORE_GIVE();
+  return stats;
+}
+#endif
+
+#if ASYNC_MQTT_PACKET_IDS
+AsyncMqttClientPacketIdStats AsyncMqttClient::getPacketIdStats() {
+  return _packetIds.stats();
+}
+#endif
+
+#if ASYNC_MQTT_OFFLINE_BUFFER
+AsyncMqttClientOfflineStats AsyncMqttClient::getOfflineStats() {
+  SEMAPHORE_TAKE(AsyncMqttClientOfflineStats());
+  AsyncMqttClientOfflineStats stats = _offlineBuffer.stats();
+  SEMAPHORE_GIVE();
+  return stats;
+}
+#endif
+
+#if ASYNC_MQTT_MULTITHREADED
+AsyncMqttClientDispatchStats AsyncMqttClient::getDispatchStats() {
+  return _messageDispatcher.getStats();
+}
+#endif
+
+#if ASYNC_MQTT_TLS
+// The TLS session of the connection, to be given back to setTlsSession(). Returns its length, copied if it fits
+// in `size`, or 0 without a session. The transport resumes it by itself across reconnections
+size_t AsyncMqttClient::getTlsSession(uint8_t* buffer, size_t size) {
+  return _transport->getTlsSession(buffer, size);
+}
+
+AsyncMqttClientTlsStats AsyncMqttClient::getTlsStats() {
+  return _transport->getTlsStats();
+}
+#endif
@@ -1,21 +1,32 @@
 #pragma once
 
+#include <array>
 #include <functional>
+#include <new>
 #include <vector>
 
-#include <Arduino.h>
+#include "AsyncMqttClient/Platform.hpp"
+#include "AsyncMqttClient/Config.hpp"
 
 #ifdef ESP32
-#include <AsyncTCP.h>
 #include <freertos/semphr.h>
+#include "AsyncMqttClient/Transports/AsyncTcpTransport.hpp"
 #elif defined(ESP8266)
-#include <ESPAsyncTCP.h>
-#else
-#error Platform not supported
+#include "AsyncMqttClient/Transports/AsyncTcpTransport.hpp"
+#elif defined(__linux__)
+#include <chrono>
+#include <mutex>
+#include "AsyncMqttClient/Transports/PosixTransport.hpp"
+#endif
+
+#if defined(ESP32) || defined(__linux__)
+#define ASYNC_MQTT_MULTITHREADED 1
 #endif
 
 #if ASYNC_TCP_SSL_ENABLED
 #include <tcp_axtls.h>
+#endif
+#if ASYNC_MQTT_TLS
 #define SHA1_SIZE 20
 #endif
 
@@ -23,9 +34,43 @@
 #include "AsyncMqttClient/ParsingInformation.hpp"
 #include "AsyncMqttClient/MessageProperties.hpp"
 #include "AsyncMqttClient/Helpers.hpp"
+#include "AsyncMqttClient/Codec.hpp"
 #include "AsyncMqttClient/Callbacks.hpp"
 #include "AsyncMqttClient/DisconnectReasons.hpp"
 #include "AsyncMqttClient/Storage.hpp"
+#include "AsyncMqttClient/FixedVector.hpp"
+#include "AsyncMqttClient/Properties.hpp"
+#include "AsyncMqttClient/TopicAliases.hpp"
+#if ASYNC_MQTT_RATE_LIMITS || ASYNC_MQTT_OFFLINE_BUFFER
+#include "AsyncMqttClient/RateLimiter.hpp"  // the offline buffer is flushed at the rate of a token bucket
+#endif
+#if ASYNC_MQTT_COALESCING
+#include "AsyncMqttClient/CoalescedPublishes.hpp"
+#endif
+#if ASYNC_MQTT_MESSAGE_CACHE
+#include "AsyncMqttClient/MessageCache.hpp"
+#endif
+#if ASYNC_MQTT_RPC
+#include "AsyncMqttClient/PendingRequests.hpp"
+#endif
+#if ASYNC_MQTT_PAYLOAD_SINKS
+#include "AsyncMqttClient/PayloadSinks.hpp"
+#endif
+#if ASYNC_MQTT_ADDRESS_CACHE
+#include "AsyncMqttClient/AddressCache.hpp"
+#include "AsyncMqttClient/ConnectStats.hpp"
+#endif
+#include "AsyncMqttClient/PacketIds.hpp"
+#if ASYNC_MQTT_ACK_TIMEOUTS
+#include "AsyncMqttClient/TimerWheel.hpp"
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+#include "AsyncMqttClient/OfflineBuffer.hpp"
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+#include "AsyncMqttClient/PublishQueue.hpp"
+#include "AsyncMqttClient/MessageDispatcher.hpp"
+#endif
 
 #include "AsyncMqttClient/Packets/Packet.hpp"
 #include "AsyncMqttClient/Packets/ConnAckPacket.hpp"
@@ -40,15 +85,22 @@
 
 #if ESP32
 #define SEMAPHORE_TAKE(X) if (xSemaphoreTake(_xSemaphore, 1000 / portTICK_PERIOD_MS) != pdTRUE) { return X; }  // Waits max 1000ms
+#define SEMAPHORE_TRY_TAKE(X) if (xSemaphoreTake(_xSemaphore, 0) != pdTRUE) { return X; }
 #define SEMAPHORE_GIVE() xSemaphoreGive(_xSemaphore);
 #elif defined(ESP8266)
 #define SEMAPHORE_TAKE(X) void()
+#define SEMAPHORE_TRY_TAKE(X) void()
 #define SEMAPHORE_GIVE() void()
+#elif defined(__linux__)
+#define SEMAPHORE_TAKE(X) if (!_xSemaphore.try_lock_for(std::chrono::milliseconds(1000))) { return X; }  // Waits max 1000ms
+#define SEMAPHORE_TRY_TAKE(X) if (!_xSemaphore.try_lock()) { return X; }
+#define SEMAPHORE_GIVE() _xSemaphore.unlock();
 #endif
 
 class AsyncMqttClient {
  public:
   AsyncMqttClient();
+  explicit AsyncMqttClient(AsyncMqttClientInternals::Transport* transport);
   ~AsyncMqttClient();
 
   AsyncMqttClient& setKeepAlive(uint16_t keepAlive);
@@ -59,9 +111,56 @@ class AsyncMqttClient {
   AsyncMqttClient& setWill(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0);
   AsyncMqttClient& setServer(IPAddress ip, uint16_t port);
   AsyncMqttClient& setServer(const char* host, uint16_t port);
-#if ASYNC_TCP_SSL_ENABLED
+#if ASYNC_MQTT_ADDRESS_CACHE
+  AsyncMqttClient& setAddressCache(uint32_t ttlMs);
+#endif
+  AsyncMqttClient& setProtocolVersion(uint8_t protocolVersion);
+  AsyncMqttClient& setTopicAliasMaximum(uint16_t topicAliasMaximum);
+  AsyncMqttClient& setReceiveMaximum(uint16_t receiveMaximum);
+  AsyncMqttClient& setMaximumPacketSize(uint32_t maximumPacketSize);
+  AsyncMqttClient& setInboundBudget(size_t inboundBudget);
+#if ASYNC_MQTT_PIPELINING
+  AsyncMqttClient& setPipelinedConnect(size_t size);
+#endif
+  AsyncMqttClient& setClock(AsyncMqttClientInternals::Clock clock);
+#if ASYNC_MQTT_RATE_LIMITS
+  AsyncMqttClient& setPublishRateLimit(uint32_t messages, uint32_t periodMs, uint16_t burst, AsyncMqttClientRatePolicy policy = AsyncMqttClientRatePolicy::REJECT, uint16_t queueSize = 8);
+  AsyncMqttClient& addPublishRateLimit(const char* topicFilter, uint32_t messages, uint32_t periodMs, uint16_t burst, AsyncMqttClientRatePolicy policy = AsyncMqttClientRatePolicy::REJECT, uint16_t queueSize = 8);
+#endif
+#if ASYNC_MQTT_RPC
+  AsyncMqttClient& setRpc(const char* responseTopic, uint8_t slots = 8);
+#endif
+#if ASYNC_MQTT_ACK_TIMEOUTS
+  AsyncMqttClient& setAckTimeout(uint32_t timeoutMs, uint16_t timers = 32);
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  AsyncMqttClient& setOfflineBuffer(size_t size, uint16_t messages = 32, uint16_t flushRate = 10);
+  AsyncMqttClient& setOfflineStore(AsyncMqttClientOfflineStore* store, uint16_t messages = 32, uint16_t flushRate = 10);
+#endif
+#if ASYNC_MQTT_PAYLOAD_WRITER
+  AsyncMqttClient& setWriterBuffer(size_t size);
+#endif
+#if ASYNC_MQTT_MESSAGE_CACHE
+  AsyncMqttClient& setMessageCache(size_t budget);
+  AsyncMqttClient& addCachedTopic(const char* topicFilter);
+#endif
+#if ASYNC_MQTT_PAYLOAD_SINKS
+  AsyncMqttClient& addPayloadSink(const char* topicFilter, AsyncMqttClientPayloadSink* sink);
+#endif
+#if ASYNC_MQTT_COALESCING
+  AsyncMqttClient& addCoalescedTopic(const char* topicFilter, uint16_t slots = 4);
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+  AsyncMqttClient& setPublishQueueSize(uint16_t publishQueueSize);
+#if ASYNC_MQTT_URGENT_PUBLISHES
+  AsyncMqttClient& setUrgentQueueSize(uint16_t urgentQueueSize);
+#endif
+  AsyncMqttClient& setMessageDispatch(uint8_t workers, uint16_t queueSize = 16);
+#endif
+#if ASYNC_MQTT_TLS
   AsyncMqttClient& setSecure(bool secure);
   AsyncMqttClient& addServerFingerprint(const uint8_t* fingerprint);
+  AsyncMqttClient& setTlsSession(const uint8_t* session, size_t length);
 #endif
 
   AsyncMqttClient& onConnect(AsyncMqttClientInternals::OnConnectUserCallback callback);
@@ -71,6 +170,9 @@ class AsyncMqttClient {
   AsyncMqttClient& onMessage(AsyncMqttClientInternals::OnMessageUserCallback callback);
   AsyncMqttClient& onPublish(AsyncMqttClientInternals::OnPublishUserCallback callback);
   AsyncMqttClient& onPing(AsyncMqttClientInternals::OnPingUserCallback callback);
+#if ASYNC_MQTT_ACK_TIMEOUTS
+  AsyncMqttClient& onTimeout(AsyncMqttClientInternals::OnTimeoutUserCallback callback);
+#endif
 
   bool connected() const;
   void connect();
@@ -78,17 +180,64 @@ class AsyncMqttClient {
   uint16_t subscribe(const char* topic, uint8_t qos);
   uint16_t unsubscribe(const char* topic);
   uint16_t publish(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0, bool dup = false, uint16_t message_id = 0);
+#if ASYNC_MQTT_STREAMED_PAYLOADS
   uint16_t publish(const char* topic, uint8_t qos, bool retain, AsyncMqttClientInternals::PayloadHandler handler, size_t length, bool dup = false, uint16_t message_id = 0);
+#endif
+#if ASYNC_MQTT_PAYLOAD_WRITER
+  uint16_t publish(const char* topic, uint8_t qos, bool retain, AsyncMqttClientInternals::PayloadWriter writer);
+#endif
+#if ASYNC_MQTT_MULTITHREADED && ASYNC_MQTT_URGENT_PUBLISHES
+  uint16_t publishUrgent(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0);
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  uint16_t publishBuffered(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, uint32_t ttlMs, uint8_t priority = 0);
+#endif
+#if ASYNC_MQTT_RPC
+  uint16_t request(const char* topic, const char* payload, size_t length, uint32_t timeoutMs, AsyncMqttClientInternals::OnResponseUserCallback callback, uint8_t qos = 1);
+#endif
+  void releaseInbound(size_t length);
+#if ASYNC_MQTT_DEADLINES
+  uint32_t nextDeadlineMs();
+  void tick();
+#endif
 
   const char* getClientId();
+#if ASYNC_MQTT_RATE_LIMITS
+  AsyncMqttClientRateStats getRateStats();
+#endif
+#if ASYNC_MQTT_ADDRESS_CACHE
+  AsyncMqttClientConnectStats getConnectStats();
+#endif
+#if ASYNC_MQTT_PACKET_IDS
+  AsyncMqttClientPacketIdStats getPacketIdStats();
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  AsyncMqttClientOfflineStats getOfflineStats();
+#endif
+#if ASYNC_MQTT_COALESCING
+  uint32_t getCoalescedCount();
+#endif
+#if ASYNC_MQTT_MESSAGE_CACHE
+  bool getCachedMessage(const char* topic, char* payload, size_t size, size_t* length);
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+  AsyncMqttClientDispatchStats getDispatchStats();
+#endif
+#if ASYNC_MQTT_TLS
+  size_t getTlsSession(uint8_t* buffer, size_t size);
+  AsyncMqttClientTlsStats getTlsStats();
+#endif
 
  private:
-  AsyncClient _client;
+  AsyncMqttClientInternals::Transport* _transport;
+  bool _transportOwned;
   bool _connected;
   bool _lockMutiConnections;
   bool _connectPacketNotEnoughSpace;
   bool _disconnectOnPoll;
+  bool _pingDue;  // waits for the end of a streamed payload
   bool _tlsBadFingerprint;
+  bool _overflowed;  // a fixed capacity was exceeded, the connection is closed once the received data is handled
   uint32_t _lastClientActivity;
   uint32_t _lastServerActivity;
   uint32_t _lastPingRequestTime;
@@ -97,7 +246,27 @@ class AsyncMqttClient {
   IPAddress _ip;
   const char* _host;
   bool _useIp;
-#if ASYNC_TCP_SSL_ENABLED
+#if ASYNC_MQTT_ADDRESS_CACHE
+  AsyncMqttClientInternals::AddressCache _addressCache;
+  AsyncMqttClientConnectStats _connectStats;
+  uint32_t _connectStart;
+  uint32_t _resolveStart;
+  bool _connectOnResolve;  // connect() waits for the resolution, there was no cached address to try
+  bool _connectingCached;  // to an address of the cache, until the TCP connection is up
+  bool _usedCache;         // connect() did not wait for a resolution
+  bool _readying;          // from connect() to the end of the onConnect callback
+  uint16_t _readyPending;  // subscriptions made meanwhile, not acknowledged yet
+#endif
+#if ASYNC_MQTT_PIPELINING
+  std::vector<char> _connectPacket;
+  bool _connectPacketStale;  // a setter changed what CONNECT carries
+  bool _connectSent;  // on this connection
+  size_t _pipelineSize;
+  std::vector<char> _pipeline;  // written while connecting, sent behind CONNECT
+#else
+  static constexpr bool _connectSent = true;  // written once connected only
+#endif
+#if ASYNC_MQTT_TLS
   bool _secure;
 #endif
   uint16_t _port;
@@ -111,66 +280,253 @@ class AsyncMqttClient {
   uint16_t _willPayloadLength;
   uint8_t _willQos;
   bool _willRetain;
+  uint8_t _protocolVersion;
+  uint16_t _topicAliasMaximum;
+  uint16_t _receiveMaximum;
+  uint16_t _serverReceiveMaximum;
+  uint32_t _serverMaximumPacketSize;
+  uint16_t _inFlightPublishes;
+  AsyncMqttClientInternals::PacketIds _packetIds;  // two bytes without the bitmap, taking the padding here
+  size_t _inboundBudget;
+  size_t _inboundHeld;
+  size_t _inboundUnacked;
+  AsyncMqttClientInternals::Clock _clock;
+#if ASYNC_MQTT_RPC
+  const char* _rpcResponseTopic;
+  size_t _rpcResponseTopicLength;
+  char* _rpcSubscription;  // the response topic followed by /+
+  uint16_t _rpcSubscribeId;
+#endif
 
-#if ASYNC_TCP_SSL_ENABLED
-  std::vector<std::array<uint8_t, SHA1_SIZE>> _secureServerFingerprints;
+#if ASYNC_MQTT_TLS
+  AsyncMqttClientInternals::Vector<std::array<uint8_t, SHA1_SIZE>, ASYNC_MQTT_SERVER_FINGERPRINTS> _secureServerFingerprints;
 #endif
 
   AsyncMqttClientInternals::OnConnectUserCallback _onConnectUserCallback;
   AsyncMqttClientInternals::OnDisconnectUserCallback _onDisconnectUserCallback;
   AsyncMqttClientInternals::OnSubscribeUserCallback _onSubscribeUserCallback;
   AsyncMqttClientInternals::OnUnsubscribeUserCallback _onUnsubscribeUserCallback;
-  std::vector<AsyncMqttClientInternals::OnMessageUserCallback> _onMessageUserCallbacks;
+  AsyncMqttClientInternals::Vector<AsyncMqttClientInternals::OnMessageUserCallback, ASYNC_MQTT_MESSAGE_CALLBACKS> _onMessageUserCallbacks;
   AsyncMqttClientInternals::OnPublishUserCallback _onPublishUserCallback;
   AsyncMqttClientInternals::OnPingUserCallback _onPingUserCallback;
+#if ASYNC_MQTT_ACK_TIMEOUTS
+  AsyncMqttClientInternals::OnTimeoutUserCallback _onTimeoutUserCallback;
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+  AsyncMqttClientInternals::MessageDispatcher _messageDispatcher;
+#endif
 
   AsyncMqttClientInternals::ParsingInformation _parsingInformation;
-  AsyncMqttClientInternals::Packet* _currentParsedPacket;
+  AsyncMqttClientInternals::Packet* _currentParsedPacket;  // in _parsedPacketStorage, or on the heap without it
+#if ASYNC_MQTT_PACKET_STORAGE
+  typedef AsyncMqttClientInternals::PacketStorage<AsyncMqttClientInternals::ConnAckPacket, AsyncMqttClientInternals::PingRespPacket,
+                                                  AsyncMqttClientInternals::SubAckPacket, AsyncMqttClientInternals::UnsubAckPacket,
+                                                  AsyncMqttClientInternals::PublishPacket, AsyncMqttClientInternals::PubRelPacket,
+                                                  AsyncMqttClientInternals::PubAckPacket, AsyncMqttClientInternals::PubRecPacket,
+                                                  AsyncMqttClientInternals::PubCompPacket> ParsedPacketStorage;
+  alignas(ParsedPacketStorage::ALIGNMENT) char _parsedPacketStorage[ParsedPacketStorage::SIZE];
+#endif
   uint8_t _remainingLengthBufferPosition;
   char _remainingLengthBuffer[4];
+  AsyncMqttClientInternals::InboundTopicAliases _inboundTopicAliases;
+  AsyncMqttClientInternals::OutboundTopicAliases _outboundTopicAliases;
+#if ASYNC_MQTT_RATE_LIMITS
+  AsyncMqttClientInternals::RateLimiter _rateLimiter;
+#endif
+#if ASYNC_MQTT_COALESCING
+  AsyncMqttClientInternals::CoalescedPublishes _coalescedPublishes;
+#endif
+#if ASYNC_MQTT_MESSAGE_CACHE
+  AsyncMqttClientInternals::MessageCache _messageCache;
+#endif
+#if ASYNC_MQTT_RPC
+  AsyncMqttClientInternals::PendingRequests _pendingRequests;
+#endif
+#if ASYNC_MQTT_PAYLOAD_SINKS
+  AsyncMqttClientInternals::PayloadSinks _payloadSinks;
+#endif
+#if ASYNC_MQTT_ACK_TIMEOUTS
+  AsyncMqttClientInternals::TimerWheel _ackTimers;
+  uint32_t _ackTimeout;
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  AsyncMqttClientInternals::OfflineBuffer _offlineBuffer;
+  AsyncMqttClientInternals::TokenBucket _offlineFlush;
+  uint16_t _offlineFlushRate;  // messages per second, 0 for as fast as TCP space allows
+#endif
+#if ASYNC_MQTT_PAYLOAD_WRITER
+  std::vector<char> _writerBuffer;  // the packet publish() with a writer builds
+#if ASYNC_MQTT_MULTITHREADED
+  std::mutex _writerMutex;
+#endif
+#endif
 
-  uint16_t _nextPacketId;
+#if ASYNC_MQTT_MULTITHREADED
+  AsyncMqttClientInternals::PublishQueue _publishQueue;
+#if ASYNC_MQTT_URGENT_PUBLISHES
+  AsyncMqttClientInternals::PublishQueue _urgentQueue;  // sent ahead of _publishQueue and streamed payloads
+#endif
+#endif
 
-  std::vector<AsyncMqttClientInternals::PendingPubRel> _pendingPubRels;
+#if ASYNC_MQTT_QOS2
+  AsyncMqttClientInternals::Vector<AsyncMqttClientInternals::PendingPubRel, ASYNC_MQTT_PENDING_PUBRELS> _pendingPubRels;
+#endif
 
-  std::vector<AsyncMqttClientInternals::PendingAck> _toSendAcks;
+  AsyncMqttClientInternals::Vector<AsyncMqttClientInternals::PendingAck, ASYNC_MQTT_ACK_QUEUE_SIZE> _toSendAcks;
 
 #ifdef ESP32
   SemaphoreHandle_t _xSemaphore = nullptr;
+#elif defined(__linux__)
+  std::timed_mutex _xSemaphore;
 #endif
 
+#if ASYNC_MQTT_STREAMED_PAYLOADS
   bool _isSendingLargePayload;
   size_t _largePayloadLength;
   size_t _largePayloadIndex;
   AsyncMqttClientInternals::PayloadHandler _largePayloadHandler;
+#else
+  static constexpr bool _isSendingLargePayload = false;  // lets the checks for a streamed payload be compiled out
+#endif
 
   void _clear();
   void _freeCurrentParsedPacket();
 
+  template <typename P, typename... Args>
+  AsyncMqttClientInternals::Packet* _newPacket(Args... args) {
+#if ASYNC_MQTT_PACKET_STORAGE
+    return new (_parsedPacketStorage) P(args...);
+#else
+    return new P(args...);
+#endif
+  }
+
+  AsyncMqttClientInternals::ConnectFields _connectFields() const;
+  template <typename Add>
+  void _writeConnect(const AsyncMqttClientInternals::ConnectFields& fields, Add add) const;
+#if ASYNC_MQTT_PIPELINING
+  void _encodeConnect();
+#endif
+  void _connectChanged() {
+#if ASYNC_MQTT_PIPELINING
+    _connectPacketStale = true;
+#endif
+  }
+
   // TCP
-  void _onConnect(AsyncClient* client);
-  void _onDisconnect(AsyncClient* client);
-  static void _onError(AsyncClient* client, int8_t error);
-  void _onTimeout(AsyncClient* client, uint32_t time);
-  static void _onAck(AsyncClient* client, size_t len, uint32_t time);
-  void _onData(AsyncClient* client, char* data, size_t len);
-  void _onPoll(AsyncClient* client);
+#if ASYNC_MQTT_ADDRESS_CACHE
+  void _connectCached();
+  void _connectTo(IPAddress address);
+  void _onResolve(const IPAddress* addresses, uint8_t count);
+#endif
+  void _onConnect();
+  void _onDisconnect();
+  static void _onError(int8_t error);
+  void _onTimeout(uint32_t time);
+  void _onAck(size_t len, uint32_t time);
+  void _onData(char* data, size_t len);
+  void _onPoll();
 
   // MQTT
   void _onPingResp();
-  void _onConnAck(bool sessionPresent, uint8_t connectReturnCode);
+  void _onConnAck(bool sessionPresent, uint8_t connectReturnCode, const AsyncMqttClientInternals::Properties& properties);
   void _onSubAck(uint16_t packetId, char status);
   void _onUnsubAck(uint16_t packetId);
   void _onMessage(char* topic, char* payload, uint8_t qos, bool dup, bool retain, size_t len, size_t index, size_t total, uint16_t packetId);
   void _onPublish(uint16_t packetId, uint8_t qos);
-  void _onPubRel(uint16_t packetId);
   void _onPubAck(uint16_t packetId);
+#if ASYNC_MQTT_RPC
+  bool _onResponse(const char* topic, const char* payload, size_t len, size_t index, size_t total);
+  void _expireRequests(bool all);
+#endif
+#if ASYNC_MQTT_QOS2
+  void _onPubRel(uint16_t packetId);
   void _onPubRec(uint16_t packetId);
   void _onPubComp(uint16_t packetId);
+#endif
+
+  void _releaseInFlightPublish();
+  void _sendWaiting();
+#if ASYNC_MQTT_RATE_LIMITS
+  void _releaseHeld();
+#endif
+#if ASYNC_MQTT_COALESCING
+  void _sendCoalesced();
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  void _flushOffline();
+#endif
+#if ASYNC_MQTT_MULTITHREADED
+#if ASYNC_MQTT_RATE_LIMITS
+  bool _admitQueued(AsyncMqttClientInternals::OutboundPacket* packet);
+#endif
+  void _drainPublishQueue();
+#endif
 
+#if ASYNC_MQTT_STREAMED_PAYLOADS
+  bool _sendLargePayload();
+#endif
+  uint16_t _publish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, bool dup, uint16_t message_id, bool urgent, char* packet = nullptr);
+#if ASYNC_MQTT_PAYLOAD_WRITER
+  bool _publishInPlace(const char* topic, uint16_t topicLength, uint8_t qos, bool retain, AsyncMqttClientInternals::PayloadWriter& writer, size_t capacity, uint16_t* result);
+#endif
+#if ASYNC_MQTT_COALESCING
+  uint16_t _publishCoalesced(const char* topic, bool retain, const char* payload, size_t length);
+#endif
+#if ASYNC_MQTT_OFFLINE_BUFFER
+  uint16_t _bufferOffline(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, uint32_t ttlMs, uint8_t priority);
+  void _setOfflineStore(AsyncMqttClientOfflineStore* store, bool owned, uint16_t messages, uint16_t flushRate);
+  bool _addOffline(const AsyncMqttClientInternals::OfflineBuffer::Entry& entry, size_t index, size_t len);
+  size_t _offlinePacketSize(const AsyncMqttClientInternals::OfflineBuffer::Entry& entry) const;
+#endif
+#if ASYNC_MQTT_RATE_LIMITS
+  bool _holdPublish(AsyncMqttClientInternals::TokenBucket* bucket, const AsyncMqttClientInternals::OutboundPacket& packet);
+  void _refundPublish(const char* topic);
+#endif
+  bool _controlPending();
+  bool _urgentPending() const {
+#if ASYNC_MQTT_MULTITHREADED && ASYNC_MQTT_URGENT_PUBLISHES
+    return !_urgentQueue.empty();
+#else
+    return false;
+#endif
+  }
+  size_t _controlSpace();
+  void _setPingDue();
+  void _sendControlPackets();
   bool _sendPing();
+  bool _queueAck(uint8_t packetType, uint8_t headerFlag, uint16_t packetId);
   void _sendAcks();
-  bool _sendDisconnect();
+  void _addAcks();
+  bool _controlFirst(size_t neededSpace);
+  bool _sendDisconnect(uint8_t reasonCode = AsyncMqttClientInternals::ReasonCode.NORMAL_DISCONNECTION);
 
+#if ASYNC_MQTT_ADDRESS_CACHE
+  void _countConnection();
+  void _trackReady(bool subAck);
+#endif
+#if ASYNC_MQTT_DEADLINES
+  uint32_t _until(uint32_t now, uint32_t deadline) const;
+#endif
+#if ASYNC_MQTT_PIPELINING
+  bool _pipelineOpen() const;
+#else
+  bool _pipelineOpen() const { return false; }
+#endif
+  size_t _space();
+  void _add(const char* data, size_t size);
+  bool _secureFlag() const;
   uint16_t _getNextPacketId();
+  uint16_t _reservePacketId(uint16_t packetId);
+#if ASYNC_MQTT_ACK_TIMEOUTS
+  void _armAckTimer(uint16_t packetId, AsyncMqttClientAckType type);
+  void _disarmAckTimer(uint16_t packetId);
+  void _expireAckTimers();
+#else
+  // their calls are compiled out
+  void _armAckTimer(uint16_t, AsyncMqttClientAckType) {}
+  void _disarmAckTimer(uint16_t) {}
+  void _expireAckTimers() {}
+#endif
+  uint32_t _millis() const;
 };
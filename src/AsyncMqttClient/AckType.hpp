@@ -0,0 +1,8 @@
+#pragma once
+
+// The operation whose acknowledgement did not come in time, as given to the onTimeout callback
+enum class AsyncMqttClientAckType : uint8_t {
+  PUBLISH = 0,     // QoS 1 or 2, PUBACK or PUBCOMP
+  SUBSCRIBE = 1,   // SUBACK
+  UNSUBSCRIBE = 2  // UNSUBACK
+};
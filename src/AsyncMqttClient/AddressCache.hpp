@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Config.hpp"
+#include "FixedVector.hpp"
+#include "Platform.hpp"
+
+namespace AsyncMqttClientInternals {
+// The addresses the server name resolved to, kept for a time to live: a reconnection goes straight to the
+// address that worked last, and moves on to the next one when it is unreachable. Addresses past their time
+// to live are still used while they are refreshed, and kept if the refresh fails.
+// Not thread safe, the client lock is held.
+class AddressCache {
+ public:
+  AddressCache()
+  : _ttl(0)
+  , _addresses()
+  , _current(0)
+  , _resolvedAt(0) {
+  }
+
+  // 0 disables the cache
+  void setTtl(uint32_t ttl) {
+    _ttl = ttl;
+  }
+
+  bool enabled() const {
+    return _ttl > 0;
+  }
+
+  // The first ASYNC_MQTT_CACHED_ADDRESSES addresses of a resolution, in the order they are tried
+  void store(const IPAddress* addresses, uint8_t count, uint32_t now) {
+    _addresses.clear();
+    for (uint8_t i = 0; i < count && !_addresses.full(); i++) _addresses.push_back(addresses[i]);
+    _current = 0;
+    _resolvedAt = now;
+  }
+
+  // The address to connect to, false if there is none or all of them were unreachable
+  bool get(IPAddress* address) const {
+    if (_current >= _addresses.size()) return false;
+    *address = _addresses[_current];
+    return true;
+  }
+
+  // To be refreshed, which includes having no address to try
+  bool stale(uint32_t now) const {
+    return _current >= _addresses.size() || now - _resolvedAt >= _ttl;
+  }
+
+  // The address returned by get() is unreachable, get() moves on to the next one
+  void failed() {
+    if (_current < _addresses.size()) _current++;
+  }
+
+  void clear() {
+    _addresses.clear();
+    _current = 0;
+  }
+
+ private:
+  uint32_t _ttl;
+  FixedVector<IPAddress, ASYNC_MQTT_CACHED_ADDRESSES> _addresses;
+  uint8_t _current;  // index of the address to try
+  uint32_t _resolvedAt;
+};
+}  // namespace AsyncMqttClientInternals
@@ -2,11 +2,17 @@
 
 #include <functional>
 
+#include "AckType.hpp"
+#include "Config.hpp"
 #include "DisconnectReasons.hpp"
 #include "MessageProperties.hpp"
+#include "PayloadWriter.hpp"
+#include "Properties.hpp"
+#include "RpcStatus.hpp"
 
 namespace AsyncMqttClientInternals {
 // user callbacks
+#if ASYNC_MQTT_FUNCTION_CALLBACKS
 typedef std::function<void(bool sessionPresent)> OnConnectUserCallback;
 typedef std::function<void(AsyncMqttClientDisconnectReason reason)> OnDisconnectUserCallback;
 typedef std::function<void(uint16_t packetId, uint8_t qos)> OnSubscribeUserCallback;
@@ -14,10 +20,25 @@ typedef std::function<void(uint16_t packetId)> OnUnsubscribeUserCallback;
 typedef std::function<void(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)> OnMessageUserCallback;
 typedef std::function<void(uint16_t packetId)> OnPublishUserCallback;
 typedef std::function<void(bool ack)> OnPingUserCallback;
+typedef std::function<void(uint16_t requestId, AsyncMqttClientRpcStatus status, const char* payload, size_t len, size_t index, size_t total)> OnResponseUserCallback;
+typedef std::function<void(uint16_t packetId, AsyncMqttClientAckType type)> OnTimeoutUserCallback;
+#else
+typedef void (*OnConnectUserCallback)(bool sessionPresent);
+typedef void (*OnDisconnectUserCallback)(AsyncMqttClientDisconnectReason reason);
+typedef void (*OnSubscribeUserCallback)(uint16_t packetId, uint8_t qos);
+typedef void (*OnUnsubscribeUserCallback)(uint16_t packetId);
+typedef void (*OnMessageUserCallback)(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total);
+typedef void (*OnPublishUserCallback)(uint16_t packetId);
+typedef void (*OnPingUserCallback)(bool ack);
+typedef void (*OnResponseUserCallback)(uint16_t requestId, AsyncMqttClientRpcStatus status, const char* payload, size_t len, size_t index, size_t total);
+typedef void (*OnTimeoutUserCallback)(uint16_t packetId, AsyncMqttClientAckType type);
+#endif
 typedef std::function<const char*(size_t index)> PayloadHandler;
+typedef std::function<void(AsyncMqttClientWriter& writer)> PayloadWriter;
+typedef std::function<uint32_t()> Clock;
 
 // internal callbacks
-typedef std::function<void(bool sessionPresent, uint8_t connectReturnCode)> OnConnAckInternalCallback;
+typedef std::function<void(bool sessionPresent, uint8_t connectReturnCode, const Properties& properties)> OnConnAckInternalCallback;
 typedef std::function<void()> OnPingRespInternalCallback;
 typedef std::function<void(uint16_t packetId, char status)> OnSubAckInternalCallback;
 typedef std::function<void(uint16_t packetId)> OnUnsubAckInternalCallback;
@@ -27,4 +48,5 @@ typedef std::function<void(uint16_t packetId)> OnPubRelInternalCallback;
 typedef std::function<void(uint16_t packetId)> OnPubAckInternalCallback;
 typedef std::function<void(uint16_t packetId)> OnPubRecInternalCallback;
 typedef std::function<void(uint16_t packetId)> OnPubCompInternalCallback;
+typedef std::function<void(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)> OnDispatchedMessageInternalCallback;
 }  // namespace AsyncMqttClientInternals
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Helpers.hpp"
+
+namespace AsyncMqttClientInternals {
+// Last value wins: the unsent QoS 0 publish of a topic matching a coalesced filter waits in a slot of its own,
+// where a newer publish to that topic replaces it and keeps its place in line. Not thread safe, the client lock
+// is held to use it. The buffers of a slot are kept and reused by the next publishes.
+class CoalescedPublishes {
+ public:
+  struct Slot {
+    std::string topic;
+    std::vector<char> packet;
+    uint64_t sequence;  // place in line, from the first unsent publish
+    bool pending;
+  };
+
+  CoalescedPublishes()
+  : _filters()
+  , _slots()
+  , _nextSequence(0)
+  , _replaced(0) {
+  }
+
+  // To be called before connecting, the filter must stay valid. `slots` topics of it can wait at once
+  void add(const char* topicFilter, uint16_t slots) {
+    _filters.push_back(topicFilter);
+    _slots.resize(_slots.size() + slots, Slot { std::string(), std::vector<char>(), 0, false });
+  }
+
+  bool enabled() const {
+    return !_filters.empty();
+  }
+
+  bool matches(const char* topic) const {
+    for (const char* filter : _filters) {
+      if (Helpers::topicMatches(filter, topic)) return true;
+    }
+    return false;
+  }
+
+  // The packet buffer of the topic, to be filled with `length` bytes. Returns nullptr if all slots wait for other topics
+  char* store(const char* topic, uint16_t topicLength, size_t length) {
+    Slot* free = nullptr;
+    for (Slot& slot : _slots) {
+      if (slot.pending && slot.topic.size() == topicLength && memcmp(slot.topic.data(), topic, topicLength) == 0) {
+        _replaced++;
+        slot.packet.resize(length);
+        return slot.packet.data();
+      }
+      if (!slot.pending && free == nullptr) free = &slot;
+    }
+    if (free == nullptr) return nullptr;
+    free->topic.assign(topic, topicLength);
+    free->packet.resize(length);
+    free->sequence = _nextSequence++;
+    free->pending = true;
+    return free->packet.data();
+  }
+
+  // The oldest pending slot after `previous`, or the oldest one if nullptr
+  Slot* next(const Slot* previous) {
+    Slot* next = nullptr;
+    for (Slot& slot : _slots) {
+      if (!slot.pending || (previous != nullptr && slot.sequence <= previous->sequence)) continue;
+      if (next == nullptr || slot.sequence < next->sequence) next = &slot;
+    }
+    return next;
+  }
+
+  // Publishes replaced by a newer one before being sent
+  uint32_t replaced() const {
+    return _replaced;
+  }
+
+  void clear() {
+    for (Slot& slot : _slots) slot.pending = false;
+  }
+
+ private:
+  std::vector<const char*> _filters;
+  std::vector<Slot> _slots;
+  uint64_t _nextSequence;
+  uint32_t _replaced;
+};
+}  // namespace AsyncMqttClientInternals
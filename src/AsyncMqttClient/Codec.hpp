@@ -0,0 +1,241 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Flags.hpp"
+
+namespace AsyncMqttClientInternals {
+// Fields of a CONNECT packet other than its strings, of which only the lengths are needed.
+// The connect flags tell which of the will, username and password are present.
+struct ConnectFields {
+  uint8_t protocolVersion;
+  uint8_t flags;
+  uint16_t keepAlive;
+  // MQTT 5 properties, 0 when not sent. The session expiry interval is sent when the session is not clean
+  uint16_t topicAliasMaximum;
+  uint16_t receiveMaximum;
+  uint32_t maximumPacketSize;
+  uint16_t clientIdLength;
+  uint16_t willTopicLength;
+  uint16_t willPayloadLength;
+  uint16_t usernameLength;
+  uint16_t passwordLength;
+};
+
+// Encoding of the packets the client sends, independent of any connection and allocation free.
+// The size calculators are constexpr: with literal topics and fixed flags, packet sizes and fixed headers are
+// computed at compile time. The encoders write a packet around its strings and payload (the head before the
+// topic, the tail after it), which the caller adds itself so that they are never copied.
+// The encoders return the number of bytes written.
+class Codec {
+ public:
+  static const uint8_t MAX_FIXED_HEADER_SIZE = 1 + 4;
+  static const uint8_t MAX_CONNECT_PROPERTIES_SIZE = 5 + 3 + 3 + 5;
+  static const uint8_t MAX_CONNECT_HEAD_SIZE = MAX_FIXED_HEADER_SIZE + 2 + 4 + 1 + 1 + 2 + 1 + MAX_CONNECT_PROPERTIES_SIZE + 2;
+  static const uint8_t MAX_CONNECT_WILL_HEAD_SIZE = 1 + 2;
+  static const uint8_t MAX_PUBLISH_HEAD_SIZE = MAX_FIXED_HEADER_SIZE + 2;
+  static const uint8_t MAX_PUBLISH_TAIL_SIZE = 2 + 1 + 3;
+  static const uint8_t MAX_SUBSCRIBE_HEAD_SIZE = MAX_FIXED_HEADER_SIZE + 2 + 1 + 2;
+  static const uint8_t ACK_SIZE = 2 + 2;
+  static const uint8_t EMPTY_PACKET_SIZE = 2;
+  static const uint8_t MAX_DISCONNECT_SIZE = 2 + 1;
+
+  // Sizes
+
+  static constexpr uint8_t remainingLengthSize(uint32_t remainingLength) {
+    return remainingLength < 128 ? 1 : remainingLength < 16384 ? 2 : remainingLength < 2097152 ? 3 : 4;
+  }
+
+  static constexpr uint32_t packetSize(uint32_t remainingLength) {
+    return 1 + remainingLengthSize(remainingLength) + remainingLength;
+  }
+
+  // For literals, strlen() is not constexpr
+  static constexpr uint16_t stringLength(const char* string, uint16_t length = 0) {
+    return string[length] == '\0' ? length : stringLength(string, length + 1);
+  }
+
+  static constexpr uint8_t connectPropertiesLength(const ConnectFields& fields) {
+    return ((fields.flags & ConnectFlag.CLEAN_SESSION) == 0 ? 5 : 0) +
+           (fields.topicAliasMaximum > 0 ? 3 : 0) +
+           (fields.receiveMaximum > 0 ? 3 : 0) +
+           (fields.maximumPacketSize > 0 ? 5 : 0);
+  }
+
+  static constexpr uint32_t connectRemainingLength(const ConnectFields& fields) {
+    return 2 + 4 + 1 + 1 + 2 + 2 + static_cast<uint32_t>(fields.clientIdLength) +
+           (_isV5(fields.protocolVersion) ? remainingLengthSize(connectPropertiesLength(fields)) + connectPropertiesLength(fields) : 0) +
+           ((fields.flags & ConnectFlag.WILL) != 0 ? (_isV5(fields.protocolVersion) ? 1 : 0) + 2 + fields.willTopicLength + 2 + fields.willPayloadLength : 0) +
+           ((fields.flags & ConnectFlag.USERNAME) != 0 ? 2 + fields.usernameLength : 0) +
+           ((fields.flags & ConnectFlag.PASSWORD) != 0 ? 2 + fields.passwordLength : 0);
+  }
+
+  // Property length byte included, a topic alias is only sent with MQTT 5
+  static constexpr uint8_t publishPropertiesLength(uint8_t protocolVersion, uint16_t topicAlias) {
+    return !_isV5(protocolVersion) ? 0 : topicAlias != 0 ? 1 + 3 : 1;
+  }
+
+  static constexpr uint32_t publishRemainingLength(uint16_t topicLength, uint8_t qos, uint8_t propertiesLength, uint32_t payloadLength) {
+    return 2 + static_cast<uint32_t>(topicLength) + (qos != 0 ? 2 : 0) + propertiesLength + payloadLength;
+  }
+
+  static constexpr uint32_t subscribeRemainingLength(uint8_t protocolVersion, uint16_t topicLength) {
+    return unsubscribeRemainingLength(protocolVersion, topicLength) + 1;
+  }
+
+  static constexpr uint32_t unsubscribeRemainingLength(uint8_t protocolVersion, uint16_t topicLength) {
+    return 2 + (_isV5(protocolVersion) ? 1 : 0) + 2 + static_cast<uint32_t>(topicLength);
+  }
+
+  // First bytes
+
+  static constexpr uint8_t fixedHeader(uint8_t packetType, uint8_t headerFlags) {
+    return (packetType << 4) | headerFlags;
+  }
+
+  static constexpr uint8_t publishFixedHeader(uint8_t qos, bool retain, bool dup) {
+    return fixedHeader(PacketType.PUBLISH,
+                       (dup ? HeaderFlag.PUBLISH_DUP : 0) |
+                       (retain ? HeaderFlag.PUBLISH_RETAIN : 0) |
+                       (qos == 1 ? HeaderFlag.PUBLISH_QOS1 : qos == 2 ? HeaderFlag.PUBLISH_QOS2 : HeaderFlag.PUBLISH_QOS0));
+  }
+
+  static constexpr uint8_t connectFlags(bool cleanSession, bool username, bool password, bool will, uint8_t willQos, bool willRetain) {
+    return (cleanSession ? ConnectFlag.CLEAN_SESSION : 0) |
+           (username ? ConnectFlag.USERNAME : 0) |
+           (password ? ConnectFlag.PASSWORD : 0) |
+           (!will ? 0 : ConnectFlag.WILL |
+                        (willRetain ? ConnectFlag.WILL_RETAIN : 0) |
+                        (willQos == 1 ? ConnectFlag.WILL_QOS1 : willQos == 2 ? ConnectFlag.WILL_QOS2 : ConnectFlag.WILL_QOS0));
+  }
+
+  // Encoders
+
+  static uint8_t encodeUint16(char* destination, uint16_t value) {
+    destination[0] = value >> 8;
+    destination[1] = value & 0xFF;
+    return 2;
+  }
+
+  static uint8_t encodeRemainingLength(char* destination, uint32_t remainingLength) {
+    uint8_t size = 0;
+    do {
+      uint8_t encodedByte = remainingLength % 128;
+      remainingLength /= 128;
+      if (remainingLength > 0) encodedByte |= 128;
+      destination[size++] = encodedByte;
+    } while (remainingLength > 0);
+    return size;
+  }
+
+  static uint8_t encodeFixedHeader(char* destination, uint8_t fixedHeader, uint32_t remainingLength) {
+    destination[0] = fixedHeader;
+    return 1 + encodeRemainingLength(destination + 1, remainingLength);
+  }
+
+  // PINGREQ and DISCONNECT
+  static uint8_t encodeEmptyPacket(char* destination, uint8_t packetType, uint8_t headerFlags) {
+    return encodeFixedHeader(destination, fixedHeader(packetType, headerFlags), 0);
+  }
+
+  // With the reason code of MQTT 5 unless it is a normal disconnection, which can leave it out
+  static uint8_t encodeDisconnect(char* destination, uint8_t protocolVersion, uint8_t reasonCode) {
+    if (protocolVersion != ProtocolVersion.V5 || reasonCode == ReasonCode.NORMAL_DISCONNECTION) {
+      return encodeEmptyPacket(destination, PacketType.DISCONNECT, HeaderFlag.DISCONNECT_RESERVED);
+    }
+    uint8_t size = encodeFixedHeader(destination, fixedHeader(PacketType.DISCONNECT, HeaderFlag.DISCONNECT_RESERVED), 1);
+    destination[size] = reasonCode;
+    return size + 1;
+  }
+
+  // PUBACK, PUBREC, PUBREL and PUBCOMP
+  static uint8_t encodeAck(char* destination, uint8_t packetType, uint8_t headerFlags, uint16_t packetId) {
+    uint8_t size = encodeFixedHeader(destination, fixedHeader(packetType, headerFlags), 2);
+    return size + encodeUint16(destination + size, packetId);
+  }
+
+  // Up to the client id, followed by the client id, the will head, topic, payload length and payload, then
+  // the username and password, each after its length
+  static uint8_t encodeConnectHead(char* destination, const ConnectFields& fields) {
+    uint8_t size = encodeFixedHeader(destination, fixedHeader(PacketType.CONNECT, HeaderFlag.CONNECT_RESERVED), connectRemainingLength(fields));
+    size += encodeUint16(destination + size, 4);
+    destination[size++] = 'M';
+    destination[size++] = 'Q';
+    destination[size++] = 'T';
+    destination[size++] = 'T';
+    destination[size++] = fields.protocolVersion;
+    destination[size++] = fields.flags;
+    size += encodeUint16(destination + size, fields.keepAlive);
+    if (_isV5(fields.protocolVersion)) size += _encodeConnectProperties(destination + size, fields);
+    size += encodeUint16(destination + size, fields.clientIdLength);
+    return size;
+  }
+
+  // Followed by the will topic
+  static uint8_t encodeConnectWillHead(char* destination, uint8_t protocolVersion, uint16_t willTopicLength) {
+    uint8_t size = 0;
+    if (_isV5(protocolVersion)) destination[size++] = 0;  // no will properties
+    return size + encodeUint16(destination + size, willTopicLength);
+  }
+
+  // Followed by the topic, then the tail
+  static uint8_t encodePublishHead(char* destination, uint8_t fixedHeader, uint32_t remainingLength, uint16_t topicLength) {
+    uint8_t size = encodeFixedHeader(destination, fixedHeader, remainingLength);
+    return size + encodeUint16(destination + size, topicLength);
+  }
+
+  // Followed by the payload
+  static uint8_t encodePublishTail(char* destination, uint8_t qos, uint16_t packetId, uint8_t protocolVersion, uint16_t topicAlias) {
+    uint8_t size = 0;
+    if (qos != 0) size += encodeUint16(destination, packetId);
+    if (_isV5(protocolVersion)) {
+      destination[size++] = topicAlias != 0 ? 3 : 0;
+      if (topicAlias != 0) {
+        destination[size++] = Property.TOPIC_ALIAS;
+        size += encodeUint16(destination + size, topicAlias);
+      }
+    }
+    return size;
+  }
+
+  // Followed by the topic, then by the requested QoS for a SUBSCRIBE
+  static uint8_t encodeSubscribeHead(char* destination, uint8_t packetType, uint8_t protocolVersion, uint16_t packetId, uint16_t topicLength) {
+    uint8_t headerFlags = packetType == PacketType.SUBSCRIBE ? HeaderFlag.SUBSCRIBE_RESERVED : HeaderFlag.UNSUBSCRIBE_RESERVED;
+    uint32_t remainingLength = packetType == PacketType.SUBSCRIBE ? subscribeRemainingLength(protocolVersion, topicLength) : unsubscribeRemainingLength(protocolVersion, topicLength);
+    uint8_t size = encodeFixedHeader(destination, fixedHeader(packetType, headerFlags), remainingLength);
+    size += encodeUint16(destination + size, packetId);
+    if (_isV5(protocolVersion)) destination[size++] = 0;  // no properties
+    return size + encodeUint16(destination + size, topicLength);
+  }
+
+ private:
+  static constexpr bool _isV5(uint8_t protocolVersion) {
+    return protocolVersion == ProtocolVersion.V5;
+  }
+
+  static uint8_t _encodeConnectProperties(char* destination, const ConnectFields& fields) {
+    uint8_t size = encodeRemainingLength(destination, connectPropertiesLength(fields));
+    if ((fields.flags & ConnectFlag.CLEAN_SESSION) == 0) {
+      // keep the session forever, as MQTT 3.1.1 does
+      destination[size++] = Property.SESSION_EXPIRY_INTERVAL;
+      size += encodeUint16(destination + size, 0xFFFF);
+      size += encodeUint16(destination + size, 0xFFFF);
+    }
+    if (fields.topicAliasMaximum > 0) {
+      destination[size++] = Property.TOPIC_ALIAS_MAXIMUM;
+      size += encodeUint16(destination + size, fields.topicAliasMaximum);
+    }
+    if (fields.receiveMaximum > 0) {
+      destination[size++] = Property.RECEIVE_MAXIMUM;
+      size += encodeUint16(destination + size, fields.receiveMaximum);
+    }
+    if (fields.maximumPacketSize > 0) {
+      destination[size++] = Property.MAXIMUM_PACKET_SIZE;
+      size += encodeUint16(destination + size, fields.maximumPacketSize >> 16);
+      size += encodeUint16(destination + size, fields.maximumPacketSize & 0xFFFF);
+    }
+    return size;
+  }
+};
+}  // namespace AsyncMqttClientInternals
@@ -0,0 +1,154 @@
+#pragma once
+
+// Compile time configuration, to trim the client of what a build does not use.
+// Set with build flags, e.g. build_flags = -DASYNC_MQTT_QOS2=0 in platformio.ini.
+// A disabled feature takes neither code nor RAM.
+
+// QoS 2: the PUBREC, PUBREL and PUBCOMP exchanges and the state they need.
+// Without it, publish() returns 0 for QoS 2 and subscriptions are requested at QoS 1 at most.
+#ifndef ASYNC_MQTT_QOS2
+#define ASYNC_MQTT_QOS2 1
+#endif
+
+// publish() with a payload handler, for payloads larger than the TCP send buffer
+#ifndef ASYNC_MQTT_STREAMED_PAYLOADS
+#define ASYNC_MQTT_STREAMED_PAYLOADS 1
+#endif
+
+// User callbacks as std::function, which lambdas with captures need.
+// Without it they are plain function pointers.
+#ifndef ASYNC_MQTT_FUNCTION_CALLBACKS
+#define ASYNC_MQTT_FUNCTION_CALLBACKS 1
+#endif
+
+// Default of setMaxTopicLength(), the topic buffer takes one more byte
+#ifndef ASYNC_MQTT_MAX_TOPIC_LENGTH
+#define ASYNC_MQTT_MAX_TOPIC_LENGTH 128
+#endif
+
+// Default of setPublishQueueSize() on ESP32 and Linux
+#ifndef ASYNC_MQTT_PUBLISH_QUEUE_SIZE
+#define ASYNC_MQTT_PUBLISH_QUEUE_SIZE 0
+#endif
+
+// Default of setUrgentQueueSize() on ESP32 and Linux
+#ifndef ASYNC_MQTT_URGENT_QUEUE_SIZE
+#define ASYNC_MQTT_URGENT_QUEUE_SIZE 4
+#endif
+
+// Fixed capacities for the state of the client, so that it does not allocate once connected.
+// A broker sending more unacknowledged QoS 2 messages than ASYNC_MQTT_PENDING_PUBRELS, or an ack queue that
+// cannot be flushed, closes the connection. With MQTT 5, a receive maximum of at most ASYNC_MQTT_PENDING_PUBRELS
+// keeps the broker within it. setPublishQueueSize() and setMessageDispatch() still allocate for each message.
+#ifndef ASYNC_MQTT_FIXED_CAPACITY
+#define ASYNC_MQTT_FIXED_CAPACITY 0
+#endif
+
+// Received packets parsed in storage inside the client, as large as the largest of them, rather than on the heap.
+// ASYNC_MQTT_FIXED_CAPACITY needs it
+#ifndef ASYNC_MQTT_PACKET_STORAGE
+#define ASYNC_MQTT_PACKET_STORAGE 1
+#endif
+
+#if ASYNC_MQTT_FIXED_CAPACITY && !ASYNC_MQTT_PACKET_STORAGE
+#error "ASYNC_MQTT_FIXED_CAPACITY needs ASYNC_MQTT_PACKET_STORAGE"
+#endif
+
+#ifndef ASYNC_MQTT_ACK_QUEUE_SIZE
+#define ASYNC_MQTT_ACK_QUEUE_SIZE 32
+#endif
+
+#ifndef ASYNC_MQTT_PENDING_PUBRELS
+#define ASYNC_MQTT_PENDING_PUBRELS 16
+#endif
+
+#ifndef ASYNC_MQTT_MESSAGE_CALLBACKS
+#define ASYNC_MQTT_MESSAGE_CALLBACKS 4
+#endif
+
+// TLS on Linux, with OpenSSL: link with -lssl -lcrypto. On ESP, TLS is ASYNC_TCP_SSL_ENABLED of the TCP library
+#ifndef ASYNC_MQTT_OPENSSL
+#define ASYNC_MQTT_OPENSSL 0
+#endif
+
+#if ASYNC_TCP_SSL_ENABLED || ASYNC_MQTT_OPENSSL
+#define ASYNC_MQTT_TLS 1
+#else
+#define ASYNC_MQTT_TLS 0
+#endif
+
+#ifndef ASYNC_MQTT_SERVER_FINGERPRINTS
+#define ASYNC_MQTT_SERVER_FINGERPRINTS 4
+#endif
+
+// Addresses of the server kept by setAddressCache(), the records of its name past them are not tried
+#ifndef ASYNC_MQTT_CACHED_ADDRESSES
+#define ASYNC_MQTT_CACHED_ADDRESSES 4
+#endif
+
+// Packet ids handed out, from 1: at most as many packets waiting for their acknowledgement, QoS 1 and 2 publishes,
+// subscriptions and unsubscriptions together. Each id takes a bit, up to 65535.
+// 0 hands them out from a counter wrapping at 65535, without checking that an id is free and without getPacketIdStats()
+#ifndef ASYNC_MQTT_PACKET_IDS
+#define ASYNC_MQTT_PACKET_IDS 4096
+#endif
+
+// setPublishRateLimit(), addPublishRateLimit() and getRateStats()
+#ifndef ASYNC_MQTT_RATE_LIMITS
+#define ASYNC_MQTT_RATE_LIMITS 1
+#endif
+
+// addCoalescedTopic() and getCoalescedCount()
+#ifndef ASYNC_MQTT_COALESCING
+#define ASYNC_MQTT_COALESCING 1
+#endif
+
+// setMessageCache(), addCachedTopic() and getCachedMessage()
+#ifndef ASYNC_MQTT_MESSAGE_CACHE
+#define ASYNC_MQTT_MESSAGE_CACHE 1
+#endif
+
+// setRpc() and request()
+#ifndef ASYNC_MQTT_RPC
+#define ASYNC_MQTT_RPC 1
+#endif
+
+// addPayloadSink()
+#ifndef ASYNC_MQTT_PAYLOAD_SINKS
+#define ASYNC_MQTT_PAYLOAD_SINKS 1
+#endif
+
+// setAddressCache() and getConnectStats()
+#ifndef ASYNC_MQTT_ADDRESS_CACHE
+#define ASYNC_MQTT_ADDRESS_CACHE 1
+#endif
+
+// setPipelinedConnect(), and CONNECT encoded once for the connections to come rather than on each
+#ifndef ASYNC_MQTT_PIPELINING
+#define ASYNC_MQTT_PIPELINING 1
+#endif
+
+// setAckTimeout() and onTimeout()
+#ifndef ASYNC_MQTT_ACK_TIMEOUTS
+#define ASYNC_MQTT_ACK_TIMEOUTS 1
+#endif
+
+// nextDeadlineMs() and tick()
+#ifndef ASYNC_MQTT_DEADLINES
+#define ASYNC_MQTT_DEADLINES 1
+#endif
+
+// setOfflineBuffer(), setOfflineStore(), publishBuffered() and getOfflineStats()
+#ifndef ASYNC_MQTT_OFFLINE_BUFFER
+#define ASYNC_MQTT_OFFLINE_BUFFER 1
+#endif
+
+// setWriterBuffer() and publish() with a writer
+#ifndef ASYNC_MQTT_PAYLOAD_WRITER
+#define ASYNC_MQTT_PAYLOAD_WRITER 1
+#endif
+
+// publishUrgent() and setUrgentQueueSize(), on ESP32 and Linux
+#ifndef ASYNC_MQTT_URGENT_PUBLISHES
+#define ASYNC_MQTT_URGENT_PUBLISHES 1
+#endif
@@ -0,0 +1,13 @@
+#pragma once
+
+struct AsyncMqttClientConnectStats {
+  uint32_t connections;        // accepted by the server
+  uint32_t cached;             // of them, connect() went straight to a cached address
+  uint32_t fallbacks;          // an address of the cache was unreachable, the next one was tried
+  uint32_t resolutions;        // of the server name, by the cache
+  uint32_t failedResolutions;  // of them, failed: the cached addresses are kept
+  uint32_t lastResolveMs;      // duration of the last resolution
+  uint32_t lastConnectMs;      // from connect() to the acceptance of the last connection
+  uint32_t lastReadyMs;        // from connect() to the acknowledgement of the subscriptions made while connecting
+                               // and by the onConnect callback
+};
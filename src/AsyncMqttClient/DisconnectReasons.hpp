@@ -11,5 +11,7 @@ enum class AsyncMqttClientDisconnectReason : int8_t {
 
   ESP8266_NOT_ENOUGH_SPACE = 6,
 
-  TLS_BAD_FINGERPRINT = 7
+  TLS_BAD_FINGERPRINT = 7,
+
+  MQTT_PACKET_TOO_LARGE = 8
 };
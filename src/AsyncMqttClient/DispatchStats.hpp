@@ -0,0 +1,9 @@
+#pragma once
+
+struct AsyncMqttClientDispatchStats {
+  uint32_t messages;         // delivered to the message callbacks
+  uint16_t queueDepth;       // waiting in the queues right now
+  uint16_t maxQueueDepth;    // highest depth of a single worker queue
+  uint32_t averageLatency;   // from reception to delivery, in microseconds
+  uint32_t maxLatency;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "Config.hpp"
+
+namespace AsyncMqttClientInternals {
+// The part of std::vector the client uses, in storage fixed at compile time.
+// push_back() returns false when full, erase() moves the following elements down.
+template <typename T, size_t N>
+class FixedVector {
+ public:
+  FixedVector()
+  : _size(0) {
+  }
+
+  bool push_back(const T& item) {
+    if (_size == N) return false;
+    _items[_size++] = item;
+    return true;
+  }
+
+  T* erase(T* position) {
+    return erase(position, position + 1);
+  }
+
+  T* erase(T* first, T* last) {
+    T* destination = first;
+    for (T* source = last; source != end(); ++source) *destination++ = *source;
+    for (T* item = destination; item != end(); ++item) *item = T();  // releases what the item holds
+    _size = destination - _items;
+    return first;
+  }
+
+  void clear() {
+    erase(begin(), end());
+  }
+
+  void shrink_to_fit() {
+  }
+
+  T& operator[](size_t index) {
+    return _items[index];
+  }
+
+  const T& operator[](size_t index) const {
+    return _items[index];
+  }
+
+  T* begin() {
+    return _items;
+  }
+
+  T* end() {
+    return _items + _size;
+  }
+
+  const T* begin() const {
+    return _items;
+  }
+
+  const T* end() const {
+    return _items + _size;
+  }
+
+  size_t size() const {
+    return _size;
+  }
+
+  bool empty() const {
+    return _size == 0;
+  }
+
+  bool full() const {
+    return _size == N;
+  }
+
+  static constexpr size_t capacity() {
+    return N;
+  }
+
+ private:
+  T _items[N];
+  size_t _size;
+};
+
+// Containers of the client: fixed with ASYNC_MQTT_FIXED_CAPACITY, so that nothing is allocated once connected,
+// growing as needed otherwise. N is only the capacity of the fixed one.
+#if ASYNC_MQTT_FIXED_CAPACITY
+template <typename T, size_t N>
+using Vector = FixedVector<T, N>;
+#else
+template <typename T, size_t N>
+using Vector = std::vector<T>;
+#endif
+}  // namespace AsyncMqttClientInternals
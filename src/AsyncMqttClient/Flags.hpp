@@ -54,4 +54,44 @@ constexpr struct {
   const uint8_t CLEAN_SESSION = 0x02;
   const uint8_t RESERVED      = 0x00;
 } ConnectFlag;
+
+constexpr struct {
+  const uint8_t V3_1_1 = 0x04;
+  const uint8_t V5     = 0x05;
+} ProtocolVersion;
+
+constexpr struct {
+  const uint8_t PAYLOAD_FORMAT_INDICATOR          = 0x01;
+  const uint8_t MESSAGE_EXPIRY_INTERVAL           = 0x02;
+  const uint8_t CONTENT_TYPE                      = 0x03;
+  const uint8_t RESPONSE_TOPIC                    = 0x08;
+  const uint8_t CORRELATION_DATA                  = 0x09;
+  const uint8_t SUBSCRIPTION_IDENTIFIER           = 0x0B;
+  const uint8_t SESSION_EXPIRY_INTERVAL           = 0x11;
+  const uint8_t ASSIGNED_CLIENT_IDENTIFIER        = 0x12;
+  const uint8_t SERVER_KEEP_ALIVE                 = 0x13;
+  const uint8_t AUTHENTICATION_METHOD             = 0x15;
+  const uint8_t AUTHENTICATION_DATA               = 0x16;
+  const uint8_t REQUEST_PROBLEM_INFORMATION       = 0x17;
+  const uint8_t WILL_DELAY_INTERVAL               = 0x18;
+  const uint8_t REQUEST_RESPONSE_INFORMATION      = 0x19;
+  const uint8_t RESPONSE_INFORMATION              = 0x1A;
+  const uint8_t SERVER_REFERENCE                  = 0x1C;
+  const uint8_t REASON_STRING                     = 0x1F;
+  const uint8_t RECEIVE_MAXIMUM                   = 0x21;
+  const uint8_t TOPIC_ALIAS_MAXIMUM               = 0x22;
+  const uint8_t TOPIC_ALIAS                       = 0x23;
+  const uint8_t MAXIMUM_QOS                       = 0x24;
+  const uint8_t RETAIN_AVAILABLE                  = 0x25;
+  const uint8_t USER_PROPERTY                     = 0x26;
+  const uint8_t MAXIMUM_PACKET_SIZE               = 0x27;
+  const uint8_t WILDCARD_SUBSCRIPTION_AVAILABLE   = 0x28;
+  const uint8_t SUBSCRIPTION_IDENTIFIER_AVAILABLE = 0x29;
+  const uint8_t SHARED_SUBSCRIPTION_AVAILABLE     = 0x2A;
+} Property;
+
+constexpr struct {
+  const uint8_t NORMAL_DISCONNECTION = 0x00;
+  const uint8_t PACKET_TOO_LARGE     = 0x95;
+} ReasonCode;
 }  // namespace AsyncMqttClientInternals
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstring>
+
 namespace AsyncMqttClientInternals {
 class Helpers {
  public:
@@ -17,22 +19,37 @@ class Helpers {
     return value;
   }
 
-  static uint8_t encodeRemainingLength(uint32_t remainingLength, char* destination) {
-    uint8_t currentByte = 0;
-    uint8_t bytesNeeded = 0;
-
-    do {
-      uint8_t encodedByte = remainingLength % 128;
-      remainingLength /= 128;
-      if (remainingLength > 0) {
-        encodedByte = encodedByte | 128;
-      }
+  // FNV-1a
+  static uint32_t topicHash(const char* topic) {
+    uint32_t hash = 2166136261u;
+    while (*topic != '\0') {
+      hash ^= static_cast<uint8_t>(*topic++);
+      hash *= 16777619u;
+    }
+    return hash;
+  }
 
-      destination[currentByte++] = encodedByte;
-      bytesNeeded++;
-    } while (remainingLength > 0);
+  // MQTT wildcards: + matches a single level, # the remaining levels and their parent
+  static bool topicMatches(const char* filter, const char* topic) {
+    return topicMatches(filter, topic, strlen(topic));
+  }
 
-    return bytesNeeded;
+  // For a topic read from a packet, without terminator
+  static bool topicMatches(const char* filter, const char* topic, size_t topicLength) {
+    const char* end = topic + topicLength;
+    while (*filter != '\0') {
+      if (*filter == '#') return true;
+      if (*filter == '+') {
+        while (topic != end && *topic != '/') topic++;
+        filter++;
+        continue;
+      }
+      if (topic == end) return strcmp(filter, "/#") == 0;
+      if (*filter != *topic) return false;
+      filter++;
+      topic++;
+    }
+    return topic == end;
   }
 };
 }  // namespace AsyncMqttClientInternals
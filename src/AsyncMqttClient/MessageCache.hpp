@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+#include "Helpers.hpp"
+
+namespace AsyncMqttClientInternals {
+// Last complete payload of the received topics matching its filters, within a budget in bytes.
+// Entries are found by a hash of their topic, the least recently used ones are evicted to make room.
+// Not thread safe, the client lock is held to use it.
+class MessageCache {
+ public:
+  MessageCache()
+  : _filters()
+  , _budget(0)
+  , _used(0)
+  , _count(0)
+  , _buckets()
+  , _newest(nullptr)
+  , _oldest(nullptr)
+  , _partial(nullptr) {
+  }
+
+  ~MessageCache() {
+    while (_oldest != nullptr) _remove(_oldest);
+    _destroy(_partial);
+  }
+
+  void setBudget(size_t budget) {
+    _budget = budget;
+    _evict(0);
+  }
+
+  // The filter must stay valid
+  void add(const char* topicFilter) {
+    _filters.push_back(topicFilter);
+  }
+
+  bool enabled() const {
+    return _budget > 0 && !_filters.empty();
+  }
+
+  // A fragment of a received message, stored once complete. An empty retained message removes its topic
+  void receive(const char* topic, const char* payload, bool retain, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+      _destroy(_partial);  // cut by a disconnection
+      _partial = nullptr;
+      if (!_matches(topic)) return;
+      size_t topicLength = strlen(topic);
+      if (_cost(topicLength, total) > _budget) {
+        remove(topic);  // too large, the previous value is stale
+        return;
+      }
+      _partial = _create(topic, topicLength, total);
+    }
+    if (_partial == nullptr) return;
+    if (len > 0) memcpy(_payload(_partial) + index, payload, len);
+    if (index + len < total) return;
+
+    Entry* entry = _partial;
+    _partial = nullptr;
+    Entry* previous = _find(topic, entry->topicLength, entry->hash);
+    if (previous != nullptr) _remove(previous);
+    if (retain && total == 0) {
+      _destroy(entry);
+      return;
+    }
+    _insert(entry);
+  }
+
+  // Copies up to `size` bytes of the payload and sets its full length, returns false if the topic is not cached
+  bool get(const char* topic, char* payload, size_t size, size_t* length) {
+    Entry* entry = _find(topic, strlen(topic), Helpers::topicHash(topic));
+    if (entry == nullptr) return false;
+    _unlink(entry);
+    _link(entry);  // most recently used
+    *length = entry->payloadLength;
+    size_t copied = size < entry->payloadLength ? size : entry->payloadLength;
+    if (copied > 0) memcpy(payload, _payload(entry), copied);
+    return true;
+  }
+
+  void remove(const char* topic) {
+    Entry* entry = _find(topic, strlen(topic), Helpers::topicHash(topic));
+    if (entry != nullptr) _remove(entry);
+  }
+
+  size_t used() const {
+    return _used;
+  }
+
+  size_t size() const {
+    return _count;
+  }
+
+ private:
+  struct Entry {
+    Entry* next;  // in its bucket
+    Entry* newer;
+    Entry* older;
+    uint32_t hash;
+    size_t topicLength;
+    size_t payloadLength;
+    char* data;  // the topic, '\0', then the payload
+  };
+
+  static size_t _cost(size_t topicLength, size_t payloadLength) {
+    return sizeof(Entry) + topicLength + 1 + payloadLength;
+  }
+
+  static char* _payload(Entry* entry) {
+    return entry->data + entry->topicLength + 1;
+  }
+
+  static Entry* _create(const char* topic, size_t topicLength, size_t payloadLength) {
+    Entry* entry = new Entry { nullptr, nullptr, nullptr, Helpers::topicHash(topic), topicLength, payloadLength, nullptr };
+    entry->data = new char[topicLength + 1 + payloadLength];
+    memcpy(entry->data, topic, topicLength + 1);
+    return entry;
+  }
+
+  static void _destroy(Entry* entry) {
+    if (entry == nullptr) return;
+    delete[] entry->data;
+    delete entry;
+  }
+
+  bool _matches(const char* topic) const {
+    for (const char* filter : _filters) {
+      if (Helpers::topicMatches(filter, topic)) return true;
+    }
+    return false;
+  }
+
+  Entry* _find(const char* topic, size_t topicLength, uint32_t hash) const {
+    if (_buckets.empty()) return nullptr;
+    for (Entry* entry = _buckets[hash & (_buckets.size() - 1)]; entry != nullptr; entry = entry->next) {
+      if (entry->hash == hash && entry->topicLength == topicLength && memcmp(entry->data, topic, topicLength) == 0) return entry;
+    }
+    return nullptr;
+  }
+
+  void _insert(Entry* entry) {
+    size_t cost = _cost(entry->topicLength, entry->payloadLength);
+    _evict(cost);
+    if (_count + 1 > _buckets.size()) _rehash(_buckets.empty() ? 8 : _buckets.size() * 2);
+    Entry*& bucket = _buckets[entry->hash & (_buckets.size() - 1)];
+    entry->next = bucket;
+    bucket = entry;
+    _link(entry);
+    _used += cost;
+    _count++;
+  }
+
+  void _remove(Entry* entry) {
+    Entry** link = &_buckets[entry->hash & (_buckets.size() - 1)];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    _unlink(entry);
+    _used -= _cost(entry->topicLength, entry->payloadLength);
+    _count--;
+    _destroy(entry);
+  }
+
+  // Least recently used first, until `cost` more bytes fit
+  void _evict(size_t cost) {
+    while (_oldest != nullptr && _used + cost > _budget) _remove(_oldest);
+  }
+
+  void _rehash(size_t size) {
+    std::vector<Entry*> buckets(size, nullptr);
+    for (Entry* entry = _newest; entry != nullptr; entry = entry->older) {
+      Entry*& bucket = buckets[entry->hash & (size - 1)];
+      entry->next = bucket;
+      bucket = entry;
+    }
+    _buckets.swap(buckets);
+  }
+
+  void _link(Entry* entry) {
+    entry->newer = nullptr;
+    entry->older = _newest;
+    if (_newest != nullptr) _newest->newer = entry;
+    _newest = entry;
+    if (_oldest == nullptr) _oldest = entry;
+  }
+
+  void _unlink(Entry* entry) {
+    if (entry->newer != nullptr) {
+      entry->newer->older = entry->older;
+    } else {
+      _newest = entry->older;
+    }
+    if (entry->older != nullptr) {
+      entry->older->newer = entry->newer;
+    } else {
+      _oldest = entry->newer;
+    }
+  }
+
+  std::vector<const char*> _filters;
+  size_t _budget;
+  size_t _used;
+  size_t _count;
+  std::vector<Entry*> _buckets;  // a power of two of them, at least as many as entries
+  Entry* _newest;
+  Entry* _oldest;
+  Entry* _partial;  // the message being received
+};
+}  // namespace AsyncMqttClientInternals
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifdef ESP32
+#include <esp_pthread.h>
+#endif
+
+#include "Platform.hpp"
+#include "Callbacks.hpp"
+#include "DispatchStats.hpp"
+#include "Helpers.hpp"
+
+#ifndef ASYNC_MQTT_DISPATCH_STACK_SIZE
+#define ASYNC_MQTT_DISPATCH_STACK_SIZE 4096
+#endif
+
+namespace AsyncMqttClientInternals {
+// Delivers received messages on worker threads instead of the network task.
+// A topic always goes to the same worker, so the messages of a topic (and the chunks of a message) stay in order.
+class MessageDispatcher {
+ public:
+  MessageDispatcher()
+  : _workers(0)
+  , _queueSize(0)
+  , _shards(nullptr)
+  , _handler(nullptr) {
+  }
+
+  ~MessageDispatcher() {
+    end();
+  }
+
+  void begin(uint8_t workers, uint16_t queueSize, OnDispatchedMessageInternalCallback handler) {
+    end();
+    if (workers == 0 || queueSize == 0) return;
+
+    _workers = workers;
+    _queueSize = queueSize;
+    _handler = handler;
+    _shards = new Shard[_workers];
+
+#ifdef ESP32
+    esp_pthread_cfg_t config = esp_pthread_get_default_config();
+    config.stack_size = ASYNC_MQTT_DISPATCH_STACK_SIZE;
+    config.thread_name = "mqtt_dispatch";
+    esp_pthread_set_cfg(&config);
+#endif
+    for (uint8_t i = 0; i < _workers; i++) {
+      _shards[i].messages = new Message[_queueSize];
+      _shards[i].thread = std::thread(&MessageDispatcher::_work, this, &_shards[i]);
+    }
+#ifdef ESP32
+    config = esp_pthread_get_default_config();
+    esp_pthread_set_cfg(&config);
+#endif
+  }
+
+  // Waits for the queued messages to be delivered, must not be called from a message callback
+  void end() {
+    if (_shards == nullptr) return;
+
+    for (uint8_t i = 0; i < _workers; i++) {
+      {
+        std::lock_guard<std::mutex> lock(_shards[i].mutex);
+        _shards[i].stopping = true;
+      }
+      _shards[i].notEmpty.notify_one();
+    }
+    for (uint8_t i = 0; i < _workers; i++) {
+      _shards[i].thread.join();
+      delete[] _shards[i].messages;
+    }
+    delete[] _shards;
+    _shards = nullptr;
+    _workers = 0;
+  }
+
+  bool enabled() const {
+    return _shards != nullptr;
+  }
+
+  // Copies the message for its worker. If the worker is that far behind, waits for it,
+  // which stops reading the socket and lets TCP slow the broker down.
+  void dispatch(const char* topic, const char* payload, const AsyncMqttClientMessageProperties& properties, size_t len, size_t index, size_t total) {
+    size_t topicLength = strlen(topic);
+    Message message;
+    message.topic = new char[topicLength + 1 + len];
+    memcpy(message.topic, topic, topicLength + 1);
+    message.payload = message.topic + topicLength + 1;
+    if (len > 0) memcpy(message.payload, payload, len);
+    message.properties = properties;
+    message.len = len;
+    message.index = index;
+    message.total = total;
+    message.queuedAt = micros();
+
+    Shard& shard = _shards[Helpers::topicHash(topic) % _workers];
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    shard.notFull.wait(lock, [&]() { return shard.count < _queueSize; });
+    shard.messages[(shard.head + shard.count) % _queueSize] = message;
+    shard.count++;
+    if (shard.count > shard.maxDepth) shard.maxDepth = shard.count;
+    lock.unlock();
+    shard.notEmpty.notify_one();
+  }
+
+  AsyncMqttClientDispatchStats getStats() {
+    AsyncMqttClientDispatchStats stats = {};
+    uint64_t totalLatency = 0;
+    for (uint8_t i = 0; i < _workers; i++) {
+      std::lock_guard<std::mutex> lock(_shards[i].mutex);
+      stats.messages += _shards[i].delivered;
+      stats.queueDepth += _shards[i].count;
+      if (_shards[i].maxDepth > stats.maxQueueDepth) stats.maxQueueDepth = _shards[i].maxDepth;
+      if (_shards[i].maxLatency > stats.maxLatency) stats.maxLatency = _shards[i].maxLatency;
+      totalLatency += _shards[i].totalLatency;
+    }
+    if (stats.messages > 0) stats.averageLatency = totalLatency / stats.messages;
+    return stats;
+  }
+
+ private:
+  struct Message {
+    char* topic;  // the payload follows the topic in the same allocation
+    char* payload;
+    AsyncMqttClientMessageProperties properties;
+    size_t len;
+    size_t index;
+    size_t total;
+    uint32_t queuedAt;
+  };
+
+  struct Shard {
+    Shard()
+    : messages(nullptr)
+    , head(0)
+    , count(0)
+    , maxDepth(0)
+    , delivered(0)
+    , totalLatency(0)
+    , maxLatency(0)
+    , stopping(false) {
+    }
+
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::thread thread;
+    Message* messages;
+    uint16_t head;
+    uint16_t count;
+    uint16_t maxDepth;
+    uint32_t delivered;
+    uint64_t totalLatency;
+    uint32_t maxLatency;
+    bool stopping;
+  };
+
+  void _work(Shard* shard) {
+    std::unique_lock<std::mutex> lock(shard->mutex);
+    for (;;) {
+      shard->notEmpty.wait(lock, [&]() { return shard->count > 0 || shard->stopping; });
+      if (shard->count == 0) return;  // stopping, and everything was delivered
+
+      Message message = shard->messages[shard->head];
+      shard->head = (shard->head + 1) % _queueSize;
+      shard->count--;
+      uint32_t latency = micros() - message.queuedAt;
+      shard->delivered++;
+      shard->totalLatency += latency;
+      if (latency > shard->maxLatency) shard->maxLatency = latency;
+      lock.unlock();
+      shard->notFull.notify_one();
+
+      _handler(message.topic, message.payload, message.properties, message.len, message.index, message.total);
+      delete[] message.topic;
+
+      lock.lock();
+    }
+  }
+
+  uint8_t _workers;
+  uint16_t _queueSize;
+  Shard* _shards;
+  OnDispatchedMessageInternalCallback _handler;
+};
+}  // namespace AsyncMqttClientInternals
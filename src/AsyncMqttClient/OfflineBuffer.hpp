@@ -0,0 +1,220 @@
+#pragma once
+
+#include <vector>
+
+#include "OfflineStats.hpp"
+#include "OfflineStore.hpp"
+
+namespace AsyncMqttClientInternals {
+// The publishes made while offline, topic and payload in the ring of a store, their index in RAM in arrival order.
+// A message that does not fit first takes the room of the expired ones, then of the gaps the evicted ones left,
+// then evicts the oldest of the lowest priority, as long as it is not above its own. Used with the client lock held.
+class OfflineBuffer {
+ public:
+  struct Entry {
+    uint32_t offset;  // in the store, of the topic
+    uint32_t length;  // of the topic and the payload
+    uint32_t expiry;
+    uint16_t topicLength;
+    uint8_t priority;
+    uint8_t qos;
+    bool retain;
+    bool expires;
+  };
+
+  OfflineBuffer()
+  : _store(nullptr)
+  , _storeOwned(false)
+  , _capacity(0)
+  , _entries()
+  , _tail(0)
+  , _span(0)
+  , _bytes(0)
+  , _stats() {
+  }
+
+  ~OfflineBuffer() {
+    if (_storeOwned) delete _store;
+  }
+
+  // Owned if `owned`. To be called before connecting
+  void setStore(AsyncMqttClientOfflineStore* store, bool owned, uint16_t messages) {
+    if (_storeOwned) delete _store;
+    _store = store;
+    _storeOwned = owned;
+    _capacity = store != nullptr ? messages : 0;
+    _entries.clear();
+    _entries.reserve(_capacity);
+    _tail = 0;
+    _span = 0;
+    _bytes = 0;
+  }
+
+  bool enabled() const {
+    return _capacity > 0;
+  }
+
+  bool empty() const {
+    return _entries.empty();
+  }
+
+  // Returns false if the message was refused: larger than the store, or only messages of higher priority to evict
+  bool push(const char* topic, uint16_t topicLength, const char* payload, size_t payloadLength, uint8_t qos, bool retain, uint32_t now, uint32_t ttlMs, uint8_t priority) {
+    size_t length = topicLength + payloadLength;
+    if (length > _store->size() || !_makeRoom(length, now, priority)) {
+      _stats.dropped++;
+      return false;
+    }
+    if (!_write(_tail, reinterpret_cast<const uint8_t*>(topic), topicLength) || !_write((_tail + topicLength) % _store->size(), reinterpret_cast<const uint8_t*>(payload), payloadLength)) {
+      _stats.dropped++;
+      return false;
+    }
+    Entry entry;
+    entry.offset = _tail;
+    entry.length = length;
+    entry.expiry = now + ttlMs;
+    entry.topicLength = topicLength;
+    entry.priority = priority;
+    entry.qos = qos;
+    entry.retain = retain;
+    entry.expires = ttlMs > 0;
+    _entries.push_back(entry);
+    _tail = (_tail + length) % _store->size();
+    _span += length;
+    _bytes += length;
+    _stats.buffered++;
+    return true;
+  }
+
+  // The message to send next, the highest priority and then the oldest one, nullptr if none is left.
+  // Valid until the buffer changes
+  const Entry* next(uint32_t now) {
+    _dropExpired(now);
+    const Entry* next = nullptr;
+    for (const Entry& entry : _entries) {
+      if (next == nullptr || entry.priority > next->priority) next = &entry;
+    }
+    return next;
+  }
+
+  // `len` bytes of the topic and payload of `entry`, from `index`
+  bool read(const Entry& entry, size_t index, uint8_t* data, size_t len) {
+    return _read((entry.offset + index) % _store->size(), data, len);
+  }
+
+  void sent(const Entry* entry) {
+    _remove(entry - _entries.data());
+    _stats.sent++;
+  }
+
+  // Too large for the server, or unreadable
+  void drop(const Entry* entry) {
+    _remove(entry - _entries.data());
+    _stats.dropped++;
+  }
+
+  AsyncMqttClientOfflineStats stats() const {
+    AsyncMqttClientOfflineStats stats = _stats;
+    stats.pending = _entries.size();
+    stats.bytes = _bytes;
+    return stats;
+  }
+
+ private:
+  static const size_t CHUNK_SIZE = 64;
+
+  bool _makeRoom(size_t length, uint32_t now, uint8_t priority) {
+    _dropExpired(now);
+    while (_entries.size() >= _capacity || _store->size() - _span < length) {
+      if (_entries.size() < _capacity && _store->size() - _bytes >= length) {
+        _compact();  // the span is then the bytes of the messages
+        continue;
+      }
+      size_t victim = _entries.size();
+      for (size_t i = 0; i < _entries.size(); i++) {
+        if (victim == _entries.size() || _entries[i].priority < _entries[victim].priority) victim = i;
+      }
+      if (victim == _entries.size() || _entries[victim].priority > priority) return false;
+      _remove(victim);
+      _stats.dropped++;
+    }
+    return true;
+  }
+
+  void _dropExpired(uint32_t now) {
+    for (size_t i = 0; i < _entries.size();) {
+      if (_entries[i].expires && static_cast<int32_t>(now - _entries[i].expiry) >= 0) {
+        _remove(i);
+        _stats.expired++;
+      } else {
+        i++;
+      }
+    }
+  }
+
+  void _remove(size_t index) {
+    _bytes -= _entries[index].length;
+    _entries.erase(_entries.begin() + index);
+    if (_entries.empty()) {
+      _tail = 0;
+      _span = 0;
+    } else if (index == 0) {
+      _span = (_tail + _store->size() - _entries.front().offset) % _store->size();
+    }
+  }
+
+  // Moves the messages back to back behind the oldest one, closing the gaps of the evicted ones
+  void _compact() {
+    size_t size = _store->size();
+    uint32_t position = _entries.front().offset;
+    for (size_t i = 0; i < _entries.size();) {
+      Entry& entry = _entries[i];
+      if (entry.offset != position && !_move(entry.offset, position, entry.length)) {
+        _remove(i);
+        _stats.dropped++;
+        continue;
+      }
+      entry.offset = position;
+      position = (position + entry.length) % size;
+      i++;
+    }
+    _tail = position;
+    _span = _bytes;
+  }
+
+  // Forward, `to` behind `from`: the bytes yet to be read are never overwritten
+  bool _move(uint32_t from, uint32_t to, size_t len) {
+    uint8_t chunk[CHUNK_SIZE];
+    size_t size = _store->size();
+    while (len > 0) {
+      size_t copied = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+      if (!_read(from, chunk, copied) || !_write(to, chunk, copied)) return false;
+      from = (from + copied) % size;
+      to = (to + copied) % size;
+      len -= copied;
+    }
+    return true;
+  }
+
+  // Across the end of the ring
+  bool _read(size_t offset, uint8_t* data, size_t len) {
+    size_t first = len < _store->size() - offset ? len : _store->size() - offset;
+    return _store->read(offset, data, first) && (first == len || _store->read(0, data + first, len - first));
+  }
+
+  bool _write(size_t offset, const uint8_t* data, size_t len) {
+    if (len == 0) return true;
+    size_t first = len < _store->size() - offset ? len : _store->size() - offset;
+    return _store->write(offset, data, first) && (first == len || _store->write(0, data + first, len - first));
+  }
+
+  AsyncMqttClientOfflineStore* _store;
+  bool _storeOwned;
+  uint16_t _capacity;  // messages
+  std::vector<Entry> _entries;
+  uint32_t _tail;   // where the next message goes
+  size_t _span;     // from the oldest message to _tail, gaps included
+  size_t _bytes;    // of the messages
+  AsyncMqttClientOfflineStats _stats;
+};
+}  // namespace AsyncMqttClientInternals
@@ -0,0 +1,10 @@
+#pragma once
+
+struct AsyncMqttClientOfflineStats {
+  uint32_t buffered;  // publishes accepted while offline
+  uint32_t sent;      // of them, once connected
+  uint32_t expired;   // dropped once past their time to live
+  uint32_t dropped;   // evicted for a message of higher or equal priority, refused, or not stored
+  uint16_t pending;   // waiting in the buffer
+  size_t bytes;       // of topics and payloads waiting in the buffer
+};
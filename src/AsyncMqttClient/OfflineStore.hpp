@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "Platform.hpp"
+
+// The bytes of the publishes buffered while offline, topic then payload, in a ring of size() bytes: RAM, or a
+// flash partition or a file. The index of the messages is kept in RAM, so it does not outlive a reboot.
+// Called with the client lock held, on the task that publishes or on the network task.
+class AsyncMqttClientOfflineStore {
+ public:
+  virtual ~AsyncMqttClientOfflineStore() {}
+
+  virtual size_t size() const = 0;
+  // `len` bytes at `offset`, never past size(). Returns false if they could not be read
+  virtual bool read(size_t offset, uint8_t* data, size_t len) = 0;
+  // Returns false if they could not be written, the message is then dropped
+  virtual bool write(size_t offset, const uint8_t* data, size_t len) = 0;
+};
+
+// The store of setOfflineBuffer(size)
+class AsyncMqttClientRamStore : public AsyncMqttClientOfflineStore {
+ public:
+  explicit AsyncMqttClientRamStore(size_t size)
+  : _data(size) {
+  }
+
+  size_t size() const override {
+    return _data.size();
+  }
+
+  bool read(size_t offset, uint8_t* data, size_t len) override {
+    memcpy(data, _data.data() + offset, len);
+    return true;
+  }
+
+  bool write(size_t offset, const uint8_t* data, size_t len) override {
+    memcpy(_data.data() + offset, data, len);
+    return true;
+  }
+
+ private:
+  std::vector<uint8_t> _data;
+};
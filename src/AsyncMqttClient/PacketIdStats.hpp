@@ -0,0 +1,7 @@
+#pragma once
+
+struct AsyncMqttClientPacketIdStats {
+  uint16_t inUse;      // ids of packets sent or queued, waiting for their acknowledgement
+  uint16_t maxInUse;   // since the client was created
+  uint32_t exhausted;  // subscribe(), unsubscribe() or publish() found no free id and returned 0
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#if ASYNC_MQTT_MULTITHREADED
+#include <atomic>
+#endif
+
+#include "Config.hpp"
+#include "PacketIdStats.hpp"
+#include "Platform.hpp"
+
+namespace AsyncMqttClientInternals {
+#if ASYNC_MQTT_PACKET_IDS
+// Packet ids 1 to ASYNC_MQTT_PACKET_IDS, one bit each, set from the packet sent until its acknowledgement: an id is
+// never reused while a PUBACK, PUBCOMP, SUBACK or UNSUBACK for it may still come. The search for a free id starts
+// after the last one allocated and moves a word of 32 ids at a time. On ESP32 and Linux, allocate() and release()
+// can be called from any task without the client lock.
+class PacketIds {
+ public:
+  static const uint16_t COUNT = ASYNC_MQTT_PACKET_IDS;
+
+  PacketIds()
+  : _cursor(0)
+  , _inUse(0)
+  , _maxInUse(0)
+  , _exhausted(0) {
+    clear();
+  }
+
+  // 0 when every id is in use
+  uint16_t allocate() {
+    uint16_t start = _cursor;
+    uint16_t startWord = start / 32;
+    for (uint16_t i = 0; i <= WORDS; i++) {
+      uint16_t word = (startWord + i) % WORDS;
+      // the ids before the cursor come last, when the search is back to its first word
+      uint32_t skipped = i == 0 ? (1u << (start % 32)) - 1 : 0;
+      uint32_t bits = _load(word);
+      while ((bits | skipped) != FULL) {
+        uint8_t bit = __builtin_ctz(~(bits | skipped));
+        if (!_set(word, &bits, bits | (1u << bit))) continue;  // taken meanwhile, bits reloaded
+        uint16_t index = word * 32 + bit;
+        _cursor = (index + 1) % COUNT;
+        uint16_t inUse = ++_inUse;
+        if (inUse > _maxInUse) _maxInUse = inUse;
+        return index + 1;
+      }
+    }
+    _exhausted++;
+    return 0;
+  }
+
+  // Marks an id in use, for a retransmission keeping the id of its original. Returns false if it already was
+  bool reserve(uint16_t id) {
+    if (id == 0 || id > COUNT) return false;
+    uint32_t mask = 1u << ((id - 1) % 32);
+    uint16_t word = (id - 1) / 32;
+    uint32_t bits = _load(word);
+    while ((bits & mask) == 0) {
+      if (_set(word, &bits, bits | mask)) {
+        ++_inUse;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The acknowledgement of the packet came, or the packet was dropped before being sent
+  void release(uint16_t id) {
+    if (id == 0 || id > COUNT) return;
+    uint32_t mask = 1u << ((id - 1) % 32);
+    uint16_t word = (id - 1) / 32;
+    uint32_t bits = _load(word);
+    while ((bits & mask) != 0) {
+      if (_set(word, &bits, bits & ~mask)) {
+        --_inUse;
+        return;
+      }
+    }
+  }
+
+  // On disconnection, no acknowledgement can come anymore
+  void clear() {
+    for (uint16_t word = 0; word < WORDS; word++) _words[word] = 0;
+    if (COUNT % 32 != 0) _words[WORDS - 1] = ~((1u << (COUNT % 32)) - 1);  // past COUNT, never free
+    _cursor = 0;
+    _inUse = 0;
+  }
+
+  AsyncMqttClientPacketIdStats stats() const {
+    AsyncMqttClientPacketIdStats stats;
+    stats.inUse = _inUse;
+    stats.maxInUse = _maxInUse;
+    stats.exhausted = _exhausted;
+    return stats;
+  }
+
+ private:
+  static const uint16_t WORDS = (COUNT + 31) / 32;
+  static const uint32_t FULL = 0xFFFFFFFF;
+
+#if ASYNC_MQTT_MULTITHREADED
+  uint32_t _load(uint16_t word) const {
+    return _words[word].load(std::memory_order_relaxed);
+  }
+
+  // Replaces *expected with desired, or reloads *expected if the word changed
+  bool _set(uint16_t word, uint32_t* expected, uint32_t desired) {
+    return _words[word].compare_exchange_weak(*expected, desired, std::memory_order_acq_rel, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint32_t> _words[WORDS];
+  std::atomic<uint16_t> _cursor;
+  std::atomic<uint16_t> _inUse;
+  std::atomic<uint16_t> _maxInUse;  // racy maximum, a statistic
+  std::atomic<uint32_t> _exhausted;
+#else
+  uint32_t _load(uint16_t word) const {
+    return _words[word];
+  }
+
+  bool _set(uint16_t word, uint32_t* expected, uint32_t desired) {
+    (void)expected;
+    _words[word] = desired;
+    return true;
+  }
+
+  uint32_t _words[WORDS];
+  uint16_t _cursor;
+  uint16_t _inUse;
+  uint16_t _maxInUse;
+  uint32_t _exhausted;
+#endif
+};
+#else
+// Packet ids from a counter wrapping from 65535 to 1: an id waiting for its acknowledgement is handed out again after
+// 65535 others. On ESP32 and Linux, allocate() can be called from any task without the client lock.
+class PacketIds {
+ public:
+  PacketIds()
+  : _next(1) {
+  }
+
+  uint16_t allocate() {
+#if ASYNC_MQTT_MULTITHREADED
+    uint16_t id = _next.load(std::memory_order_relaxed);
+    while (!_next.compare_exchange_weak(id, id == 65535 ? 1 : id + 1, std::memory_order_relaxed)) {
+    }
+#else
+    uint16_t id = _next;
+    _next = id == 65535 ? 1 : id + 1;
+#endif
+    return id;
+  }
+
+  // Ids are not tracked, the one of a retransmission is never taken by it
+  bool reserve(uint16_t id) {
+    (void)id;
+    return false;
+  }
+
+  void release(uint16_t id) {
+    (void)id;
+  }
+
+  void clear() {
+  }
+
+ private:
+#if ASYNC_MQTT_MULTITHREADED
+  std::atomic<uint16_t> _next;
+#else
+  uint16_t _next;
+#endif
+};
+#endif
+}  // namespace AsyncMqttClientInternals
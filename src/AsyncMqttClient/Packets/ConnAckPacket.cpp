@@ -7,21 +7,30 @@ ConnAckPacket::ConnAckPacket(ParsingInformation* parsingInformation, OnConnAckIn
 , _callback(callback)
 , _bytePosition(0)
 , _sessionPresent(false)
-, _connectReturnCode(0) {
+, _connectReturnCode(0)
+, _propertiesParser() {
 }
 
 ConnAckPacket::~ConnAckPacket() {
 }
 
 void ConnAckPacket::parseVariableHeader(char* data, size_t len, size_t* currentBytePosition) {
-  char currentByte = data[(*currentBytePosition)++];
-  if (_bytePosition++ == 0) {
+  uint8_t currentByte = data[(*currentBytePosition)++];
+  if (_bytePosition == 0) {
     _sessionPresent = (currentByte << 7) >> 7;
-  } else {
+  } else if (_bytePosition == 1) {
     _connectReturnCode = currentByte;
-    _parsingInformation->bufferState = BufferState::NONE;
-    _callback(_sessionPresent, _connectReturnCode);
+  } else if (!_propertiesParser.parse(currentByte)) {
+    return;
   }
+  _bytePosition++;
+
+  if (_bytePosition == 1) return;
+  // MQTT 5 properties follow, unless a broker refusing MQTT 5 answered with a 3.1.1 CONNACK
+  if (_bytePosition == 2 && _parsingInformation->remainingLength > 2) return;
+
+  _parsingInformation->bufferState = BufferState::NONE;
+  _callback(_sessionPresent, _connectReturnCode, _propertiesParser.properties);
 }
 
 void ConnAckPacket::parsePayload(char* data, size_t len, size_t* currentBytePosition) {
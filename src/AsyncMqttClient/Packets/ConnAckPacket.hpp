@@ -1,8 +1,9 @@
 #pragma once
 
-#include "Arduino.h"
+#include "../Platform.hpp"
 #include "Packet.hpp"
 #include "../ParsingInformation.hpp"
+#include "../Properties.hpp"
 #include "../Callbacks.hpp"
 
 namespace AsyncMqttClientInternals {
@@ -21,5 +22,6 @@ class ConnAckPacket : public Packet {
   uint8_t _bytePosition;
   bool _sessionPresent;
   uint8_t _connectReturnCode;
+  PropertiesParser _propertiesParser;
 };
 }  // namespace AsyncMqttClientInternals
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 namespace AsyncMqttClientInternals {
 class Packet {
  public:
@@ -8,4 +10,20 @@ class Packet {
   virtual void parseVariableHeader(char* data, size_t len, size_t* currentBytePosition) = 0;
   virtual void parsePayload(char* data, size_t len, size_t* currentBytePosition) = 0;
 };
+
+// Size and alignment of the largest of the packet types, so that packets are parsed in place rather than on the heap
+template <typename... Packets>
+struct PacketStorage;
+
+template <typename P>
+struct PacketStorage<P> {
+  static const size_t SIZE = sizeof(P);
+  static const size_t ALIGNMENT = alignof(P);
+};
+
+template <typename P, typename... Rest>
+struct PacketStorage<P, Rest...> {
+  static const size_t SIZE = sizeof(P) > PacketStorage<Rest...>::SIZE ? sizeof(P) : PacketStorage<Rest...>::SIZE;
+  static const size_t ALIGNMENT = alignof(P) > PacketStorage<Rest...>::ALIGNMENT ? alignof(P) : PacketStorage<Rest...>::ALIGNMENT;
+};
 }  // namespace AsyncMqttClientInternals
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "Arduino.h"
+#include "../Platform.hpp"
 #include "Packet.hpp"
 #include "../ParsingInformation.hpp"
 #include "../Callbacks.hpp"
@@ -14,17 +14,29 @@ PubAckPacket::~PubAckPacket() {
 }
 
 void PubAckPacket::parseVariableHeader(char* data, size_t len, size_t* currentBytePosition) {
-  char currentByte = data[(*currentBytePosition)++];
+  uint8_t currentByte = data[(*currentBytePosition)++];
   if (_bytePosition++ == 0) {
     _packetIdMsb = currentByte;
   } else {
     _packetId = currentByte | _packetIdMsb << 8;
-    _parsingInformation->bufferState = BufferState::NONE;
-    _callback(_packetId);
+    if (_parsingInformation->remainingLength > 2) {
+      _parsingInformation->bufferState = BufferState::PAYLOAD;
+    } else {
+      _parsingInformation->bufferState = BufferState::NONE;
+      _callback(_packetId);
+    }
   }
 }
 
 void PubAckPacket::parsePayload(char* data, size_t len, size_t* currentBytePosition) {
-  (void)data;
-  (void)currentBytePosition;
+  // MQTT 5 reason code and properties are skipped
+  size_t remainToSkip = _parsingInformation->remainingLength - _bytePosition;
+  if (len - (*currentBytePosition) < remainToSkip) remainToSkip = len - (*currentBytePosition);
+  _bytePosition += remainToSkip;
+  (*currentBytePosition) += remainToSkip;
+
+  if (_bytePosition == _parsingInformation->remainingLength) {
+    _parsingInformation->bufferState = BufferState::NONE;
+    _callback(_packetId);
+  }
 }
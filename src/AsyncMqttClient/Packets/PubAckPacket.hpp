@@ -1,6 +1,6 @@
 #pragma once
 
-#include "Arduino.h"
+#include "../Platform.hpp"
 #include "Packet.hpp"
 #include "../ParsingInformation.hpp"
 #include "../Callbacks.hpp"
@@ -18,8 +18,8 @@ class PubAckPacket : public Packet {
   ParsingInformation* _parsingInformation;
   OnPubAckInternalCallback _callback;
 
-  uint8_t _bytePosition;
-  char _packetIdMsb;
+  uint32_t _bytePosition;
+  uint8_t _packetIdMsb;
   uint16_t _packetId;
 };
 }  // namespace AsyncMqttClientInternals
@@ -1,4 +1,5 @@
 #include "PublishPacket.hpp"
+#include "../Codec.hpp"
 
 using AsyncMqttClientInternals::PublishPacket;
 
@@ -16,7 +17,9 @@ PublishPacket::PublishPacket(ParsingInformation* parsingInformation, OnMessageIn
 , _packetIdMsb(0)
 , _packetId(0)
 , _payloadLength(0)
-, _payloadBytesRead(0) {
+, _payloadBytesRead(0)
+, _propertiesParser()
+, _propertiesParsed(false) {
     _dup = _parsingInformation->packetFlags & HeaderFlag.PUBLISH_DUP;
     _retain = _parsingInformation->packetFlags & HeaderFlag.PUBLISH_RETAIN;
     char qosMasked = _parsingInformation->packetFlags & 0x06;
@@ -37,9 +40,17 @@ PublishPacket::~PublishPacket() {
 }
 
 void PublishPacket::parseVariableHeader(char* data, size_t len, size_t* currentBytePosition) {
-  char currentByte = data[(*currentBytePosition)++];
+  uint8_t currentByte = data[(*currentBytePosition)++];
+  uint32_t topicEnd = 2 + _topicLength;
   if (_bytePosition == 0) {
     _topicLengthMsb = currentByte;
+    uint32_t remainingLength = _parsingInformation->remainingLength;
+    uint32_t packetSize = Codec::packetSize(remainingLength);
+    if (_parsingInformation->maximumPacketSize != 0 && packetSize > _parsingInformation->maximumPacketSize) {
+      // a protocol error with MQTT 5, which advertised the size. MQTT 3.1.1 did not, the publish is dropped
+      if (_parsingInformation->protocolVersion == ProtocolVersion.V5) _parsingInformation->packetTooLarge = true;
+      _ignore = true;
+    }
   } else if (_bytePosition == 1) {
     _topicLength = currentByte | _topicLengthMsb << 8;
     if (_topicLength > _parsingInformation->maxTopicLength) {
@@ -47,30 +58,51 @@ void PublishPacket::parseVariableHeader(char* data, size_t len, size_t* currentB
     } else {
       _parsingInformation->topicBuffer[_topicLength] = '\0';
     }
-  } else if (_bytePosition >= 2 && _bytePosition < 2 + _topicLength) {
+  } else if (_bytePosition < topicEnd) {
     // Starting from here, _ignore might be true
     if (!_ignore) _parsingInformation->topicBuffer[_bytePosition - 2] = currentByte;
-    if (_bytePosition == 2 + _topicLength - 1 && _qos == 0) {
-      _preparePayloadHandling(_parsingInformation->remainingLength - (_bytePosition + 1));
-      return;
-    }
-  } else if (_bytePosition == 2 + _topicLength) {
+  } else if (_qos != 0 && _bytePosition == topicEnd) {
     _packetIdMsb = currentByte;
-  } else {
+  } else if (_qos != 0 && _bytePosition == topicEnd + 1) {
     _packetId = currentByte | _packetIdMsb << 8;
-    _preparePayloadHandling(_parsingInformation->remainingLength - (_bytePosition + 1));
+  } else if (_propertiesParser.parse(currentByte)) {
+    _propertiesParsed = true;
   }
   _bytePosition++;
+
+  uint32_t headerLength = 2 + _topicLength;
+  if (_qos != 0) headerLength += 2;
+  if (_bytePosition < headerLength) return;
+  if (_parsingInformation->protocolVersion == ProtocolVersion.V5) {
+    if (!_propertiesParsed) return;
+    _resolveTopicAlias();
+  }
+  _preparePayloadHandling(_parsingInformation->remainingLength - _bytePosition);
+}
+
+void PublishPacket::_resolveTopicAlias() {
+  uint16_t topicAlias = _propertiesParser.properties.topicAlias;
+  if (_ignore || topicAlias == 0) return;
+
+  if (_topicLength == 0) {
+    const char* topic = _parsingInformation->topicAliases->get(topicAlias);
+    if (topic == nullptr) {
+      _ignore = true;
+    } else {
+      strcpy(_parsingInformation->topicBuffer, topic);
+    }
+  } else {
+    _parsingInformation->topicAliases->set(topicAlias, _parsingInformation->topicBuffer, _topicLength);
+  }
 }
 
 void PublishPacket::_preparePayloadHandling(uint32_t payloadLength) {
   _payloadLength = payloadLength;
   if (payloadLength == 0) {
     _parsingInformation->bufferState = BufferState::NONE;
-    if (!_ignore) {
-      _dataCallback(_parsingInformation->topicBuffer, nullptr, _qos, _dup, _retain, 0, 0, 0, _packetId);
-      _completeCallback(_packetId, _qos);
-    }
+    if (!_ignore) _dataCallback(_parsingInformation->topicBuffer, nullptr, _qos, _dup, _retain, 0, 0, 0, _packetId);
+    // an ignored publish is acknowledged all the same, not to hold the broker's quota of unacknowledged ones
+    _completeCallback(_packetId, _qos);
   } else {
     _parsingInformation->bufferState = BufferState::PAYLOAD;
   }
@@ -86,6 +118,6 @@ void PublishPacket::parsePayload(char* data, size_t len, size_t* currentBytePosi
 
   if (_payloadBytesRead == _payloadLength) {
     _parsingInformation->bufferState = BufferState::NONE;
-    if (!_ignore) _completeCallback(_packetId, _qos);
+    _completeCallback(_packetId, _qos);
   }
 }
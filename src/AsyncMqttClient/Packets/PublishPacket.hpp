@@ -1,9 +1,10 @@
 #pragma once
 
-#include "Arduino.h"
+#include "../Platform.hpp"
 #include "Packet.hpp"
 #include "../Flags.hpp"
 #include "../ParsingInformation.hpp"
+#include "../Properties.hpp"
 #include "../Callbacks.hpp"
 
 namespace AsyncMqttClientInternals {
@@ -21,18 +22,21 @@ class PublishPacket : public Packet {
   OnPublishInternalCallback _completeCallback;
 
   void _preparePayloadHandling(uint32_t payloadLength);
+  void _resolveTopicAlias();
 
   bool _dup;
   uint8_t _qos;
   bool _retain;
 
-  uint8_t _bytePosition;
-  char _topicLengthMsb;
+  uint32_t _bytePosition;
+  uint8_t _topicLengthMsb;
   uint16_t _topicLength;
   bool _ignore;
-  char _packetIdMsb;
+  uint8_t _packetIdMsb;
   uint16_t _packetId;
   uint32_t _payloadLength;
   uint32_t _payloadBytesRead;
+  PropertiesParser _propertiesParser;
+  bool _propertiesParsed;
 };
 }  // namespace AsyncMqttClientInternals
@@ -7,20 +7,24 @@ SubAckPacket::SubAckPacket(ParsingInformation* parsingInformation, OnSubAckInter
 , _callback(callback)
 , _bytePosition(0)
 , _packetIdMsb(0)
-, _packetId(0) {
+, _packetId(0)
+, _propertiesParser() {
 }
 
 SubAckPacket::~SubAckPacket() {
 }
 
 void SubAckPacket::parseVariableHeader(char* data, size_t len, size_t* currentBytePosition) {
-  char currentByte = data[(*currentBytePosition)++];
-  if (_bytePosition++ == 0) {
+  uint8_t currentByte = data[(*currentBytePosition)++];
+  if (_bytePosition == 0) {
     _packetIdMsb = currentByte;
-  } else {
+  } else if (_bytePosition == 1) {
     _packetId = currentByte | _packetIdMsb << 8;
+    if (_parsingInformation->protocolVersion != ProtocolVersion.V5) _parsingInformation->bufferState = BufferState::PAYLOAD;
+  } else if (_propertiesParser.parse(currentByte)) {
     _parsingInformation->bufferState = BufferState::PAYLOAD;
   }
+  _bytePosition++;
 }
 
 void SubAckPacket::parsePayload(char* data, size_t len, size_t* currentBytePosition) {
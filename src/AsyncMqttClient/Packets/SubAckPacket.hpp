@@ -1,8 +1,10 @@
 #pragma once
 
-#include "Arduino.h"
+#include "../Platform.hpp"
 #include "Packet.hpp"
+#include "../Flags.hpp"
 #include "../ParsingInformation.hpp"
+#include "../Properties.hpp"
 #include "../Callbacks.hpp"
 
 namespace AsyncMqttClientInternals {
@@ -18,8 +20,9 @@ class SubAckPacket : public Packet {
   ParsingInformation* _parsingInformation;
   OnSubAckInternalCallback _callback;
 
-  uint8_t _bytePosition;
-  char _packetIdMsb;
+  uint32_t _bytePosition;
+  uint8_t _packetIdMsb;
   uint16_t _packetId;
+  PropertiesParser _propertiesParser;
 };
 }  // namespace AsyncMqttClientInternals
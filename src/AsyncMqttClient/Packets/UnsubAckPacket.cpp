@@ -7,24 +7,39 @@ UnsubAckPacket::UnsubAckPacket(ParsingInformation* parsingInformation, OnUnsubAc
 , _callback(callback)
 , _bytePosition(0)
 , _packetIdMsb(0)
-, _packetId(0) {
+, _packetId(0)
+, _propertiesParser() {
 }
 
 UnsubAckPacket::~UnsubAckPacket() {
 }
 
 void UnsubAckPacket::parseVariableHeader(char* data, size_t len, size_t* currentBytePosition) {
-  char currentByte = data[(*currentBytePosition)++];
-  if (_bytePosition++ == 0) {
+  uint8_t currentByte = data[(*currentBytePosition)++];
+  if (_bytePosition == 0) {
     _packetIdMsb = currentByte;
-  } else {
+  } else if (_bytePosition == 1) {
     _packetId = currentByte | _packetIdMsb << 8;
+  } else if (_propertiesParser.parse(currentByte)) {
+    _parsingInformation->bufferState = BufferState::PAYLOAD;
+  }
+  _bytePosition++;
+
+  if (_bytePosition == 2 && _parsingInformation->protocolVersion != ProtocolVersion.V5) {
     _parsingInformation->bufferState = BufferState::NONE;
     _callback(_packetId);
   }
 }
 
 void UnsubAckPacket::parsePayload(char* data, size_t len, size_t* currentBytePosition) {
-  (void)data;
-  (void)currentBytePosition;
+  // MQTT 5 reason codes are skipped
+  size_t remainToSkip = _parsingInformation->remainingLength - _bytePosition;
+  if (len - (*currentBytePosition) < remainToSkip) remainToSkip = len - (*currentBytePosition);
+  _bytePosition += remainToSkip;
+  (*currentBytePosition) += remainToSkip;
+
+  if (_bytePosition == _parsingInformation->remainingLength) {
+    _parsingInformation->bufferState = BufferState::NONE;
+    _callback(_packetId);
+  }
 }
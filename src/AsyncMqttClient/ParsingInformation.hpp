@@ -1,5 +1,7 @@
 #pragma once
 
+#include "TopicAliases.hpp"
+
 namespace AsyncMqttClientInternals {
 enum class BufferState : uint8_t {
   NONE = 0,
@@ -11,8 +13,13 @@ enum class BufferState : uint8_t {
 struct ParsingInformation {
   BufferState bufferState;
 
+  uint8_t protocolVersion;
+  InboundTopicAliases* topicAliases;
+
   uint16_t maxTopicLength;
   char* topicBuffer;
+  uint32_t maximumPacketSize;
+  bool packetTooLarge;  // an MQTT 5 packet over maximumPacketSize, the connection is to be closed
 
   uint8_t packetType;
   uint16_t packetFlags;
@@ -0,0 +1,235 @@
+#pragma once
+
+#if ASYNC_MQTT_MULTITHREADED
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#ifdef ESP32
+#include <esp_pthread.h>
+#endif
+
+#include "Platform.hpp"
+#include "Sha256.hpp"
+
+#ifndef ASYNC_MQTT_SINK_STACK_SIZE
+#define ASYNC_MQTT_SINK_STACK_SIZE 4096
+#endif
+
+// Receives the payloads of the topics of a filter as they arrive, in place of the onMessage handlers.
+// Called on the network task: the time it takes holds up the connection.
+class AsyncMqttClientPayloadSink {
+ public:
+  virtual ~AsyncMqttClientPayloadSink() {}
+
+  // A payload of `total` bytes starts, returns false to drop it
+  virtual bool begin(const char* topic, size_t total) = 0;
+  // The next bytes of the payload, from `index`. Returns false to abort it
+  virtual bool write(const uint8_t* data, size_t len, size_t index) = 0;
+  // The last byte was written
+  virtual void end() = 0;
+  // The payload was cut by a disconnection, or write() returned false
+  virtual void abort() = 0;
+};
+
+// Hands the payload over in blocks of `blockSize` bytes, e.g. flash sectors, and hashes it with SHA-256 as it
+// arrives: the digest is known once the last block is written. On ESP32 and Linux the blocks are written on a
+// task of their own, started with the first payload and kept until the sink is destroyed, the network filling a
+// buffer while the other one is written.
+class AsyncMqttClientBlockSink : public AsyncMqttClientPayloadSink {
+ public:
+  explicit AsyncMqttClientBlockSink(size_t blockSize = 4096)
+  : _blockSize(blockSize > 0 ? blockSize : 1)
+  , _buffers{ nullptr, nullptr }
+  , _filling(0)
+  , _filled(0)
+  , _offset(0)
+  , _hash()
+  , _failed(false)
+#if ASYNC_MQTT_MULTITHREADED
+  , _thread()
+  , _mutex()
+  , _wake()
+  , _idle()
+  , _block(nullptr)
+  , _blockLength(0)
+  , _blockOffset(0)
+  , _writing(false)
+  , _stopping(false)
+#endif
+  {
+  }
+
+  ~AsyncMqttClientBlockSink() {
+    _release();
+#if ASYNC_MQTT_MULTITHREADED
+    if (_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+      }
+      _wake.notify_one();
+      _thread.join();
+    }
+#endif
+  }
+
+  bool begin(const char* topic, size_t total) override {
+    _release();
+    if (!open(topic, total)) return false;
+#if ASYNC_MQTT_MULTITHREADED
+    _buffers[1] = new uint8_t[_blockSize];
+#endif
+    _buffers[0] = new uint8_t[_blockSize];
+    _filling = 0;
+    _filled = 0;
+    _offset = 0;
+    _hash.reset();
+    _failed = false;
+#if ASYNC_MQTT_MULTITHREADED
+    if (_thread.joinable()) return true;
+#ifdef ESP32
+    esp_pthread_cfg_t config = esp_pthread_get_default_config();
+    config.stack_size = ASYNC_MQTT_SINK_STACK_SIZE;
+    config.thread_name = "mqtt_sink";
+    esp_pthread_set_cfg(&config);
+#endif
+    _thread = std::thread(&AsyncMqttClientBlockSink::_work, this);
+#ifdef ESP32
+    config = esp_pthread_get_default_config();
+    esp_pthread_set_cfg(&config);
+#endif
+#endif
+    return true;
+  }
+
+  bool write(const uint8_t* data, size_t len, size_t index) override {
+    (void)index;
+    _hash.update(data, len);
+    while (len > 0) {
+      size_t copied = len < _blockSize - _filled ? len : _blockSize - _filled;
+      memcpy(_buffers[_filling] + _filled, data, copied);
+      _filled += copied;
+      data += copied;
+      len -= copied;
+      if (_filled == _blockSize && !_submit()) return false;
+    }
+    return true;
+  }
+
+  void end() override {
+    bool written = (_filled == 0 || _submit()) && _wait();
+    if (written) {
+      uint8_t digest[AsyncMqttClientInternals::Sha256::DIGEST_SIZE];
+      _hash.finish(digest);
+      close(digest);
+    } else {
+      cancel();
+    }
+    _release();
+  }
+
+  void abort() override {
+    _wait();
+    cancel();
+    _release();
+  }
+
+ protected:
+  // e.g. Update.begin(total). Returns false to drop the payload
+  virtual bool open(const char* topic, size_t total) {
+    (void)topic;
+    (void)total;
+    return true;
+  }
+
+  // `length` is the block size but for the last block. Returns false to abort the payload
+  virtual bool writeBlock(const uint8_t* block, size_t length, size_t offset) = 0;
+
+  // All blocks are written, with the SHA-256 of the payload to check it against the expected one
+  virtual void close(const uint8_t* digest) = 0;
+
+  // The payload was aborted or a block could not be written, no block is being written anymore
+  virtual void cancel() {}
+
+ private:
+  // Hands the filled buffer over and moves on to the other one. Returns false if a block could not be written
+  bool _submit() {
+#if ASYNC_MQTT_MULTITHREADED
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this] { return !_writing; });  // the other buffer is free again
+    if (_failed) return false;
+    _block = _buffers[_filling];
+    _blockLength = _filled;
+    _blockOffset = _offset;
+    _writing = true;
+    lock.unlock();
+    _wake.notify_one();
+    _filling ^= 1;
+#else
+    if (!writeBlock(_buffers[_filling], _filled, _offset)) {
+      _failed = true;
+      return false;
+    }
+#endif
+    _offset += _filled;
+    _filled = 0;
+    return true;
+  }
+
+  // Until the last block handed over is written, returns false if a block could not be
+  bool _wait() {
+#if ASYNC_MQTT_MULTITHREADED
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this] { return !_writing; });
+#endif
+    return !_failed;
+  }
+
+  // The buffers of the payload, once its last block handed over is written
+  void _release() {
+#if ASYNC_MQTT_MULTITHREADED
+    _wait();
+    delete[] _buffers[1];
+    _buffers[1] = nullptr;
+#endif
+    delete[] _buffers[0];
+    _buffers[0] = nullptr;
+  }
+
+#if ASYNC_MQTT_MULTITHREADED
+  void _work() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+      _wake.wait(lock, [this] { return _writing || _stopping; });
+      if (!_writing) return;
+      lock.unlock();
+      bool written = writeBlock(_block, _blockLength, _blockOffset);
+      lock.lock();
+      if (!written) _failed = true;
+      _writing = false;
+      _idle.notify_one();
+    }
+  }
+#endif
+
+  size_t _blockSize;
+  uint8_t* _buffers[2];
+  uint8_t _filling;
+  size_t _filled;
+  size_t _offset;  // in the payload, of the buffer being filled
+  AsyncMqttClientInternals::Sha256 _hash;
+  bool _failed;
+#if ASYNC_MQTT_MULTITHREADED
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _idle;
+  const uint8_t* _block;  // being written
+  size_t _blockLength;
+  size_t _blockOffset;
+  bool _writing;
+  bool _stopping;
+#endif
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+
+#include "Helpers.hpp"
+#include "PayloadSink.hpp"
+
+namespace AsyncMqttClientInternals {
+// Routes the received messages to the sink of the first filter matching their topic, fragment by fragment.
+// Used on the network task only.
+class PayloadSinks {
+ public:
+  PayloadSinks()
+  : _routes()
+  , _receiving(false)
+  , _active(nullptr) {
+  }
+
+  // To be called before connecting, the filter and the sink must stay valid
+  void add(const char* topicFilter, AsyncMqttClientPayloadSink* sink) {
+    _routes.push_back(Route { topicFilter, sink });
+  }
+
+  bool enabled() const {
+    return !_routes.empty();
+  }
+
+  // A fragment of a received message, returns false if its topic has no sink
+  bool receive(const char* topic, const char* payload, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+      abort();  // cut by a disconnection
+      AsyncMqttClientPayloadSink* sink = _match(topic);
+      if (sink == nullptr) return false;
+      _receiving = true;
+      if (sink->begin(topic, total)) _active = sink;
+    }
+    if (!_receiving) return false;
+    if (_active == nullptr) return true;  // dropped by its sink
+
+    AsyncMqttClientPayloadSink* sink = _active;
+    if (len > 0 && !sink->write(reinterpret_cast<const uint8_t*>(payload), len, index)) {
+      _active = nullptr;
+      sink->abort();
+    } else if (index + len == total) {
+      _active = nullptr;
+      _receiving = false;
+      sink->end();
+    }
+    return true;
+  }
+
+  // The message being received was cut
+  void abort() {
+    _receiving = false;
+    if (_active == nullptr) return;
+    AsyncMqttClientPayloadSink* sink = _active;
+    _active = nullptr;
+    sink->abort();
+  }
+
+ private:
+  struct Route {
+    const char* topicFilter;
+    AsyncMqttClientPayloadSink* sink;
+  };
+
+  AsyncMqttClientPayloadSink* _match(const char* topic) const {
+    for (const Route& route : _routes) {
+      if (Helpers::topicMatches(route.topicFilter, topic)) return route.sink;
+    }
+    return nullptr;
+  }
+
+  std::vector<Route> _routes;
+  bool _receiving;  // the message being received has a sink, even if it dropped it
+  AsyncMqttClientPayloadSink* _active;
+};
+}  // namespace AsyncMqttClientInternals
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <math.h>
+#include <type_traits>
+
+#include "Platform.hpp"
+
+// The payload of publish() with a writer, serialised straight into the packet after its topic. Bounded by the
+// buffer of setWriterBuffer(): a write past it fails the publish, as cancel() does.
+class AsyncMqttClientWriter {
+ public:
+  AsyncMqttClientWriter(char* buffer, size_t capacity)
+  : _buffer(buffer)
+  , _capacity(capacity)
+  , _length(0)
+  , _failed(false) {
+  }
+
+  bool write(const void* data, size_t len) {
+    if (_failed || len > _capacity - _length) {
+      _failed = true;
+      return false;
+    }
+    memcpy(_buffer + _length, data, len);
+    _length += len;
+    return true;
+  }
+
+  bool put(uint8_t byte) {
+    return write(&byte, 1);
+  }
+
+  // The payload is not published
+  void cancel() {
+    _failed = true;
+  }
+
+  const char* data() const {
+    return _buffer;
+  }
+
+  size_t length() const {
+    return _length;
+  }
+
+  size_t remaining() const {
+    return _capacity - _length;
+  }
+
+  bool failed() const {
+    return _failed;
+  }
+
+ private:
+  char* _buffer;
+  size_t _capacity;
+  size_t _length;
+  bool _failed;
+};
+
+// JSON, the commas and colons written as the members and elements come. Up to 32 levels of nesting
+class AsyncMqttClientJsonWriter {
+ public:
+  explicit AsyncMqttClientJsonWriter(AsyncMqttClientWriter& writer)
+  : _writer(writer)
+  , _depth(0)
+  , _empty(0)
+  , _afterKey(false) {
+  }
+
+  AsyncMqttClientJsonWriter& beginObject() {
+    return _open('{');
+  }
+
+  AsyncMqttClientJsonWriter& endObject() {
+    return _close('}');
+  }
+
+  AsyncMqttClientJsonWriter& beginArray() {
+    return _open('[');
+  }
+
+  AsyncMqttClientJsonWriter& endArray() {
+    return _close(']');
+  }
+
+  AsyncMqttClientJsonWriter& key(const char* name) {
+    value(name);
+    _writer.put(':');
+    _afterKey = true;
+    return *this;
+  }
+
+  AsyncMqttClientJsonWriter& value(const char* text) {
+    return value(text, strlen(text));
+  }
+
+  // Escaped, `text` in UTF-8
+  AsyncMqttClientJsonWriter& value(const char* text, size_t len) {
+    _separate();
+    _writer.put('"');
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+      uint8_t c = text[i];
+      if (c >= 0x20 && c != '"' && c != '\\') continue;
+      _writer.write(text + start, i - start);
+      start = i + 1;
+      char escape[7] = { '\\', static_cast<char>(c), 0 };
+      if (c == '\n') escape[1] = 'n';
+      if (c == '\r') escape[1] = 'r';
+      if (c == '\t') escape[1] = 't';
+      if (c >= 0x20 || c == '\n' || c == '\r' || c == '\t') {
+        _writer.write(escape, 2);
+      } else {
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        _writer.write(escape, 6);
+      }
+    }
+    _writer.write(text + start, len - start);
+    _writer.put('"');
+    return *this;
+  }
+
+  AsyncMqttClientJsonWriter& value(bool value) {
+    _separate();
+    if (value) {
+      _writer.write("true", 4);
+    } else {
+      _writer.write("false", 5);
+    }
+    return *this;
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, AsyncMqttClientJsonWriter&>::type value(T value) {
+    _separate();
+    if (value < 0) _writer.put('-');
+    // the magnitude of the smallest value does not fit in T
+    _digits(value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value));
+    return *this;
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value, AsyncMqttClientJsonWriter&>::type value(T value) {
+    _separate();
+    _digits(value);
+    return *this;
+  }
+
+  // With `precision` significant digits, null for NaN and infinities which JSON does not have
+  AsyncMqttClientJsonWriter& value(double value, uint8_t precision = 6) {
+    if (isnan(value) || isinf(value)) return null();
+    _separate();
+    char number[32];
+    int length = snprintf(number, sizeof(number), "%.*g", precision < 17 ? precision : 17, value);
+    _writer.write(number, length);
+    return *this;
+  }
+
+  AsyncMqttClientJsonWriter& null() {
+    _separate();
+    _writer.write("null", 4);
+    return *this;
+  }
+
+  // Already encoded JSON, e.g. a constant fragment
+  AsyncMqttClientJsonWriter& raw(const char* json) {
+    _separate();
+    _writer.write(json, strlen(json));
+    return *this;
+  }
+
+ private:
+  AsyncMqttClientJsonWriter& _open(char bracket) {
+    _separate();
+    _writer.put(bracket);
+    if (_depth == 32) _writer.cancel();
+    _empty |= 1u << (_depth++ % 32);
+    return *this;
+  }
+
+  AsyncMqttClientJsonWriter& _close(char bracket) {
+    _writer.put(bracket);
+    if (_depth > 0) _depth--;
+    return *this;
+  }
+
+  // The comma before a member or an element but the first
+  void _separate() {
+    if (_afterKey) {
+      _afterKey = false;
+      return;
+    }
+    if (_depth == 0) return;
+    uint32_t bit = 1u << ((_depth - 1) % 32);
+    if ((_empty & bit) == 0) _writer.put(',');
+    _empty &= ~bit;
+  }
+
+  void _digits(uint64_t value) {
+    char digits[20];
+    uint8_t count = 0;
+    do {
+      digits[sizeof(digits) - ++count] = '0' + value % 10;
+      value /= 10;
+    } while (value != 0);
+    _writer.write(digits + sizeof(digits) - count, count);
+  }
+
+  AsyncMqttClientWriter& _writer;
+  uint8_t _depth;
+  uint32_t _empty;  // per level, no member or element written yet
+  bool _afterKey;
+};
+
+// CBOR (RFC 8949). beginMap() and beginArray() have an indefinite length and need end(), map(size) and array(size)
+// are followed by `size` pairs or elements
+class AsyncMqttClientCborWriter {
+ public:
+  explicit AsyncMqttClientCborWriter(AsyncMqttClientWriter& writer)
+  : _writer(writer) {
+  }
+
+  AsyncMqttClientCborWriter& beginMap() {
+    _writer.put(0xBF);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& beginArray() {
+    _writer.put(0x9F);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& end() {
+    _writer.put(0xFF);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& map(uint32_t size) {
+    _head(MAP, size);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& array(uint32_t size) {
+    _head(ARRAY, size);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& key(const char* name) {
+    return value(name);
+  }
+
+  AsyncMqttClientCborWriter& value(const char* text) {
+    return value(text, strlen(text));
+  }
+
+  // A text string, `text` in UTF-8
+  AsyncMqttClientCborWriter& value(const char* text, size_t len) {
+    _head(TEXT, len);
+    _writer.write(text, len);
+    return *this;
+  }
+
+  // A byte string
+  AsyncMqttClientCborWriter& bytes(const uint8_t* data, size_t len) {
+    _head(BYTES, len);
+    _writer.write(data, len);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& value(bool value) {
+    _writer.put(value ? 0xF5 : 0xF4);
+    return *this;
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, AsyncMqttClientCborWriter&>::type value(T value) {
+    if (value < 0) {
+      _head(NEGATIVE, static_cast<uint64_t>(-(value + 1)));  // -1 - n
+    } else {
+      _head(UNSIGNED, static_cast<uint64_t>(value));
+    }
+    return *this;
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value, AsyncMqttClientCborWriter&>::type value(T value) {
+    _head(UNSIGNED, value);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& value(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    _writer.put(0xFA);
+    _bigEndian(bits, 4);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& value(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    _writer.put(0xFB);
+    _bigEndian(bits, 8);
+    return *this;
+  }
+
+  AsyncMqttClientCborWriter& null() {
+    _writer.put(0xF6);
+    return *this;
+  }
+
+ private:
+  static const uint8_t UNSIGNED = 0;
+  static const uint8_t NEGATIVE = 1;
+  static const uint8_t BYTES = 2;
+  static const uint8_t TEXT = 3;
+  static const uint8_t ARRAY = 4;
+  static const uint8_t MAP = 5;
+
+  // The major type and its argument, in the shortest form
+  void _head(uint8_t major, uint64_t argument) {
+    uint8_t type = major << 5;
+    if (argument < 24) {
+      _writer.put(type | argument);
+    } else if (argument <= 0xFF) {
+      _writer.put(type | 24);
+      _bigEndian(argument, 1);
+    } else if (argument <= 0xFFFF) {
+      _writer.put(type | 25);
+      _bigEndian(argument, 2);
+    } else if (argument <= 0xFFFFFFFF) {
+      _writer.put(type | 26);
+      _bigEndian(argument, 4);
+    } else {
+      _writer.put(type | 27);
+      _bigEndian(argument, 8);
+    }
+  }
+
+  void _bigEndian(uint64_t value, uint8_t size) {
+    uint8_t bytes[8];
+    for (uint8_t i = 0; i < size; i++) bytes[i] = value >> (8 * (size - 1 - i));
+    _writer.write(bytes, size);
+  }
+
+  AsyncMqttClientWriter& _writer;
+};
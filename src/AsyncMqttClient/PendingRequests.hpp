@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+
+#include "Callbacks.hpp"
+
+namespace AsyncMqttClientInternals {
+// Requests waiting for their response, in slots allocated once. A request id is its slot number in the low
+// byte and a count of the uses of the slot in the high byte, so that a late response to a previous use of the
+// slot is not taken for the current one. Not thread safe, the client lock is held to add and remove.
+class PendingRequests {
+ public:
+  struct Request {
+    OnResponseUserCallback callback;
+    uint32_t deadline;
+    uint16_t id;       // 0 when the slot is free
+    uint8_t uses;
+    bool delivering;   // a response is being delivered, it does not time out anymore
+  };
+
+  PendingRequests()
+  : _requests() {
+  }
+
+  // To be called before connecting, 255 slots at most
+  void resize(uint8_t slots) {
+    _requests.assign(slots, Request { nullptr, 0, 0, 0, false });
+  }
+
+  bool enabled() const {
+    return !_requests.empty();
+  }
+
+  // Returns the id of the request, 0 if no slot is free
+  uint16_t add(OnResponseUserCallback callback, uint32_t deadline) {
+    for (size_t slot = 0; slot < _requests.size(); slot++) {
+      Request& request = _requests[slot];
+      if (request.id != 0) continue;
+      request.callback = callback;
+      request.deadline = deadline;
+      request.id = (static_cast<uint16_t>(++request.uses) << 8) | (slot + 1);
+      request.delivering = false;
+      return request.id;
+    }
+    return 0;
+  }
+
+  Request* find(uint16_t id) {
+    size_t slot = (id & 0xFF) - 1;
+    if (id == 0 || slot >= _requests.size() || _requests[slot].id != id) return nullptr;
+    return &_requests[slot];
+  }
+
+  // The first request past its deadline, or any with `all`
+  Request* expired(uint32_t now, bool all) {
+    for (Request& request : _requests) {
+      if (request.id == 0) continue;
+      if (all || (!request.delivering && static_cast<int32_t>(now - request.deadline) >= 0)) return &request;
+    }
+    return nullptr;
+  }
+
+  // The earliest deadline of the requests waiting for their response, false if none
+  bool nextDeadline(uint32_t* deadline) const {
+    bool found = false;
+    for (const Request& request : _requests) {
+      if (request.id == 0 || request.delivering) continue;
+      if (!found || static_cast<int32_t>(request.deadline - *deadline) < 0) *deadline = request.deadline;
+      found = true;
+    }
+    return found;
+  }
+
+  void remove(Request* request) {
+    request->callback = nullptr;
+    request->id = 0;
+    request->delivering = false;
+  }
+
+ private:
+  std::vector<Request> _requests;
+};
+}  // namespace AsyncMqttClientInternals
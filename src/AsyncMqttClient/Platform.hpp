@@ -0,0 +1,60 @@
+#pragma once
+
+#if defined(ESP32) || defined(ESP8266)
+#include <Arduino.h>
+#elif defined(__linux__)
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The few Arduino functions and types the client relies on
+
+inline uint32_t millis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+inline uint32_t micros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+class IPAddress {
+ public:
+  IPAddress() {
+    _address.dword = 0;
+  }
+
+  IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth) {
+    _address.bytes[0] = first;
+    _address.bytes[1] = second;
+    _address.bytes[2] = third;
+    _address.bytes[3] = fourth;
+  }
+
+  // In network byte order, like in_addr.s_addr
+  IPAddress(uint32_t address) {  // NOLINT(runtime/explicit)
+    _address.dword = address;
+  }
+
+  operator uint32_t() const {
+    return _address.dword;
+  }
+
+  uint8_t operator[](int index) const {
+    return _address.bytes[index];
+  }
+
+ private:
+  union {
+    uint8_t bytes[4];
+    uint32_t dword;
+  } _address;
+};
+#else
+#error Platform not supported
+#endif
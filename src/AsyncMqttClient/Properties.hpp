@@ -0,0 +1,190 @@
+#pragma once
+
+#include "Flags.hpp"
+
+namespace AsyncMqttClientInternals {
+struct Properties {
+  uint16_t topicAlias;
+  uint16_t topicAliasMaximum;
+  uint16_t receiveMaximum;
+  uint32_t maximumPacketSize;
+};
+
+// Streaming parser for an MQTT 5 property block (variable byte length + properties).
+// Bytes are fed one at a time so a block can be split across TCP segments.
+// Properties the client does not use are skipped.
+class PropertiesParser {
+ public:
+  PropertiesParser() {
+    reset();
+  }
+
+  void reset() {
+    _state = State::LENGTH;
+    _length = 0;
+    _multiplier = 1;
+    _bytesRead = 0;
+    _identifier = 0;
+    _value = 0;
+    _valueRemaining = 0;
+    _stringsRemaining = 0;
+    properties = {};
+  }
+
+  // Returns true once the whole property block has been consumed
+  bool parse(char currentByte) {
+    uint8_t byte = currentByte;
+    if (_state == State::LENGTH) {
+      _length += (byte & 127) * _multiplier;
+      _multiplier *= 128;
+      if ((byte & 128) != 0) return false;
+      _state = State::IDENTIFIER;
+      return _length == 0;
+    }
+
+    _bytesRead++;
+    switch (_state) {
+      case State::IDENTIFIER:
+        _identifier = byte;
+        _value = 0;
+        _multiplier = 1;
+        _startValue();
+        break;
+      case State::VALUE:
+        _value = (_value << 8) | byte;
+        if (--_valueRemaining == 0) _endValue();
+        break;
+      case State::VALUE_VARIABLE:
+        _value += (byte & 127) * _multiplier;
+        _multiplier *= 128;
+        if ((byte & 128) == 0) _endValue();
+        break;
+      case State::STRING_LENGTH:
+        _value = (_value << 8) | byte;
+        if (--_valueRemaining == 0) {
+          _valueRemaining = _value;
+          if (_valueRemaining == 0) {
+            _endString();
+          } else {
+            _state = State::STRING;
+          }
+        }
+        break;
+      case State::STRING:
+        if (--_valueRemaining == 0) _endString();
+        break;
+      default:
+        // unknown property, its length cannot be known so the rest of the block is skipped
+        break;
+    }
+
+    return _bytesRead == _length;
+  }
+
+  Properties properties;
+
+ private:
+  enum class State : uint8_t {
+    LENGTH,
+    IDENTIFIER,
+    VALUE,
+    VALUE_VARIABLE,
+    STRING_LENGTH,
+    STRING,
+    SKIP
+  };
+
+  void _startValue() {
+    switch (_identifier) {
+      case Property.PAYLOAD_FORMAT_INDICATOR:
+      case Property.REQUEST_PROBLEM_INFORMATION:
+      case Property.REQUEST_RESPONSE_INFORMATION:
+      case Property.MAXIMUM_QOS:
+      case Property.RETAIN_AVAILABLE:
+      case Property.WILDCARD_SUBSCRIPTION_AVAILABLE:
+      case Property.SUBSCRIPTION_IDENTIFIER_AVAILABLE:
+      case Property.SHARED_SUBSCRIPTION_AVAILABLE:
+        _state = State::VALUE;
+        _valueRemaining = 1;
+        break;
+      case Property.SERVER_KEEP_ALIVE:
+      case Property.RECEIVE_MAXIMUM:
+      case Property.TOPIC_ALIAS_MAXIMUM:
+      case Property.TOPIC_ALIAS:
+        _state = State::VALUE;
+        _valueRemaining = 2;
+        break;
+      case Property.MESSAGE_EXPIRY_INTERVAL:
+      case Property.SESSION_EXPIRY_INTERVAL:
+      case Property.WILL_DELAY_INTERVAL:
+      case Property.MAXIMUM_PACKET_SIZE:
+        _state = State::VALUE;
+        _valueRemaining = 4;
+        break;
+      case Property.SUBSCRIPTION_IDENTIFIER:
+        _state = State::VALUE_VARIABLE;
+        break;
+      case Property.CONTENT_TYPE:
+      case Property.RESPONSE_TOPIC:
+      case Property.CORRELATION_DATA:
+      case Property.ASSIGNED_CLIENT_IDENTIFIER:
+      case Property.AUTHENTICATION_METHOD:
+      case Property.AUTHENTICATION_DATA:
+      case Property.RESPONSE_INFORMATION:
+      case Property.SERVER_REFERENCE:
+      case Property.REASON_STRING:
+        _state = State::STRING_LENGTH;
+        _valueRemaining = 2;
+        _stringsRemaining = 1;
+        break;
+      case Property.USER_PROPERTY:
+        _state = State::STRING_LENGTH;
+        _valueRemaining = 2;
+        _stringsRemaining = 2;
+        break;
+      default:
+        _state = State::SKIP;
+        break;
+    }
+  }
+
+  void _endValue() {
+    switch (_identifier) {
+      case Property.TOPIC_ALIAS:
+        properties.topicAlias = _value;
+        break;
+      case Property.TOPIC_ALIAS_MAXIMUM:
+        properties.topicAliasMaximum = _value;
+        break;
+      case Property.RECEIVE_MAXIMUM:
+        properties.receiveMaximum = _value;
+        break;
+      case Property.MAXIMUM_PACKET_SIZE:
+        properties.maximumPacketSize = _value;
+        break;
+      default:
+        break;
+    }
+    _state = State::IDENTIFIER;
+  }
+
+  void _endString() {
+    if (--_stringsRemaining > 0) {
+      _state = State::STRING_LENGTH;
+      _valueRemaining = 2;
+      _value = 0;
+    } else {
+      _state = State::IDENTIFIER;
+    }
+  }
+
+  State _state;
+  uint32_t _length;
+  uint32_t _multiplier;
+  uint32_t _bytesRead;
+  uint8_t _identifier;
+  uint32_t _value;
+  uint32_t _valueRemaining;
+  uint8_t _stringsRemaining;
+};
+}  // namespace AsyncMqttClientInternals
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+
+#include "Storage.hpp"
+
+namespace AsyncMqttClientInternals {
+// Bounded lock-free multi-producer single-consumer ring of serialised packets (Vyukov's bounded queue).
+// Any task may push; whoever holds the client lock is the consumer, so front()/pop()/clear() must be called with it held.
+class PublishQueue {
+ public:
+  PublishQueue()
+  : _capacity(0)
+  , _cells(nullptr)
+  , _enqueuePosition(0)
+  , _dequeuePosition(0) {
+  }
+
+  ~PublishQueue() {
+    clear();
+    delete[] _cells;
+  }
+
+  // Not thread safe, to be called before connecting. The capacity is rounded up to a power of two.
+  void resize(size_t capacity) {
+    clear();
+    delete[] _cells;
+    _cells = nullptr;
+    _capacity = 0;
+    if (capacity == 0) return;
+
+    _capacity = 1;
+    while (_capacity < capacity) _capacity <<= 1;
+    _cells = new Cell[_capacity];
+    for (size_t i = 0; i < _capacity; i++) _cells[i].sequence.store(i, std::memory_order_relaxed);
+    _enqueuePosition.store(0, std::memory_order_relaxed);
+    _dequeuePosition.store(0, std::memory_order_relaxed);
+  }
+
+  size_t capacity() const {
+    return _capacity;
+  }
+
+  // Returns false if the queue is full, the packet is then still owned by the caller
+  bool push(const OutboundPacket& packet) {
+    if (_capacity == 0) return false;
+
+    Cell* cell;
+    size_t position = _enqueuePosition.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &_cells[position & (_capacity - 1)];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (difference == 0) {
+        if (_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = _enqueuePosition.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->packet = packet;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Safe to call without the lock, only a hint
+  bool empty() const {
+    return _capacity == 0 || _dequeuePosition.load(std::memory_order_relaxed) == _enqueuePosition.load(std::memory_order_relaxed);
+  }
+
+  // Returns nullptr if the oldest packet is not completely pushed yet
+  OutboundPacket* front() {
+    if (_capacity == 0) return nullptr;
+    size_t position = _dequeuePosition.load(std::memory_order_relaxed);
+    Cell* cell = &_cells[position & (_capacity - 1)];
+    if (cell->sequence.load(std::memory_order_acquire) != position + 1) return nullptr;
+    return &cell->packet;
+  }
+
+  void pop() {
+    size_t position = _dequeuePosition.load(std::memory_order_relaxed);
+    Cell* cell = &_cells[position & (_capacity - 1)];
+    delete[] cell->packet.data;
+    cell->packet.data = nullptr;
+    cell->sequence.store(position + _capacity, std::memory_order_release);
+    _dequeuePosition.store(position + 1, std::memory_order_relaxed);
+  }
+
+  void clear() {
+    while (front() != nullptr) pop();
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    OutboundPacket packet;
+  };
+
+  size_t _capacity;
+  Cell* _cells;
+  std::atomic<size_t> _enqueuePosition;
+  std::atomic<size_t> _dequeuePosition;
+};
+}  // namespace AsyncMqttClientInternals
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <vector>
+
+#include "Helpers.hpp"
+#include "PacketIds.hpp"
+#include "RateLimits.hpp"
+#include "Storage.hpp"
+
+namespace AsyncMqttClientInternals {
+// `messages` tokens every `periodMs`, up to `burst`, a message taking one. Without a topic filter, it is the global bucket.
+// With the QUEUE and DROP_OLDEST policies, the messages it holds back wait in a ring of serialised packets.
+class TokenBucket {
+ public:
+  TokenBucket(const char* topicFilter, uint32_t messages, uint32_t periodMs, uint16_t burst, AsyncMqttClientRatePolicy policy, uint16_t queueSize)
+  : topicFilter(topicFilter)
+  , policy(policy)
+  , stats()
+  , _messages(messages)
+  , _periodMs(periodMs > 0 ? periodMs : 1)
+  , _capacity(static_cast<uint64_t>(burst) * _periodMs)
+  , _tokens(_capacity)
+  , _lastRefill(0)
+  , _started(false)
+  , _held(policy != AsyncMqttClientRatePolicy::REJECT ? queueSize : 0)
+  , _heldStart(0)
+  , _heldCount(0) {
+  }
+
+  // No message held back, and a token left
+  bool admits(uint32_t now) {
+    return _heldCount == 0 && hasToken(now);
+  }
+
+  bool hasToken(uint32_t now) {
+    _refill(now);
+    return _tokens >= _periodMs;
+  }
+
+  // Milliseconds until hasToken() returns true
+  uint32_t wait(uint32_t now) {
+    if (hasToken(now)) return 0;
+    if (_messages == 0) return UINT32_MAX;
+    return (_periodMs - _tokens + _messages - 1) / _messages;
+  }
+
+  // Once hasToken() returned true
+  void take() {
+    _tokens -= _periodMs;
+  }
+
+  // The token of a message that could not be sent after all
+  void giveBack() {
+    _tokens = _tokens + _periodMs < _capacity ? _tokens + _periodMs : _capacity;
+  }
+
+  // Whether a message can be held, the oldest one being dropped for it with DROP_OLDEST, its packet id released
+  bool makeRoom(PacketIds* packetIds) {
+    if (_held.empty()) return false;
+    if (_heldCount < _held.size()) return true;
+    if (policy != AsyncMqttClientRatePolicy::DROP_OLDEST) return false;
+    if (packetIds != nullptr && front()->ownsId) packetIds->release(front()->packetId);
+    delete[] front()->data;
+    pop();
+    stats.dropped++;
+    return true;
+  }
+
+  void push(const OutboundPacket& packet) {
+    _held[(_heldStart + _heldCount) % _held.size()] = packet;
+    _heldCount++;
+  }
+
+  OutboundPacket* front() {
+    return _heldCount > 0 ? &_held[_heldStart] : nullptr;
+  }
+
+  // The packet data then belongs to the caller
+  void pop() {
+    _heldStart = (_heldStart + 1) % _held.size();
+    _heldCount--;
+  }
+
+  const char* topicFilter;
+  AsyncMqttClientRatePolicy policy;
+  AsyncMqttClientRateStats stats;
+
+ private:
+  // The bucket starts full
+  void _refill(uint32_t now) {
+    if (!_started) {
+      _started = true;
+      _lastRefill = now;
+      return;
+    }
+    uint64_t tokens = _tokens + static_cast<uint64_t>(now - _lastRefill) * _messages;
+    _tokens = tokens < _capacity ? tokens : _capacity;
+    _lastRefill = now;
+  }
+
+  // in 1 / periodMs of a token, so that the refill is exact with integers
+  uint32_t _messages;
+  uint32_t _periodMs;
+  uint64_t _capacity;
+  uint64_t _tokens;
+  uint32_t _lastRefill;
+  bool _started;
+  std::vector<OutboundPacket> _held;
+  size_t _heldStart;
+  size_t _heldCount;
+};
+
+// Publish rate limits: a message takes a token of the first bucket whose topic filter matches its topic, then
+// one of the global bucket. The first bucket out of tokens applies its policy. Not thread safe, the client lock
+// is held to use it.
+class RateLimiter {
+ public:
+  enum class Admission : uint8_t {
+    ADMITTED,  // to be sent now, the tokens are taken
+    HELD,      // to be held by the bucket given, there is room for it
+    REJECTED
+  };
+
+  RateLimiter()
+  : _buckets()
+  , _hasGlobal(false)
+  , _packetIds(nullptr) {
+  }
+
+  ~RateLimiter() {
+    clear();
+  }
+
+  // Where the ids of the messages dropped with DROP_OLDEST go back
+  void setPacketIds(PacketIds* packetIds) {
+    _packetIds = packetIds;
+  }
+
+  // To be called before connecting. The global bucket stays last, the topic buckets are matched in order.
+  void setGlobal(uint32_t messages, uint32_t periodMs, uint16_t burst, AsyncMqttClientRatePolicy policy, uint16_t queueSize) {
+    if (_hasGlobal) _buckets.pop_back();
+    _buckets.push_back(TokenBucket(nullptr, messages, periodMs, burst, policy, queueSize));
+    _hasGlobal = true;
+  }
+
+  void add(const char* topicFilter, uint32_t messages, uint32_t periodMs, uint16_t burst, AsyncMqttClientRatePolicy policy, uint16_t queueSize) {
+    _buckets.insert(_buckets.end() - (_hasGlobal ? 1 : 0), TokenBucket(topicFilter, messages, periodMs, burst, policy, queueSize));
+  }
+
+  bool enabled() const {
+    return !_buckets.empty();
+  }
+
+  // Without canHold, a message that would be held is rejected
+  Admission admit(const char* topic, uint32_t now, bool canHold, TokenBucket** holder) {
+    return admit(topic, strlen(topic), now, canHold, holder);
+  }
+
+  Admission admit(const char* topic, size_t topicLength, uint32_t now, bool canHold, TokenBucket** holder) {
+    TokenBucket* stages[2] = { _match(topic, topicLength), global() };
+    for (uint8_t i = 0; i < 2; i++) {
+      TokenBucket* stage = stages[i];
+      if (stage == nullptr || stage->admits(now)) continue;
+      if (!canHold || !stage->makeRoom(_packetIds)) {
+        stage->stats.rejected++;
+        return Admission::REJECTED;
+      }
+      if (i == 1 && stages[0] != nullptr) stages[0]->take();  // held past its topic bucket
+      stage->stats.queued++;
+      *holder = stage;
+      return Admission::HELD;
+    }
+    for (TokenBucket* stage : stages) {
+      if (stage != nullptr) stage->take();
+    }
+    return Admission::ADMITTED;
+  }
+
+  // For a publish waiting elsewhere: takes its tokens if it would be admitted, without counting anything otherwise
+  bool tryTake(const char* topic, uint32_t now) {
+    TokenBucket* stages[2] = { _match(topic), global() };
+    for (TokenBucket* stage : stages) {
+      if (stage != nullptr && !stage->admits(now)) return false;
+    }
+    for (TokenBucket* stage : stages) {
+      if (stage != nullptr) stage->take();
+    }
+    return true;
+  }
+
+  // Milliseconds until the buckets of the topic all have a token
+  uint32_t wait(const char* topic, uint32_t now) {
+    TokenBucket* stages[2] = { _match(topic), global() };
+    uint32_t wait = 0;
+    for (TokenBucket* stage : stages) {
+      if (stage != nullptr && stage->wait(now) > wait) wait = stage->wait(now);
+    }
+    return wait;
+  }
+
+  // Undoes an admission
+  void giveBack(const char* topic) {
+    TokenBucket* stages[2] = { _match(topic), global() };
+    for (TokenBucket* stage : stages) {
+      if (stage != nullptr) stage->giveBack();
+    }
+  }
+
+  // A message released by a topic bucket goes through the global one, held there or dropped per its policy.
+  // Returns false if dropped, the packet data still belongs to the caller.
+  bool hold(TokenBucket* bucket, const OutboundPacket& packet) {
+    if (!bucket->makeRoom(_packetIds)) {
+      bucket->stats.dropped++;
+      return false;
+    }
+    bucket->push(packet);
+    return true;
+  }
+
+  TokenBucket* global() {
+    return _hasGlobal ? &_buckets.back() : nullptr;
+  }
+
+  size_t size() const {
+    return _buckets.size();
+  }
+
+  TokenBucket& operator[](size_t index) {
+    return _buckets[index];
+  }
+
+  bool holding() {
+    for (TokenBucket& bucket : _buckets) {
+      if (bucket.front() != nullptr) return true;
+    }
+    return false;
+  }
+
+  AsyncMqttClientRateStats stats() const {
+    AsyncMqttClientRateStats total = {};
+    for (const TokenBucket& bucket : _buckets) {
+      total.rejected += bucket.stats.rejected;
+      total.queued += bucket.stats.queued;
+      total.dropped += bucket.stats.dropped;
+    }
+    return total;
+  }
+
+  // The messages held back, dropped on connection like the queued publishes
+  void clear() {
+    for (TokenBucket& bucket : _buckets) {
+      OutboundPacket* packet;
+      while ((packet = bucket.front()) != nullptr) {
+        delete[] packet->data;
+        bucket.pop();
+      }
+    }
+  }
+
+ private:
+  TokenBucket* _match(const char* topic) {
+    return _match(topic, strlen(topic));
+  }
+
+  TokenBucket* _match(const char* topic, size_t topicLength) {
+    for (TokenBucket& bucket : _buckets) {
+      if (bucket.topicFilter != nullptr && Helpers::topicMatches(bucket.topicFilter, topic, topicLength)) return &bucket;
+    }
+    return nullptr;
+  }
+
+  std::vector<TokenBucket> _buckets;
+  bool _hasGlobal;
+  PacketIds* _packetIds;
+};
+}  // namespace AsyncMqttClientInternals
@@ -0,0 +1,14 @@
+#pragma once
+
+// What a rate limited publish becomes when its bucket is out of tokens
+enum class AsyncMqttClientRatePolicy : uint8_t {
+  REJECT = 0,       // publish() returns 0
+  QUEUE = 1,        // held until tokens are back, publish() returns 0 when the queue is full
+  DROP_OLDEST = 2   // held until tokens are back, the oldest held message is dropped when the queue is full
+};
+
+struct AsyncMqttClientRateStats {
+  uint32_t rejected;  // publish() returned 0
+  uint32_t queued;    // held by a bucket
+  uint32_t dropped;   // held, then dropped for a newer message or by the global bucket
+};
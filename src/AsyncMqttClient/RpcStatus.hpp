@@ -0,0 +1,8 @@
+#pragma once
+
+// How a request made with request() ended, as given to its callback
+enum class AsyncMqttClientRpcStatus : uint8_t {
+  RESPONSE = 0,     // a fragment of the response
+  TIMEOUT = 1,      // no response before the deadline
+  DISCONNECTED = 2  // the connection was lost first
+};
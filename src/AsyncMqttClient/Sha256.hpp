@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstring>
+
+#include "Platform.hpp"
+
+namespace AsyncMqttClientInternals {
+// SHA-256 (FIPS 180-4), fed as the bytes arrive
+class Sha256 {
+ public:
+  static const size_t DIGEST_SIZE = 32;
+
+  Sha256() {
+    reset();
+  }
+
+  void reset() {
+    static const uint32_t initial[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(_state, initial, sizeof(_state));
+    _length = 0;
+    _buffered = 0;
+  }
+
+  void update(const uint8_t* data, size_t len) {
+    _length += len;
+    if (_buffered > 0) {
+      size_t copied = len < 64 - _buffered ? len : 64 - _buffered;
+      memcpy(_block + _buffered, data, copied);
+      _buffered += copied;
+      data += copied;
+      len -= copied;
+      if (_buffered < 64) return;
+      _transform(_block);
+      _buffered = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) _transform(data);
+    if (len > 0) memcpy(_block, data, len);
+    _buffered = len;
+  }
+
+  // The hash of the bytes so far, reset() to hash others
+  void finish(uint8_t digest[DIGEST_SIZE]) {
+    uint64_t bits = _length * 8;
+    uint8_t padding[72] = { 0x80 };
+    size_t padLength = (_buffered < 56 ? 56 : 120) - _buffered;
+    for (uint8_t i = 0; i < 8; i++) padding[padLength + i] = bits >> (56 - 8 * i);
+    update(padding, padLength + 8);
+    for (uint8_t i = 0; i < 8; i++) {
+      digest[4 * i] = _state[i] >> 24;
+      digest[4 * i + 1] = _state[i] >> 16;
+      digest[4 * i + 2] = _state[i] >> 8;
+      digest[4 * i + 3] = _state[i];
+    }
+  }
+
+ private:
+  static uint32_t _rotate(uint32_t value, uint8_t bits) {
+    return (value >> bits) | (value << (32 - bits));
+  }
+
+  void _transform(const uint8_t* block) {
+    static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t w[64];
+    for (uint8_t i = 0; i < 16; i++) {
+      w[i] = (static_cast<uint32_t>(block[4 * i]) << 24) | (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+             (static_cast<uint32_t>(block[4 * i + 2]) << 8) | block[4 * i + 3];
+    }
+    for (uint8_t i = 16; i < 64; i++) {
+      uint32_t s0 = _rotate(w[i - 15], 7) ^ _rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = _rotate(w[i - 2], 17) ^ _rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+    uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+    for (uint8_t i = 0; i < 64; i++) {
+      uint32_t t1 = h + (_rotate(e, 6) ^ _rotate(e, 11) ^ _rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+      uint32_t t2 = (_rotate(a, 2) ^ _rotate(a, 13) ^ _rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    _state[0] += a;
+    _state[1] += b;
+    _state[2] += c;
+    _state[3] += d;
+    _state[4] += e;
+    _state[5] += f;
+    _state[6] += g;
+    _state[7] += h;
+  }
+
+  uint32_t _state[8];
+  uint64_t _length;
+  uint8_t _block[64];
+  size_t _buffered;
+};
+}  // namespace AsyncMqttClientInternals
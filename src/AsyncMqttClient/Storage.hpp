@@ -10,4 +10,12 @@ struct PendingAck {
   uint8_t headerFlag;
   uint16_t packetId;
 };
+
+struct OutboundPacket {
+  char* data;
+  uint32_t length;
+  bool inFlight;      // takes a Receive Maximum slot once sent
+  uint16_t packetId;  // 0 at QoS 0
+  bool ownsId;        // the id was taken for this packet, released if it is dropped
+};
 }  // namespace AsyncMqttClientInternals
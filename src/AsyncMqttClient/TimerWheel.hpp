@@ -0,0 +1,204 @@
+#pragma once
+
+#include <vector>
+
+#include "Platform.hpp"
+
+namespace AsyncMqttClientInternals {
+// Deadlines of the packets waiting for their acknowledgement, in a hierarchical timing wheel of 4 levels of 64 slots,
+// of 1 ms, 64 ms, 4 s and 4.4 min: a deadline up to 4.6 h ahead goes in the slot of the level its distance falls in,
+// and moves down a level when the wheel reaches that slot. A mask of the occupied slots of each level lets the wheel
+// skip the empty ones. Adding, cancelling and expiring a timer take constant time, a timer is found by its packet id
+// through a hash of chains. Timers live in slots allocated once. Not thread safe, the client lock is held to use it.
+class TimerWheel {
+ public:
+  TimerWheel()
+  : _timers()
+  , _index()
+  , _heads()
+  , _occupied{ 0, 0, 0, 0 }
+  , _free(NONE)
+  , _count(0)
+  , _current(0) {
+  }
+
+  // To be called before connecting
+  void resize(uint16_t timers) {
+    if (timers == NONE) timers--;
+    _timers.assign(timers, Timer { 0, 0, NONE, NONE, NONE, 0, 0 });
+    size_t buckets = 1;
+    while (buckets < timers) buckets *= 2;
+    _index.resize(timers > 0 ? buckets : 0);
+    _heads.resize(timers > 0 ? LEVELS * SLOTS : 0);
+    clear();
+  }
+
+  bool enabled() const {
+    return !_timers.empty();
+  }
+
+  // Replaces the timer of the packet id if it has one. Returns false if all timers are in use
+  bool add(uint16_t packetId, uint8_t tag, uint32_t deadline, uint32_t now) {
+    cancel(packetId);
+    if (_free == NONE) return false;
+    if (_count == 0) _current = now;  // nothing to move, the wheel starts over from now
+    uint16_t timer = _free;
+    _free = _timers[timer].next;
+    Timer& added = _timers[timer];
+    added.deadline = deadline;
+    added.packetId = packetId;
+    added.tag = tag;
+    uint16_t& bucket = _index[packetId & (_index.size() - 1)];
+    added.hashNext = bucket;
+    bucket = timer;
+    _place(timer);
+    _count++;
+    return true;
+  }
+
+  // Returns false if the packet id has no timer
+  bool cancel(uint16_t packetId) {
+    if (_index.empty()) return false;
+    uint16_t* link = &_index[packetId & (_index.size() - 1)];
+    while (*link != NONE && _timers[*link].packetId != packetId) link = &_timers[*link].hashNext;
+    if (*link == NONE) return false;
+    uint16_t timer = *link;
+    *link = _timers[timer].hashNext;
+    _unlink(timer);
+    _release(timer);
+    return true;
+  }
+
+  // Moves the wheel up to `now` and returns the first timer past its deadline on the way, which is removed
+  bool expired(uint32_t now, uint16_t* packetId, uint8_t* tag) {
+    while (_count > 0) {
+      int32_t ahead = static_cast<int32_t>(now - _current);
+      if (ahead < 0) return false;
+      // the first level slot of the current time holds the timers due now
+      uint8_t slot = _current & MASK;
+      uint16_t timer = _heads[slot];
+      if (timer != NONE) {
+        *packetId = _timers[timer].packetId;
+        *tag = _timers[timer].tag;
+        cancel(*packetId);
+        return true;
+      }
+      if (ahead == 0) return false;
+      // to the next occupied slot of the first level, or to the end of its round where the next level moves down
+      uint64_t occupied = _occupied[0] >> slot;
+      uint32_t step = occupied != 0 ? __builtin_ctzll(occupied) : SLOTS - slot;
+      _current += step < static_cast<uint32_t>(ahead) ? step : ahead;
+      if ((_current & MASK) == 0) _cascade();
+    }
+    return false;
+  }
+
+  // The earliest deadline, false without timers. The slots of a level are reached in order from the one after the
+  // current one, the first level from its own: the first occupied slot of each level holds its earliest deadline,
+  // but for the last level, where a deadline beyond its span waits in a slot earlier than its own
+  bool nextDeadline(uint32_t* deadline) const {
+    if (_count == 0) return false;
+    bool found = false;
+    for (uint8_t level = 0; level < LEVELS; level++) {
+      uint8_t start = ((_current >> (level * BITS)) + (level > 0 ? 1 : 0)) & MASK;
+      uint64_t occupied = start > 0 ? (_occupied[level] >> start) | (_occupied[level] << (SLOTS - start)) : _occupied[level];
+      while (occupied != 0) {
+        uint8_t slot = (start + __builtin_ctzll(occupied)) & MASK;
+        for (uint16_t timer = _heads[level * SLOTS + slot]; timer != NONE; timer = _timers[timer].next) {
+          if (!found || static_cast<int32_t>(_timers[timer].deadline - *deadline) < 0) *deadline = _timers[timer].deadline;
+          found = true;
+        }
+        if (level < LEVELS - 1) break;
+        occupied &= occupied - 1;
+      }
+    }
+    return found;
+  }
+
+  // On disconnection, no acknowledgement is waited for anymore
+  void clear() {
+    for (uint16_t& head : _heads) head = NONE;
+    for (uint16_t& bucket : _index) bucket = NONE;
+    for (uint8_t level = 0; level < LEVELS; level++) _occupied[level] = 0;
+    for (size_t timer = 0; timer < _timers.size(); timer++) _timers[timer].next = timer + 1 < _timers.size() ? timer + 1 : NONE;
+    _free = _timers.empty() ? NONE : 0;
+    _count = 0;
+  }
+
+ private:
+  static const uint16_t NONE = 0xFFFF;
+  static const uint8_t LEVELS = 4;
+  static const uint8_t BITS = 6;
+  static const uint8_t SLOTS = 1 << BITS;
+  static const uint8_t MASK = SLOTS - 1;
+  static const uint32_t SPAN = 1u << (LEVELS * BITS);  // ms, beyond it a timer is placed at SPAN - 1 and placed again
+
+  struct Timer {
+    uint32_t deadline;
+    uint16_t packetId;
+    uint16_t next;      // in its slot, or in the free list
+    uint16_t prev;
+    uint16_t hashNext;  // in its bucket of the index
+    uint8_t slot;       // level * SLOTS + slot
+    uint8_t tag;
+  };
+
+  void _place(uint16_t timer) {
+    Timer& placed = _timers[timer];
+    int32_t distance = static_cast<int32_t>(placed.deadline - _current);
+    uint32_t ahead = distance > 0 ? distance : 0;
+    if (ahead >= SPAN) ahead = SPAN - 1;
+    uint8_t level = 0;
+    while (level < LEVELS - 1 && ahead >= (1u << ((level + 1) * BITS))) level++;
+    uint8_t slot = ((_current + ahead) >> (level * BITS)) & MASK;
+    placed.slot = level * SLOTS + slot;
+    placed.prev = NONE;
+    placed.next = _heads[placed.slot];
+    if (placed.next != NONE) _timers[placed.next].prev = timer;
+    _heads[placed.slot] = timer;
+    _occupied[level] |= 1ull << slot;
+  }
+
+  void _unlink(uint16_t timer) {
+    Timer& unlinked = _timers[timer];
+    if (unlinked.prev != NONE) {
+      _timers[unlinked.prev].next = unlinked.next;
+    } else {
+      _heads[unlinked.slot] = unlinked.next;
+      if (unlinked.next == NONE) _occupied[unlinked.slot / SLOTS] &= ~(1ull << (unlinked.slot & MASK));
+    }
+    if (unlinked.next != NONE) _timers[unlinked.next].prev = unlinked.prev;
+  }
+
+  void _release(uint16_t timer) {
+    _timers[timer].next = _free;
+    _free = timer;
+    _count--;
+  }
+
+  // At the start of a round of a level, the timers of the slot the next level reached move down
+  void _cascade() {
+    for (uint8_t level = 1; level < LEVELS; level++) {
+      uint8_t slot = (_current >> (level * BITS)) & MASK;
+      uint8_t index = level * SLOTS + slot;
+      uint16_t timer = _heads[index];
+      _heads[index] = NONE;
+      _occupied[level] &= ~(1ull << slot);
+      while (timer != NONE) {
+        uint16_t next = _timers[timer].next;
+        _place(timer);
+        timer = next;
+      }
+      if (slot != 0) return;
+    }
+  }
+
+  std::vector<Timer> _timers;
+  std::vector<uint16_t> _index;  // first timer of each bucket, by packet id
+  std::vector<uint16_t> _heads;  // first timer of each slot
+  uint64_t _occupied[LEVELS];
+  uint16_t _free;
+  uint16_t _count;
+  uint32_t _current;  // the time the wheel is at, in ms
+};
+}  // namespace AsyncMqttClientInternals
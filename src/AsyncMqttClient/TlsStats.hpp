@@ -0,0 +1,8 @@
+#pragma once
+
+struct AsyncMqttClientTlsStats {
+  uint32_t handshakes;        // completed
+  uint32_t resumed;           // of them, resuming a previous session
+  uint32_t lastHandshakeUs;   // duration of the last one, in microseconds
+  uint64_t totalHandshakeUs;
+};
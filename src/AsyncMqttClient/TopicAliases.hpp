@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstring>
+
+namespace AsyncMqttClientInternals {
+// Aliases the broker assigns to the topics it sends us (MQTT 5)
+class InboundTopicAliases {
+ public:
+  InboundTopicAliases()
+  : _maximum(0)
+  , _maxTopicLength(0)
+  , _topics(nullptr) {
+  }
+
+  ~InboundTopicAliases() {
+    delete[] _topics;
+  }
+
+  void resize(uint16_t maximum, uint16_t maxTopicLength) {
+    delete[] _topics;
+    _topics = nullptr;
+    _maximum = maximum;
+    _maxTopicLength = maxTopicLength;
+    if (_maximum > 0) _topics = new char[_maximum * (_maxTopicLength + 1)];
+    clear();
+  }
+
+  void clear() {
+    for (uint16_t alias = 1; alias <= _maximum; alias++) _slot(alias)[0] = '\0';
+  }
+
+  uint16_t maximum() const {
+    return _maximum;
+  }
+
+  bool set(uint16_t alias, const char* topic, uint16_t topicLength) {
+    if (alias == 0 || alias > _maximum || topicLength > _maxTopicLength) return false;
+    char* slot = _slot(alias);
+    memcpy(slot, topic, topicLength);
+    slot[topicLength] = '\0';
+    return true;
+  }
+
+  const char* get(uint16_t alias) const {
+    if (alias == 0 || alias > _maximum) return nullptr;
+    const char* slot = _slot(alias);
+    if (slot[0] == '\0') return nullptr;
+    return slot;
+  }
+
+ private:
+  char* _slot(uint16_t alias) const {
+    return _topics + (alias - 1) * (_maxTopicLength + 1);
+  }
+
+  uint16_t _maximum;
+  uint16_t _maxTopicLength;
+  char* _topics;
+};
+
+// Aliases we assign to the topics we publish to (MQTT 5), least recently used one is reassigned when full.
+// The topics are kept in slots allocated once, topics longer than the slots are sent without an alias.
+class OutboundTopicAliases {
+ public:
+  OutboundTopicAliases()
+  : _capacity(0)
+  , _maxTopicLength(0)
+  , _limit(0)
+  , _uses(0)
+  , _lastUses(nullptr) {
+  }
+
+  ~OutboundTopicAliases() {
+    delete[] _lastUses;
+  }
+
+  // The last uses and the topics in one allocation, the topics behind the last uses
+  void resize(uint16_t capacity, uint16_t maxTopicLength) {
+    delete[] _lastUses;
+    _lastUses = nullptr;
+    _capacity = capacity;
+    _maxTopicLength = maxTopicLength;
+    if (_capacity > 0) {
+      size_t topicsSize = static_cast<size_t>(_capacity) * (_maxTopicLength + 1);
+      _lastUses = new uint32_t[_capacity + (topicsSize + sizeof(uint32_t) - 1) / sizeof(uint32_t)];
+    }
+    clear();
+  }
+
+  // Called with the Topic Alias Maximum of the broker once connected
+  void setLimit(uint16_t serverMaximum) {
+    _limit = serverMaximum < _capacity ? serverMaximum : _capacity;
+  }
+
+  void clear() {
+    for (uint16_t alias = 1; alias <= _capacity; alias++) {
+      _slot(alias)[0] = '\0';
+      _lastUses[alias - 1] = 0;
+    }
+    _limit = 0;
+    _uses = 0;
+  }
+
+  // Returns the alias to use for the topic, or 0 if aliases are not available.
+  // known tells whether the broker already has the mapping, in which case the topic can be omitted.
+  // Nothing is recorded until commit() is called, so a packet that cannot be sent does not desynchronize the mapping.
+  uint16_t lookup(const char* topic, uint16_t topicLength, bool* known) const {
+    *known = false;
+    if (_limit == 0 || topicLength > _maxTopicLength) return 0;
+
+    uint16_t leastRecentlyUsed = 1;
+    for (uint16_t alias = 1; alias <= _limit; alias++) {
+      const char* slot = _slot(alias);
+      if (slot[0] == '\0') {
+        leastRecentlyUsed = alias;
+        break;
+      }
+      if (strcmp(slot, topic) == 0) {
+        *known = true;
+        return alias;
+      }
+      if (_lastUses[alias - 1] < _lastUses[leastRecentlyUsed - 1]) leastRecentlyUsed = alias;
+    }
+
+    return leastRecentlyUsed;
+  }
+
+  void commit(uint16_t alias, bool known, const char* topic, uint16_t topicLength) {
+    _lastUses[alias - 1] = ++_uses;
+    if (known) return;
+
+    char* slot = _slot(alias);
+    memcpy(slot, topic, topicLength);
+    slot[topicLength] = '\0';
+  }
+
+ private:
+  char* _slot(uint16_t alias) const {
+    return reinterpret_cast<char*>(_lastUses + _capacity) + (alias - 1) * (_maxTopicLength + 1);
+  }
+
+  uint16_t _capacity;
+  uint16_t _maxTopicLength;
+  uint16_t _limit;
+  uint32_t _uses;
+  uint32_t* _lastUses;
+};
+}  // namespace AsyncMqttClientInternals
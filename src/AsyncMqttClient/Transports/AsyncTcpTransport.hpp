@@ -0,0 +1,137 @@
+#pragma once
+
+#ifdef ESP32
+#include <AsyncTCP.h>
+#elif defined(ESP8266)
+#include <ESPAsyncTCP.h>
+#endif
+#include <lwip/dns.h>
+
+#include "Transport.hpp"
+
+namespace AsyncMqttClientInternals {
+// AsyncTCP (ESP32) or ESPAsyncTCP (ESP8266) connection
+class AsyncTcpTransport : public Transport {
+ public:
+  AsyncTcpTransport()
+#if ASYNC_TCP_SSL_ENABLED
+  : _secure(false)
+  , _connectStart(0)
+  , _tlsStats()
+#endif
+  {
+    _client.onConnect([](void* obj, AsyncClient* c) { (void)c; (static_cast<AsyncTcpTransport*>(obj))->_connected(); }, this);
+    _client.onDisconnect([](void* obj, AsyncClient* c) { (void)c; (static_cast<AsyncTcpTransport*>(obj))->_onDisconnect(); }, this);
+    _client.onError([](void* obj, AsyncClient* c, int8_t error) { (void)c; (static_cast<AsyncTcpTransport*>(obj))->_onError(error); }, this);
+    _client.onTimeout([](void* obj, AsyncClient* c, uint32_t time) { (void)c; (static_cast<AsyncTcpTransport*>(obj))->_onTimeout(time); }, this);
+    _client.onAck([](void* obj, AsyncClient* c, size_t len, uint32_t time) { (void)c; (static_cast<AsyncTcpTransport*>(obj))->_onAck(len, time); }, this);
+    _client.onData([](void* obj, AsyncClient* c, void* data, size_t len) { (void)c; (static_cast<AsyncTcpTransport*>(obj))->_onData(static_cast<char*>(data), len); }, this);
+    _client.onPoll([](void* obj, AsyncClient* c) { (void)c; (static_cast<AsyncTcpTransport*>(obj))->_onPoll(); }, this);
+  }
+
+  bool connect(IPAddress ip, uint16_t port, bool secure) override {
+#if ASYNC_TCP_SSL_ENABLED
+    _secure = secure;
+    _connectStart = micros();
+    return _client.connect(ip, port, secure);
+#else
+    (void)secure;
+    return _client.connect(ip, port);
+#endif
+  }
+
+  bool connect(const char* host, uint16_t port, bool secure) override {
+#if ASYNC_TCP_SSL_ENABLED
+    _secure = secure;
+    _connectStart = micros();
+    return _client.connect(host, port, secure);
+#else
+    (void)secure;
+    return _client.connect(host, port);
+#endif
+  }
+
+  // With lwIP's DNS client, which hands over one address per name
+  bool resolve(const char* host) override {
+    ip_addr_t address;
+    err_t error = dns_gethostbyname(host, &address, &AsyncTcpTransport::_resolved, this);
+    if (error == ERR_OK) _resolved(host, &address, this);  // from lwIP's cache
+    return error == ERR_OK || error == ERR_INPROGRESS;
+  }
+
+  void close(bool now) override {
+    _client.close(now);
+  }
+
+  bool canSend() override {
+    return _client.canSend();
+  }
+
+  size_t space() override {
+    return _client.space();
+  }
+
+  size_t add(const char* data, size_t size) override {
+    return _client.add(data, size);
+  }
+
+  bool send() override {
+    return _client.send();
+  }
+
+  void ackLater() override {
+    _client.ackLater();
+  }
+
+  size_t ack(size_t len) override {
+    return _client.ack(len);
+  }
+
+#if ASYNC_TCP_SSL_ENABLED
+  SSL* getSSL() override {
+    return _client.getSSL();
+  }
+
+  bool matchFingerprint(const uint8_t* fingerprint) override {
+    return ssl_match_fingerprint(_client.getSSL(), fingerprint) == SSL_OK;
+  }
+
+  // The TCP library does not hand the session of a connection over to the next one: every handshake is a full
+  // one, timed from connect() as the TCP handshake cannot be told apart
+  AsyncMqttClientTlsStats getTlsStats() override {
+    return _tlsStats;
+  }
+#endif
+
+ private:
+  void _connected() {
+#if ASYNC_TCP_SSL_ENABLED
+    if (_secure) {
+      _tlsStats.handshakes++;
+      _tlsStats.lastHandshakeUs = micros() - _connectStart;
+      _tlsStats.totalHandshakeUs += _tlsStats.lastHandshakeUs;
+    }
+#endif
+    _onConnect();
+  }
+
+  static void _resolved(const char* name, const ip_addr_t* address, void* arg) {
+    (void)name;
+    AsyncTcpTransport* transport = static_cast<AsyncTcpTransport*>(arg);
+    if (!transport->_onResolve) return;
+    if (address == nullptr) {
+      transport->_onResolve(nullptr, 0);
+      return;
+    }
+    IPAddress resolved(ip_2_ip4(address)->addr);
+    transport->_onResolve(&resolved, 1);
+  }
+
+  AsyncClient _client;
+#if ASYNC_TCP_SSL_ENABLED
+  bool _secure;
+  uint32_t _connectStart;
+  AsyncMqttClientTlsStats _tlsStats;
+#endif
+};
+}  // namespace AsyncMqttClientInternals
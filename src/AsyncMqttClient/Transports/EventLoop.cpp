@@ -0,0 +1,168 @@
+#ifdef __linux__
+
+#include "EventLoop.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+#include "PosixTransport.hpp"
+
+using AsyncMqttClientInternals::EventLoop;
+using AsyncMqttClientInternals::PosixTransport;
+
+EventLoop::EventLoop()
+: _epollFd(epoll_create1(EPOLL_CLOEXEC))
+, _wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+, _running(false)
+, _mutex()
+, _transports()
+, _closed()
+, _resolved()
+, _handled()
+, _thread(std::thread::id())
+, _lastPoll(millis()) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &event);
+}
+
+EventLoop::~EventLoop() {
+  ::close(_wakeFd);
+  ::close(_epollFd);
+}
+
+EventLoop* EventLoop::getDefault() {
+  static EventLoop eventLoop;
+  return &eventLoop;
+}
+
+void EventLoop::run() {
+  _running = true;
+  while (_running) runOnce(POLL_INTERVAL);
+}
+
+void EventLoop::runOnce(int timeout) {
+  _thread = std::this_thread::get_id();
+  uint32_t sinceLastPoll = millis() - _lastPoll;
+  if (sinceLastPoll >= POLL_INTERVAL) {
+    timeout = 0;
+  } else if (timeout < 0 || static_cast<uint32_t>(timeout) > POLL_INTERVAL - sinceLastPoll) {
+    timeout = POLL_INTERVAL - sinceLastPoll;
+  }
+
+  struct epoll_event events[16];
+  int count = epoll_wait(_epollFd, events, 16, timeout);
+  for (int i = 0; i < count; i++) {
+    PosixTransport* transport = static_cast<PosixTransport*>(events[i].data.ptr);
+    if (transport == nullptr) {
+      uint64_t value;
+      if (read(_wakeFd, &value, sizeof(value)) < 0) {
+        // nothing to drain
+      }
+      continue;
+    }
+    // it may have been closed by an earlier event of this batch
+    if (_registered(transport)) transport->handleEvents(events[i].events);
+  }
+
+  // the handlers may close other transports, they are called on a copy kept across iterations
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _handled.swap(_closed);
+  }
+  for (PosixTransport* transport : _handled) transport->handleClosed();
+  _handled.clear();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _handled.swap(_resolved);
+  }
+  for (PosixTransport* transport : _handled) transport->handleResolved();
+  _handled.clear();
+
+  if (millis() - _lastPoll >= POLL_INTERVAL) {
+    _lastPoll = millis();
+    // by index, the handlers may add or remove transports: one moved down by a removal waits for the next poll
+    for (size_t i = 0;; i++) {
+      PosixTransport* transport;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (i >= _transports.size()) break;
+        transport = _transports[i];
+      }
+      transport->handlePoll();
+    }
+  }
+}
+
+void EventLoop::stop() {
+  _running = false;
+  uint64_t value = 1;
+  if (write(_wakeFd, &value, sizeof(value)) < 0) {
+    // the loop is already being woken up
+  }
+}
+
+void EventLoop::add(PosixTransport* transport, int fd, uint32_t events) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.ptr = transport;
+  epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event);
+  _transports.push_back(transport);
+}
+
+void EventLoop::modify(PosixTransport* transport, int fd, uint32_t events) {
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.ptr = transport;
+  epoll_ctl(_epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void EventLoop::remove(PosixTransport* transport, int fd) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+  _transports.erase(std::remove(_transports.begin(), _transports.end(), transport), _transports.end());
+}
+
+bool EventLoop::inLoopThread() const {
+  std::thread::id thread = _thread;
+  return thread == std::thread::id() || thread == std::this_thread::get_id();
+}
+
+void EventLoop::notifyClosed(PosixTransport* transport) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed.push_back(transport);
+  }
+  uint64_t value = 1;
+  if (write(_wakeFd, &value, sizeof(value)) < 0) {
+    // the loop is already being woken up
+  }
+}
+
+void EventLoop::notifyResolved(PosixTransport* transport) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _resolved.push_back(transport);
+  }
+  uint64_t value = 1;
+  if (write(_wakeFd, &value, sizeof(value)) < 0) {
+    // the loop is already being woken up
+  }
+}
+
+void EventLoop::cancelNotifications(PosixTransport* transport) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _closed.erase(std::remove(_closed.begin(), _closed.end(), transport), _closed.end());
+  _resolved.erase(std::remove(_resolved.begin(), _resolved.end(), transport), _resolved.end());
+}
+
+bool EventLoop::_registered(PosixTransport* transport) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return std::find(_transports.begin(), _transports.end(), transport) != _transports.end();
+}
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AsyncMqttClientInternals {
+class PosixTransport;
+
+// Single epoll loop driving the POSIX transports, the Linux counterpart of the AsyncTCP task.
+// Every callback of the clients runs on the thread calling run().
+class EventLoop {
+ public:
+  EventLoop();
+  ~EventLoop();
+
+  // The loop used by clients that are not given one
+  static EventLoop* getDefault();
+
+  // Runs until stop() is called
+  void run();
+  // Waits at most timeout ms for events and handles them
+  void runOnce(int timeout);
+  // Can be called from any thread
+  void stop();
+
+  // Used by the transports, from any thread
+  void add(PosixTransport* transport, int fd, uint32_t events);
+  void modify(PosixTransport* transport, int fd, uint32_t events);
+  void remove(PosixTransport* transport, int fd);
+  // Whether the caller runs the loop, which is assumed when it has never been run
+  bool inLoopThread() const;
+  // Reports on the loop thread the disconnection of a transport closed from another thread
+  void notifyClosed(PosixTransport* transport);
+  // Reports on the loop thread the end of a resolution run on another thread
+  void notifyResolved(PosixTransport* transport);
+  void cancelNotifications(PosixTransport* transport);
+
+  static const uint32_t POLL_INTERVAL = 500;  // ms, like AsyncTCP
+
+ private:
+  bool _registered(PosixTransport* transport);
+
+  int _epollFd;
+  int _wakeFd;
+  std::atomic<bool> _running;
+  std::mutex _mutex;
+  std::vector<PosixTransport*> _transports;
+  std::vector<PosixTransport*> _closed;
+  std::vector<PosixTransport*> _resolved;
+  std::vector<PosixTransport*> _handled;  // loop thread only
+  std::atomic<std::thread::id> _thread;
+  uint32_t _lastPoll;
+};
+}  // namespace AsyncMqttClientInternals
+
+#endif
@@ -0,0 +1,656 @@
+#ifdef __linux__
+
+#include "PosixTransport.hpp"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#if ASYNC_MQTT_OPENSSL
+#include <climits>
+#include <cstring>
+#include <openssl/x509.h>
+#endif
+
+using AsyncMqttClientInternals::PosixTransport;
+
+#if ASYNC_MQTT_OPENSSL
+namespace {
+// OpenSSL socket I/O, with MSG_NOSIGNAL like the rest of the transport: a closed peer must not raise SIGPIPE
+int bioWrite(BIO* bio, const char* data, int size) {
+  BIO_clear_retry_flags(bio);
+  ssize_t sent = ::send(*static_cast<int*>(BIO_get_data(bio)), data, size, MSG_NOSIGNAL);
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) BIO_set_retry_write(bio);
+  return sent;
+}
+
+int bioRead(BIO* bio, char* buffer, int size) {
+  BIO_clear_retry_flags(bio);
+  ssize_t received = recv(*static_cast<int*>(BIO_get_data(bio)), buffer, size, 0);
+  if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) BIO_set_retry_read(bio);
+  return received;
+}
+
+long bioControl(BIO* bio, int command, long number, void* pointer) {  // NOLINT(runtime/int)
+  (void)bio;
+  (void)number;
+  (void)pointer;
+  return command == BIO_CTRL_FLUSH ? 1 : 0;
+}
+
+int bioCreate(BIO* bio) {
+  BIO_set_init(bio, 1);
+  return 1;
+}
+
+BIO_METHOD* socketBio() {
+  static BIO_METHOD* method = []() {
+    BIO_METHOD* method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "mqtt socket");
+    BIO_meth_set_write(method, bioWrite);
+    BIO_meth_set_read(method, bioRead);
+    BIO_meth_set_ctrl(method, bioControl);
+    BIO_meth_set_create(method, bioCreate);
+    return method;
+  }();
+  return method;
+}
+}  // namespace
+#endif
+
+PosixTransport::PosixTransport(EventLoop* eventLoop, size_t sendBufferSize)
+: _eventLoop(eventLoop)
+, _sendBufferSize(sendBufferSize)
+, _mutex()
+, _fd(-1)
+, _state(State::CLOSED)
+, _sendBuffer(new char[sendBufferSize])
+, _sendBufferLength(0)
+, _sendBufferIndex(0)
+, _reserved(0)
+, _written(0)
+, _ackLater(false)
+, _unacked(0)
+, _resolverMutex()
+, _resolver()
+, _resolving(false)
+, _resolvingHost()
+#if ASYNC_MQTT_ADDRESS_CACHE
+, _resolveRequested(false)
+#endif
+, _resolved()
+, _port(0)
+, _secure(false)
+, _host()
+#if ASYNC_MQTT_OPENSSL
+, _tlsContext(nullptr)
+, _tls(nullptr)
+, _tlsSession(nullptr)
+, _verifyPeer(true)
+, _address(0)
+, _handshakeStart(0)
+, _tlsStats()
+#endif
+{
+}
+
+PosixTransport::~PosixTransport() {
+  {
+    std::lock_guard<std::mutex> lock(_resolverMutex);
+    if (_resolver.joinable()) _resolver.join();
+  }
+  _eventLoop->cancelNotifications(this);
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_fd != -1) {
+    _eventLoop->remove(this, _fd);
+#if ASYNC_MQTT_OPENSSL
+    _closeTls(false, false);
+#endif
+    ::close(_fd);
+  }
+#if ASYNC_MQTT_OPENSSL
+  if (_tlsSession != nullptr) SSL_SESSION_free(_tlsSession);
+  if (_tlsContext != nullptr) SSL_CTX_free(_tlsContext);
+#endif
+  delete[] _sendBuffer;
+}
+
+bool PosixTransport::connect(IPAddress ip, uint16_t port, bool secure) {
+#if !ASYNC_MQTT_OPENSSL
+  if (secure) return false;  // TLS needs ASYNC_MQTT_OPENSSL
+#endif
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_state != State::CLOSED) return false;
+  return _connect(ip, port, secure, nullptr);
+}
+
+// Connects once the name is resolved on the resolver thread, a name that does not resolve is reported as a
+// disconnection like an unreachable address
+bool PosixTransport::connect(const char* host, uint16_t port, bool secure) {
+#if !ASYNC_MQTT_OPENSSL
+  if (secure) return false;
+#endif
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_state != State::CLOSED || !_startResolution(host)) return false;
+  _state = State::RESOLVING;
+  _port = port;
+  _secure = secure;
+  _host = host;
+  return true;
+}
+
+#if ASYNC_MQTT_ADDRESS_CACHE
+bool PosixTransport::connectResolved(IPAddress ip, const char* host, uint16_t port, bool secure) {
+#if !ASYNC_MQTT_OPENSSL
+  if (secure) return false;
+#endif
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_state != State::CLOSED) return false;
+  return _connect(ip, port, secure, host);
+}
+
+bool PosixTransport::resolve(const char* host) {
+  std::lock_guard<std::mutex> lock(_resolverMutex);
+  if (_resolving) return false;
+  if (_resolver.joinable()) _resolver.join();  // done, its addresses were handed over
+  _resolving = true;
+  _resolvingHost = host;
+  _resolveRequested = true;
+  _resolver = std::thread(&PosixTransport::_resolve, this, _resolvingHost);
+  return true;
+}
+#endif
+
+// For connect(), which shares a resolution of the same name in progress. Returns false while another name is resolved
+bool PosixTransport::_startResolution(const char* host) {
+  std::lock_guard<std::mutex> lock(_resolverMutex);
+  if (_resolving) return _resolvingHost == host;
+  if (_resolver.joinable()) _resolver.join();
+  _resolving = true;
+  _resolvingHost = host;
+  _resolver = std::thread(&PosixTransport::_resolve, this, _resolvingHost);
+  return true;
+}
+
+void PosixTransport::_resolve(std::string host) {
+  std::vector<IPAddress> addresses;
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* result;
+  if (getaddrinfo(host.c_str(), nullptr, &hints, &result) == 0) {
+    for (struct addrinfo* info = result; info != nullptr && addresses.size() < ASYNC_MQTT_CACHED_ADDRESSES; info = info->ai_next) {
+      addresses.push_back(reinterpret_cast<struct sockaddr_in*>(info->ai_addr)->sin_addr.s_addr);
+    }
+    freeaddrinfo(result);
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _resolved.swap(addresses);
+  }
+  _eventLoop->notifyResolved(this);
+}
+
+// With _mutex held, the transport closed
+bool PosixTransport::_connect(uint32_t address, uint16_t port, bool secure, const char* host) {
+  _secure = secure;
+  _host = host != nullptr ? host : "";
+#if ASYNC_MQTT_OPENSSL
+  _address = address;
+#endif
+
+  _fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_fd == -1) return false;
+  int noDelay = 1;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  struct sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = address;
+  if (::connect(_fd, reinterpret_cast<struct sockaddr*>(&server), sizeof(server)) == -1 && errno != EINPROGRESS) {
+    ::close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  _state = State::CONNECTING;
+  _sendBufferLength = 0;
+  _sendBufferIndex = 0;
+  _reserved = 0;
+  _written = 0;
+  _ackLater = false;
+  _unacked = 0;
+  _eventLoop->add(this, _fd, EPOLLOUT);
+  return true;
+}
+
+void PosixTransport::close(bool now) {
+  _close(now, false);
+}
+
+void PosixTransport::_close(bool now, bool failed) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_state == State::CLOSED) return;
+    // while resolving there is no socket yet, the resolution ends without connecting
+    if (_state != State::RESOLVING) {
+      if (!now && _state == State::CONNECTED) _flush();  // best effort, the socket is not waited for
+      _eventLoop->remove(this, _fd);
+#if ASYNC_MQTT_OPENSSL
+      _closeTls(!now && _state == State::CONNECTED, failed);
+#endif
+      ::close(_fd);
+      _fd = -1;
+    }
+    _state = State::CLOSED;
+  }
+  // the client state is only touched from the loop thread
+  if (_eventLoop->inLoopThread()) {
+    handleClosed();
+  } else {
+    _eventLoop->notifyClosed(this);
+  }
+}
+
+bool PosixTransport::canSend() {
+  return space() > 0;
+}
+
+size_t PosixTransport::space() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_state != State::CONNECTED) return 0;
+  return _sendBufferSize - (_sendBufferLength - _sendBufferIndex);
+}
+
+size_t PosixTransport::add(const char* data, size_t size) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_state != State::CONNECTED || _reserved > 0) return 0;
+  _compact();
+  size_t available = _sendBufferSize - _sendBufferLength;
+  if (size > available) size = available;
+  memcpy(_sendBuffer + _sendBufferLength, data, size);
+  _sendBufferLength += size;
+  return size;
+}
+
+bool PosixTransport::send() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_state != State::CONNECTED) return false;
+  _flush();  // the ack callback is left to the event loop, the caller may hold the client lock
+  return true;
+}
+
+// The event loop keeps sending what came before, without moving the reserved bytes
+char* PosixTransport::reserve(size_t size) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_state != State::CONNECTED || _reserved > 0) return nullptr;
+  _compact();
+  if (size > _sendBufferSize - _sendBufferLength) return nullptr;
+  char* reserved = _sendBuffer + _sendBufferLength;
+  _sendBufferLength += size;
+  _reserved = size;
+  return reserved;
+}
+
+// The bytes dropped before the ones handed over are skipped if all that came before was sent, otherwise the ones
+// handed over are moved behind what is still to send
+void PosixTransport::commit(size_t offset, size_t length) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_reserved == 0) return;  // the connection was opened again meanwhile
+  size_t start = _sendBufferLength - _reserved;
+  _reserved = 0;
+  if (_sendBufferIndex == start) {
+    _sendBufferIndex += offset;
+    _sendBufferLength = _sendBufferIndex + length;
+  } else {
+    if (offset > 0) memmove(_sendBuffer + start, _sendBuffer + start + offset, length);
+    _sendBufferLength = start + length;
+  }
+}
+
+void PosixTransport::ackLater() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _ackLater = true;
+}
+
+size_t PosixTransport::ack(size_t len) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (len > _unacked) len = _unacked;
+  _unacked -= len;
+  // reading again lets the kernel reopen the TCP window
+  if (_unacked == 0 && _state == State::CONNECTED) _eventLoop->modify(this, _fd, _events());
+  return len;
+}
+
+void PosixTransport::handleEvents(uint32_t events) {
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  if (_state == State::CONNECTING) {
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+    if (error != 0 || (events & (EPOLLERR | EPOLLHUP)) != 0) {
+      lock.unlock();
+      _fail(error != 0 ? error : ECONNREFUSED);
+      return;
+    }
+    if ((events & EPOLLOUT) == 0) return;
+
+#if ASYNC_MQTT_OPENSSL
+    if (_secure) {
+      if (!_startTls()) {
+        lock.unlock();
+        _fail(EPROTO);
+        return;
+      }
+      _state = State::HANDSHAKING;
+      _handshakeStart = micros();
+    }
+  }
+
+  if (_state == State::HANDSHAKING) {
+    int result = SSL_connect(_tls);
+    if (result != 1) {
+      int error = SSL_get_error(_tls, result);
+      if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        _eventLoop->modify(this, _fd, error == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT);
+        return;
+      }
+      if (_tlsSession != nullptr) {
+        SSL_SESSION_free(_tlsSession);  // in case the server chokes on it, the next handshake is a full one
+        _tlsSession = nullptr;
+      }
+      lock.unlock();
+      _fail(EPROTO);
+      return;
+    }
+    _tlsStats.handshakes++;
+    if (SSL_session_reused(_tls)) _tlsStats.resumed++;
+    _tlsStats.lastHandshakeUs = micros() - _handshakeStart;
+    _tlsStats.totalHandshakeUs += _tlsStats.lastHandshakeUs;
+#else
+  }
+  if (_state == State::CONNECTING) {
+#endif
+    _state = State::CONNECTED;
+    _eventLoop->modify(this, _fd, _events());
+    lock.unlock();
+    if (_onConnect) _onConnect();
+    return;
+  }
+  if (_state != State::CONNECTED) return;
+
+  if ((events & EPOLLOUT) != 0) {
+    _flush();
+    size_t written = _written;
+    _written = 0;
+    _eventLoop->modify(this, _fd, _events());
+    lock.unlock();
+    if (written > 0 && _onAck) _onAck(written, 0);
+    lock.lock();
+    if (_state != State::CONNECTED) return;
+  }
+
+  bool readable = (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+#if ASYNC_MQTT_OPENSSL
+  readable = readable || _tlsPending();
+#endif
+  if (readable && _unacked == 0) {
+    char buffer[RECEIVE_BUFFER_SIZE];
+    ssize_t received = _receive(buffer, sizeof(buffer));
+    if (received > 0) {
+      _ackLater = false;
+      lock.unlock();
+      if (_onData) _onData(buffer, received);
+      lock.lock();
+      if (_ackLater && _state == State::CONNECTED) {
+        // stop reading until the data is acknowledged
+        _unacked += received;
+        _eventLoop->modify(this, _fd, _events());
+#if ASYNC_MQTT_OPENSSL
+      } else if (_tlsPending()) {
+        _eventLoop->modify(this, _fd, _events());  // to be woken up for the rest
+#endif
+      }
+    } else if (received == 0) {
+      lock.unlock();
+      close(true);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      int error = errno;
+      lock.unlock();
+      _fail(error);
+    }
+  }
+}
+
+void PosixTransport::handlePoll() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_state != State::CONNECTED) return;
+  }
+  if (_onPoll) _onPoll();
+}
+
+void PosixTransport::handleClosed() {
+  if (_onDisconnect) _onDisconnect();
+}
+
+void PosixTransport::handleResolved() {
+  std::vector<IPAddress> addresses;
+  bool connecting;
+  bool connected = false;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    addresses.swap(_resolved);
+    connecting = _state == State::RESOLVING;
+    if (connecting) {
+      _state = State::CLOSED;
+      connected = !addresses.empty() && _connect(addresses.front(), _port, _secure, _host.c_str());
+    }
+  }
+#if ASYNC_MQTT_ADDRESS_CACHE
+  bool requested;
+#endif
+  {
+    std::lock_guard<std::mutex> lock(_resolverMutex);
+    _resolving = false;
+#if ASYNC_MQTT_ADDRESS_CACHE
+    requested = _resolveRequested;
+    _resolveRequested = false;
+#endif
+  }
+#if ASYNC_MQTT_ADDRESS_CACHE
+  if (requested && _onResolve) _onResolve(addresses.data(), addresses.size());
+#endif
+  if (connecting && !connected) handleClosed();
+}
+
+void PosixTransport::_flush() {
+  size_t end = _sendBufferLength - _reserved;
+  while (_sendBufferIndex < end) {
+    ssize_t sent = _send(_sendBuffer + _sendBufferIndex, end - _sendBufferIndex);
+    if (sent <= 0) break;
+    _sendBufferIndex += sent;
+    _written += sent;
+  }
+  _compact();
+  _eventLoop->modify(this, _fd, _events());
+}
+
+// What is left to send moves to the front, unless bytes are reserved behind it
+void PosixTransport::_compact() {
+  if (_sendBufferIndex == 0 || _reserved > 0) return;
+  memmove(_sendBuffer, _sendBuffer + _sendBufferIndex, _sendBufferLength - _sendBufferIndex);
+  _sendBufferLength -= _sendBufferIndex;
+  _sendBufferIndex = 0;
+}
+
+uint32_t PosixTransport::_events() const {
+  uint32_t events = 0;
+  if (_unacked == 0) events |= EPOLLIN;
+  // written data is reported from the loop, the socket being writable the event comes right away
+  if (_sendBufferIndex < _sendBufferLength - _reserved || _written > 0) events |= EPOLLOUT;
+#if ASYNC_MQTT_OPENSSL
+  // decrypted data left in OpenSSL does not make the socket readable, the writable event comes instead
+  if (_unacked == 0 && _tlsPending()) events |= EPOLLOUT;
+#endif
+  return events;
+}
+
+// The bytes sent, or -1 with errno set, EAGAIN if the socket would block, EPROTO if TLS failed
+ssize_t PosixTransport::_send(const char* data, size_t size) {
+#if ASYNC_MQTT_OPENSSL
+  if (_tls != nullptr) {
+    int sent = SSL_write(_tls, data, size < INT_MAX ? size : INT_MAX);
+    if (sent > 0) return sent;
+    int error = SSL_get_error(_tls, sent);
+    if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) errno = EAGAIN;
+    if (error == SSL_ERROR_SSL) errno = EPROTO;
+    if (error == SSL_ERROR_SYSCALL && errno == 0) errno = EPIPE;
+    return -1;
+  }
+#endif
+  return ::send(_fd, data, size, MSG_NOSIGNAL);
+}
+
+// The bytes received, 0 once the peer closed the connection, or -1 with errno set
+ssize_t PosixTransport::_receive(char* buffer, size_t size) {
+#if ASYNC_MQTT_OPENSSL
+  if (_tls != nullptr) {
+    int received = SSL_read(_tls, buffer, size < INT_MAX ? size : INT_MAX);
+    if (received > 0) return received;
+    int error = SSL_get_error(_tls, received);
+    // a broker closing the socket without close_notify, where SSL_OP_IGNORE_UNEXPECTED_EOF is missing
+    if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && errno == 0)) return 0;
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) errno = EAGAIN;
+    if (error == SSL_ERROR_SSL) errno = EPROTO;
+    return -1;
+  }
+#endif
+  return recv(_fd, buffer, size, 0);
+}
+
+void PosixTransport::_fail(int error) {
+  if (_onError) _onError(-static_cast<int8_t>(error));
+  // the socket reset by the server after a DISCONNECT, say, leaves the TLS session sound
+  _close(true, error == EPROTO);
+}
+
+#if ASYNC_MQTT_OPENSSL
+bool PosixTransport::matchFingerprint(const uint8_t* fingerprint) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_tls == nullptr) return false;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  X509* certificate = SSL_get1_peer_certificate(_tls);
+#else
+  X509* certificate = SSL_get_peer_certificate(_tls);
+#endif
+  if (certificate == nullptr) return false;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  bool matches = X509_digest(certificate, EVP_sha1(), digest, &length) == 1 && length == 20 && memcmp(digest, fingerprint, length) == 0;
+  X509_free(certificate);
+  return matches;
+}
+
+size_t PosixTransport::getTlsSession(uint8_t* buffer, size_t size) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_tlsSession == nullptr) return 0;
+  int length = i2d_SSL_SESSION(_tlsSession, nullptr);
+  if (length <= 0) return 0;
+  if (static_cast<size_t>(length) <= size) i2d_SSL_SESSION(_tlsSession, &buffer);
+  return length;
+}
+
+bool PosixTransport::setTlsSession(const uint8_t* session, size_t length) {
+  SSL_SESSION* decoded = nullptr;
+  if (length > 0) {
+    decoded = d2i_SSL_SESSION(nullptr, &session, length);
+    if (decoded == nullptr) return false;
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_tlsSession != nullptr) SSL_SESSION_free(_tlsSession);
+  _tlsSession = decoded;
+  return true;
+}
+
+void PosixTransport::setFingerprintVerification(bool fingerprints) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _verifyPeer = !fingerprints;
+}
+
+AsyncMqttClientTlsStats PosixTransport::getTlsStats() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _tlsStats;
+}
+
+bool PosixTransport::_startTls() {
+  if (_tlsContext == nullptr) {
+    _tlsContext = SSL_CTX_new(TLS_client_method());
+    if (_tlsContext == nullptr) return false;
+    // for the servers not authenticated by the fingerprint of their certificate
+    SSL_CTX_set_default_verify_paths(_tlsContext);
+    SSL_CTX_set_mode(_tlsContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(_tlsContext, SSL_OP_IGNORE_UNEXPECTED_EOF);  // a broker closing the socket is a disconnection
+#endif
+    SSL_CTX_set_session_cache_mode(_tlsContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(_tlsContext, &PosixTransport::_onTlsSession);
+  }
+  BIO* bio = BIO_new(socketBio());
+  _tls = SSL_new(_tlsContext);
+  if (bio == nullptr || _tls == nullptr) {
+    BIO_free(bio);
+    _closeTls(false, false);
+    return false;
+  }
+  BIO_set_data(bio, &_fd);
+  SSL_set_bio(_tls, bio, bio);
+  SSL_set_app_data(_tls, this);
+  if (!_host.empty()) SSL_set_tlsext_host_name(_tls, _host.c_str());
+  // the certificate chain and the name of the server, the one connected to or else its address. With a fingerprint
+  // the client checks the certificate itself once connected, like with axTLS on ESP
+  SSL_set_verify(_tls, _verifyPeer ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, nullptr);
+  if (_verifyPeer && !_host.empty()) SSL_set1_host(_tls, _host.c_str());
+  if (_verifyPeer && _host.empty()) X509_VERIFY_PARAM_set1_ip(SSL_get0_param(_tls), reinterpret_cast<const unsigned char*>(&_address), sizeof(_address));
+  if (_tlsSession != nullptr) SSL_set_session(_tls, _tlsSession);
+  return true;
+}
+
+bool PosixTransport::_tlsPending() const {
+  return _tls != nullptr && _state == State::CONNECTED && SSL_pending(_tls) > 0;
+}
+
+void PosixTransport::_closeTls(bool notify, bool failed) {
+  if (_tls == nullptr) return;
+  // the session of a connection that failed is not resumed: it is not shut down, which OpenSSL takes as a broken
+  // session, and not kept either
+  if (failed) {
+    if (_tlsSession != nullptr) SSL_SESSION_free(_tlsSession);
+    _tlsSession = nullptr;
+  // a connection not shut down would make its session not resumable: it is, quietly unless notifying the server
+  // with a close_notify, best effort like the flush
+  } else if (SSL_is_init_finished(_tls)) {
+    if (!notify) SSL_set_quiet_shutdown(_tls, 1);
+    SSL_shutdown(_tls);
+  }
+  SSL_free(_tls);
+  _tls = nullptr;
+}
+
+// A session handed out by the server, with the transport locked: from the handshake with TLS 1.2,
+// from a later read with the tickets of TLS 1.3
+int PosixTransport::_onTlsSession(SSL* tls, SSL_SESSION* session) {
+  PosixTransport* transport = static_cast<PosixTransport*>(SSL_get_app_data(tls));
+  if (transport->_tlsSession != nullptr) SSL_SESSION_free(transport->_tlsSession);
+  transport->_tlsSession = session;
+  return 1;  // its reference is kept
+}
+#endif
+
+#endif
@@ -0,0 +1,122 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if ASYNC_MQTT_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+#include "Transport.hpp"
+#include "EventLoop.hpp"
+
+namespace AsyncMqttClientInternals {
+// Non-blocking socket driven by an EventLoop. add()/send() can be called from any thread,
+// the callbacks are called from the event loop thread. resolve() and connect() to a host name run getaddrinfo() on a
+// thread of its own, the caller never blocks. With ASYNC_MQTT_OPENSSL, secure connections run TLS and resume the
+// session of the previous connection. The server certificate is verified against the certificate authorities of the
+// system and the host name, unless the client checks its fingerprint.
+class PosixTransport : public Transport {
+ public:
+  explicit PosixTransport(EventLoop* eventLoop = EventLoop::getDefault(), size_t sendBufferSize = SEND_BUFFER_SIZE);
+  ~PosixTransport();
+
+  bool connect(IPAddress ip, uint16_t port, bool secure) override;
+  bool connect(const char* host, uint16_t port, bool secure) override;
+#if ASYNC_MQTT_ADDRESS_CACHE
+  bool connectResolved(IPAddress ip, const char* host, uint16_t port, bool secure) override;
+  bool resolve(const char* host) override;
+#endif
+  void close(bool now) override;
+  bool canSend() override;
+  size_t space() override;
+  size_t add(const char* data, size_t size) override;
+  bool send() override;
+  char* reserve(size_t size) override;
+  void commit(size_t offset, size_t length) override;
+  void ackLater() override;
+  size_t ack(size_t len) override;
+#if ASYNC_MQTT_OPENSSL
+  bool matchFingerprint(const uint8_t* fingerprint) override;
+  size_t getTlsSession(uint8_t* buffer, size_t size) override;
+  bool setTlsSession(const uint8_t* session, size_t length) override;
+  void setFingerprintVerification(bool fingerprints) override;
+  AsyncMqttClientTlsStats getTlsStats() override;
+#endif
+
+  // Called by the event loop
+  void handleEvents(uint32_t events);
+  void handlePoll();
+  void handleClosed();
+  void handleResolved();
+
+  static const size_t SEND_BUFFER_SIZE = 16384;  // default of what space() reports when nothing is pending
+  static const size_t RECEIVE_BUFFER_SIZE = 4096;
+
+ private:
+  enum class State : uint8_t {
+    CLOSED,
+    RESOLVING,  // connect() to a host name
+    CONNECTING,
+    HANDSHAKING,
+    CONNECTED
+  };
+
+  bool _connect(uint32_t address, uint16_t port, bool secure, const char* host);
+  bool _startResolution(const char* host);
+  void _flush();
+  void _compact();
+  ssize_t _send(const char* data, size_t size);
+  ssize_t _receive(char* buffer, size_t size);
+#if ASYNC_MQTT_OPENSSL
+  bool _startTls();
+  bool _tlsPending() const;
+  void _closeTls(bool notify, bool failed);
+  static int _onTlsSession(SSL* tls, SSL_SESSION* session);
+#endif
+  uint32_t _events() const;
+  void _close(bool now, bool failed);
+  void _fail(int error);
+  void _resolve(std::string host);
+
+  EventLoop* _eventLoop;
+  size_t _sendBufferSize;
+  std::mutex _mutex;
+  int _fd;
+  State _state;
+  char* _sendBuffer;  // _sendBufferSize bytes
+  size_t _sendBufferLength;
+  size_t _sendBufferIndex;  // bytes of _sendBuffer already written to the socket
+  size_t _reserved;         // at the end of _sendBuffer, written in place until commit()
+  size_t _written;          // written to the socket but not reported to the ack callback yet
+  bool _ackLater;
+  size_t _unacked;
+  std::mutex _resolverMutex;  // for _resolver, not held by the resolution
+  std::thread _resolver;
+  std::atomic<bool> _resolving;
+  std::string _resolvingHost;        // under _resolverMutex
+#if ASYNC_MQTT_ADDRESS_CACHE
+  bool _resolveRequested;            // by resolve(), whose handler gets the addresses, under _resolverMutex
+#endif
+  std::vector<IPAddress> _resolved;  // by the last resolution, under _mutex
+  uint16_t _port;                    // of the connection waiting for its resolution
+  bool _secure;
+  std::string _host;  // for SNI, empty when connecting to an address
+#if ASYNC_MQTT_OPENSSL
+  SSL_CTX* _tlsContext;
+  SSL* _tls;
+  SSL_SESSION* _tlsSession;  // to resume
+  bool _verifyPeer;          // the certificate chain and the host name, the client not checking a fingerprint
+  uint32_t _address;         // of the connection, for the verification of a certificate without host name
+  uint32_t _handshakeStart;
+  AsyncMqttClientTlsStats _tlsStats;
+#endif
+};
+}  // namespace AsyncMqttClientInternals
+
+#endif
@@ -0,0 +1,472 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "Transport.hpp"
+
+namespace AsyncMqttClientInternals {
+// In-memory connection on a simulated clock, to reproduce network conditions deterministically.
+// Time only moves with advance(), every random choice (segment boundaries, jitter) comes from the seed,
+// and the broker side is played by the caller through the server methods.
+// Give now() to the client with setClock() so its timers follow the simulation.
+class SimulatedTransport : public Transport {
+ public:
+  typedef std::function<void()> ServerHandler;
+  typedef std::function<void(const char* data, size_t len)> ServerDataHandler;
+
+  explicit SimulatedTransport(uint32_t seed = 0)
+  : _random(seed)
+  , _now(1)  // 0 means "never" in the client timestamps
+  , _latency(0)
+  , _jitter(0)
+  , _maxSegmentSize(SIZE_MAX)
+  , _sendBufferSize(DEFAULT_SEND_BUFFER_SIZE)
+  , _refuseConnections(false)
+  , _hostAddresses(1, IPAddress(127, 0, 0, 1))
+  , _resolveTime(0)
+  , _unreachable()
+  , _dropAfter(SIZE_MAX)
+  , _failedConnects(0)
+  , _resolving(false)
+  , _resolutions(0)
+  , _lastAddress()
+  , _state(State::CLOSED)
+  , _generation(0)
+  , _events()
+  , _toClient()
+  , _lastToClient(0)
+  , _lastToServer(0)
+  , _lastPoll(0)
+  , _sendBuffer()
+  , _inFlight(0)
+  , _ackLater(false)
+  , _unacked(0) {
+  }
+
+  // Network conditions, they apply to what is sent from now on
+
+  // One way delay in ms, plus a random delay of at most jitter ms. TCP order is kept.
+  void setLatency(uint32_t latency, uint32_t jitter = 0) {
+    _latency = latency;
+    _jitter = jitter;
+  }
+
+  // Data sent to the client is split at random boundaries, in segments of 1 to maxSegmentSize bytes
+  void setMaxSegmentSize(size_t maxSegmentSize) {
+    _maxSegmentSize = maxSegmentSize > 0 ? maxSegmentSize : 1;
+  }
+
+  // What space() reports when nothing is in flight, it can be shrunk while connected
+  void setSendBufferSize(size_t sendBufferSize) {
+    _sendBufferSize = sendBufferSize;
+  }
+
+  void setRefuseConnections(bool refuseConnections) {
+    _refuseConnections = refuseConnections;
+  }
+
+  // Every host name resolves to `addresses` in `resolveTime` ms, by resolve() and by connect(host) alike.
+  // Without addresses, resolutions fail
+  void setHostAddresses(const std::vector<IPAddress>& addresses, uint32_t resolveTime = 0) {
+    _hostAddresses = addresses;
+    _resolveTime = resolveTime;
+  }
+
+  // Connections to `address` are refused, as if the server behind it was down
+  void setUnreachable(IPAddress address, bool unreachable = true) {
+    _unreachable.erase(std::remove(_unreachable.begin(), _unreachable.end(), static_cast<uint32_t>(address)), _unreachable.end());
+    if (unreachable) _unreachable.push_back(address);
+  }
+
+  // Faults
+
+  // The connection is lost once the client received that many more bytes, possibly in the middle of a packet
+  void dropAfter(size_t bytes) {
+    _dropAfter = bytes;
+  }
+
+  // The next `count` connections are not even started: connect() returns false, like a socket that cannot be opened
+  void failConnects(uint32_t count) {
+    _failedConnects = count;
+  }
+
+  // The connection is lost now, without notice to either side: what is in flight is lost
+  void drop() {
+    if (_state == State::CLOSED) return;
+    bool wasConnected = _state == State::CONNECTED;
+    _reset();
+    _events.clear();
+    if (wasConnected && _onServerDisconnect) _onServerDisconnect();
+    if (_onError) _onError(ERROR_RESET);
+    if (_onDisconnect) _onDisconnect();
+  }
+
+  // Clock
+
+  uint32_t now() const {
+    return _now;
+  }
+
+  // Network statistics
+
+  uint32_t resolutions() const {
+    return _resolutions;
+  }
+
+  // Of the last connection attempt, to a host name or not
+  IPAddress lastAddress() const {
+    return _lastAddress;
+  }
+
+  // Handles what is due, then moves the clock ms by ms, polling the client every POLL_INTERVAL like AsyncTCP
+  void advance(uint32_t ms = 0) {
+    _process();
+    for (uint32_t i = 0; i < ms; i++) {
+      _now++;
+      _process();
+    }
+  }
+
+  // Broker side
+
+  void onServerConnect(ServerHandler handler) {
+    _onServerConnect = handler;
+  }
+
+  void onServerDisconnect(ServerHandler handler) {
+    _onServerDisconnect = handler;
+  }
+
+  void onServerData(ServerDataHandler handler) {
+    _onServerData = handler;
+  }
+
+  bool serverSend(const char* data, size_t len) {
+    if (_state != State::CONNECTED) return false;
+    while (len > 0) {
+      size_t segmentSize = _maxSegmentSize == SIZE_MAX ? len : 1 + _randomBelow(_maxSegmentSize);
+      if (segmentSize > len) segmentSize = len;
+      _toClient.push_back({ _toClientTime(), std::vector<char>(data, data + segmentSize), false });
+      data += segmentSize;
+      len -= segmentSize;
+    }
+    return true;
+  }
+
+  // Closes the connection after the data already sent, like a FIN
+  void serverClose() {
+    if (_state != State::CONNECTED) return;
+    _toClient.push_back({ _toClientTime(), std::vector<char>(), true });
+  }
+
+  // Transport
+
+  bool connect(IPAddress ip, uint16_t port, bool secure) override {
+    (void)port;
+    if (secure || _state != State::CLOSED) return false;
+    _lastAddress = ip;
+    if (_failedConnects > 0) {
+      _failedConnects--;
+      return false;
+    }
+    return _connect(0, _isUnreachable(ip));
+  }
+
+  bool connect(const char* host, uint16_t port, bool secure) override {
+    (void)host;
+    (void)port;
+    if (secure || _state != State::CLOSED) return false;
+    _resolutions++;
+    bool resolved = !_hostAddresses.empty();
+    _lastAddress = resolved ? _hostAddresses.front() : IPAddress();
+    if (_failedConnects > 0) {
+      _failedConnects--;
+      return false;
+    }
+    return _connect(_resolveTime, !resolved || _isUnreachable(_lastAddress));
+  }
+
+  bool resolve(const char* host) override {
+    (void)host;
+    if (_resolving) return false;
+    _resolving = true;
+    _resolutions++;
+    _schedule(_now + _resolveTime, EventType::RESOLVED, std::vector<char>());
+    return true;
+  }
+
+  void close(bool now) override {
+    if (_state == State::CLOSED) return;
+    bool wasConnected = _state == State::CONNECTED;
+    if (!now) send();
+    _reset();
+    // the broker learns it after the data sent before
+    if (wasConnected) _schedule(_toServerTime(), EventType::CLIENT_CLOSED, std::vector<char>());
+    if (_onDisconnect) _onDisconnect();
+  }
+
+  bool canSend() override {
+    return space() > 0;
+  }
+
+  size_t space() override {
+    if (_state != State::CONNECTED) return 0;
+    size_t used = _sendBuffer.size() + _inFlight;
+    return used < _sendBufferSize ? _sendBufferSize - used : 0;
+  }
+
+  size_t add(const char* data, size_t size) override {
+    size_t available = space();
+    if (size > available) size = available;
+    _sendBuffer.insert(_sendBuffer.end(), data, data + size);
+    return size;
+  }
+
+  bool send() override {
+    if (_state != State::CONNECTED || _sendBuffer.empty()) return false;
+    uint32_t arrival = _toServerTime();
+    _inFlight += _sendBuffer.size();
+    // acknowledged once the data made the round trip
+    _schedule(arrival + _latency, EventType::ACK, std::vector<char>(), _sendBuffer.size());
+    _schedule(arrival, EventType::TO_SERVER, std::move(_sendBuffer));
+    _sendBuffer.clear();
+    return true;
+  }
+
+  // Nothing more is delivered to the client until the held data is acknowledged
+  void ackLater() override {
+    _ackLater = true;
+  }
+
+  size_t ack(size_t len) override {
+    if (len > _unacked) len = _unacked;
+    _unacked -= len;
+    return len;
+  }
+
+#if ASYNC_TCP_SSL_ENABLED
+  SSL* getSSL() override {
+    return nullptr;
+  }
+#endif
+#if ASYNC_MQTT_TLS
+  bool matchFingerprint(const uint8_t* fingerprint) override {
+    (void)fingerprint;
+    return false;
+  }
+#endif
+
+  static const uint32_t POLL_INTERVAL = 500;  // ms
+  static const size_t DEFAULT_SEND_BUFFER_SIZE = 5744;  // TCP_SND_BUF of lwIP on ESP32
+  static const int8_t ERROR_RESET = -14;  // ERR_RST of lwIP
+
+ private:
+  enum class State : uint8_t {
+    CLOSED,
+    CONNECTING,
+    CONNECTED
+  };
+
+  enum class EventType : uint8_t {
+    CONNECTED,
+    REFUSED,
+    ACK,
+    TO_SERVER,
+    CLIENT_CLOSED,
+    RESOLVED
+  };
+
+  struct Event {
+    EventType type;
+    uint32_t generation;  // events of the client side only apply to the connection they were made for
+    std::vector<char> data;
+    size_t length;
+    uint32_t sentAt;
+  };
+
+  struct Segment {
+    uint32_t time;
+    std::vector<char> data;
+    bool close;
+  };
+
+  // After `delay` ms of name resolution
+  bool _connect(uint32_t delay, bool unreachable) {
+    _state = State::CONNECTING;
+    _generation++;
+    // SYN, SYN-ACK
+    bool refused = _refuseConnections || unreachable;
+    _schedule(_now + delay + 2 * _latency + _randomJitter(), refused ? EventType::REFUSED : EventType::CONNECTED, std::vector<char>());
+    return true;
+  }
+
+  bool _isUnreachable(IPAddress address) const {
+    return std::find(_unreachable.begin(), _unreachable.end(), static_cast<uint32_t>(address)) != _unreachable.end();
+  }
+
+  void _reset() {
+    _state = State::CLOSED;
+    _generation++;
+    _toClient.clear();
+    _sendBuffer.clear();
+    _inFlight = 0;
+    _unacked = 0;
+    _dropAfter = SIZE_MAX;
+  }
+
+  void _schedule(uint32_t time, EventType type, std::vector<char>&& data, size_t length = 0) {
+    _events.insert(std::make_pair(time, Event { type, _generation, std::move(data), length, _now }));
+  }
+
+  void _process() {
+    while (true) {
+      if (!_events.empty() && _events.begin()->first <= _now) {
+        Event event = std::move(_events.begin()->second);
+        _events.erase(_events.begin());
+        _handle(event);
+      } else if (!_toClient.empty() && _toClient.front().time <= _now && _unacked == 0) {
+        Segment segment = std::move(_toClient.front());
+        _toClient.pop_front();
+        _deliver(segment);
+      } else {
+        break;
+      }
+    }
+
+    if (_state == State::CONNECTED && _now - _lastPoll >= POLL_INTERVAL) {
+      _lastPoll = _now;
+      if (_onPoll) _onPoll();
+    }
+  }
+
+  void _handle(const Event& event) {
+    switch (event.type) {
+      case EventType::TO_SERVER:
+        if (_onServerData) _onServerData(event.data.data(), event.data.size());
+        return;
+      case EventType::CLIENT_CLOSED:
+        if (_onServerDisconnect) _onServerDisconnect();
+        return;
+      case EventType::RESOLVED:
+        _resolving = false;
+        if (_onResolve) _onResolve(_hostAddresses.data(), _hostAddresses.size());
+        return;
+      default:
+        break;
+    }
+    if (event.generation != _generation) return;
+
+    switch (event.type) {
+      case EventType::CONNECTED:
+        _state = State::CONNECTED;
+        _lastPoll = _now;
+        _lastToClient = _now;
+        _lastToServer = _now;
+        if (_onServerConnect) _onServerConnect();
+        if (_onConnect) _onConnect();
+        break;
+      case EventType::REFUSED:
+        _reset();
+        if (_onError) _onError(ERROR_RESET);
+        if (_onDisconnect) _onDisconnect();
+        break;
+      case EventType::ACK:
+        _inFlight -= event.length;
+        if (_onAck) _onAck(event.length, _now - event.sentAt);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void _deliver(const Segment& segment) {
+    if (segment.close) {
+      _reset();
+      if (_onDisconnect) _onDisconnect();
+      return;
+    }
+
+    size_t len = segment.data.size();
+    bool drop = false;
+    if (_dropAfter != SIZE_MAX) {
+      if (len >= _dropAfter) {
+        len = _dropAfter;
+        drop = true;
+      } else {
+        _dropAfter -= len;
+      }
+    }
+
+    if (len > 0) {
+      uint32_t generation = _generation;
+      _ackLater = false;
+      // the client parses in place, like with lwIP buffers
+      std::vector<char> data(segment.data.begin(), segment.data.begin() + len);
+      if (_onData) _onData(data.data(), len);
+      if (generation != _generation) return;  // closed by the client meanwhile
+      if (_ackLater) _unacked += len;
+    }
+    if (drop) this->drop();
+  }
+
+  uint32_t _toClientTime() {
+    uint32_t time = _now + _latency + _randomJitter();
+    if (time < _lastToClient) time = _lastToClient;
+    _lastToClient = time;
+    return time;
+  }
+
+  uint32_t _toServerTime() {
+    uint32_t time = _now + _latency + _randomJitter();
+    if (time < _lastToServer) time = _lastToServer;
+    _lastToServer = time;
+    return time;
+  }
+
+  uint32_t _randomJitter() {
+    return _jitter == 0 ? 0 : _randomBelow(_jitter + 1);
+  }
+
+  // std::uniform_int_distribution differs between standard libraries, the raw generator does not
+  size_t _randomBelow(size_t bound) {
+    return _random() % bound;
+  }
+
+  std::mt19937 _random;
+  uint32_t _now;
+  uint32_t _latency;
+  uint32_t _jitter;
+  size_t _maxSegmentSize;
+  size_t _sendBufferSize;
+  bool _refuseConnections;
+  std::vector<IPAddress> _hostAddresses;
+  uint32_t _resolveTime;
+  std::vector<uint32_t> _unreachable;
+  size_t _dropAfter;
+  uint32_t _failedConnects;
+  bool _resolving;
+  uint32_t _resolutions;
+  IPAddress _lastAddress;
+
+  State _state;
+  uint32_t _generation;
+  std::multimap<uint32_t, Event> _events;  // in time order, then in scheduling order
+  std::deque<Segment> _toClient;
+  uint32_t _lastToClient;
+  uint32_t _lastToServer;
+  uint32_t _lastPoll;
+  std::vector<char> _sendBuffer;
+  size_t _inFlight;
+  bool _ackLater;
+  size_t _unacked;
+
+  ServerHandler _onServerConnect;
+  ServerHandler _onServerDisconnect;
+  ServerDataHandler _onServerData;
+};
+}  // namespace AsyncMqttClientInternals
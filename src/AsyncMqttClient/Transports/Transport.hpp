@@ -0,0 +1,149 @@
+#pragma once
+
+#include <functional>
+
+#include "../Platform.hpp"
+#include "../Config.hpp"
+#include "../TlsStats.hpp"
+
+#if ASYNC_TCP_SSL_ENABLED
+#include <tcp_axtls.h>
+#endif
+
+namespace AsyncMqttClientInternals {
+// The TCP connection the client runs on. The callbacks are called from the network context:
+// the AsyncTCP task or lwIP on ESP, the event loop thread on Linux.
+class Transport {
+ public:
+  typedef std::function<void()> ConnectHandler;
+  typedef std::function<void(int8_t error)> ErrorHandler;
+  typedef std::function<void(uint32_t time)> TimeoutHandler;
+  typedef std::function<void(size_t len, uint32_t time)> AckHandler;
+  typedef std::function<void(char* data, size_t len)> DataHandler;
+  typedef std::function<void(const IPAddress* addresses, uint8_t count)> ResolveHandler;
+
+  virtual ~Transport() {}
+
+  // Return false if the connection could not be started, the disconnect handler is then not called. Otherwise
+  // the connect handler is called once the connection is up, or the disconnect handler if it failed
+  virtual bool connect(IPAddress ip, uint16_t port, bool secure) = 0;
+  virtual bool connect(const char* host, uint16_t port, bool secure) = 0;
+
+  // Connects to `ip`, an address `host` resolved to: a secure connection still presents `host` to the server.
+  // Without support for it, a secure connection resolves `host` again
+  virtual bool connectResolved(IPAddress ip, const char* host, uint16_t port, bool secure) {
+    return secure ? connect(host, port, secure) : connect(ip, port, secure);
+  }
+
+  // Resolves `host` to its IPv4 addresses in the background, the resolve handler is called with them, or with
+  // none if it failed. Returns false without support for it, or while a resolution is in progress
+  virtual bool resolve(const char* host) {
+    (void)host;
+    return false;
+  }
+
+  virtual void close(bool now) = 0;
+  virtual bool canSend() = 0;
+  virtual size_t space() = 0;
+  virtual size_t add(const char* data, size_t size) = 0;
+  virtual bool send() = 0;
+
+  // Room for `size` bytes at the end of what was added, written in place rather than copied by add(). commit() then
+  // hands over `length` of them from `offset`, the others are dropped. Nothing is added in between. Returns nullptr
+  // without support for it or without room for them
+  virtual char* reserve(size_t size) {
+    (void)size;
+    return nullptr;
+  }
+
+  virtual void commit(size_t offset, size_t length) {
+    (void)offset;
+    (void)length;
+  }
+
+  // Only valid from the data callback: the received data stays unacknowledged until ack() is called
+  virtual void ackLater() = 0;
+  virtual size_t ack(size_t len) = 0;
+#if ASYNC_TCP_SSL_ENABLED
+  virtual SSL* getSSL() = 0;
+#endif
+#if ASYNC_MQTT_TLS
+  // Whether the SHA-1 of the server certificate is `fingerprint`, once connected
+  virtual bool matchFingerprint(const uint8_t* fingerprint) = 0;
+
+  // The TLS session to resume, serialised so that it can be kept across reboots.
+  // Returns its length, copied if it fits in `size`, or 0 without a session or without support for it
+  virtual size_t getTlsSession(uint8_t* buffer, size_t size) {
+    (void)buffer;
+    (void)size;
+    return 0;
+  }
+
+  // Resumed by the next connections, until the server hands out a newer one. Without `length`, the session is
+  // forgotten and the next handshake is a full one. Returns false if not supported
+  virtual bool setTlsSession(const uint8_t* session, size_t length) {
+    (void)session;
+    (void)length;
+    return false;
+  }
+
+  // Whether the client authenticates the server by the fingerprint of its certificate. Otherwise a transport that
+  // can do it verifies the certificate chain and the host name
+  virtual void setFingerprintVerification(bool fingerprints) {
+    (void)fingerprints;
+  }
+
+  virtual AsyncMqttClientTlsStats getTlsStats() {
+    return AsyncMqttClientTlsStats();
+  }
+#endif
+
+  size_t write(const char* data, size_t size) {
+    size_t written = add(data, size);
+    send();
+    return written;
+  }
+
+  void onConnect(ConnectHandler handler) {
+    _onConnect = handler;
+  }
+
+  void onDisconnect(ConnectHandler handler) {
+    _onDisconnect = handler;
+  }
+
+  void onError(ErrorHandler handler) {
+    _onError = handler;
+  }
+
+  void onTimeout(TimeoutHandler handler) {
+    _onTimeout = handler;
+  }
+
+  void onAck(AckHandler handler) {
+    _onAck = handler;
+  }
+
+  void onData(DataHandler handler) {
+    _onData = handler;
+  }
+
+  void onPoll(ConnectHandler handler) {
+    _onPoll = handler;
+  }
+
+  void onResolve(ResolveHandler handler) {
+    _onResolve = handler;
+  }
+
+ protected:
+  ConnectHandler _onConnect;
+  ConnectHandler _onDisconnect;
+  ErrorHandler _onError;
+  TimeoutHandler _onTimeout;
+  AckHandler _onAck;
+  DataHandler _onData;
+  ConnectHandler _onPoll;
+  ResolveHandler _onResolve;
+};
+}  // namespace AsyncMqttClientInternals